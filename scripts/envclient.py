@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+#
+# Minimal client of mptet-env written without any dependencies, showing the
+# shared memory protocol described in src/env.h from another language.
+#
+# Claims a lane, steps every game in it with random actions and prints the
+# steps taken per second.
+#
+# Usage: scripts/envclient.py [path] [seconds]
+
+import ctypes
+import mmap
+import os
+import platform
+import random
+import struct
+import sys
+import time
+
+SYS_FUTEX = {"x86_64": 202, "aarch64": 98}[platform.machine()]
+FUTEX_WAIT, FUTEX_WAKE = 0, 1
+
+HEADER = struct.Struct("=8sIHHIIII4QII")
+OBS = struct.Struct("=28sBBBbb6sBB3xfIII4x")
+HARD_DROP = 7
+
+libc = ctypes.CDLL(None, use_errno=True)
+libc.syscall.restype = ctypes.c_long
+
+
+class Timespec(ctypes.Structure):
+    _fields_ = [("sec", ctypes.c_long), ("nsec", ctypes.c_long)]
+
+
+def futex(buf, offset, op, value, timeout=None):
+    addr = ctypes.addressof(ctypes.c_char.from_buffer(buf, offset))
+    ts = ctypes.byref(timeout) if timeout else None
+    libc.syscall(SYS_FUTEX, ctypes.c_void_p(addr), op, value, ts, None, 0)
+
+
+class Client:
+    def __init__(self, path):
+        fd = os.open(path, os.O_RDWR)
+        self.map = mmap.mmap(fd, 0)
+        os.close(fd)
+
+        (magic, _, _, obs_size, self.lanes, self.envs, self.threads, _,
+         lane_off, bell_off, action_off, obs_off, running, _) = HEADER.unpack_from(self.map)
+        assert magic == b"mptetenv" and obs_size == OBS.size and running
+
+        # Claim a free lane. Python has no compare and swap, so check the
+        # claim was not overwritten by another client
+        for i in range(self.lanes):
+            self.lane = lane_off + 64 * i
+            if self.u32(self.lane) == 0:
+                self.set_u32(self.lane, os.getpid())
+                time.sleep(0.01)
+                if self.u32(self.lane) == os.getpid():
+                    break
+        else:
+            raise RuntimeError("every lane is in use")
+
+        self.bell = bell_off + 64 * (i % self.threads)
+        self.actions = action_off + self.envs * i
+        self.obs = obs_off + OBS.size * self.envs * i
+
+    def u32(self, offset):
+        return struct.unpack_from("=I", self.map, offset)[0]
+
+    def set_u32(self, offset, value):
+        struct.pack_into("=I", self.map, offset, value & 0xffffffff)
+
+    def step(self, actions):
+        self.map[self.actions:self.actions + self.envs] = bytes(actions)
+
+        request = (self.u32(self.lane + 4) + 1) & 0xffffffff
+        self.set_u32(self.lane + 4, request)
+        self.set_u32(self.bell, self.u32(self.bell) + 1)
+        futex(self.map, self.bell, FUTEX_WAKE, 1)
+
+        # Sleep with a timeout, ringing again in case the host missed it,
+        # since plain stores give none of the ordering the C client relies on
+        while (response := self.u32(self.lane + 8)) != request:
+            self.set_u32(self.lane + 12, 1)
+            futex(self.map, self.lane + 8, FUTEX_WAIT, response, Timespec(0, 1000000))
+            self.set_u32(self.lane + 12, 0)
+            futex(self.map, self.bell, FUTEX_WAKE, 1)
+
+        return [OBS.unpack_from(self.map, self.obs + OBS.size * i) for i in range(self.envs)]
+
+    def close(self):
+        self.set_u32(self.lane, 0)
+        self.map.close()
+
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else "/dev/shm/mptet-env"
+    seconds = float(sys.argv[2]) if len(sys.argv) > 2 else 5
+
+    client = Client(path)
+    steps = games = 0
+    start = time.monotonic()
+
+    while time.monotonic() - start < seconds:
+        actions = [random.choice((1, 2, 3, 4, 5, 6, HARD_DROP, HARD_DROP))
+                   for _ in range(client.envs)]
+        obs = client.step(actions)
+        steps += client.envs
+        games += sum(1 for o in obs if o[8])
+
+    elapsed = time.monotonic() - start
+    print(f"{steps} steps in {elapsed:.2f} s ({steps / elapsed:.0f} steps/s), {games} games ended")
+    client.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# Build each graphical frontend and run its render benchmark against a local
+# stand-in for a real display:
+#
+#   x11, x11-shm  Xvfb
+#   sdl2          SDL's dummy video driver and software renderer
+#   directfb      DirectFB with hardware acceleration disabled, on its X11
+#                 system under Xvfb
+#   dump          no display is needed
+#
+# Each frontend renders a scripted game at each field density (see
+# src/bench.h) and reports render time per frame. A frontend fails if it
+# cannot be built, exits abnormally, or does not report every density.
+#
+# Usage: scripts/headless.sh [frontend...]
+#
+# Environment:
+#   FRAMES      frames rendered at each density (default 600)
+#   SIZE        display size (default 1920x1080)
+#   THREADED    build the threaded variant of each frontend when set to 1
+#   MAX_P99_US  fail a frontend whose p99 render time at any density
+#               exceeds this many microseconds
+#   DFB_ARGS    options given to DirectFB, replacing the defaults
+
+FRAMES=${FRAMES:-600}
+SIZE=${SIZE:-1920x1080}
+XVFB_DISPLAY=${XVFB_DISPLAY:-:99}
+DFB_ARGS=${DFB_ARGS:-system=x11,no-hardware,no-cursor}
+
+frontends=${*:-"x11 x11-shm sdl2 directfb dump"}
+xvfb_pid=
+failed=
+
+cleanup() {
+    if [ -n "$xvfb_pid" ]; then
+        kill "$xvfb_pid" 2>/dev/null
+        wait "$xvfb_pid" 2>/dev/null
+    fi
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Start Xvfb the first time a frontend needs it, and wait for its socket
+start_xvfb() {
+    [ -n "$xvfb_pid" ] && return 0
+
+    if ! command -v Xvfb >/dev/null; then
+        echo "Xvfb is not installed" >&2
+        return 1
+    fi
+
+    Xvfb "$XVFB_DISPLAY" -screen 0 "${SIZE}x24" -nolisten tcp >/dev/null 2>&1 &
+    xvfb_pid=$!
+
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        [ -S "/tmp/.X11-unix/X${XVFB_DISPLAY#:}" ] && return 0
+        sleep 0.5
+    done
+
+    echo "Xvfb did not start on $XVFB_DISPLAY" >&2
+    return 1
+}
+
+# Check that every density was reported, and within MAX_P99_US if set
+check() {
+    awk -v max="${MAX_P99_US:-0}" '
+        $1 == "empty" || $1 == "half" || $1 == "topout" {
+            seen++
+            for (i = 1; i < NF; ++i) {
+                if ($i == "p99" && max > 0 && $(i + 1) > max) {
+                    printf "%s: p99 %s us exceeds %s us\n", $1, $(i + 1), max
+                    slow++
+                }
+            }
+        }
+        END {
+            if (seen != 3)
+                print "timings were not reported for every density"
+            exit seen != 3 || slow
+        }'
+}
+
+run() {
+    fe=$1
+
+    case $fe in
+    x11|x11-shm)
+        start_xvfb || return 1
+        set -- env DISPLAY="$XVFB_DISPLAY" ./mptet ;;
+    sdl2)
+        set -- env SDL_VIDEODRIVER="${SDL_VIDEODRIVER:-dummy}" ./mptet ;;
+    directfb)
+        start_xvfb || return 1
+        set -- env DISPLAY="$XVFB_DISPLAY" ./mptet "--dfb:$DFB_ARGS" ;;
+    dump)
+        if [ "${THREADED:-}" = 1 ]; then
+            echo "dump: skipped, it cannot run threaded"
+            return 0
+        fi
+        set -- ./mptet --dump-size="$SIZE" --dump-output=/dev/null ;;
+    *)
+        echo "$fe: unknown frontend" >&2
+        return 1 ;;
+    esac
+
+    if ! make -s "$fe" ${THREADED:+THREADED=$THREADED} >/dev/null; then
+        echo "$fe: build failed" >&2
+        return 1
+    fi
+
+    out=$(MPTET_SEED=1 MPTET_BENCH=$FRAMES "$@" </dev/null) || {
+        echo "$fe: exited with status $?" >&2
+        return 1
+    }
+
+    echo "$out" | sed "s/^/$fe: /"
+    echo "$out" | check
+}
+
+for fe in $frontends; do
+    run "$fe" || failed="$failed $fe"
+done
+
+if [ -n "$failed" ]; then
+    echo "failed:$failed" >&2
+    exit 1
+fi
@@ -0,0 +1,337 @@
+/**
+ * archive.c
+ *
+ * Implements an append-only archive of replays.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+/* Entries claimed by a scanning thread at once */
+#define MPARCHIVE_CHUNK 1024
+
+/* Most threads a scan will start */
+#define MPARCHIVE_THREADS 256
+
+static bool mparchive_header_valid(const mparchive_header *h, uint64_t size)
+{
+    return !memcmp(h->magic, MPARCHIVE_MAGIC, 8) &&
+        h->version == MPARCHIVE_VERSION &&
+        h->header_size == sizeof(mparchive_header) &&
+        h->entry_size == sizeof(mparchive_entry) &&
+        h->index >= sizeof(mparchive_header) &&
+        h->index <= size &&
+        h->count <= (size - h->index) / sizeof(mparchive_entry);
+}
+
+bool mparchive_open(mparchive *a, const char *path)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    a->size = st.st_size;
+    a->map = NULL;
+
+    if (a->size >= sizeof(mparchive_header)) {
+        void *map = mmap(NULL, a->size, PROT_READ, MAP_SHARED, fd, 0);
+        a->map = map == MAP_FAILED ? NULL : map;
+    }
+
+    close(fd);
+
+    if (!a->map || !mparchive_header_valid((const void *) a->map, a->size)) {
+        fprintf(stderr, "%s is not a valid archive\n", path);
+        if (a->map)
+            munmap((void *) a->map, a->size);
+        return false;
+    }
+
+    a->header = (const void *) a->map;
+    a->entries = (const void *) (a->map + a->header->index);
+    a->count = a->header->count;
+
+    /* Any payloads read are usually read in order */
+    madvise((void *) a->map, a->size, MADV_SEQUENTIAL);
+    return true;
+}
+
+void mparchive_close(mparchive *a)
+{
+    munmap((void *) a->map, a->size);
+    a->map = NULL;
+}
+
+bool mparchive_verify(const mparchive *a, const mparchive_entry *e, mpstate *ms,
+        mpresult *res)
+{
+    if (!mparchive_payload_valid(a, e))
+        return false;
+
+    if (!mpreplay_run(ms, e->seed, e->goal, mparchive_payload(a, e), e->size, res))
+        return false;
+
+    return res->frames == e->frames && res->lines == e->lines && res->hash == e->hash &&
+        res->finished == !!(e->flags & MPARCHIVE_FINISHED);
+}
+
+typedef struct {
+    const mparchive *a;
+    bool (*filter)(const mparchive_entry *e, void *ctx);
+    void (*fn)(const mparchive *a, const mparchive_entry *e, int thread,
+            mpstate *ms, void *ctx);
+    void *ctx;
+
+    /* Next entry to be claimed */
+    atomic_uint_fast64_t next;
+} mparchive_job;
+
+typedef struct {
+    mparchive_job *job;
+    int thread;
+} mparchive_worker;
+
+static void *mparchive_scan_thread(void *arg)
+{
+    mparchive_worker *w = arg;
+    mparchive_job *job = w->job;
+    const uint64_t count = job->a->count;
+    mpstate ms;
+
+    while (true) {
+        const uint64_t start = atomic_fetch_add(&job->next, MPARCHIVE_CHUNK);
+
+        if (start >= count)
+            break;
+
+        const uint64_t end = start + MPARCHIVE_CHUNK < count ? start + MPARCHIVE_CHUNK : count;
+
+        for (uint64_t i = start; i < end; ++i) {
+            const mparchive_entry *e = &job->a->entries[i];
+
+            if (!job->filter || job->filter(e, job->ctx))
+                job->fn(job->a, e, w->thread, &ms, job->ctx);
+        }
+    }
+
+    return NULL;
+}
+
+void mparchive_scan(const mparchive *a, int threads,
+        bool (*filter)(const mparchive_entry *e, void *ctx),
+        void (*fn)(const mparchive *a, const mparchive_entry *e, int thread,
+            mpstate *ms, void *ctx),
+        void *ctx)
+{
+    mparchive_job job = { a, filter, fn, ctx, 0 };
+    mparchive_worker workers[MPARCHIVE_THREADS];
+    pthread_t thread[MPARCHIVE_THREADS];
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > MPARCHIVE_THREADS)
+        threads = MPARCHIVE_THREADS;
+
+    /* The calling thread takes part as the last thread */
+    for (int i = 0; i < threads; ++i) {
+        workers[i].job = &job;
+        workers[i].thread = i;
+
+        if (i < threads - 1 &&
+                pthread_create(&thread[i], NULL, mparchive_scan_thread, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to create scan thread\n");
+            exit(-1);
+        }
+    }
+
+    mparchive_scan_thread(&workers[threads - 1]);
+
+    for (int i = 0; i < threads - 1; ++i)
+        pthread_join(thread[i], NULL);
+}
+
+static bool mparchive_write(int fd, const void *data, size_t size, uint64_t offset)
+{
+    const uint8_t *p = data;
+
+    while (size) {
+        const ssize_t n = pwrite(fd, p, size, offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0) {
+            fprintf(stderr, "Cannot write archive: %s\n", strerror(errno));
+            return false;
+        }
+
+        p += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+bool mparchive_create(mparchive_writer *w, const char *path)
+{
+    w->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    w->entries = NULL;
+    w->count = 0;
+    w->capacity = 0;
+    w->written = 0;
+    w->index = 0;
+    w->slot = 0;
+    w->end = sizeof(mparchive_header);
+
+    if (w->fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    /* Only one writer may append at once, which would otherwise both write
+     * payloads at the same offset. The lock goes when the file is closed. */
+    if (flock(w->fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "Cannot lock %s: %s\n", path,
+                errno == EWOULDBLOCK ? "it is being appended to" : strerror(errno));
+        close(w->fd);
+        return false;
+    }
+
+    struct stat st;
+
+    if (fstat(w->fd, &st) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        close(w->fd);
+        return false;
+    }
+
+    if (st.st_size == 0)
+        return true;
+
+    /* Keep the existing index, and append after it */
+    mparchive a;
+
+    if (!mparchive_open(&a, path)) {
+        close(w->fd);
+        return false;
+    }
+
+    w->count = w->capacity = w->written = a.count;
+    w->index = a.header->index;
+    w->end = a.size;
+    w->entries = malloc(a.count * sizeof(mparchive_entry) + 1);
+
+    if (!w->entries) {
+        fprintf(stderr, "Failed to allocate archive index\n");
+        exit(-1);
+    }
+
+    memcpy(w->entries, a.entries, a.count * sizeof(mparchive_entry));
+
+    /* The slot of the index runs until the first payload after it */
+    uint64_t slot = a.size;
+
+    for (uint64_t i = 0; i < a.count; ++i) {
+        if (a.entries[i].offset > w->index && a.entries[i].offset < slot)
+            slot = a.entries[i].offset;
+    }
+
+    w->slot = (slot - w->index) / sizeof(mparchive_entry);
+    mparchive_close(&a);
+    return true;
+}
+
+bool mparchive_append(mparchive_writer *w, uint64_t seed, int goal,
+        const mpreplay *r, const mpresult *res)
+{
+    if (w->count == w->capacity) {
+        w->capacity = w->capacity ? 2 * w->capacity : 1024;
+        w->entries = realloc(w->entries, w->capacity * sizeof(mparchive_entry));
+
+        if (!w->entries) {
+            fprintf(stderr, "Failed to allocate archive index\n");
+            exit(-1);
+        }
+    }
+
+    mparchive_entry *e = &w->entries[w->count];
+    memset(e, 0, sizeof(*e));
+
+    e->seed = seed;
+    e->offset = w->end;
+    e->size = r->size;
+    e->frames = res->frames;
+    e->lines = res->lines;
+    e->goal = goal;
+    e->flags = res->finished ? MPARCHIVE_FINISHED : 0;
+    e->hash = res->hash;
+
+    if (!mparchive_write(w->fd, r->data, r->size, w->end))
+        return false;
+
+    w->end += r->size;
+    w->count++;
+    return true;
+}
+
+bool mparchive_finish(mparchive_writer *w)
+{
+    mparchive_header h;
+    uint64_t from = w->written;
+    bool ok = true;
+
+    /* An index which outgrows its slot moves to the end of the file, with
+     * room for as many entries again, leaving the old slot unused. Otherwise
+     * the new entries are written after those already in the slot, which no
+     * reader looks at until the header counts them. */
+    if (!w->index || w->count > w->slot) {
+        /* Entries are aligned so the index can be used in place */
+        w->index = (w->end + 7) & ~7ull;
+        w->slot = 2 * w->count;
+        from = 0;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MPARCHIVE_MAGIC, 8);
+    h.version = MPARCHIVE_VERSION;
+    h.header_size = sizeof(mparchive_header);
+    h.entry_size = sizeof(mparchive_entry);
+    h.count = w->count;
+    h.index = w->index;
+
+    const uint64_t slot_end = h.index + w->slot * sizeof(mparchive_entry);
+
+    /* The index must be on disk before the header points to it */
+    ok = mparchive_write(w->fd, w->entries + from, (w->count - from) * sizeof(mparchive_entry),
+                h.index + from * sizeof(mparchive_entry)) &&
+        (slot_end <= w->end || ftruncate(w->fd, slot_end) == 0) &&
+        fdatasync(w->fd) == 0 &&
+        mparchive_write(w->fd, &h, sizeof(h), 0) &&
+        fdatasync(w->fd) == 0;
+
+    close(w->fd);
+    free(w->entries);
+    w->fd = -1;
+    w->entries = NULL;
+    return ok;
+}
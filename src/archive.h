@@ -0,0 +1,170 @@
+#pragma once
+
+/**
+ * archive.h
+ *
+ * Implements an append-only archive holding many replays in a single file,
+ * which is read through a read-only memory map.
+ *
+ * The file starts with a header, followed by the packed payloads of every
+ * replay, and ends with an index of fixed size records:
+ *
+ *   header     magic, version, number of replays, offset of the index
+ *   payloads   keys of each replay, as described in replay.h
+ *   index      one mparchive_entry per replay, in the order appended
+ *
+ * The index is followed by room for as many entries again. Appending writes
+ * new payloads at the end of the file and their entries after those already
+ * in the index, and only then rewrites the header. An index which outgrows
+ * its room is written again at the end of the file, with room to double, so
+ * the space left by old indexes stays within twice the final index. An
+ * archive interrupted while appending still holds every replay it held
+ * before, and only one process may append at once.
+ *
+ * Every field of the index can be queried without reading any payload, so
+ * filtering touches only the pages of the index. All integers are stored in
+ * the byte order of the machine writing them, and an archive is rejected by
+ * a machine of the other order.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "replay.h"
+
+#define MPARCHIVE_MAGIC "mptetarc"
+/* Raised whenever the engine changes how a recorded game plays out, since
+ * replays are only checked by running them again. Version 2 follows the fix
+ * to the cell kept below a cleared line in mptet_lineclear. */
+#define MPARCHIVE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+
+    /* Size of the header and of each index entry, for checking */
+    uint16_t header_size;
+    uint16_t entry_size;
+
+    uint64_t count;
+    uint64_t index;
+} mparchive_header;
+
+typedef struct {
+    uint64_t seed;
+
+    /* Offset of the payload from the start of the file, and its size */
+    uint64_t offset;
+    uint32_t size;
+
+    /* Length of the game, and lines cleared by its end */
+    uint32_t frames;
+    uint32_t lines;
+
+    /* Lines the game was played to, or 0 to play until topping out */
+    uint16_t goal;
+
+    /* MPARCHIVE_* flags */
+    uint16_t flags;
+
+    /* mpreplay_hash of the final field */
+    uint64_t hash;
+} mparchive_entry;
+
+enum {
+    /* The game reached its goal */
+    MPARCHIVE_FINISHED = 1 << 0
+};
+
+/* An archive opened for reading */
+typedef struct {
+    const uint8_t *map;
+    size_t size;
+
+    const mparchive_header *header;
+    const mparchive_entry *entries;
+    uint64_t count;
+} mparchive;
+
+/* An archive opened for appending */
+typedef struct {
+    int fd;
+
+    /* Every entry, including those already in the file */
+    mparchive_entry *entries;
+    uint64_t count;
+    uint64_t capacity;
+
+    /* Entries already in the index, its offset and the entries it has room
+     * for before the next payload */
+    uint64_t written;
+    uint64_t index;
+    uint64_t slot;
+
+    /* Offset at which the next payload is written */
+    uint64_t end;
+} mparchive_writer;
+
+/**
+ * Open an archive for reading. Returns false with a message on stderr if
+ * it cannot be opened or is invalid.
+ */
+bool mparchive_open(mparchive *a, const char *path);
+
+void mparchive_close(mparchive *a);
+
+/* Return the payload of an entry */
+static inline const uint8_t *mparchive_payload(const mparchive *a, const mparchive_entry *e)
+{
+    return a->map + e->offset;
+}
+
+/* Does the payload of an entry lie within the file, clear of the header and
+ * the index? Payloads can be on either side of the index. */
+static inline bool mparchive_payload_valid(const mparchive *a, const mparchive_entry *e)
+{
+    const uint64_t index = a->header->index;
+    const uint64_t index_end = index + a->count * sizeof(mparchive_entry);
+
+    return e->offset >= sizeof(mparchive_header) && e->offset <= a->size &&
+        e->size <= a->size - e->offset &&
+        (e->offset >= index_end || e->offset + e->size <= index);
+}
+
+/**
+ * Replay an entry through mptet_update. Returns false if it does not
+ * reproduce the outcome recorded in the index.
+ */
+bool mparchive_verify(const mparchive *a, const mparchive_entry *e, mpstate *ms,
+        mpresult *res);
+
+/**
+ * Call fn for each entry, split across the given number of threads, which
+ * each take chunks of the index in turn. The thread number and a state for
+ * that thread's own use are passed with each entry. Entries for which filter
+ * returns false are skipped without their payload being touched.
+ */
+void mparchive_scan(const mparchive *a, int threads,
+        bool (*filter)(const mparchive_entry *e, void *ctx),
+        void (*fn)(const mparchive *a, const mparchive_entry *e, int thread,
+            mpstate *ms, void *ctx),
+        void *ctx);
+
+/**
+ * Open an archive for appending, creating it if it does not exist, and lock
+ * it until mparchive_finish. Returns false with a message on stderr on
+ * failure, including when another writer holds the lock.
+ */
+bool mparchive_create(mparchive_writer *w, const char *path);
+
+/* Append a recorded game along with its outcome */
+bool mparchive_append(mparchive_writer *w, uint64_t seed, int goal,
+        const mpreplay *r, const mpresult *res);
+
+/**
+ * Write the index and header, making everything appended visible to
+ * readers. Returns false on failure, in which case the archive is left as
+ * it was when opened.
+ */
+bool mparchive_finish(mparchive_writer *w);
@@ -0,0 +1,402 @@
+/**
+ * archiver.c
+ *
+ * Implements a tool to build and query archives of replays.
+ *
+ * Usage: mptet-archive COMMAND ARCHIVE [options]
+ *
+ *   record     append games played with random input
+ *   list       print the index entries matching the filters
+ *   verify     replay matching games and check their outcome is unchanged
+ *   stats      replay matching games and summarise them
+ *   export     replay matching games and write each placement to a dataset
+ *
+ * Options for record:
+ *
+ *   --games=N      games to record, 1000 by default
+ *   --frames=N     longest game in frames, 36000 by default
+ *   --goal=N       lines to clear, 40 by default, or 0 to play until topping out
+ *   --seed=N       seed of the first game, which increases for each game
+ *
+ * Filters, which only read the index:
+ *
+ *   --min-lines=N  games clearing at least N lines
+ *   --max-frames=N games no longer than N frames
+ *   --seed=N       the game with seed N
+ *   --finished     games which reached their goal
+ *
+ * verify, stats and export also take --threads=N, the number of cores by
+ * default, and export takes --output=PATH, the dataset to write, and
+ * --scored, to score each placement with the evaluator in eval.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "dataset.h"
+#include "eval.h"
+#include "hist.h"
+#include "replay.h"
+
+typedef struct {
+    uint32_t min_lines;
+    uint32_t max_frames;
+    uint64_t seed;
+    bool has_seed;
+    bool finished;
+} mpfilter;
+
+/* Totals for each scanning thread, padded so threads never share a line */
+typedef struct {
+    uint64_t games;
+    uint64_t frames;
+    uint64_t lines;
+    uint64_t finished;
+    uint64_t failed;
+    char pad[24];
+} mptally;
+
+typedef struct {
+    mpfilter filter;
+    mptally *tally;
+    hist_t *lines;
+
+    /* Producer for each thread when exporting */
+    mpdataset_stream *streams;
+} mpjob;
+
+static double mparchiver_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool mparchiver_filter(const mparchive_entry *e, void *ctx)
+{
+    const mpfilter *f = ctx;
+
+    return e->lines >= f->min_lines &&
+        (!f->max_frames || e->frames <= f->max_frames) &&
+        (!f->has_seed || e->seed == f->seed) &&
+        (!f->finished || e->flags & MPARCHIVE_FINISHED);
+}
+
+/**
+ * Play games pressing random keys, holding each for a few frames. Hard drops
+ * are frequent so games place many pieces.
+ */
+static int mparchiver_record(const char *path, int games, int frames, int goal, uint64_t seed)
+{
+    static const uint8_t choices[] = {
+        1 << K_Left, 1 << K_Right, 1 << K_Down, 1 << K_z, 1 << K_x, 1 << K_c,
+        1 << K_Space, 1 << K_Space, 0
+    };
+
+    mparchive_writer w;
+    mpreplay r;
+    mpstate ms, rng;
+    mpresult res;
+
+    if (!mparchive_create(&w, path))
+        return 1;
+
+    mpreplay_init(&r);
+    mpstate_init(&rng);
+    mpstate_seed(&rng, seed);
+
+    const double start = mparchiver_now();
+    uint64_t total = 0;
+
+    for (int g = 0; g < games; ++g) {
+        uint8_t keys = 0;
+        int hold = 0;
+
+        mpreplay_clear(&r);
+        mpreplay_start(&ms, seed + g, goal);
+
+        for (int f = 0; f < frames; ++f) {
+            if (--hold <= 0) {
+                keys = choices[mptet_random(&rng) % sizeof(choices)];
+                hold = 1 + mptet_random(&rng) % 8;
+            }
+
+            mpreplay_frame(&r, keys);
+
+            if (!mpreplay_step(&ms, keys))
+                break;
+        }
+
+        mpreplay_result(&ms, &res);
+        total += res.frames;
+
+        if (!mparchive_append(&w, seed + g, goal, &r, &res)) {
+            mparchive_finish(&w);
+            return 1;
+        }
+    }
+
+    mpreplay_free(&r);
+
+    if (!mparchive_finish(&w))
+        return 1;
+
+    const double elapsed = mparchiver_now() - start;
+    printf("recorded %d games, %" PRIu64 " frames in %.2f s\n", games, total, elapsed);
+    return 0;
+}
+
+static int mparchiver_list(const mparchive *a, const mpfilter *f)
+{
+    printf("%-20s %8s %6s %4s %8s %6s %16s\n",
+            "seed", "frames", "lines", "goal", "finished", "bytes", "hash");
+
+    for (uint64_t i = 0; i < a->count; ++i) {
+        const mparchive_entry *e = &a->entries[i];
+
+        if (!mparchiver_filter(e, (void *) f))
+            continue;
+
+        printf("%-20" PRIu64 " %8u %6u %4u %8s %6u %016" PRIx64 "\n",
+                e->seed, e->frames, e->lines, e->goal,
+                e->flags & MPARCHIVE_FINISHED ? "yes" : "no", e->size, e->hash);
+    }
+
+    return 0;
+}
+
+static void mparchiver_replay(const mparchive *a, const mparchive_entry *e, int thread,
+        mpstate *ms, void *ctx)
+{
+    mpjob *job = ctx;
+    mptally *t = &job->tally[thread];
+    mpresult res;
+
+    if (!mparchive_verify(a, e, ms, &res)) {
+        fprintf(stderr, "seed %" PRIu64 ": recorded %u frames, %u lines, replayed %u frames, %u lines\n",
+                e->seed, e->frames, e->lines, res.frames, res.lines);
+        t->failed++;
+    }
+
+    t->games++;
+    t->frames += res.frames;
+    t->lines += res.lines;
+    t->finished += res.finished;
+    hist_record(&job->lines[thread], res.lines);
+}
+
+static int mparchiver_scan(const mparchive *a, const mpfilter *f, int threads, bool stats)
+{
+    mpjob job = {
+        .filter = *f,
+        .tally = calloc(threads, sizeof(mptally)),
+        .lines = calloc(threads, sizeof(hist_t))
+    };
+    mptally sum = { 0 };
+    hist_t lines;
+
+    if (!job.tally || !job.lines) {
+        fprintf(stderr, "Failed to allocate totals\n");
+        exit(-1);
+    }
+
+    const double start = mparchiver_now();
+    mparchive_scan(a, threads, mparchiver_filter, mparchiver_replay, &job);
+    const double elapsed = mparchiver_now() - start;
+
+    hist_zero(&lines);
+
+    for (int i = 0; i < threads; ++i) {
+        sum.games += job.tally[i].games;
+        sum.frames += job.tally[i].frames;
+        sum.lines += job.tally[i].lines;
+        sum.finished += job.tally[i].finished;
+        sum.failed += job.tally[i].failed;
+
+        hist_merge(&lines, &job.lines[i]);
+    }
+
+    printf("%" PRIu64 " of %" PRIu64 " games replayed on %d threads in %.2f s "
+            "(%.0f games/s, %.0f frames/s)\n", sum.games, a->count, threads, elapsed,
+            sum.games / elapsed, sum.frames / elapsed);
+
+    if (stats) {
+        printf("frames: %" PRIu64 ", mean %.1f per game\n", sum.frames,
+                sum.games ? (double) sum.frames / sum.games : 0.0);
+        printf("finished: %" PRIu64 "\n", sum.finished);
+        printf("lines cleared per game:\n");
+        hist_print(&lines, "lines", 1.0, stdout);
+    }
+
+    printf("%" PRIu64 " games did not replay as recorded\n", sum.failed);
+
+    free(job.tally);
+    free(job.lines);
+    return sum.failed != 0;
+}
+
+static void mparchiver_export_game(const mparchive *a, const mparchive_entry *e, int thread,
+        mpstate *ms, void *ctx)
+{
+    mpjob *job = ctx;
+    mptally *t = &job->tally[thread];
+
+    if (!mparchive_payload_valid(a, e)) {
+        t->failed++;
+        return;
+    }
+
+    mpreplay_start(ms, e->seed, e->goal);
+    mpdataset_attach(ms, &job->streams[thread]);
+
+    if (!mpreplay_play(ms, mparchive_payload(a, e), e->size))
+        t->failed++;
+
+    t->games++;
+    t->frames += ms->total_frames;
+    t->lines += ms->lines_cleared;
+}
+
+static int mparchiver_export(const mparchive *a, const mpfilter *f, int threads,
+        const char *output, bool scored)
+{
+    mpjob job = {
+        .filter = *f,
+        .tally = calloc(threads, sizeof(mptally)),
+        .streams = calloc(threads, sizeof(mpdataset_stream))
+    };
+    mptally sum = { 0 };
+    mpdataset d;
+
+    if (!job.tally || !job.streams) {
+        fprintf(stderr, "Failed to allocate totals\n");
+        exit(-1);
+    }
+
+    if (!mpdataset_create(&d, output, scored))
+        return 1;
+
+    for (int i = 0; i < threads; ++i)
+        mpdataset_stream_init(&job.streams[i], &d, scored ? mpeval_lock_score : NULL, NULL);
+
+    const double start = mparchiver_now();
+    mparchive_scan(a, threads, mparchiver_filter, mparchiver_export_game, &job);
+
+    for (int i = 0; i < threads; ++i)
+        mpdataset_stream_free(&job.streams[i]);
+
+    const bool ok = mpdataset_finish(&d);
+    const double elapsed = mparchiver_now() - start;
+    const uint64_t records = atomic_load(&d.count);
+
+    for (int i = 0; i < threads; ++i) {
+        sum.games += job.tally[i].games;
+        sum.frames += job.tally[i].frames;
+        sum.failed += job.tally[i].failed;
+    }
+
+    printf("%" PRIu64 " placements from %" PRIu64 " games exported on %d threads in %.2f s "
+            "(%.0f placements/s, %.1f MB)\n", records, sum.games, threads, elapsed,
+            records / elapsed, (records * sizeof(mpdataset_record)) / 1e6);
+    printf("%" PRIu64 " games could not be replayed\n", sum.failed);
+
+    free(job.tally);
+    free(job.streams);
+    return !ok || sum.failed != 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s record|list|verify|stats|export ARCHIVE [options]\n", argv[0]);
+        return 2;
+    }
+
+    const char *command = argv[1];
+    const char *path = argv[2];
+
+    mpfilter filter = { 0 };
+    int games = 1000;
+    int frames = 36000;
+    int goal = mprules_classic.goal;
+    uint64_t seed = time(NULL);
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *output = NULL;
+    bool scored = false;
+
+    for (int i = 3; i < argc; ++i) {
+        if (!strncmp(argv[i], "--games=", 8)) {
+            games = atoi(argv[i] + 8);
+        }
+        else if (!strncmp(argv[i], "--frames=", 9)) {
+            frames = atoi(argv[i] + 9);
+        }
+        else if (!strncmp(argv[i], "--goal=", 7)) {
+            goal = atoi(argv[i] + 7);
+        }
+        else if (!strncmp(argv[i], "--seed=", 7)) {
+            seed = filter.seed = strtoull(argv[i] + 7, NULL, 10);
+            filter.has_seed = true;
+        }
+        else if (!strncmp(argv[i], "--min-lines=", 12)) {
+            filter.min_lines = atoi(argv[i] + 12);
+        }
+        else if (!strncmp(argv[i], "--max-frames=", 13)) {
+            filter.max_frames = atoi(argv[i] + 13);
+        }
+        else if (!strcmp(argv[i], "--finished")) {
+            filter.finished = true;
+        }
+        else if (!strncmp(argv[i], "--threads=", 10)) {
+            threads = atoi(argv[i] + 10);
+        }
+        else if (!strncmp(argv[i], "--output=", 9)) {
+            output = argv[i] + 9;
+        }
+        else if (!strcmp(argv[i], "--scored")) {
+            scored = true;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (threads < 1)
+        threads = 1;
+
+    if (!strcmp(command, "record"))
+        return mparchiver_record(path, games, frames, goal, seed);
+
+    mparchive a;
+
+    if (!mparchive_open(&a, path))
+        return 1;
+
+    int status = 2;
+
+    if (!strcmp(command, "list"))
+        status = mparchiver_list(&a, &filter);
+    else if (!strcmp(command, "verify"))
+        status = mparchiver_scan(&a, &filter, threads, false);
+    else if (!strcmp(command, "stats"))
+        status = mparchiver_scan(&a, &filter, threads, true);
+    else if (!strcmp(command, "export") && output)
+        status = mparchiver_export(&a, &filter, threads, output, scored);
+    else if (!strcmp(command, "export"))
+        fprintf(stderr, "export needs --output=PATH\n");
+    else
+        fprintf(stderr, "Unknown command: %s\n", command);
+
+    mparchive_close(&a);
+    return status;
+}
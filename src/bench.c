@@ -0,0 +1,83 @@
+/**
+ * bench.c
+ *
+ * Implements the scripted game used to benchmark rendering.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "bench.h"
+
+/* Number of filled rows at each density */
+static const int rows[B_Count] = {
+    [B_Empty] = 0, [B_Half] = 11, [B_Topout] = 18
+};
+
+const char *mpbench_names[B_Count] = {
+    [B_Empty] = "empty", [B_Half] = "half", [B_Topout] = "topout"
+};
+
+/* Length of the input script in frames */
+#define B_SCRIPT 64
+
+/**
+ * Each step holds a key for a run of frames. Left and right are held past
+ * DAS so the piece sweeps the width of the field, and every cycle ends with
+ * a hard drop. Frames not covered by a step have no keys held.
+ */
+static const struct {
+    int start;
+    int frames;
+    int key;
+} script[] = {
+    {  0,  1, K_x },
+    {  4, 14, K_Left },
+    { 20,  1, K_c },
+    { 24, 16, K_Right },
+    { 42,  1, K_z },
+    { 46,  6, K_Down },
+    { 56,  1, K_Space }
+};
+
+void mpbench_start(mpbench *mb, mpstate *ms, int density)
+{
+    mem256_zero(&mb->field);
+
+    for (int y = 0; y < rows[density]; ++y) {
+        const int hole = mptet_random(ms) % 10;
+
+        for (int x = 0; x < 10; ++x) {
+            if (x != hole)
+                mem256_set(&mb->field, y * 10 + x);
+        }
+    }
+
+    mb->frame = 0;
+    ms->field = mb->field;
+    ms->lock_piece = false;
+    memset(ms->keystate, 0, sizeof(ms->keystate));
+    mptet_set_random_block(ms);
+}
+
+void mpbench_input(mpbench *mb, mpstate *ms)
+{
+    const int t = mb->frame++ % B_SCRIPT;
+    bool held[K_q] = { false };
+
+    for (size_t i = 0; i < sizeof(script) / sizeof(script[0]); ++i) {
+        if (t >= script[i].start && t < script[i].start + script[i].frames)
+            held[script[i].key] = true;
+    }
+
+    for (int k = 0; k < K_q; ++k)
+        ms->keystate[k] = held[k] ? ms->keystate[k] + 1 : 0;
+}
+
+void mpbench_restore(mpbench *mb, mpstate *ms)
+{
+    ms->field = mb->field;
+
+    /* A drop may complete the top row, which must not end the game */
+    ms->lines_cleared = 0;
+}
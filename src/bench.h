@@ -0,0 +1,45 @@
+#pragma once
+
+/**
+ * bench.h
+ *
+ * Implements the scripted game used to benchmark rendering.
+ *
+ * Frames are rendered with the field filled to a fixed density, while a
+ * scripted sequence of moves, rotations, holds and drops exercises the same
+ * drawing paths as play. The field is restored whenever a piece locks, so
+ * the density stays constant for the whole run.
+ */
+
+#include <stdint.h>
+
+#include "mem256.h"
+#include "mptet.h"
+
+/* Densities the field is benchmarked at */
+enum {
+    B_Empty, B_Half, B_Topout, B_Count
+};
+
+typedef struct {
+    /* Field to restore when a piece locks */
+    mem256_t field;
+
+    /* Frames run at the current density */
+    int64_t frame;
+} mpbench;
+
+/* Name of each density, for reporting */
+extern const char *mpbench_names[B_Count];
+
+/**
+ * Fill the field to the given density and spawn a new piece. Each filled row
+ * has a single randomly placed hole.
+ */
+void mpbench_start(mpbench *mb, mpstate *ms, int density);
+
+/* Set the keys held this frame from the script */
+void mpbench_input(mpbench *mb, mpstate *ms);
+
+/* Restore the field, removing any piece locked by the last update */
+void mpbench_restore(mpbench *mb, mpstate *ms);
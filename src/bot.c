@@ -0,0 +1,471 @@
+/**
+ * bot.c
+ *
+ * Implements a load generator for the versus server. Many bot clients are
+ * run from a single epoll loop, each joining a match, pressing random keys at
+ * the game rate and joining another match once theirs has ended.
+ *
+ * Spectators may also be run, each watching the most recent match and
+ * decoding its stream, then watching another once it has ended.
+ *
+ * Options:
+ *
+ *   --host=ADDR     server IPv4 address, 127.0.0.1 by default
+ *   --port=N        server TCP port
+ *   --unix=PATH     connect to a Unix socket instead
+ *   --clients=N     number of clients, 100 by default
+ *   --players=N     players in each match, 2 by default
+ *   --viewers=N     number of spectators, none by default
+ *   --seconds=N     run for N seconds, 10 by default
+ *
+ * A summary of games played and messages received is printed on exit,
+ * along with the time between frame updates seen by the clients.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "mptet.h"
+#include "proto.h"
+#include "spectate.h"
+
+/* Length of a game frame */
+#define BOT_FRAME_NS (1000000000ull / FPS)
+
+typedef struct {
+    /* Socket, or -1 while waiting to reconnect */
+    int fd;
+    bool connected;
+
+    /* Is this a spectator? */
+    bool viewer;
+
+    /* Seat once the match has started, or -1 */
+    int seat;
+
+    /* Match as decoded by a spectator, once a keyframe has been received */
+    mpspec view;
+    bool synced;
+
+    /* Partially received message */
+    uint8_t in[MPSPEC_MAX_SIZE];
+    size_t inlen;
+
+    /* Keys being held, and frames until they change */
+    uint8_t keys;
+    int hold;
+
+    /* Time own seat's last frame update was received */
+    uint64_t last;
+} mpbot;
+
+static struct {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    int epfd;
+    int players;
+    mpbot *bots;
+    int nbots;
+    int nviewers;
+
+    /* Chooses keys */
+    mpstate rng;
+
+    uint64_t connects;
+    uint64_t retries;
+    uint64_t games;
+    uint64_t wins;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t errors;
+
+    /* Spectator messages and bytes received, and matches watched to the end */
+    uint64_t keyframes;
+    uint64_t deltas;
+    uint64_t spectated;
+    uint64_t watched;
+
+    /* Time between updates of a bot's own seat */
+    hist_t gap;
+} bot;
+
+static volatile sig_atomic_t running = 1;
+
+static uint64_t bot_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bot_stop(int sig)
+{
+    (void) sig;
+    running = 0;
+}
+
+static void bot_send(mpbot *b, const uint8_t *msg, size_t n)
+{
+    /* Messages are tiny, so a full socket buffer means the server is not
+     * reading and the message may as well be lost. A connection the server
+     * has closed is noticed when reading. */
+    if (write(b->fd, msg, n) < 0 && errno != EAGAIN && errno != EPIPE && errno != ECONNRESET)
+        bot.errors++;
+}
+
+static void bot_connect(mpbot *b)
+{
+    b->fd = socket(bot.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (b->fd < 0) {
+        fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+        exit(-1);
+    }
+    b->connected = false;
+    b->seat = -1;
+    b->synced = false;
+    b->inlen = 0;
+    b->keys = 0;
+    b->hold = 0;
+
+    if (bot.addr.ss_family == AF_INET) {
+        const int one = 1;
+        setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (connect(b->fd, (struct sockaddr *) &bot.addr, bot.addrlen) < 0) {
+        /* The backlog of a Unix socket is full, so try again later */
+        if (errno == EAGAIN) {
+            close(b->fd);
+            b->fd = -1;
+            bot.retries++;
+            return;
+        }
+
+        if (errno != EINPROGRESS) {
+            fprintf(stderr, "Cannot connect: %s\n", strerror(errno));
+            exit(-1);
+        }
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = b };
+    epoll_ctl(bot.epfd, EPOLL_CTL_ADD, b->fd, &ev);
+    bot.connects++;
+}
+
+/* Connect again at the next frame, so a server with no match to watch is not
+ * flooded with attempts */
+static void bot_reconnect(mpbot *b)
+{
+    close(b->fd);
+    b->fd = -1;
+}
+
+/**
+ * Check each spectator message decodes, and that frames only go forward.
+ */
+static void bot_spectate(mpbot *b, const uint8_t *msg, size_t size)
+{
+    const uint32_t frame = b->view.frame;
+
+    bot.spectated += size;
+
+    if (msg[0] == MSG_KEYFRAME)
+        bot.keyframes++;
+    else
+        bot.deltas++;
+
+    if ((msg[0] == MSG_DELTA && !b->synced) || !mpspec_apply(&b->view, msg, size) ||
+            (b->synced && b->view.frame <= frame)) {
+        bot.errors++;
+    }
+
+    b->synced = true;
+}
+
+static void bot_message(mpbot *b, const uint8_t *msg, size_t size)
+{
+    bot.messages++;
+
+    switch (msg[0]) {
+    case MSG_KEYFRAME:
+    case MSG_DELTA:
+        bot_spectate(b, msg, size);
+        break;
+
+    case MSG_START:
+        b->seat = msg[1];
+        b->last = bot_now();
+        break;
+
+    case MSG_FRAME:
+        if (msg[1] == b->seat) {
+            const uint64_t now = bot_now();
+            hist_record(&bot.gap, now - b->last);
+            b->last = now;
+        }
+        break;
+
+    case MSG_END:
+        if (b->viewer) {
+            bot.watched += b->synced;
+            break;
+        }
+
+        bot.games++;
+        bot.wins += msg[1] == b->seat;
+        b->seat = -1;
+        break;
+    }
+}
+
+/**
+ * Read available input. Returns false once the server has closed the
+ * connection.
+ */
+static bool bot_read(mpbot *b)
+{
+    uint8_t buf[4096];
+
+    while (true) {
+        const ssize_t n = read(b->fd, buf, sizeof(buf));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && errno == EAGAIN)
+            return true;
+
+        if (n <= 0)
+            return false;
+
+        bot.bytes += n;
+
+        for (ssize_t i = 0; i < n; ++i) {
+            b->in[b->inlen++] = buf[i];
+
+            const size_t length = mpmsg_need(b->in, b->inlen);
+
+            if (!length || length > sizeof(b->in)) {
+                bot.errors++;
+                return false;
+            }
+
+            if (b->inlen == length) {
+                bot_message(b, b->in, length);
+                b->inlen = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Choose keys to hold for a few frames. Hard drops are frequent so games
+ * keep placing pieces and sending garbage.
+ */
+static void bot_frame(mpbot *b)
+{
+    if (b->fd == -1)
+        bot_connect(b);
+
+    if (b->seat == -1 || --b->hold > 0)
+        return;
+
+    static const uint8_t choices[] = {
+        1 << K_Left, 1 << K_Right, 1 << K_Down, 1 << K_z, 1 << K_x, 1 << K_c,
+        1 << K_Space, 1 << K_Space, 0
+    };
+
+    const uint8_t keys = choices[mptet_random(&bot.rng) % sizeof(choices)];
+    b->hold = 1 + mptet_random(&bot.rng) % 8;
+
+    if (keys != b->keys) {
+        const uint8_t msg[MSG_INPUT_SIZE] = { MSG_INPUT, keys };
+        bot_send(b, msg, sizeof(msg));
+        b->keys = keys;
+    }
+}
+
+static void bot_event(mpbot *b, uint32_t events)
+{
+    if (!b->connected && events & EPOLLOUT) {
+        const uint8_t join[MSG_JOIN_SIZE] = { MSG_JOIN, bot.players };
+        const uint8_t watch[MSG_WATCH_SIZE] = { MSG_WATCH };
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = b };
+
+        epoll_ctl(bot.epfd, EPOLL_CTL_MOD, b->fd, &ev);
+        b->connected = true;
+
+        if (b->viewer)
+            bot_send(b, watch, sizeof(watch));
+        else
+            bot_send(b, join, sizeof(join));
+    }
+
+    /* Usually the server's backlog was full */
+    if (events & EPOLLERR) {
+        bot.retries++;
+        bot_reconnect(b);
+        return;
+    }
+
+    /* The server closes the connection once the match ends */
+    if (events & (EPOLLIN | EPOLLHUP) && !bot_read(b))
+        bot_reconnect(b);
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = "127.0.0.1";
+    const char *path = NULL;
+    int port = MP_PORT;
+    int seconds = 10;
+
+    bot.nbots = 100;
+    bot.players = 2;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--host=", 7)) {
+            host = argv[i] + 7;
+        }
+        else if (!strncmp(argv[i], "--port=", 7)) {
+            port = atoi(argv[i] + 7);
+        }
+        else if (!strncmp(argv[i], "--unix=", 7)) {
+            path = argv[i] + 7;
+        }
+        else if (!strncmp(argv[i], "--clients=", 10)) {
+            bot.nbots = atoi(argv[i] + 10);
+        }
+        else if (!strncmp(argv[i], "--players=", 10)) {
+            bot.players = atoi(argv[i] + 10);
+        }
+        else if (!strncmp(argv[i], "--viewers=", 10)) {
+            bot.nviewers = atoi(argv[i] + 10);
+        }
+        else if (!strncmp(argv[i], "--seconds=", 10)) {
+            seconds = atoi(argv[i] + 10);
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+
+    if (bot.nbots < 1 || bot.nviewers < 0 || bot.players < 2 || bot.players > MP_MAX_PLAYERS) {
+        fprintf(stderr, "Invalid number of clients or players\n");
+        exit(-1);
+    }
+
+    if (path) {
+        struct sockaddr_un *addr = (struct sockaddr_un *) &bot.addr;
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+        bot.addrlen = sizeof(*addr);
+    }
+    else {
+        struct sockaddr_in *addr = (struct sockaddr_in *) &bot.addr;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        bot.addrlen = sizeof(*addr);
+
+        if (inet_pton(AF_INET, host, &addr->sin_addr) != 1) {
+            fprintf(stderr, "Invalid address: %s\n", host);
+            exit(-1);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, bot_stop);
+    signal(SIGTERM, bot_stop);
+
+    /* Every client needs a descriptor, so allow as many as possible */
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    const int total = bot.nbots + bot.nviewers;
+
+    bot.epfd = epoll_create1(EPOLL_CLOEXEC);
+    bot.bots = calloc(total, sizeof(mpbot));
+    mpstate_init(&bot.rng);
+    hist_zero(&bot.gap);
+
+    for (int i = 0; i < total; ++i) {
+        bot.bots[i].viewer = i >= bot.nbots;
+        bot_connect(&bot.bots[i]);
+    }
+
+    struct epoll_event events[256];
+    const uint64_t start = bot_now();
+    const uint64_t end = start + seconds * 1000000000ull;
+    uint64_t next = start + BOT_FRAME_NS;
+
+    while (running) {
+        uint64_t now = bot_now();
+
+        if (now >= end)
+            break;
+
+        const int timeout = next > now ? (next - now) / 1000000 : 0;
+        const int n = epoll_wait(bot.epfd, events, 256, timeout);
+
+        for (int i = 0; i < n; ++i)
+            bot_event(events[i].data.ptr, events[i].events);
+
+        now = bot_now();
+
+        if (now >= next) {
+            for (int i = 0; i < total; ++i)
+                bot_frame(&bot.bots[i]);
+
+            next += BOT_FRAME_NS;
+
+            /* Skip frames rather than sending bursts after a stall */
+            if (next < now)
+                next = now + BOT_FRAME_NS;
+        }
+    }
+
+    const double elapsed = (bot_now() - start) * 1e-9;
+
+    printf("%d clients, %d players per match, %.1f s\n", bot.nbots, bot.players, elapsed);
+    printf("connects: %" PRIu64 ", retries: %" PRIu64 ", games: %" PRIu64 ", wins: %" PRIu64
+            ", errors: %" PRIu64 "\n", bot.connects, bot.retries, bot.games, bot.wins, bot.errors);
+    printf("received: %" PRIu64 " messages (%.0f/s), %" PRIu64 " bytes (%.0f/s)\n",
+            bot.messages, bot.messages / elapsed, bot.bytes, bot.bytes / elapsed);
+    printf("own frame update interval (us):\n");
+    hist_print(&bot.gap, "gap", 1e-3, stdout);
+
+    if (bot.nviewers) {
+        const uint64_t messages = bot.keyframes + bot.deltas;
+
+        printf("%d spectators: %" PRIu64 " keyframes, %" PRIu64 " deltas, %" PRIu64
+                " matches watched, %.1f bytes per message, %.0f bytes/s\n",
+                bot.nviewers, bot.keyframes, bot.deltas, bot.watched,
+                messages ? (double) bot.spectated / messages : 0.0, bot.spectated / elapsed);
+    }
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "damage.h"
+#include "mem256.h"
+#include "mptet.h"
+
+void mpdamage_init(mpdamage *md, int age)
+{
+    md->age = age < 1 ? 1 : age > MPDAMAGE_AGES ? MPDAMAGE_AGES : age;
+    mpdamage_reset(md);
+}
+
+void mpdamage_reset(mpdamage *md)
+{
+    md->head = 0;
+    md->frames = 0;
+}
+
+/**
+ * Return the cells which are drawn filled and those drawn as ghost.
+ */
+static void mpdamage_classify(mpdamage_frame *f, mem256_t *filled, mem256_t *ghost)
+{
+    *filled = f->field;
+    mem256_ior(filled, &f->block);
+
+    mem256_t mask = *filled;
+    mem256_negate(&mask);
+
+    *ghost = f->ghost;
+    mem256_and(ghost, &mask);
+}
+
+bool mpdamage_compute(mpdamage *md, mpstate *ms, mpdamage_list *dl)
+{
+    /* The frame which is currently in the buffer being drawn to */
+    mpdamage_frame *prev = md->frames >= md->age
+            ? &md->frame[(md->head + MPDAMAGE_AGES - md->age + 1) % MPDAMAGE_AGES]
+            : NULL;
+
+    md->head = (md->head + 1) % MPDAMAGE_AGES;
+    if (md->frames < MPDAMAGE_AGES)
+        md->frames++;
+
+    mpdamage_frame *cur = &md->frame[md->head];
+    cur->field = ms->field;
+    cur->block = ms->block;
+    cur->ghost = ms->ghost;
+    cur->hold = ms->hold;
+    cur->bhead = ms->bhead;
+
+    dl->count = 0;
+
+    if (!prev) {
+        dl->full = true;
+        return true;
+    }
+
+    dl->full = false;
+    dl->hold = cur->hold != prev->hold;
+    dl->preview = cur->bhead != prev->bhead;
+
+    mem256_t filled, ghost, pfilled, pghost;
+    mpdamage_classify(cur, &filled, &ghost);
+    mpdamage_classify(prev, &pfilled, &pghost);
+
+    mem256_xor(&filled, &pfilled);
+    mem256_xor(&ghost, &pghost);
+    mem256_ior(&filled, &ghost);
+
+    /* Walk each set bit of the difference, the field only uses 220 bits */
+    for (int l = 0; l < 4; ++l) {
+        uint64_t limb = filled.limb[l];
+
+        while (limb) {
+            const int i = l * 64 + mem256_64lowbit(limb);
+            limb &= limb - 1;
+
+            if (i >= 220)
+                break;
+
+            const int x = 9 - i % 10;
+            const int y = 21 - i / 10;
+
+            if (!dl->count) {
+                dl->x0 = dl->x1 = x;
+                dl->y0 = dl->y1 = y;
+            }
+            else {
+                if (x < dl->x0) dl->x0 = x;
+                if (x > dl->x1) dl->x1 = x;
+                if (y < dl->y0) dl->y0 = y;
+                if (y > dl->y1) dl->y1 = y;
+            }
+
+            dl->cell[dl->count++] = i;
+        }
+    }
+
+    return dl->count || dl->hold || dl->preview;
+}
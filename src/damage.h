@@ -0,0 +1,76 @@
+#pragma once
+
+/**
+ * damage.h
+ *
+ * Implements tracking of which parts of the display have changed between
+ * frames, so that frontends only need to redraw and present those parts.
+ *
+ * Damage is computed against the state which was presented some number of
+ * frames ago. A frontend drawing into a persistent buffer uses an age of 1,
+ * whereas a double-buffered frontend uses 2, since its back buffer holds the
+ * frame before last.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mem256.h"
+#include "mptet.h"
+
+/* Maximum buffer age which can be tracked */
+#define MPDAMAGE_AGES 3
+
+typedef struct {
+    /* Was there no previous frame to compare against? Everything must be
+     * redrawn and the remaining fields are not set. */
+    bool full;
+
+    /* Number of changed cells */
+    int count;
+
+    /* Field bit index of each changed cell */
+    uint8_t cell[220];
+
+    /* Bounding box of the changed cells in grid coordinates, inclusive. The
+     * origin is the top-left cell, as it is drawn. */
+    int x0, y0, x1, y1;
+
+    /* Has the hold piece changed? */
+    bool hold;
+
+    /* Have the preview pieces changed? */
+    bool preview;
+} mpdamage_list;
+
+typedef struct {
+    mem256_t field;
+    mem256_t block;
+    mem256_t ghost;
+    int hold;
+    int bhead;
+} mpdamage_frame;
+
+typedef struct {
+    /* Previously presented frames, most recent at head */
+    mpdamage_frame frame[MPDAMAGE_AGES];
+    int head;
+
+    /* Number of valid entries in frame */
+    int frames;
+
+    /* Age of the buffer which is drawn into */
+    int age;
+} mpdamage;
+
+/* Initialize a tracker for a buffer of the given age */
+void mpdamage_init(mpdamage *md, int age);
+
+/* Forget all previous frames, so the next frame is fully redrawn */
+void mpdamage_reset(mpdamage *md);
+
+/**
+ * Compute what has changed between the state and the buffer being drawn to,
+ * and record the state as presented. Returns true if anything has changed.
+ */
+bool mpdamage_compute(mpdamage *md, mpstate *ms, mpdamage_list *dl);
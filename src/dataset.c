@@ -0,0 +1,289 @@
+/**
+ * dataset.c
+ *
+ * Implements a dataset of placements written from a background thread.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dataset.h"
+
+static bool mpdataset_write(int fd, const void *data, size_t size, uint64_t offset)
+{
+    const uint8_t *p = data;
+
+    while (size) {
+        const ssize_t n = pwrite(fd, p, size, offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0) {
+            fprintf(stderr, "Cannot write dataset: %s\n", strerror(errno));
+            return false;
+        }
+
+        p += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+static void mpdataset_header_fill(mpdataset_header *h, uint8_t flags, uint64_t count)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, MPDATASET_MAGIC, 8);
+    h->version = MPDATASET_VERSION;
+    h->header_size = sizeof(mpdataset_header);
+    h->record_size = sizeof(mpdataset_record);
+    h->next = MPDATASET_NEXT;
+    h->flags = flags;
+    h->count = count;
+}
+
+bool mpdataset_create(mpdataset *d, const char *path, bool scored)
+{
+    mpdataset_header h;
+
+    d->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    d->flags = scored ? MPDATASET_SCORED : 0;
+    atomic_init(&d->count, 0);
+    atomic_init(&d->failed, false);
+
+    if (d->fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    /* An empty dataset until it is finished */
+    mpdataset_header_fill(&h, d->flags, 0);
+
+    if (!mpdataset_write(d->fd, &h, sizeof(h), 0)) {
+        close(d->fd);
+        return false;
+    }
+
+    return true;
+}
+
+bool mpdataset_finish(mpdataset *d)
+{
+    mpdataset_header h;
+
+    mpdataset_header_fill(&h, d->flags, atomic_load(&d->count));
+
+    /* The records must be on disk before the header counts them */
+    bool ok = !atomic_load(&d->failed) &&
+        fdatasync(d->fd) == 0 &&
+        mpdataset_write(d->fd, &h, sizeof(h), 0) &&
+        fdatasync(d->fd) == 0;
+
+    close(d->fd);
+    d->fd = -1;
+    return ok;
+}
+
+static void *mpdataset_thread(void *arg)
+{
+    mpdataset_stream *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+
+    while (true) {
+        while (!s->writing && !s->stop)
+            pthread_cond_wait(&s->cond, &s->lock);
+
+        if (!s->writing)
+            break;
+
+        const mpdataset_record *r = s->writing;
+        const size_t count = s->wcount;
+        const uint64_t at = s->wat;
+
+        /* The producer fills the other buffer meanwhile */
+        pthread_mutex_unlock(&s->lock);
+
+        if (!mpdataset_write(s->d->fd, r, count * sizeof(*r),
+                    sizeof(mpdataset_header) + at * sizeof(*r)))
+            atomic_store(&s->d->failed, true);
+
+        pthread_mutex_lock(&s->lock);
+        s->writing = NULL;
+        pthread_cond_signal(&s->cond);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/**
+ * Hand the active buffer to the writing thread and switch to the other one,
+ * waiting only if the thread has not finished writing it yet.
+ */
+static void mpdataset_flush(mpdataset_stream *s)
+{
+    if (!s->fill)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+
+    while (s->writing)
+        pthread_cond_wait(&s->cond, &s->lock);
+
+    s->writing = s->buffer[s->active];
+    s->wcount = s->fill;
+    s->wat = atomic_fetch_add(&s->d->count, s->fill);
+    pthread_cond_signal(&s->cond);
+
+    pthread_mutex_unlock(&s->lock);
+
+    s->active ^= 1;
+    s->fill = 0;
+}
+
+void mpdataset_stream_init(mpdataset_stream *s, mpdataset *d, mpdataset_score_fn score,
+        void *ctx)
+{
+    s->d = d;
+    s->score = score;
+    s->score_ctx = ctx;
+    s->active = 0;
+    s->fill = 0;
+    s->writing = NULL;
+    s->stop = false;
+
+    for (int i = 0; i < 2; ++i) {
+        s->buffer[i] = malloc(MPDATASET_BUFFER * sizeof(mpdataset_record));
+
+        if (!s->buffer[i]) {
+            fprintf(stderr, "Failed to allocate dataset buffer\n");
+            exit(-1);
+        }
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if (pthread_create(&s->thread, NULL, mpdataset_thread, s) != 0) {
+        fprintf(stderr, "Failed to create dataset thread\n");
+        exit(-1);
+    }
+}
+
+void mpdataset_stream_free(mpdataset_stream *s)
+{
+    mpdataset_flush(s);
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->thread, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+
+    free(s->buffer[0]);
+    free(s->buffer[1]);
+    s->buffer[0] = s->buffer[1] = NULL;
+}
+
+void mpdataset_pack(uint8_t out[28], const mem256_t *field)
+{
+    for (int i = 0; i < 28; ++i)
+        out[i] = field->limb[i / 8] >> (8 * (i % 8));
+}
+
+static void mpdataset_lock(const mpstate *ms, const mem256_t *before, int cleared, void *ctx)
+{
+    mpdataset_stream *s = ctx;
+    mpdataset_record *r = &s->buffer[s->active][s->fill];
+
+    mpdataset_pack(r->field, before);
+
+    r->id = ms->id;
+    r->hold = ms->hold < 0 ? MPDATASET_NONE : ms->hold;
+    r->br = ms->br;
+    r->bx = ms->bx;
+    r->by = ms->by;
+    r->lines = cleared;
+
+    /* The next piece has not been taken from the bag yet */
+    for (int i = 0; i < MPDATASET_NEXT; ++i)
+        r->next[i] = ms->bag[(ms->bhead + i) % 14];
+
+    r->score = s->score ? s->score(ms, before, cleared, s->score_ctx) : NAN;
+    r->frame = ms->total_frames;
+
+    if (++s->fill == MPDATASET_BUFFER)
+        mpdataset_flush(s);
+}
+
+void mpdataset_attach(mpstate *ms, mpdataset_stream *s)
+{
+    ms->lock_hook = mpdataset_lock;
+    ms->lock_ctx = s;
+}
+
+static bool mpdataset_header_valid(const mpdataset_header *h, uint64_t size)
+{
+    return !memcmp(h->magic, MPDATASET_MAGIC, 8) &&
+        h->version == MPDATASET_VERSION &&
+        h->header_size == sizeof(mpdataset_header) &&
+        h->record_size == sizeof(mpdataset_record) &&
+        h->next == MPDATASET_NEXT &&
+        h->count <= (size - sizeof(mpdataset_header)) / sizeof(mpdataset_record);
+}
+
+bool mpdataset_open(mpdataset_view *v, const char *path)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    v->size = st.st_size;
+    v->map = NULL;
+
+    if (v->size >= sizeof(mpdataset_header)) {
+        void *map = mmap(NULL, v->size, PROT_READ, MAP_SHARED, fd, 0);
+        v->map = map == MAP_FAILED ? NULL : map;
+    }
+
+    close(fd);
+
+    if (!v->map || !mpdataset_header_valid((const void *) v->map, v->size)) {
+        fprintf(stderr, "%s is not a valid dataset\n", path);
+        if (v->map)
+            munmap((void *) v->map, v->size);
+        return false;
+    }
+
+    v->header = (const void *) v->map;
+    v->records = (const void *) (v->map + sizeof(mpdataset_header));
+    v->count = v->header->count;
+    return true;
+}
+
+void mpdataset_close(mpdataset_view *v)
+{
+    munmap((void *) v->map, v->size);
+    v->map = NULL;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+/**
+ * dataset.h
+ *
+ * Implements a dataset of placements for training models, written while
+ * games are played or replayed and read back through a memory map.
+ *
+ * The file is a header followed by fixed size records, one for each piece
+ * locked, so record i is found at header_size + i * record_size without
+ * reading anything before it:
+ *
+ *   header     magic, version, sizes, number of records
+ *   records    one mpdataset_record per placement
+ *
+ * Records are gathered by each producer into one of two buffers while a
+ * thread of its own writes the other, so games are never held up by the
+ * disk. Each full buffer reserves the next range of records in the file,
+ * and the header only counts them once every producer has finished, so an
+ * interrupted export holds no records at all rather than a torn one.
+ *
+ * As in archive.h, integers and floats are stored in the byte order of the
+ * machine writing them.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mptet.h"
+
+#define MPDATASET_MAGIC "mptetset"
+#define MPDATASET_VERSION 1
+
+/* Pieces of the queue stored with each placement */
+#define MPDATASET_NEXT 6
+
+/* Records gathered before a buffer is handed to the writing thread */
+#define MPDATASET_BUFFER 8192
+
+/* Stored for a hold piece when nothing is held */
+#define MPDATASET_NONE 0xff
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+
+    /* Size of the header and of each record, for checking */
+    uint16_t header_size;
+    uint16_t record_size;
+
+    /* Pieces of the queue in each record, and MPDATASET_* flags */
+    uint8_t next;
+    uint8_t flags;
+    uint8_t pad[6];
+
+    uint64_t count;
+    uint8_t reserved[32];
+} mpdataset_header;
+
+enum {
+    /* Records hold a score from an evaluator */
+    MPDATASET_SCORED = 1 << 0
+};
+
+typedef struct {
+    /* The 22 rows of the field before the piece was placed. Bit i of the
+     * mem256_t is bit i % 8 of byte i / 8, see mpdataset_cell */
+    uint8_t field[28];
+
+    /* Piece placed, and the piece held at the time */
+    uint8_t id;
+    uint8_t hold;
+
+    /* Rotation and top-left corner of the bounding square as it locked */
+    uint8_t br;
+    int8_t bx;
+    int8_t by;
+
+    /* Lines cleared by this placement */
+    uint8_t lines;
+
+    /* Pieces to be spawned next, in order */
+    uint8_t next[MPDATASET_NEXT];
+
+    /* Score of the placement, or NaN if the dataset is not scored */
+    float score;
+
+    /* Frame of the game the piece locked on */
+    uint32_t frame;
+} mpdataset_record;
+
+_Static_assert(sizeof(mpdataset_header) == 64, "dataset header is not 64 bytes");
+_Static_assert(sizeof(mpdataset_record) == 48, "dataset record is not 48 bytes");
+
+/**
+ * Score a placement, with the same arguments as an mplock_fn.
+ */
+typedef float (*mpdataset_score_fn)(const mpstate *ms, const mem256_t *before,
+        int cleared, void *ctx);
+
+/* A dataset being written, shared by every producer */
+typedef struct {
+    int fd;
+    uint8_t flags;
+
+    /* Records reserved by producers so far */
+    atomic_uint_fast64_t count;
+
+    /* Set if any write failed */
+    atomic_bool failed;
+} mpdataset;
+
+/* A single producer of records, which must only be used by one thread */
+typedef struct {
+    mpdataset *d;
+
+    mpdataset_score_fn score;
+    void *score_ctx;
+
+    /* The buffer being filled, and the records in it */
+    mpdataset_record *buffer[2];
+    int active;
+    size_t fill;
+
+    /* The buffer being written by the thread, NULL once it is done */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    mpdataset_record *writing;
+    size_t wcount;
+    uint64_t wat;
+    bool stop;
+} mpdataset_stream;
+
+/* A dataset opened for reading */
+typedef struct {
+    const uint8_t *map;
+    size_t size;
+
+    const mpdataset_header *header;
+    const mpdataset_record *records;
+    uint64_t count;
+} mpdataset_view;
+
+/**
+ * Create a dataset, replacing any file at path. Returns false with a message
+ * on stderr on failure.
+ */
+bool mpdataset_create(mpdataset *d, const char *path, bool scored);
+
+/**
+ * Count every record written in the header. Every stream must have been
+ * freed first. Returns false if any write failed.
+ */
+bool mpdataset_finish(mpdataset *d);
+
+/**
+ * Start a producer writing to a dataset. score may be NULL if the dataset
+ * is not scored.
+ */
+void mpdataset_stream_init(mpdataset_stream *s, mpdataset *d, mpdataset_score_fn score,
+        void *ctx);
+
+/* Write any records still buffered and stop the writing thread */
+void mpdataset_stream_free(mpdataset_stream *s);
+
+/* Pack the 22 rows of a field as stored in a record */
+void mpdataset_pack(uint8_t out[28], const mem256_t *field);
+
+/* Record every piece locked by a state */
+void mpdataset_attach(mpstate *ms, mpdataset_stream *s);
+
+/**
+ * Open a dataset for reading. Returns false with a message on stderr if it
+ * cannot be opened or is invalid.
+ */
+bool mpdataset_open(mpdataset_view *v, const char *path);
+
+void mpdataset_close(mpdataset_view *v);
+
+/* Is the cell at column x from the left and row y from the top filled? */
+static inline bool mpdataset_cell(const mpdataset_record *r, int x, int y)
+{
+    const int i = 10 * (21 - y) + 9 - x;
+    return r->field[i / 8] >> (i % 8) & 1;
+}
@@ -1,5 +1,9 @@
 #include <directfb.h>
 
+#include "damage.h"
+#include "layout.h"
+#include "raster.h"
+
 #define DC_(...)                                                 \
     do {                                                         \
         DFBResult err = __VA_ARGS__;                             \
@@ -9,14 +13,50 @@
         }                                                        \
     } while (0)
 
+#if defined(MP_THREADED)
+#   include <pthread.h>
+#   include "input.h"
+#endif
+
+/* Pre-rendered tiles for each way a cell can be drawn */
+enum {
+    T_Block, T_Ghost, T_Empty, T_Count
+};
+
 typedef struct mpgfx__ {
     int width;
     int height;
     IDirectFB *dfb;
     IDirectFBSurface *primary;
     IDirectFBInputDevice *keyboard;
+
+    /* Off-screen surface holding every tile and piece sprite, and the area
+     * of each. Sprites are indexed by mplayout_sprite. */
+    IDirectFBSurface *tiles;
+    DFBRectangle tile[T_Count];
+    DFBRectangle hold[L_SPRITES];
+    DFBRectangle preview[L_SPRITES];
+
+    /* Placement of everything on the primary surface */
+    mplayout layout;
+
+    /* Changes since the frame which is in the back buffer */
+    mpdamage damage;
+#if defined(MP_THREADED)
+    /* Key events are read from an event buffer by the input thread */
+    IDirectFBEventBuffer *events;
+    pthread_t input_thread;
+    atomic_bool input_running;
+    mpqueue input;
+#endif
 } mpgfx;
 
+#if defined(MP_THREADED)
+static void *mpgfx_input_thread(void *arg);
+#endif
+
+static void mpgfx_init_tiles(mpgfx *mx);
+
 void mpgfx_init(mpgfx *mx, int *argc, char ***argv)
 {
     DFBSurfaceDescription dsc;
@@ -33,8 +73,28 @@ void mpgfx_init(mpgfx *mx, int *argc, char ***argv)
     DC_(mx->primary->FillRectangle(mx->primary, 0, 0, mx->width, mx->height));
     DC_(mx->primary->Flip(mx->primary, NULL, DSFLIP_NONE));
 
+    /* The primary surface is never resized */
+    mplayout_compute(&mx->layout, mx->width, mx->height);
+    mpgfx_init_tiles(mx);
+
+    /* Every frame is presented by copying the back buffer to the front, so
+     * the back buffer always holds the last frame */
+    mpdamage_init(&mx->damage, 1);
+
     /* Setup keyboard */
     DC_(mx->dfb->GetInputDevice(mx->dfb, DIDID_KEYBOARD, &mx->keyboard));
+
+#if defined(MP_THREADED)
+    DC_(mx->keyboard->CreateEventBuffer(mx->keyboard, &mx->events));
+
+    mpqueue_init(&mx->input);
+    atomic_init(&mx->input_running, true);
+
+    if (pthread_create(&mx->input_thread, NULL, mpgfx_input_thread, mx) != 0) {
+        fprintf(stderr, "Failed to create input thread\n");
+        exit(-1);
+    }
+#endif
 }
 
 static int keycodes[] = {
@@ -42,6 +102,45 @@ static int keycodes[] = {
     DIKI_SPACE, DIKI_Q
 };
 
+#if defined(MP_THREADED)
+static void *mpgfx_input_thread(void *arg)
+{
+    mpgfx *mx = arg;
+    DFBInputEvent e;
+
+    while (atomic_load(&mx->input_running)) {
+        /* Wake periodically to check if we should stop */
+        if (mx->events->WaitForEventWithTimeout(mx->events, 0, 50) != DFB_OK)
+            continue;
+
+        while (mx->events->GetEvent(mx->events, DFB_EVENT(&e)) == DFB_OK) {
+            if (e.type != DIET_KEYPRESS && e.type != DIET_KEYRELEASE)
+                continue;
+
+            const uint64_t now = ts_get_current_time();
+
+            for (size_t i = 0; i < sizeof(keycodes) / sizeof(keycodes[0]); ++i) {
+                if (e.key_id == keycodes[i]) {
+                    mpqueue_push(&mx->input, now, i, e.type == DIET_KEYPRESS);
+                    break;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void mpgfx_update(mpstate *ms, mpgfx *mx)
+{
+    mpqueue_drain(&mx->input, ms);
+}
+
+void mpgfx_poll(mpgfx *mx)
+{
+    (void) mx;
+}
+#else
 void mpgfx_update(mpstate *ms, mpgfx *mx)
 {
     DFBInputDeviceKeyState state;
@@ -55,112 +154,243 @@ void mpgfx_update(mpstate *ms, mpgfx *mx)
             ms->keystate[i] = 0;
     }
 }
+#endif
 
 void mpgfx_free(mpgfx *mx)
 {
+#if defined(MP_THREADED)
+    atomic_store(&mx->input_running, false);
+    pthread_join(mx->input_thread, NULL);
+    mx->events->Release(mx->events);
+#endif
+
     mx->keyboard->Release(mx->keyboard);
+    mx->tiles->Release(mx->tiles);
     mx->primary->Release(mx->primary);
     mx->dfb->Release(mx->dfb);
 }
 
-/* Number of preview pieces shown */
-#define PREVIEW_NUMBER 3
+/**
+ * Grow a region so that it also contains the given rectangle.
+ */
+static void mpgfx_region_add(DFBRegion *r, bool *valid, const mprect *a)
+{
+    if (!*valid) {
+        r->x1 = a->x;
+        r->y1 = a->y;
+        r->x2 = a->x + a->w - 1;
+        r->y2 = a->y + a->h - 1;
+        *valid = true;
+        return;
+    }
 
-/* Block side length */
-#define M_BLOCK_SIDE 36
+    if (a->x < r->x1) r->x1 = a->x;
+    if (a->y < r->y1) r->y1 = a->y;
+    if (a->x + a->w - 1 > r->x2) r->x2 = a->x + a->w - 1;
+    if (a->y + a->h - 1 > r->y2) r->y2 = a->y + a->h - 1;
+}
 
-/* Main grid x offset */
-#define M_X_OFFSET 200
+/**
+ * Lay out a row of sprites of the given size in the tile surface.
+ */
+static void mpgfx_sprite_row(DFBRectangle *sprite, int n, int y, const mprect *area,
+        DFBSurfaceDescription *dsc)
+{
+    for (int i = 0; i < n; ++i) {
+        sprite[i].x = i * area->w;
+        sprite[i].y = y;
+        sprite[i].w = area->w;
+        sprite[i].h = area->h;
+    }
 
-/* Main grid y offset */
-#define M_Y_OFFSET 100
+    if (n * area->w > dsc->width)
+        dsc->width = n * area->w;
+    dsc->height = y + area->h;
+}
 
-/* Preview x offset */
-#define P_X_OFFSET 40
+/**
+ * Draw the filled cells of a piece into its sprite.
+ */
+static void mpgfx_sprite_piece(mpgfx *mx, const DFBRectangle *sprite, uint64_t block,
+        const mprect *cell)
+{
+    DFBRectangle fill[16];
+    int n = 0;
 
-/* Preview y offset */
-#define P_Y_OFFSET 20
+    for (int k = 0; k < 16; ++k) {
+        if (!mplayout_piece_cell(block, k))
+            continue;
 
-/* Preview block scale */
-#define P_BLOCK_SCALE 0.9f
+        fill[n].x = sprite->x + cell[k].x;
+        fill[n].y = sprite->y + cell[k].y;
+        fill[n].w = cell[k].w;
+        fill[n].h = cell[k].h;
+        n++;
+    }
 
-/* Hold preview block scale */
-#define H_BLOCK_SCALE 0.9f
+    DC_(mx->tiles->FillRectangles(mx->tiles, fill, n));
+}
 
-/* Hold preview x offset - assert(M_X_OFFSET > (M_BLOCK_SIDE * H_BLOCK_SCALE * 4))*/
-#define H_X_OFFSET (M_X_OFFSET / 2 -  (M_BLOCK_SIDE * H_BLOCK_SCALE) * 2)
+/**
+ * Render each tile and piece sprite once into an off-screen surface, so that
+ * cells and pieces are drawn by blitting from it without changing any
+ * drawing state. Cell tiles are in the first row, followed by a row of hold
+ * sprites and a row of preview sprites.
+ */
+static void mpgfx_init_tiles(mpgfx *mx)
+{
+    static const uint8_t color[T_Count][4] = {
+        [T_Block] = { 0x80, 0x80, 0xff, 0xff },
+        [T_Ghost] = { 0x80, 0x80, 0xff / 2, 0 },
+        [T_Empty] = { 0, 0, 0, 0xff }
+    };
 
-/* Hold preview y offset */
-#define H_Y_OFFSET 40
+    const mplayout *l = &mx->layout;
+    const int side = l->cell[0].w;
 
-void mpgfx_render(mpstate *ms, mpgfx *mx)
-{
-    // Clear Screen
-    DC_(mx->primary->SetColor(mx->primary, 0, 0, 0, 0xff));
-    DC_(mx->primary->FillRectangle(mx->primary, 0, 0, mx->width, mx->height));
+    DFBSurfaceDescription dsc;
+    dsc.flags = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
+    dsc.width = 0;
+    dsc.height = l->side;
+    DC_(mx->primary->GetPixelFormat(mx->primary, &dsc.pixelformat));
 
-    // Draw bounding field
-    DC_(mx->primary->SetColor(mx->primary, 0x80, 0x80, 0x80, 0xff));
-    DC_(mx->primary->DrawRectangle(mx->primary,
-                M_X_OFFSET - 1,
-                M_Y_OFFSET - 1,
-                10 * M_BLOCK_SIDE + 2,
-                22 * M_BLOCK_SIDE + 2));
-
-    DC_(mx->primary->DrawRectangle(mx->primary,
-                M_X_OFFSET - 2,
-                M_Y_OFFSET - 2,
-                10 * M_BLOCK_SIDE + 4,
-                22 * M_BLOCK_SIDE + 4));
-
-    // Draw blocks
-    for (int i = 219; i >= 0; --i) {
-        if (mem256_get(&ms->field, i) || mem256_get(&ms->block, i))
-            DC_(mx->primary->SetColor(mx->primary, 0x80, 0x80, 0xff, 0xff));
-        else if (mem256_get(&ms->ghost, i))
-            DC_(mx->primary->SetColor(mx->primary, 0x80, 0x80, 0xff / 2, 0));
-        else
-            DC_(mx->primary->SetColor(mx->primary, 0, 0, 0, 0xff));
+    for (int i = 0; i < T_Count; ++i) {
+        mx->tile[i].x = dsc.width;
+        mx->tile[i].y = 0;
+        mx->tile[i].w = side;
+        mx->tile[i].h = side;
+        dsc.width += side;
+    }
 
-        DC_(mx->primary->FillRectangle(mx->primary,
-                    M_X_OFFSET + M_BLOCK_SIDE * (9 - i % 10) + 1,
-                    M_Y_OFFSET + M_BLOCK_SIDE * (21 - (i / 10)) + 1,
-                    M_BLOCK_SIDE - 2,
-                    M_BLOCK_SIDE - 2));
+    mpgfx_sprite_row(mx->hold, L_SPRITES, dsc.height, &l->hold, &dsc);
+    mpgfx_sprite_row(mx->preview, L_SPRITES, dsc.height, &l->preview_piece[0], &dsc);
+
+    DC_(mx->dfb->CreateSurface(mx->dfb, &dsc, &mx->tiles));
+    DC_(mx->tiles->Clear(mx->tiles, 0, 0, 0, 0xff));
+
+    for (int i = 0; i < T_Count; ++i) {
+        DC_(mx->tiles->SetColor(mx->tiles, color[i][0], color[i][1], color[i][2], color[i][3]));
+        DC_(mx->tiles->FillRectangle(mx->tiles,
+                    mx->tile[i].x, mx->tile[i].y, mx->tile[i].w, mx->tile[i].h));
     }
 
-    DC_(mx->primary->SetColor(mx->primary, 0x80, 0x80, 0xff, 0xff));
-    uint64_t block = mptetd_block[ms->hold][0];
-
-    if (ms->hold != -1) {
-        for (int x = 0; x < 4; ++x) {
-            for (int y = 0; y < 4; ++y) {
-                if (block & ((1 << ((4 - y) * 10 - x - 1))))
-                    DC_(mx->primary->FillRectangle(mx->primary,
-                                H_X_OFFSET + x * M_BLOCK_SIDE * H_BLOCK_SCALE,
-                                M_Y_OFFSET + H_Y_OFFSET + y * M_BLOCK_SIDE * H_BLOCK_SCALE,
-                                H_BLOCK_SCALE * M_BLOCK_SIDE - 2,
-                                H_BLOCK_SCALE * M_BLOCK_SIDE - 2));
-            }
-        }
+    /* The last sprite of each row is left empty */
+    DC_(mx->tiles->SetColor(mx->tiles, 0x80, 0x80, 0xff, 0xff));
+    for (int id = 0; id < L_SPRITES - 1; ++id) {
+        mpgfx_sprite_piece(mx, &mx->hold[id], mptetd_block[id][0], l->hold_sprite);
+        mpgfx_sprite_piece(mx, &mx->preview[id], mptetd_block[id][0], l->preview_sprite);
     }
 
-    // Draw preview pieces
+    DC_(mx->primary->SetBlittingFlags(mx->primary, DSBLIT_NOFX));
+}
+
+/* Blits gathered for a single BatchBlit call */
+typedef struct {
+    DFBRectangle src[220 + 1 + PREVIEW_NUMBER];
+    DFBPoint dst[220 + 1 + PREVIEW_NUMBER];
+    int n;
+} mpgfx_batch;
+
+static void mpgfx_batch_add(mpgfx_batch *b, const DFBRectangle *src, const mprect *at)
+{
+    b->src[b->n] = *src;
+    b->dst[b->n].x = at->x;
+    b->dst[b->n].y = at->y;
+    b->n++;
+}
+
+static void mpgfx_cell(const mpraster *r, mpgfx *mx, mpgfx_batch *b, int i)
+{
+    static const int tiles[R_Classes] = {
+        [R_Field] = T_Block, [R_Block] = T_Block,
+        [R_Ghost] = T_Ghost, [R_Empty] = T_Empty
+    };
+
+    mpgfx_batch_add(b, &mx->tile[tiles[mpraster_cell(r, i)]], &mx->layout.cell[i]);
+}
+
+/* Sprites cover the whole area of each piece, so nothing needs clearing */
+static void mpgfx_hold(mpstate *ms, mpgfx *mx, mpgfx_batch *b)
+{
+    mpgfx_batch_add(b, &mx->hold[mplayout_sprite(ms->hold)], &mx->layout.hold);
+}
+
+static void mpgfx_preview(mpstate *ms, mpgfx *mx, mpgfx_batch *b)
+{
     for (int i = 0; i < PREVIEW_NUMBER; ++i) {
-        uint64_t block = mptetd_block[ms->bag[ms->bhead + i] % 14][0];
-
-        for (int x = 0; x < 4; ++x) {
-            for (int y = 0; y < 4; ++y) {
-                if (block & ((1 << ((4 - y) * 10 - x - 1))))
-                    DC_(mx->primary->FillRectangle(mx->primary,
-                                M_X_OFFSET + 10 * M_BLOCK_SIDE + P_X_OFFSET + x * M_BLOCK_SIDE * P_BLOCK_SCALE,
-                                M_Y_OFFSET + i * (P_Y_OFFSET + 4 * M_BLOCK_SIDE * P_BLOCK_SCALE)
-                                + y * M_BLOCK_SIDE * P_BLOCK_SCALE,
-                                P_BLOCK_SCALE * M_BLOCK_SIDE - 2,
-                                P_BLOCK_SCALE * M_BLOCK_SIDE - 2));
-            }
+        mpgfx_batch_add(b, &mx->preview[mplayout_sprite(ms->bag[(ms->bhead + i) % 14])],
+                &mx->layout.preview_piece[i]);
+    }
+}
+
+/**
+ * Only the parts of the frame which differ from the back buffer are redrawn,
+ * and only the region containing them is copied to the front. Flipping with
+ * DSFLIP_BLIT copies rather than swaps even for the whole screen, so the back
+ * buffer is never left holding an older frame. All tiles are drawn with a
+ * single BatchBlit.
+ */
+void mpgfx_render(mpstate *ms, mpgfx *mx)
+{
+    const mplayout *l = &mx->layout;
+    mpdamage_list dl;
+    mpgfx_batch batch;
+
+    if (!mpdamage_compute(&mx->damage, ms, &dl))
+        return;
+
+    batch.n = 0;
+
+    mpraster r;
+    mpraster_classify(&r, ms);
+
+    if (dl.full) {
+        // Clear Screen
+        DC_(mx->primary->SetColor(mx->primary, 0, 0, 0, 0xff));
+        DC_(mx->primary->FillRectangle(mx->primary, 0, 0, mx->width, mx->height));
+
+        // Draw bounding field
+        DC_(mx->primary->SetColor(mx->primary, 0x80, 0x80, 0x80, 0xff));
+        for (int i = 0; i < 2; ++i) {
+            DC_(mx->primary->DrawRectangle(mx->primary,
+                        l->border[i].x, l->border[i].y, l->border[i].w, l->border[i].h));
         }
+
+        // Draw blocks
+        for (int i = 219; i >= 0; --i)
+            mpgfx_cell(&r, mx, &batch, i);
+
+        mpgfx_hold(ms, mx, &batch);
+        mpgfx_preview(ms, mx, &batch);
+
+        DC_(mx->primary->BatchBlit(mx->primary, mx->tiles, batch.src, batch.dst, batch.n));
+        DC_(mx->primary->Flip(mx->primary, NULL, DSFLIP_BLIT));
+        return;
     }
 
-    DC_(mx->primary->Flip(mx->primary, NULL, DSFLIP_NONE));
+    DFBRegion region;
+    bool valid = false;
+
+    for (int i = 0; i < dl.count; ++i)
+        mpgfx_cell(&r, mx, &batch, dl.cell[i]);
+
+    if (dl.count) {
+        const mprect cells = mplayout_cells(l, dl.x0, dl.y0, dl.x1, dl.y1);
+        mpgfx_region_add(&region, &valid, &cells);
+    }
+
+    if (dl.hold) {
+        mpgfx_hold(ms, mx, &batch);
+        mpgfx_region_add(&region, &valid, &l->hold);
+    }
+
+    if (dl.preview) {
+        mpgfx_preview(ms, mx, &batch);
+        mpgfx_region_add(&region, &valid, &l->preview);
+    }
+
+    if (batch.n)
+        DC_(mx->primary->BatchBlit(mx->primary, mx->tiles, batch.src, batch.dst, batch.n));
+
+    DC_(mx->primary->Flip(mx->primary, &region, DSFLIP_BLIT));
 }
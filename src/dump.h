@@ -0,0 +1,450 @@
+/**
+ * dump.h
+ *
+ * Renders every frame into a memory framebuffer and writes it out instead of
+ * displaying it. No display server is required and the game is run as fast
+ * as frames can be written.
+ *
+ * Options:
+ *
+ *  --dump-format=ppm|rgb|y4m   Output format (default ppm)
+ *  --dump-output=PATH          Output stream, or a printf pattern such as
+ *                              frame%05d.ppm to write each frame to its own
+ *                              file, holding one %d with an optional zero
+ *                              flag and width (default mptet.<format>)
+ *  --dump-input=PATH           Scripted input, see below
+ *  --dump-frames=N             Quit after N frames, the game as it starts
+ *                              and after each of its first N - 1 ticks,
+ *                              counting duplicates skipped (default 600
+ *                              when no input script is given)
+ *  --dump-size=WxH             Framebuffer size (default 1920x1080)
+ *  --dump-skip-dups            Do not write frames identical to the last
+ *
+ * The input script holds one line per run of frames, giving the number of
+ * frames and the keys held during them. Keys are named by the characters
+ * l, r, d, z, x, c, s (space) and q, or '-' for none. Lines beginning with
+ * '#' are ignored. The game quits once the script is exhausted.
+ *
+ *  # das right, then hard drop
+ *  12 r
+ *  1 s
+ *  1 -
+ *
+ * Set MPTET_SEED in the environment for a reproducible piece sequence.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "damage.h"
+#include "layout.h"
+
+#if defined(MP_THREADED)
+#   error "The dump frontend writes every frame and cannot run threaded"
+#endif
+
+#include "fb.h"
+
+/* Frames are produced as fast as they can be written */
+#define MP_GFX_UNPACED
+
+enum {
+    D_Ppm, D_Rgb, D_Y4m
+};
+
+typedef struct {
+    int width;
+    int height;
+
+    /* Placement of everything in the frame */
+    mplayout layout;
+
+    /* Hold and preview piece sprites */
+    mpfb_cache sprites;
+
+    /* Rendered frame, as 0x00RRGGBB pixels */
+    uint32_t *pixels;
+
+    /* Frame converted to the output format */
+    uint8_t *out;
+
+    int format;
+
+    /* Output stream, when not writing one file per frame */
+    FILE *fd;
+    const char *pattern;
+
+    /* Scripted input and the keys held for the remaining frames */
+    FILE *input;
+    int hold_frames;
+    bool held[10];
+
+    /* Frame limit, or -1 for none */
+    int64_t frames;
+
+    bool skip_dups;
+    mpdamage damage;
+
+    int64_t written;
+    int64_t skipped;
+} mpgfx;
+
+static const char *dump_extensions[] = { "ppm", "rgb", "y4m" };
+
+/**
+ * Return the value of an option of the form --name=value, or NULL.
+ */
+static const char *dump_option(const char *arg, const char *name)
+{
+    const size_t n = strlen(name);
+
+    if (strncmp(arg, name, n) == 0 && arg[n] == '=')
+        return arg + n + 1;
+
+    return NULL;
+}
+
+/**
+ * Is the output a pattern holding a single %d, optionally with a zero flag
+ * and a width, and no other conversions? It is used as a printf format, so
+ * anything else is rejected.
+ */
+static bool dump_pattern_valid(const char *pattern)
+{
+    int conversions = 0;
+
+    for (const char *p = strchr(pattern, '%'); p; p = strchr(p, '%')) {
+        p++;
+
+        if (*p == '0')
+            p++;
+
+        while (*p >= '0' && *p <= '9')
+            p++;
+
+        if (*p++ != 'd' || conversions++)
+            return false;
+    }
+
+    return conversions == 1;
+}
+
+static FILE *dump_open(const char *path)
+{
+    FILE *fd = fopen(path, "wb");
+
+    if (!fd) {
+        perror(path);
+        exit(-1);
+    }
+
+    return fd;
+}
+
+void mpgfx_init(mpgfx *mx, int *argc, char ***argv)
+{
+    static char default_output[16];
+    const char *output = NULL;
+    const char *input = NULL;
+    const char *v;
+
+    mx->width = 1920;
+    mx->height = 1080;
+    mx->format = D_Ppm;
+    mx->input = NULL;
+    mx->hold_frames = 0;
+    memset(mx->held, 0, sizeof(mx->held));
+    mx->frames = -1;
+    mx->skip_dups = false;
+    mx->written = 0;
+    mx->skipped = 0;
+
+    for (int i = 1; i < *argc; ++i) {
+        const char *arg = (*argv)[i];
+
+        if ((v = dump_option(arg, "--dump-format"))) {
+            if (!strcmp(v, "ppm"))
+                mx->format = D_Ppm;
+            else if (!strcmp(v, "rgb"))
+                mx->format = D_Rgb;
+            else if (!strcmp(v, "y4m"))
+                mx->format = D_Y4m;
+            else {
+                fprintf(stderr, "Unknown dump format: %s\n", v);
+                exit(-1);
+            }
+        }
+        else if ((v = dump_option(arg, "--dump-output"))) {
+            output = v;
+        }
+        else if ((v = dump_option(arg, "--dump-input"))) {
+            input = v;
+        }
+        else if ((v = dump_option(arg, "--dump-frames"))) {
+            mx->frames = strtoll(v, NULL, 10);
+        }
+        else if ((v = dump_option(arg, "--dump-size"))) {
+            if (sscanf(v, "%dx%d", &mx->width, &mx->height) != 2) {
+                fprintf(stderr, "Invalid dump size: %s\n", v);
+                exit(-1);
+            }
+        }
+        else if (!strcmp(arg, "--dump-skip-dups")) {
+            mx->skip_dups = true;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            exit(-1);
+        }
+    }
+
+    mplayout_compute(&mx->layout, mx->width, mx->height);
+
+    /* The whole field must be visible */
+    const mprect *border = &mx->layout.border[1];
+    if (mx->width <= 0 || mx->height <= 0 || border->x < 0 || border->y < 0 ||
+            border->x + border->w > mx->width || border->y + border->h > mx->height) {
+        fprintf(stderr, "Dump size %dx%d is too small\n", mx->width, mx->height);
+        exit(-1);
+    }
+
+    if (input) {
+        mx->input = fopen(input, "r");
+
+        if (!mx->input) {
+            perror(input);
+            exit(-1);
+        }
+    }
+    else if (mx->frames < 0) {
+        mx->frames = 600;
+    }
+
+    if (!output) {
+        snprintf(default_output, sizeof(default_output), "mptet.%s",
+                dump_extensions[mx->format]);
+        output = default_output;
+    }
+
+    /* A pattern writes each frame to a new file, otherwise frames are
+     * concatenated into a single stream */
+    mx->pattern = strchr(output, '%') ? output : NULL;
+
+    if (mx->pattern && !dump_pattern_valid(mx->pattern)) {
+        fprintf(stderr, "Invalid dump output pattern, which must hold one %%d: %s\n",
+                mx->pattern);
+        exit(-1);
+    }
+
+    mx->fd = mx->pattern ? NULL : dump_open(output);
+
+    const size_t pixels = (size_t) mx->width * mx->height;
+    mx->pixels = malloc(pixels * sizeof(uint32_t));
+    mx->out = malloc(pixels * 3 + 64);
+
+    if (!mx->pixels || !mx->out) {
+        fprintf(stderr, "Failed to allocate %dx%d framebuffer\n", mx->width, mx->height);
+        exit(-1);
+    }
+
+    if (mx->format == D_Y4m && mx->fd) {
+        fprintf(mx->fd, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+                mx->width, mx->height, FPS);
+    }
+
+    mpfb_cache_init(&mx->sprites);
+    mpdamage_init(&mx->damage, 1);
+}
+
+/**
+ * Read the next run of frames from the input script. Returns false once the
+ * script is exhausted.
+ */
+static bool dump_next_input(mpgfx *mx)
+{
+    static const char keys[] = "lrdzxcsq";
+    char line[256];
+
+    while (fgets(line, sizeof(line), mx->input)) {
+        char held[64];
+        int frames;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (sscanf(line, "%d %63s", &frames, held) != 2 || frames < 0) {
+            fprintf(stderr, "Invalid input line: %s", line);
+            exit(-1);
+        }
+
+        memset(mx->held, 0, sizeof(mx->held));
+
+        for (const char *c = held; *c; ++c) {
+            const char *k = strchr(keys, *c);
+
+            if (k)
+                mx->held[k - keys] = true;
+            else if (*c != '-') {
+                fprintf(stderr, "Invalid input key: %c\n", *c);
+                exit(-1);
+            }
+        }
+
+        mx->hold_frames = frames;
+        if (frames)
+            return true;
+    }
+
+    return false;
+}
+
+void mpgfx_update(mpstate *ms, mpgfx *mx)
+{
+    /* The first frame is rendered before any tick, and the tick which quits
+     * is not rendered, so quitting on tick N - 1 leaves N frames */
+    bool quit = mx->frames >= 0 && ms->total_frames + 1 >= mx->frames;
+
+    if (mx->input && !mx->hold_frames && !dump_next_input(mx))
+        quit = true;
+
+    for (int i = 0; i < 10; ++i) {
+        if (mx->held[i] && mx->hold_frames)
+            ms->keystate[i]++;
+        else
+            ms->keystate[i] = 0;
+    }
+
+    if (mx->hold_frames)
+        mx->hold_frames--;
+
+    if (quit)
+        ms->keystate[K_q] = 1;
+}
+
+void mpgfx_free(mpgfx *mx)
+{
+    fprintf(stderr, "dumped %" PRId64 " frames, %" PRId64 " duplicates skipped\n",
+            mx->written, mx->skipped);
+
+    if (mx->fd)
+        fclose(mx->fd);
+    if (mx->input)
+        fclose(mx->input);
+
+    free(mx->pixels);
+    free(mx->out);
+    mpfb_cache_free(&mx->sprites);
+}
+
+/**
+ * Convert the framebuffer to the output format, returning the size of the
+ * converted frame. Y4M frames are full resolution BT.601 studio range.
+ */
+static size_t dump_convert(mpgfx *mx)
+{
+    const size_t pixels = (size_t) mx->width * mx->height;
+    uint8_t *p = mx->out;
+
+    switch (mx->format) {
+    case D_Ppm:
+        p += sprintf((char *) p, "P6\n%d %d\n255\n", mx->width, mx->height);
+        /* fallthrough */
+    case D_Rgb:
+        for (size_t i = 0; i < pixels; ++i) {
+            const uint32_t c = mx->pixels[i];
+            *p++ = c >> 16;
+            *p++ = c >> 8;
+            *p++ = c;
+        }
+        break;
+
+    case D_Y4m:
+        p += sprintf((char *) p, "FRAME\n");
+
+        for (size_t i = 0; i < pixels; ++i) {
+            const int r = (mx->pixels[i] >> 16) & 0xff;
+            const int g = (mx->pixels[i] >> 8) & 0xff;
+            const int b = mx->pixels[i] & 0xff;
+
+            p[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            p[pixels + i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            p[2 * pixels + i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+
+        p += 3 * pixels;
+        break;
+    }
+
+    return p - mx->out;
+}
+
+static void dump_write(mpgfx *mx, size_t size)
+{
+    FILE *fd = mx->fd;
+
+    if (mx->pattern) {
+        char path[4096];
+        snprintf(path, sizeof(path), mx->pattern, (int) mx->written);
+        fd = dump_open(path);
+
+        if (mx->format == D_Y4m) {
+            fprintf(fd, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+                    mx->width, mx->height, FPS);
+        }
+    }
+
+    if (fwrite(mx->out, 1, size, fd) != size) {
+        perror("Failed to write frame");
+        exit(-1);
+    }
+
+    if (mx->pattern)
+        fclose(fd);
+}
+
+/**
+ * Only damaged cells are redrawn into the framebuffer, and frames without
+ * any damage can be left out of the output entirely. The frame of the tick
+ * which quits is not part of the dump.
+ */
+void mpgfx_render(mpstate *ms, mpgfx *mx)
+{
+    static const mpfb_palette palette = {
+        .background = 0x000000,
+        .border = 0x808080,
+        .block = 0x8080ff,
+        .ghost = 0x80807f,
+        .empty = 0x000000
+    };
+
+    mpfb fb = { mx->pixels, mx->width, mx->height, mx->width };
+    mpdamage_list dl;
+
+    if (ms->keystate[K_q])
+        return;
+
+    if (!mpdamage_compute(&mx->damage, ms, &dl) && mx->skip_dups) {
+        mx->skipped++;
+        return;
+    }
+
+    if (dl.full) {
+        mpfb_render(ms, &fb, &mx->layout, &palette, &mx->sprites);
+    }
+    else {
+        if (dl.count)
+            mpfb_rows(ms, &fb, &mx->layout, &palette, dl.y0, dl.y1);
+
+        if (dl.hold)
+            mpfb_hold(ms, &fb, &mx->layout, &palette, &mx->sprites);
+
+        if (dl.preview)
+            mpfb_preview(ms, &fb, &mx->layout, &palette, &mx->sprites);
+    }
+
+    dump_write(mx, dump_convert(mx));
+    mx->written++;
+}
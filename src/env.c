@@ -0,0 +1,469 @@
+/**
+ * env.c
+ *
+ * Implements an environment host stepping games for clients through shared
+ * memory, and the client side of its protocol.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dataset.h"
+#include "env.h"
+
+/* Checks of a doorbell or response before sleeping, when there is more than
+ * one core for the other side to be running on */
+#define MPENV_SPIN 20000
+
+/* Longest a client sleeps before checking the host is still alive */
+#define MPENV_TIMEOUT_NS 100000000
+
+struct mpenv_worker {
+    _Alignas(64) mpenv_host *h;
+    pthread_t thread;
+    uint32_t index;
+    atomic_uint_fast64_t stepped;
+};
+
+static long mpenv_futex(_Atomic uint32_t *word, int op, uint32_t value,
+        const struct timespec *timeout)
+{
+    return syscall(SYS_futex, (uint32_t *) word, op, value, timeout, NULL, 0);
+}
+
+static inline void mpenv_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static int mpenv_spin(void)
+{
+    return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MPENV_SPIN : 0;
+}
+
+static mpenv_lane *mpenv_lanes(uint8_t *map, const mpenv_header *h)
+{
+    return (mpenv_lane *) (map + h->lane_offset);
+}
+
+static mpenv_bell *mpenv_bells(uint8_t *map, const mpenv_header *h)
+{
+    return (mpenv_bell *) (map + h->bell_offset);
+}
+
+static mpenv_obs *mpenv_observations(uint8_t *map, const mpenv_header *h)
+{
+    return (mpenv_obs *) (map + h->obs_offset);
+}
+
+/* Start the next game in a slot, each with a seed of its own */
+static void mpenv_start(mpenv_host *h, uint32_t index)
+{
+    mpstate *ms = &h->states[index];
+    const uint64_t games = (uint64_t) h->header->lanes * h->header->envs;
+
+    mpstate_init(ms);
+    mpstate_seed(ms, h->seed + index + games * h->episodes[index]);
+    ms->goal = 0;
+    mptet_set_random_block(ms);
+}
+
+static void mpenv_observe(const mpstate *ms, uint32_t episode, mpenv_obs *o)
+{
+    mpdataset_pack(o->field, &ms->field);
+
+    o->id = ms->id;
+    o->hold = ms->hold < 0 ? MPENV_EMPTY : ms->hold;
+    o->br = ms->br;
+    o->bx = ms->bx;
+    o->by = ms->by;
+
+    for (int i = 0; i < MPENV_NEXT; ++i)
+        o->next[i] = ms->bag[(ms->bhead + i) % 14];
+
+    o->can_hold = ms->can_hold;
+    o->lines = ms->lines_cleared;
+    o->steps = ms->total_frames;
+    o->episode = episode;
+}
+
+static void mpenv_step_game(mpenv_host *h, uint32_t index, uint8_t action, mpenv_obs *o)
+{
+    mpstate *ms = &h->states[index];
+    const int lines = ms->lines_cleared;
+    int done = MPENV_PLAYING;
+
+    switch (action) {
+    case MPENV_LEFT:
+        mptet_move(ms, 1);
+        break;
+    case MPENV_RIGHT:
+        mptet_move(ms, -1);
+        break;
+    case MPENV_ROTATE_CW:
+        mptet_rotate(ms, 1);
+        break;
+    case MPENV_ROTATE_CCW:
+        mptet_rotate(ms, -1);
+        break;
+    case MPENV_HOLD:
+        mptet_hold(ms);
+        break;
+    case MPENV_SOFT_DROP:
+        mptet_move(ms, -10);
+        break;
+    case MPENV_HARD_DROP:
+        mptet_hard_drop(ms);
+        break;
+    default:
+        break;
+    }
+
+    if (ms->lock_piece)
+        mptet_lock(ms);
+
+    ms->total_frames++;
+
+    const float reward = ms->lines_cleared - lines;
+
+    if (!ms->running)
+        done = MPENV_TOPPED_OUT;
+    else if (h->header->max_steps && ms->total_frames >= h->header->max_steps)
+        done = MPENV_TRUNCATED;
+
+    if (done || action == MPENV_RESET) {
+        h->episodes[index]++;
+        mpenv_start(h, index);
+    }
+
+    mpenv_observe(ms, h->episodes[index], o);
+    o->reward = action == MPENV_RESET ? 0 : reward;
+    o->done = done;
+}
+
+static void mpenv_step_lane(mpenv_host *h, uint32_t lane)
+{
+    const uint32_t envs = h->header->envs;
+    const uint8_t *actions = h->map + h->header->action_offset + (size_t) lane * envs;
+    mpenv_obs *obs = mpenv_observations(h->map, h->header) + (size_t) lane * envs;
+
+    for (uint32_t i = 0; i < envs; ++i)
+        mpenv_step_game(h, lane * envs + i, actions[i], &obs[i]);
+}
+
+static void *mpenv_thread(void *arg)
+{
+    struct mpenv_worker *w = arg;
+    mpenv_host *h = w->h;
+    mpenv_header *hd = h->header;
+    mpenv_lane *lanes = mpenv_lanes(h->map, hd);
+    mpenv_bell *b = &mpenv_bells(h->map, hd)[w->index];
+    int idle = 0;
+
+    while (atomic_load(&hd->running)) {
+        const uint32_t bell = atomic_load(&b->bell);
+        bool worked = false;
+
+        for (uint32_t i = w->index; i < hd->lanes; i += hd->threads) {
+            mpenv_lane *l = &lanes[i];
+            const uint32_t request = atomic_load(&l->request);
+
+            if (request == atomic_load_explicit(&l->response, memory_order_relaxed))
+                continue;
+
+            mpenv_step_lane(h, i);
+            atomic_fetch_add_explicit(&w->stepped, hd->envs, memory_order_relaxed);
+
+            /* Observations are visible before the response is */
+            atomic_store(&l->response, request);
+
+            if (atomic_load(&l->waiting))
+                mpenv_futex(&l->response, FUTEX_WAKE, INT_MAX, NULL);
+
+            worked = true;
+        }
+
+        if (worked) {
+            idle = 0;
+            continue;
+        }
+
+        if (idle++ < h->spin) {
+            mpenv_pause();
+            continue;
+        }
+
+        /* A client ringing after this sees waiting set, and one ringing
+         * before it changed the bell */
+        atomic_store(&b->waiting, 1);
+
+        if (atomic_load(&b->bell) == bell && atomic_load(&hd->running))
+            mpenv_futex(&b->bell, FUTEX_WAIT, bell, NULL);
+
+        atomic_store(&b->waiting, 0);
+        idle = 0;
+    }
+
+    return NULL;
+}
+
+bool mpenv_create(mpenv_host *h, const char *path, int lanes, int envs, int threads,
+        uint64_t seed, int max_steps)
+{
+    if (threads > lanes)
+        threads = lanes;
+
+    const size_t games = (size_t) lanes * envs;
+    const size_t lane_offset = sizeof(mpenv_header);
+    const size_t bell_offset = lane_offset + lanes * sizeof(mpenv_lane);
+    const size_t action_offset = bell_offset + threads * sizeof(mpenv_bell);
+    const size_t obs_offset = action_offset + ((games + 63) & ~(size_t) 63);
+
+    h->size = obs_offset + games * sizeof(mpenv_obs);
+    h->seed = seed;
+    h->spin = mpenv_spin();
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0 || ftruncate(fd, h->size) < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+        unlink(path);
+        return false;
+    }
+
+    h->map = map;
+    h->path = strdup(path);
+    h->header = map;
+    h->states = calloc(games, sizeof(mpstate));
+    h->episodes = calloc(games, sizeof(uint32_t));
+    h->workers = aligned_alloc(64, threads * sizeof(struct mpenv_worker));
+
+    if (!h->path || !h->states || !h->episodes || !h->workers) {
+        fprintf(stderr, "Failed to allocate environments\n");
+        exit(-1);
+    }
+
+    /* The file is zeroed by ftruncate, so only the header needs filling */
+    mpenv_header *hd = h->header;
+    memcpy(hd->magic, MPENV_MAGIC, 8);
+    hd->version = MPENV_VERSION;
+    hd->header_size = sizeof(mpenv_header);
+    hd->obs_size = sizeof(mpenv_obs);
+    hd->lanes = lanes;
+    hd->envs = envs;
+    hd->threads = threads;
+    hd->max_steps = max_steps;
+    hd->lane_offset = lane_offset;
+    hd->bell_offset = bell_offset;
+    hd->action_offset = action_offset;
+    hd->obs_offset = obs_offset;
+    hd->pid = getpid();
+
+    mpenv_obs *obs = mpenv_observations(h->map, hd);
+
+    for (size_t i = 0; i < games; ++i) {
+        mpenv_start(h, i);
+        mpenv_observe(&h->states[i], 0, &obs[i]);
+    }
+
+    atomic_store(&hd->running, 1);
+
+    for (int i = 0; i < threads; ++i) {
+        struct mpenv_worker *w = &h->workers[i];
+
+        w->h = h;
+        w->index = i;
+        atomic_init(&w->stepped, 0);
+
+        if (pthread_create(&w->thread, NULL, mpenv_thread, w) != 0) {
+            fprintf(stderr, "Failed to create environment thread\n");
+            exit(-1);
+        }
+    }
+
+    return true;
+}
+
+void mpenv_destroy(mpenv_host *h)
+{
+    mpenv_header *hd = h->header;
+    mpenv_bell *bells = mpenv_bells(h->map, hd);
+    mpenv_lane *lanes = mpenv_lanes(h->map, hd);
+
+    atomic_store(&hd->running, 0);
+
+    for (uint32_t i = 0; i < hd->threads; ++i) {
+        atomic_fetch_add(&bells[i].bell, 1);
+        mpenv_futex(&bells[i].bell, FUTEX_WAKE, INT_MAX, NULL);
+    }
+
+    for (uint32_t i = 0; i < hd->threads; ++i)
+        pthread_join(h->workers[i].thread, NULL);
+
+    for (uint32_t i = 0; i < hd->lanes; ++i)
+        mpenv_futex(&lanes[i].response, FUTEX_WAKE, INT_MAX, NULL);
+
+    unlink(h->path);
+    munmap(h->map, h->size);
+    free(h->path);
+    free(h->states);
+    free(h->episodes);
+    free(h->workers);
+}
+
+uint64_t mpenv_stepped(const mpenv_host *h)
+{
+    uint64_t total = 0;
+
+    for (uint32_t i = 0; i < h->header->threads; ++i)
+        total += atomic_load_explicit(&h->workers[i].stepped, memory_order_relaxed);
+
+    return total;
+}
+
+static bool mpenv_header_valid(const mpenv_header *h, size_t size)
+{
+    return !memcmp(h->magic, MPENV_MAGIC, 8) &&
+        h->version == MPENV_VERSION &&
+        h->header_size == sizeof(mpenv_header) &&
+        h->obs_size == sizeof(mpenv_obs) &&
+        h->threads > 0 &&
+        h->obs_offset <= size &&
+        (size - h->obs_offset) / sizeof(mpenv_obs) >= (uint64_t) h->lanes * h->envs;
+}
+
+/* Has the process using a lane exited? */
+static bool mpenv_gone(uint32_t pid)
+{
+    return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+bool mpenv_attach(mpenv_client *c, const char *path)
+{
+    const int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    c->size = st.st_size;
+    c->map = NULL;
+
+    if (c->size >= sizeof(mpenv_header)) {
+        void *map = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        c->map = map == MAP_FAILED ? NULL : map;
+    }
+
+    close(fd);
+
+    if (!c->map || !mpenv_header_valid((const void *) c->map, c->size) ||
+            !atomic_load(&((mpenv_header *) c->map)->running)) {
+        fprintf(stderr, "%s is not a running environment host\n", path);
+        if (c->map)
+            munmap(c->map, c->size);
+        return false;
+    }
+
+    c->header = (mpenv_header *) c->map;
+    c->envs = c->header->envs;
+    c->spin = mpenv_spin();
+
+    const uint32_t pid = getpid();
+    mpenv_lane *lanes = mpenv_lanes(c->map, c->header);
+
+    for (uint32_t i = 0; i < c->header->lanes; ++i) {
+        uint32_t owner = atomic_load(&lanes[i].owner);
+
+        if ((owner && !mpenv_gone(owner)) ||
+                !atomic_compare_exchange_strong(&lanes[i].owner, &owner, pid))
+            continue;
+
+        c->index = i;
+        c->lane = &lanes[i];
+        c->bell = &mpenv_bells(c->map, c->header)[i % c->header->threads];
+        c->actions = c->map + c->header->action_offset + (size_t) i * c->envs;
+        c->obs = mpenv_observations(c->map, c->header) + (size_t) i * c->envs;
+        return true;
+    }
+
+    fprintf(stderr, "Every lane of %s is in use\n", path);
+    munmap(c->map, c->size);
+    return false;
+}
+
+void mpenv_detach(mpenv_client *c)
+{
+    atomic_store(&c->lane->owner, 0);
+    munmap(c->map, c->size);
+    c->map = NULL;
+}
+
+bool mpenv_step(mpenv_client *c)
+{
+    const uint32_t request = atomic_fetch_add(&c->lane->request, 1) + 1;
+
+    /* The thread sees either the new bell or that it must be woken */
+    atomic_fetch_add(&c->bell->bell, 1);
+
+    if (atomic_load(&c->bell->waiting))
+        mpenv_futex(&c->bell->bell, FUTEX_WAKE, INT_MAX, NULL);
+
+    for (int i = 0; atomic_load(&c->lane->response) != request; ++i) {
+        if (!atomic_load(&c->header->running))
+            return false;
+
+        if (i < c->spin) {
+            mpenv_pause();
+            continue;
+        }
+
+        atomic_store(&c->lane->waiting, 1);
+
+        const uint32_t response = atomic_load(&c->lane->response);
+
+        bool timeout = false;
+
+        if (response != request) {
+            const struct timespec limit = { 0, MPENV_TIMEOUT_NS };
+            timeout = mpenv_futex(&c->lane->response, FUTEX_WAIT, response, &limit) < 0 &&
+                errno == ETIMEDOUT;
+        }
+
+        atomic_store(&c->lane->waiting, 0);
+
+        if (timeout && mpenv_gone(c->header->pid))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+/**
+ * env.h
+ *
+ * Implements an environment host for reinforcement learning, which steps
+ * batches of games for clients in other processes through shared memory.
+ *
+ * The host creates a file, usually under /dev/shm, which every client maps.
+ * It is split into lanes, each a batch of games stepped together, and each
+ * client process claims a lane of its own:
+ *
+ *   header         sizes and the offset of each part below
+ *   lanes          control words of each lane
+ *   bells          doorbell of each host thread
+ *   actions        one byte per game, written by the client
+ *   observations   one mpenv_obs per game, written by the host
+ *
+ * To step a lane, its client writes an action for every game, increments the
+ * lane's request count and then the doorbell of the thread owning the lane,
+ * which is lane % threads. The thread steps every game in the lane, writes
+ * their observations and sets the response count equal to the request count.
+ *
+ * Neither side makes a system call while the other is busy. Both spin for a
+ * while before sleeping on a futex, and each only wakes the other when it
+ * has said it is asleep, so a client stepping continuously never enters the
+ * kernel. Futex words are 32 bit and the futexes are not private, so that
+ * they work across processes.
+ *
+ * Games have no gravity, and each step applies one action. A piece only
+ * locks when hard dropped. A game ends when it tops out or reaches the
+ * host's step limit. Its observation then has done set, and already shows
+ * the first state of the game which replaced it.
+ *
+ * All integers are stored in the byte order of the host.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mptet.h"
+
+#define MPENV_MAGIC "mptetenv"
+#define MPENV_VERSION 1
+
+/* Pieces of the queue in each observation */
+#define MPENV_NEXT 6
+
+/* Stored for a hold piece when nothing is held */
+#define MPENV_EMPTY 0xff
+
+enum {
+    MPENV_NONE,
+    MPENV_LEFT,
+    MPENV_RIGHT,
+    MPENV_ROTATE_CW,
+    MPENV_ROTATE_CCW,
+    MPENV_HOLD,
+    MPENV_SOFT_DROP,
+    MPENV_HARD_DROP,
+
+    /* Abandon the game and start another */
+    MPENV_RESET,
+    MPENV_ACTIONS
+};
+
+/* Values of done */
+enum {
+    MPENV_PLAYING,
+    MPENV_TOPPED_OUT,
+    MPENV_TRUNCATED
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+
+    /* Size of the header and of each observation, for checking */
+    uint16_t header_size;
+    uint16_t obs_size;
+
+    uint32_t lanes;
+
+    /* Games in each lane */
+    uint32_t envs;
+
+    uint32_t threads;
+
+    /* Steps after which a game is ended, or 0 for no limit */
+    uint32_t max_steps;
+
+    /* Offsets of each part from the start of the file */
+    uint64_t lane_offset;
+    uint64_t bell_offset;
+    uint64_t action_offset;
+    uint64_t obs_offset;
+
+    /* Cleared when the host stops, and the host's process id, so clients can
+     * tell if it exited without clearing running */
+    _Atomic uint32_t running;
+    uint32_t pid;
+    uint8_t pad[56];
+} mpenv_header;
+
+typedef struct {
+    /* Process id of the client using the lane, or 0 if it is free */
+    _Atomic uint32_t owner;
+
+    /* Steps requested by the client and completed by the host */
+    _Atomic uint32_t request;
+    _Atomic uint32_t response;
+
+    /* Set while the client sleeps on response */
+    _Atomic uint32_t waiting;
+    uint8_t pad[48];
+} mpenv_lane;
+
+typedef struct {
+    _Atomic uint32_t bell;
+
+    /* Set while the thread sleeps on bell */
+    _Atomic uint32_t waiting;
+    uint8_t pad[56];
+} mpenv_bell;
+
+typedef struct {
+    /* The field without the current piece, packed as in mpdataset_record */
+    uint8_t field[28];
+
+    /* Current piece, the piece held or MPENV_EMPTY, and the current piece's
+     * rotation and top-left corner of its bounding square */
+    uint8_t id;
+    uint8_t hold;
+    uint8_t br;
+    int8_t bx;
+    int8_t by;
+
+    /* Pieces to be spawned next, in order */
+    uint8_t next[MPENV_NEXT];
+
+    uint8_t can_hold;
+
+    /* MPENV_PLAYING, or how the last game ended */
+    uint8_t done;
+    uint8_t pad0[3];
+
+    /* Lines cleared by the last step */
+    float reward;
+
+    /* Lines cleared and steps taken in the current game, and the number of
+     * games played before it */
+    uint32_t lines;
+    uint32_t steps;
+    uint32_t episode;
+    uint8_t pad1[4];
+} mpenv_obs;
+
+_Static_assert(sizeof(mpenv_header) == 128, "env header is not 128 bytes");
+_Static_assert(sizeof(mpenv_lane) == 64, "env lane is not 64 bytes");
+_Static_assert(sizeof(mpenv_bell) == 64, "env bell is not 64 bytes");
+_Static_assert(sizeof(mpenv_obs) == 64, "env observation is not 64 bytes");
+
+/* A running host */
+typedef struct {
+    char *path;
+    uint8_t *map;
+    size_t size;
+    mpenv_header *header;
+
+    /* Every game, and its seed and number of games played */
+    mpstate *states;
+    uint64_t seed;
+    uint32_t *episodes;
+
+    /* Each thread and the steps it has taken */
+    struct mpenv_worker *workers;
+
+    /* Checks of the doorbells before sleeping */
+    int spin;
+} mpenv_host;
+
+/* A client using one lane of a host */
+typedef struct {
+    uint8_t *map;
+    size_t size;
+    mpenv_header *header;
+    mpenv_lane *lane;
+    mpenv_bell *bell;
+
+    /* Actions and observations of the lane's games */
+    uint8_t *actions;
+    const mpenv_obs *obs;
+    uint32_t envs;
+    int index;
+
+    /* Checks of the response before sleeping */
+    int spin;
+} mpenv_client;
+
+/**
+ * Create the shared file at path and start threads stepping its games.
+ * Returns false with a message on stderr on failure.
+ */
+bool mpenv_create(mpenv_host *h, const char *path, int lanes, int envs, int threads,
+        uint64_t seed, int max_steps);
+
+/* Stop the threads, waking any waiting clients, and remove the file */
+void mpenv_destroy(mpenv_host *h);
+
+/* Total steps taken by every thread of a host so far */
+uint64_t mpenv_stepped(const mpenv_host *h);
+
+/**
+ * Map a host's file and claim a free lane, or one whose owner has exited.
+ * Returns false with a message on stderr if none is free.
+ */
+bool mpenv_attach(mpenv_client *c, const char *path);
+
+/* Release the lane and unmap the file */
+void mpenv_detach(mpenv_client *c);
+
+/**
+ * Step every game of the lane with the actions written to c->actions, and
+ * wait until their observations are ready. Returns false if the host
+ * stopped.
+ */
+bool mpenv_step(mpenv_client *c);
@@ -0,0 +1,214 @@
+/**
+ * envhost.c
+ *
+ * Implements a tool which hosts environments for reinforcement learning in
+ * shared memory, as described in env.h, optionally along with local client
+ * processes stepping them with random actions to measure throughput.
+ *
+ * Options:
+ *
+ *   --path=PATH      shared file, /dev/shm/mptet-env by default
+ *   --lanes=N        lanes, the most clients which can attach, 8 by default
+ *   --envs=N         games in each lane, 256 by default
+ *   --threads=N      threads stepping lanes, the number of cores by default
+ *   --seed=N         seed of the first game
+ *   --max-steps=N    steps after which a game ends, 10000 by default
+ *   --clients=N      fork N clients stepping random actions, none by default
+ *   --seconds=N      run the clients for N seconds, 10 by default
+ *
+ * Without clients the host runs until interrupted. Steps taken are printed
+ * on exit, or on SIGUSR1.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "env.h"
+#include "hist.h"
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t stats_requested;
+
+static void env_stop(int sig)
+{
+    (void) sig;
+    running = 0;
+}
+
+static void env_stats(int sig)
+{
+    (void) sig;
+    stats_requested = 1;
+}
+
+static uint64_t env_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Step every game of a lane with random actions until the deadline, and
+ * print the time each step of the whole lane took.
+ */
+static int env_client(const char *path, int id, uint64_t deadline)
+{
+    mpenv_client c;
+    mpstate rng;
+    hist_t step;
+    uint64_t steps = 0, games = 0;
+    char name[16];
+
+    if (!mpenv_attach(&c, path))
+        return 1;
+
+    mpstate_init(&rng);
+    mpstate_seed(&rng, id);
+    hist_zero(&step);
+
+    while (env_now() < deadline) {
+        /* Hard drops are frequent so games place many pieces */
+        for (uint32_t i = 0; i < c.envs; ++i) {
+            const uint32_t r = mptet_random(&rng) % 8;
+            c.actions[i] = r == 0 ? MPENV_HARD_DROP : r;
+        }
+
+        const uint64_t start = env_now();
+
+        if (!mpenv_step(&c))
+            break;
+
+        hist_record(&step, env_now() - start);
+        steps += c.envs;
+
+        for (uint32_t i = 0; i < c.envs; ++i)
+            games += c.obs[i].done != MPENV_PLAYING;
+    }
+
+    snprintf(name, sizeof(name), "lane %d", c.index);
+    printf("client %d: %" PRIu64 " steps, %" PRIu64 " games ended\n", id, steps, games);
+    hist_print(&step, name, 1e-3, stdout);
+    fflush(stdout);
+
+    mpenv_detach(&c);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/dev/shm/mptet-env";
+    int lanes = 8;
+    int envs = 256;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seed = time(NULL);
+    int max_steps = 10000;
+    int clients = 0;
+    int seconds = 10;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--path=", 7)) {
+            path = argv[i] + 7;
+        }
+        else if (!strncmp(argv[i], "--lanes=", 8)) {
+            lanes = atoi(argv[i] + 8);
+        }
+        else if (!strncmp(argv[i], "--envs=", 7)) {
+            envs = atoi(argv[i] + 7);
+        }
+        else if (!strncmp(argv[i], "--threads=", 10)) {
+            threads = atoi(argv[i] + 10);
+        }
+        else if (!strncmp(argv[i], "--seed=", 7)) {
+            seed = strtoull(argv[i] + 7, NULL, 10);
+        }
+        else if (!strncmp(argv[i], "--max-steps=", 12)) {
+            max_steps = atoi(argv[i] + 12);
+        }
+        else if (!strncmp(argv[i], "--clients=", 10)) {
+            clients = atoi(argv[i] + 10);
+        }
+        else if (!strncmp(argv[i], "--seconds=", 10)) {
+            seconds = atoi(argv[i] + 10);
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (lanes < 1 || envs < 1 || clients > lanes) {
+        fprintf(stderr, "Need at least one game in each lane, and a lane for every client\n");
+        return 2;
+    }
+
+    if (threads < 1)
+        threads = 1;
+
+    signal(SIGINT, env_stop);
+    signal(SIGTERM, env_stop);
+    signal(SIGUSR1, env_stats);
+
+    mpenv_host h;
+
+    if (!mpenv_create(&h, path, lanes, envs, threads, seed, max_steps))
+        return 1;
+
+    fprintf(stderr, "hosting %d lanes of %d games on %d threads at %s\n",
+            lanes, envs, h.header->threads, path);
+
+    const uint64_t start = env_now();
+    const uint64_t deadline = start + seconds * 1000000000ull;
+    int status = 0;
+
+    for (int i = 0; i < clients; ++i) {
+        const pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            status = 1;
+            break;
+        }
+
+        if (pid == 0)
+            _exit(env_client(path, i, deadline));
+    }
+
+    if (clients) {
+        int child;
+
+        while (wait(&child) > 0) {
+            if (!WIFEXITED(child) || WEXITSTATUS(child))
+                status = 1;
+        }
+    }
+    else {
+        while (running) {
+            pause();
+
+            if (stats_requested) {
+                stats_requested = 0;
+                fprintf(stderr, "%" PRIu64 " steps\n", mpenv_stepped(&h));
+            }
+        }
+    }
+
+    const double elapsed = (env_now() - start) * 1e-9;
+    const uint64_t steps = mpenv_stepped(&h);
+
+    fprintf(stderr, "%" PRIu64 " steps in %.2f s (%.0f steps/s)\n",
+            steps, elapsed, steps / elapsed);
+
+    mpenv_destroy(&h);
+    return status;
+}
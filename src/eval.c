@@ -0,0 +1,282 @@
+/**
+ * eval.c
+ *
+ * Implements scoring of batches of fields.
+ */
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#endif
+
+#include "eval.h"
+
+const float mpeval_default[E_Count] = {
+    [E_Height] = -0.510066f,
+    [E_Holes] = -0.35663f,
+    [E_Transitions] = -0.05f,
+    [E_Wells] = -0.05f,
+    [E_Bumpiness] = -0.184483f,
+    [E_Lines] = 0.760666f
+};
+
+/* A batch of fields, stored row by row from the bottom */
+typedef struct {
+    uint16_t row[MPEVAL_ROWS][MPEVAL_LANES];
+
+    /* Each feature of each field */
+    uint16_t feature[E_Count][MPEVAL_LANES];
+
+    /* Rows below the top of the highest field, above which all are empty */
+    int rows;
+} mpeval_batch;
+
+/**
+ * Transpose up to MPEVAL_LANES fields into rows, leaving out full rows as
+ * mptet_lineclear would clear them. Unused lanes are empty fields.
+ */
+static void mpeval_transpose(mpeval_batch *b, const mem256_t *fields, int n)
+{
+    memset(b, 0, sizeof(*b));
+
+    for (int j = 0; j < n; ++j) {
+        mem256_t field = fields[j];
+        const int rows = (mem256_highbit(&field) + 9) / 10;
+        int y = 0;
+
+        for (int r = 0; r < rows; ++r) {
+            const uint16_t row = mem256_extract(&field, 10 * r, 10);
+
+            if (row == 0x3ff)
+                b->feature[E_Lines][j]++;
+            else
+                b->row[y++][j] = row;
+        }
+
+        if (y > b->rows)
+            b->rows = y;
+    }
+}
+
+#if defined(__AVX2__)
+
+/* Population count of each 16 bit lane */
+static inline __m256i mpeval_popcnt(__m256i v)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+
+    const __m256i bytes = _mm256_add_epi8(
+            _mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+            _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+
+    return _mm256_add_epi16(_mm256_and_si256(bytes, _mm256_set1_epi16(0xff)),
+            _mm256_srli_epi16(bytes, 8));
+}
+
+static void mpeval_measure(mpeval_batch *b, int n)
+{
+    const __m256i cells = _mm256_set1_epi16(0x3ff);
+    const __m256i pairs = _mm256_set1_epi16(0x1ff);
+    const __m256i edges = _mm256_set1_epi16(0x7ff);
+    const __m256i walls = _mm256_set1_epi16(0x801);
+    const __m256i left = _mm256_set1_epi16(0x200);
+    const __m256i right = _mm256_set1_epi16(0x001);
+    __m256i covered = _mm256_setzero_si256();
+    __m256i height = covered, holes = covered, transitions = covered;
+    __m256i wells = covered, bumpiness = covered;
+    (void) n;
+
+    /* Empty rows only have a transition at each wall */
+    transitions = _mm256_set1_epi16(2 * (MPEVAL_ROWS - b->rows));
+
+    for (int y = b->rows - 1; y >= 0; --y) {
+        const __m256i row = _mm256_loadu_si256((const __m256i *) b->row[y]);
+        const __m256i empty = _mm256_andnot_si256(row, cells);
+
+        /* Open cells between two filled cells, or a filled cell and a wall */
+        const __m256i well = _mm256_and_si256(_mm256_andnot_si256(covered, empty),
+                _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi16(row, 1), left),
+                    _mm256_or_si256(_mm256_slli_epi16(row, 1), right)));
+
+        wells = _mm256_add_epi16(wells, mpeval_popcnt(well));
+        holes = _mm256_add_epi16(holes, mpeval_popcnt(_mm256_and_si256(empty, covered)));
+
+        /* Columns whose height is above this row */
+        covered = _mm256_or_si256(covered, row);
+        height = _mm256_add_epi16(height, mpeval_popcnt(covered));
+
+        const __m256i steps = _mm256_xor_si256(covered, _mm256_srli_epi16(covered, 1));
+        bumpiness = _mm256_add_epi16(bumpiness, mpeval_popcnt(_mm256_and_si256(steps, pairs)));
+
+        const __m256i walled = _mm256_or_si256(_mm256_slli_epi16(row, 1), walls);
+        const __m256i changes = _mm256_xor_si256(walled, _mm256_srli_epi16(walled, 1));
+        transitions = _mm256_add_epi16(transitions,
+                mpeval_popcnt(_mm256_and_si256(changes, edges)));
+    }
+
+    _mm256_storeu_si256((__m256i *) b->feature[E_Height], height);
+    _mm256_storeu_si256((__m256i *) b->feature[E_Holes], holes);
+    _mm256_storeu_si256((__m256i *) b->feature[E_Transitions], transitions);
+    _mm256_storeu_si256((__m256i *) b->feature[E_Wells], wells);
+    _mm256_storeu_si256((__m256i *) b->feature[E_Bumpiness], bumpiness);
+}
+
+static void mpeval_weigh(const mpeval_batch *b, const float weights[E_Count], float *scores,
+        int n)
+{
+    float out[MPEVAL_LANES];
+
+    for (int half = 0; half < MPEVAL_LANES; half += 8) {
+        __m256 score = _mm256_setzero_ps();
+
+        for (int f = 0; f < E_Count; ++f) {
+            const __m128i v = _mm_loadu_si128((const __m128i *) &b->feature[f][half]);
+            const __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v));
+
+            score = _mm256_add_ps(score, _mm256_mul_ps(x, _mm256_set1_ps(weights[f])));
+        }
+
+        _mm256_storeu_ps(&out[half], score);
+    }
+
+    memcpy(scores, out, n * sizeof(float));
+}
+
+#else
+
+/* Bits set in every value of up to 11 bits, which covers every mask */
+#define MPEVAL_B1(n) n, n + 1
+#define MPEVAL_B3(n) MPEVAL_B1(n), MPEVAL_B1(n + 1), MPEVAL_B1(n + 1), MPEVAL_B1(n + 2)
+#define MPEVAL_B5(n) MPEVAL_B3(n), MPEVAL_B3(n + 1), MPEVAL_B3(n + 1), MPEVAL_B3(n + 2)
+#define MPEVAL_B7(n) MPEVAL_B5(n), MPEVAL_B5(n + 1), MPEVAL_B5(n + 1), MPEVAL_B5(n + 2)
+#define MPEVAL_B9(n) MPEVAL_B7(n), MPEVAL_B7(n + 1), MPEVAL_B7(n + 1), MPEVAL_B7(n + 2)
+
+static const uint8_t mpeval_bits[1 << 11] = {
+    MPEVAL_B9(0), MPEVAL_B9(1), MPEVAL_B9(1), MPEVAL_B9(2)
+};
+
+static void mpeval_measure(mpeval_batch *b, int n)
+{
+    const uint8_t *bits = mpeval_bits;
+
+    for (int j = 0; j < n; ++j) {
+        unsigned covered = 0;
+        uint16_t height = 0, holes = 0, wells = 0, bumpiness = 0;
+
+        /* Empty rows only have a transition at each wall */
+        uint16_t transitions = 2 * (MPEVAL_ROWS - b->rows);
+
+        for (int y = b->rows - 1; y >= 0; --y) {
+            const unsigned row = b->row[y][j];
+            const unsigned empty = ~row & 0x3ff;
+
+            /* Open cells between two filled cells, or a filled cell and a wall */
+            const unsigned well = empty & ~covered & (row >> 1 | 0x200) & (row << 1 | 0x001);
+
+            wells += bits[well];
+            holes += bits[empty & covered];
+
+            /* Columns whose height is above this row */
+            covered |= row;
+            height += bits[covered];
+            bumpiness += bits[(covered ^ covered >> 1) & 0x1ff];
+
+            const unsigned walled = row << 1 | 0x801;
+            transitions += bits[(walled ^ walled >> 1) & 0x7ff];
+        }
+
+        b->feature[E_Height][j] = height;
+        b->feature[E_Holes][j] = holes;
+        b->feature[E_Transitions][j] = transitions;
+        b->feature[E_Wells][j] = wells;
+        b->feature[E_Bumpiness][j] = bumpiness;
+    }
+}
+
+static void mpeval_weigh(const mpeval_batch *b, const float weights[E_Count], float *scores,
+        int n)
+{
+    for (int j = 0; j < n; ++j) {
+        float score = 0;
+
+        for (int f = 0; f < E_Count; ++f)
+            score += b->feature[f][j] * weights[f];
+
+        scores[j] = score;
+    }
+}
+
+#endif
+
+void mpeval_features(const mem256_t *fields, int n, uint16_t (*features)[E_Count])
+{
+    mpeval_batch b;
+
+    for (int i = 0; i < n; i += MPEVAL_LANES) {
+        const int lanes = n - i < MPEVAL_LANES ? n - i : MPEVAL_LANES;
+
+        mpeval_transpose(&b, &fields[i], lanes);
+        mpeval_measure(&b, lanes);
+
+        for (int j = 0; j < lanes; ++j) {
+            for (int f = 0; f < E_Count; ++f)
+                features[i + j][f] = b.feature[f][j];
+        }
+    }
+}
+
+void mpeval_score(const mem256_t *fields, int n, const float weights[E_Count], float *scores)
+{
+    mpeval_batch b;
+
+    for (int i = 0; i < n; i += MPEVAL_LANES) {
+        const int lanes = n - i < MPEVAL_LANES ? n - i : MPEVAL_LANES;
+
+        mpeval_transpose(&b, &fields[i], lanes);
+        mpeval_measure(&b, lanes);
+        mpeval_weigh(&b, weights, &scores[i], lanes);
+    }
+}
+
+int mpeval_best(const mem256_t *field, int id, const float weights[E_Count],
+        mpplacement *best)
+{
+    mpplacement places[MPTET_PLACEMENTS];
+    mem256_t fields[MPTET_PLACEMENTS];
+    float scores[MPTET_PLACEMENTS];
+
+    const int n = mptet_placements(field, id, places);
+
+    for (int i = 0; i < n; ++i) {
+        fields[i] = *field;
+        mem256_ior(&fields[i], &places[i].block);
+    }
+
+    mpeval_score(fields, n, weights, scores);
+
+    int top = 0;
+
+    for (int i = 1; i < n; ++i) {
+        if (scores[i] > scores[top])
+            top = i;
+    }
+
+    if (n)
+        *best = places[top];
+
+    return n;
+}
+
+float mpeval_lock_score(const mpstate *ms, const mem256_t *before, int cleared, void *ctx)
+{
+    const float *weights = ctx ? ctx : mpeval_default;
+    float score;
+    (void) before;
+
+    /* The field has already been cleared */
+    mpeval_score(&ms->field, 1, weights, &score);
+    return score + cleared * weights[E_Lines];
+}
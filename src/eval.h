@@ -0,0 +1,76 @@
+#pragma once
+
+/**
+ * eval.h
+ *
+ * Implements an evaluator which scores many fields at once, such as the
+ * fields left by every placement of a piece, for bots choosing between them.
+ *
+ * Fields are first transposed so that a batch is stored row by row, with
+ * each row holding that row of every field, rather than field by field.
+ * Every feature is then a sum over rows of the population count of a mask
+ * made from the row and the rows above it, so a single pass from the top
+ * row down measures every feature of the whole batch:
+ *
+ *   height       cells at or below the top of each column, which is the sum
+ *                of the column heights
+ *   holes        empty cells with a filled cell above them, ~row & covered
+ *                where covered is the field smeared downward
+ *   transitions  changes between empty and filled cells along each row,
+ *                counting both walls as filled
+ *   wells        uncovered empty cells whose neighbours are both filled,
+ *                which is the sum of the depths of the wells
+ *   bumpiness    rows in which exactly one of two adjacent columns is
+ *                covered, which is the sum of their height differences
+ *   lines        full rows, which are cleared as mptet_lineclear would
+ *                before the other features are measured
+ *
+ * When built with AVX2 each vector holds a row of MPEVAL_LANES fields in 16
+ * bit lanes, and population counts are table lookups on each half byte.
+ * Otherwise each field is measured in turn with the same operations.
+ */
+
+#include <stdint.h>
+
+#include "mem256.h"
+#include "mptet.h"
+
+/* Rows measured, which covers every row a piece can lock in */
+#define MPEVAL_ROWS 25
+
+/* Fields measured together */
+#define MPEVAL_LANES 16
+
+/* Features of a field */
+enum {
+    E_Height, E_Holes, E_Transitions, E_Wells, E_Bumpiness, E_Lines, E_Count
+};
+
+/**
+ * Weights of each feature. Height, holes, bumpiness and lines are weighted
+ * as a well known hand tuned evaluator weights them, with transitions and
+ * wells only lightly penalised. Higher scores are better.
+ */
+extern const float mpeval_default[E_Count];
+
+/* Measure the features of n fields */
+void mpeval_features(const mem256_t *fields, int n, uint16_t (*features)[E_Count]);
+
+/* Score n fields as the features weighted by weights */
+void mpeval_score(const mem256_t *fields, int n, const float weights[E_Count], float *scores);
+
+/**
+ * Find the best placement of piece id in field, by locking it in each place
+ * mptet_placements finds and scoring all the fields at once. Returns the
+ * number of placements, and 0 if there are none, in which case best is not
+ * written.
+ */
+int mpeval_best(const mem256_t *field, int id, const float weights[E_Count],
+        mpplacement *best);
+
+/**
+ * Score the field left by a piece which just locked, as an
+ * mpdataset_score_fn scoring the placements of a dataset. ctx points to the
+ * weights, or is NULL for mpeval_default.
+ */
+float mpeval_lock_score(const mpstate *ms, const mem256_t *before, int cleared, void *ctx);
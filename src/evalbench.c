@@ -0,0 +1,179 @@
+/**
+ * evalbench.c
+ *
+ * Implements a tool which measures the batch evaluator described in eval.h
+ * against scoring placements one at a time.
+ *
+ * For each random field and piece, every placement is found, and the fields
+ * they leave are scored once as a batch and once by locking each piece into
+ * a copy of the game, clearing lines with mptet_lineclear and scoring the
+ * single field left. Both must agree on every score, and mpeval_best on the
+ * best placement.
+ *
+ * Options:
+ *
+ *   --fields=N     random fields to place pieces in, 100000 by default
+ *   --seed=N       seed of the fields
+ *
+ * Build with -mavx2, or -march=native on a machine with AVX2, to measure the
+ * vector path.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "eval.h"
+#include "hist.h"
+
+static uint64_t evalbench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Fill a field to a random height, each row with a few random holes so that
+ * some placements clear lines.
+ */
+static void evalbench_field(mpstate *rng, mem256_t *field)
+{
+    const int height = mptet_random(rng) % 16;
+
+    mem256_zero(field);
+
+    for (int y = 0; y < height; ++y) {
+        unsigned row = 0x3ff;
+
+        for (int h = 1 + mptet_random(rng) % 3; h > 0; --h)
+            row &= ~(1u << mptet_random(rng) % 10);
+
+        for (int x = 0; x < 10; ++x) {
+            if (row >> x & 1)
+                mem256_set(field, 10 * y + x);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int count = 100000;
+    uint64_t seed = time(NULL);
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--fields=", 9)) {
+            count = atoi(argv[i] + 9);
+        }
+        else if (!strncmp(argv[i], "--seed=", 7)) {
+            seed = strtoull(argv[i] + 7, NULL, 10);
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    mpstate rng, ms, scratch;
+    hist_t generate, batch, single;
+    uint64_t candidates = 0, batch_total = 0, single_total = 0;
+    int disagree = 0;
+
+    mpstate_init(&rng);
+    mpstate_seed(&rng, seed);
+    mpstate_init(&ms);
+    mpstate_init(&scratch);
+    hist_zero(&generate);
+    hist_zero(&batch);
+    hist_zero(&single);
+
+    for (int i = 0; i < count; ++i) {
+        mpplacement places[MPTET_PLACEMENTS], best;
+        mem256_t fields[MPTET_PLACEMENTS];
+        float batched[MPTET_PLACEMENTS], scores[MPTET_PLACEMENTS];
+        const int id = i % 7;
+
+        evalbench_field(&rng, &ms.field);
+
+        uint64_t t = evalbench_now();
+        const int n = mptet_placements(&ms.field, id, places);
+        hist_record(&generate, evalbench_now() - t);
+
+        /* Batched: lock each piece with a single or and score them together */
+        t = evalbench_now();
+
+        for (int p = 0; p < n; ++p) {
+            fields[p] = ms.field;
+            mem256_ior(&fields[p], &places[p].block);
+        }
+
+        mpeval_score(fields, n, mpeval_default, batched);
+        const uint64_t b = evalbench_now() - t;
+
+        /* One at a time, locking and clearing each piece as a game would */
+        t = evalbench_now();
+
+        for (int p = 0; p < n; ++p) {
+            scratch.field = ms.field;
+            mem256_ior(&scratch.field, &places[p].block);
+
+            const int cleared = mptet_lineclear(&scratch);
+            mpeval_score(&scratch.field, 1, mpeval_default, &scores[p]);
+            scores[p] += cleared * mpeval_default[E_Lines];
+        }
+
+        const uint64_t s = evalbench_now() - t;
+        int top = 0;
+
+        for (int p = 1; p < n; ++p) {
+            if (scores[p] > scores[top])
+                top = p;
+        }
+
+        /* Placements scoring the same to rounding may be chosen either way */
+        mpeval_best(&ms.field, id, mpeval_default, &best);
+
+        for (int p = 0; p < n; ++p) {
+            if (fabsf(batched[p] - scores[p]) > 1e-4f)
+                disagree++;
+
+            if (!memcmp(&places[p].block, &best.block, sizeof(mem256_t)) &&
+                    scores[p] < scores[top] - 1e-4f)
+                disagree++;
+        }
+
+        hist_record(&batch, b);
+        hist_record(&single, s);
+        batch_total += b;
+        single_total += s;
+        candidates += n;
+    }
+
+#if defined(__AVX2__)
+    const char *path = "AVX2";
+#else
+    const char *path = "scalar";
+#endif
+
+    printf("%" PRIu64 " placements of %d pieces scored with the %s path\n", candidates, count,
+            path);
+    printf("batch  %.1f ns per placement (%.1fM placements/s)\n",
+            (double) batch_total / candidates, candidates * 1e3 / batch_total);
+    printf("single %.1f ns per placement (%.1fM placements/s)\n",
+            (double) single_total / candidates, candidates * 1e3 / single_total);
+    hist_print(&generate, "placements", 1e-3, stdout);
+    hist_print(&batch, "batch", 1e-3, stdout);
+    hist_print(&single, "single", 1e-3, stdout);
+
+    if (disagree)
+        printf("%d scores or best placements differ\n", disagree);
+
+    mpstate_free(&ms);
+    mpstate_free(&scratch);
+    return disagree != 0;
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+/**
+ * fb.h
+ *
+ * Implements rendering of the game into a client-side 32-bit framebuffer,
+ * for frontends which present pixels directly rather than drawing through a
+ * graphics library.
+ *
+ * Everything is placed according to a layout computed by the frontend for
+ * the framebuffer's size.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+#include "mptet.h"
+#include "raster.h"
+
+typedef struct {
+    /* First pixel of the top row */
+    uint32_t *pixels;
+
+    /* Dimensions in pixels */
+    int width;
+    int height;
+
+    /* Distance between the start of each row in pixels */
+    int pitch;
+} mpfb;
+
+/* Pixel values used for each element, in the framebuffer's pixel format */
+typedef struct {
+    uint32_t background;
+    uint32_t border;
+    uint32_t block;
+    uint32_t ghost;
+    uint32_t empty;
+} mpfb_palette;
+
+/**
+ * Pre-rendered hold or preview pieces at a single scale, drawn over their
+ * whole area so that no clear is needed beforehand.
+ */
+typedef struct {
+    /* Size of each sprite, zero before any are rendered */
+    int width;
+    int height;
+
+    /* L_SPRITES sprites one after another, indexed by mplayout_sprite */
+    uint32_t *pixels;
+} mpfb_sprites;
+
+/**
+ * Sprites for the hold and preview pieces. These are re-rendered only when
+ * the layout changes their size, so the palette used must not change.
+ */
+typedef struct {
+    mpfb_sprites hold;
+    mpfb_sprites preview;
+} mpfb_cache;
+
+/**
+ * Fill a rectangle, clipped to the framebuffer.
+ */
+static inline void mpfb_fill(mpfb *fb, int x, int y, int w, int h, uint32_t color)
+{
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > fb->width) w = fb->width - x;
+    if (y + h > fb->height) h = fb->height - y;
+
+    for (int j = 0; j < h; ++j)
+        mpraster_span(fb->pixels + (y + j) * fb->pitch + x, w, color);
+}
+
+/**
+ * Draw the one pixel outline of a rectangle, clipped to the framebuffer.
+ */
+static inline void mpfb_outline(mpfb *fb, int x, int y, int w, int h, uint32_t color)
+{
+    mpfb_fill(fb, x, y, w, 1, color);
+    mpfb_fill(fb, x, y + h - 1, w, 1, color);
+    mpfb_fill(fb, x, y, 1, h, color);
+    mpfb_fill(fb, x + w - 1, y, 1, h, color);
+}
+
+/**
+ * Draw the filled cells of a 4x4 block preview.
+ */
+static inline void mpfb_piece(mpfb *fb, uint64_t block, const mprect *cell, uint32_t color)
+{
+    for (int k = 0; k < 16; ++k) {
+        if (mplayout_piece_cell(block, k))
+            mpfb_fill(fb, cell[k].x, cell[k].y, cell[k].w, cell[k].h, color);
+    }
+}
+
+/**
+ * Render a sprite for every piece if the sprite size has changed. Cells are
+ * relative to the top-left of each sprite.
+ */
+static void mpfb_sprites_update(mpfb_sprites *s, const mprect *area, const mprect *cell,
+        const mpfb_palette *pal)
+{
+    const int w = area->w;
+    const int h = area->h;
+
+    if (s->width == w && s->height == h)
+        return;
+
+    free(s->pixels);
+    s->pixels = malloc((size_t) L_SPRITES * w * h * sizeof(uint32_t));
+
+    if (!s->pixels) {
+        fprintf(stderr, "Failed to allocate %dx%d sprites\n", w, h);
+        exit(-1);
+    }
+
+    s->width = w;
+    s->height = h;
+
+    for (int id = 0; id < L_SPRITES; ++id) {
+        mpfb sprite = { s->pixels + (size_t) id * w * h, w, h, w };
+
+        mpfb_fill(&sprite, 0, 0, w, h, pal->background);
+
+        if (id != mplayout_sprite(-1))
+            mpfb_piece(&sprite, mptetd_block[id][0], cell, pal->block);
+    }
+}
+
+/**
+ * Copy the sprite for a piece id to the given position, clipped to the
+ * framebuffer.
+ */
+static inline void mpfb_sprite(mpfb *fb, const mpfb_sprites *s, int id, int x, int y)
+{
+    const uint32_t *src = s->pixels + (size_t) mplayout_sprite(id) * s->width * s->height;
+    int w = s->width;
+    int h = s->height;
+
+    if (x < 0) { src -= x; w += x; x = 0; }
+    if (y < 0) { src -= y * s->width; h += y; y = 0; }
+    if (x + w > fb->width) w = fb->width - x;
+    if (y + h > fb->height) h = fb->height - y;
+
+    for (int j = 0; j < h; ++j) {
+        memcpy(fb->pixels + (y + j) * fb->pitch + x, src + j * s->width,
+                w * sizeof(uint32_t));
+    }
+}
+
+/**
+ * Initialize an empty sprite cache.
+ */
+static inline void mpfb_cache_init(mpfb_cache *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+static inline void mpfb_cache_free(mpfb_cache *c)
+{
+    free(c->hold.pixels);
+    free(c->preview.pixels);
+    mpfb_cache_init(c);
+}
+
+/**
+ * Can the field be drawn? It is not clipped, so must fit entirely within the
+ * framebuffer.
+ */
+static inline bool mpfb_fits(mpfb *fb, const mplayout *l)
+{
+    const mprect *b = &l->border[1];
+    return b->x >= 0 && b->y >= 0 && b->x + b->w <= fb->width && b->y + b->h <= fb->height;
+}
+
+/**
+ * Redraw rows y0 to y1 inclusive of the field.
+ */
+void mpfb_rows(mpstate *ms, mpfb *fb, const mplayout *l, const mpfb_palette *pal,
+        int y0, int y1)
+{
+    const mpraster_palette rp = {
+        .background = pal->background,
+        .edge = { pal->block, pal->block, pal->ghost, pal->empty },
+        .fill = { pal->block, pal->block, pal->background, pal->background }
+    };
+
+    if (!mpfb_fits(fb, l))
+        return;
+
+    mpraster r;
+    mpraster_classify(&r, ms);
+    mpraster_draw(&r, fb->pixels + l->field.y * fb->pitch + l->field.x,
+            fb->pitch, l->side, &rp, y0, y1);
+}
+
+/**
+ * Redraw the hold piece region.
+ */
+void mpfb_hold(mpstate *ms, mpfb *fb, const mplayout *l, const mpfb_palette *pal,
+        mpfb_cache *c)
+{
+    mpfb_sprites_update(&c->hold, &l->hold, l->hold_sprite, pal);
+    mpfb_sprite(fb, &c->hold, ms->hold, l->hold.x, l->hold.y);
+}
+
+/**
+ * Redraw the preview pieces. The gaps between them are never drawn over.
+ */
+void mpfb_preview(mpstate *ms, mpfb *fb, const mplayout *l, const mpfb_palette *pal,
+        mpfb_cache *c)
+{
+    mpfb_sprites_update(&c->preview, &l->preview_piece[0], l->preview_sprite, pal);
+
+    for (int i = 0; i < PREVIEW_NUMBER; ++i) {
+        mpfb_sprite(fb, &c->preview, ms->bag[(ms->bhead + i) % 14],
+                l->preview_piece[i].x, l->preview_piece[i].y);
+    }
+}
+
+/**
+ * Render an entire frame.
+ */
+void mpfb_render(mpstate *ms, mpfb *fb, const mplayout *l, const mpfb_palette *pal,
+        mpfb_cache *c)
+{
+    mpfb_fill(fb, 0, 0, fb->width, fb->height, pal->background);
+
+    if (!mpfb_fits(fb, l))
+        return;
+
+    for (int i = 0; i < 2; ++i) {
+        mpfb_outline(fb, l->border[i].x, l->border[i].y,
+                l->border[i].w, l->border[i].h, pal->border);
+    }
+
+    mpfb_rows(ms, fb, l, pal, 0, 21);
+    mpfb_hold(ms, fb, l, pal, c);
+    mpfb_preview(ms, fb, l, pal, c);
+}
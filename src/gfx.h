@@ -8,6 +8,10 @@
 #   include "directfb.h"
 #elif defined(MP_GFX_X11)
 #   include "x11.h"
+#elif defined(MP_GFX_TERM)
+#   include "term.h"
+#elif defined(MP_GFX_DUMP)
+#   include "dump.h"
 #else
 #   define MP_NO_GFX
 #endif
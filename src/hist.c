@@ -0,0 +1,98 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hist.h"
+#include "mem256.h"
+
+/* Values below this are recorded exactly */
+#define HIST_LINEAR (2 << HIST_SUB_BITS)
+
+static int hist_index(uint64_t value)
+{
+    if (value < HIST_LINEAR)
+        return value;
+
+    /* Bit index of the leading 1, which is at least HIST_SUB_BITS + 1 */
+    const int high = mem256_64highbit(value) - 1;
+    const int shift = high - HIST_SUB_BITS;
+    const int sub = (value >> shift) & ((1 << HIST_SUB_BITS) - 1);
+
+    return HIST_LINEAR + (shift - 1) * (1 << HIST_SUB_BITS) + sub;
+}
+
+/* Return the largest value which maps to the given bucket */
+static uint64_t hist_upper(int index)
+{
+    if (index < HIST_LINEAR)
+        return index;
+
+    const int shift = (index - HIST_LINEAR) / (1 << HIST_SUB_BITS) + 1;
+    const uint64_t sub = (index - HIST_LINEAR) % (1 << HIST_SUB_BITS);
+    const uint64_t base = ((1ull << HIST_SUB_BITS) | sub) << shift;
+
+    return base + (1ull << shift) - 1;
+}
+
+void hist_zero(hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; ++i)
+        dst->bucket[i] += src->bucket[i];
+
+    dst->count += src->count;
+    dst->total += src->total;
+
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+void hist_record(hist_t *h, uint64_t value)
+{
+    h->bucket[hist_index(value)]++;
+    h->count++;
+    h->total += value;
+
+    if (value > h->max)
+        h->max = value;
+}
+
+uint64_t hist_percentile(hist_t *h, double p)
+{
+    if (!h->count)
+        return 0;
+
+    /* Rank of the value we are looking for, starting from 1 */
+    uint64_t rank = p * h->count + 0.5;
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->bucket[i];
+
+        if (seen >= rank) {
+            const uint64_t upper = hist_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+void hist_print(hist_t *h, const char *name, double scale, FILE *fd)
+{
+    fprintf(fd, "%-8s n=%-8" PRIu64 " mean %9.1f p50 %9.1f p99 %9.1f "
+                "p999 %9.1f max %9.1f\n",
+            name, h->count,
+            h->count ? (double) h->total / h->count * scale : 0,
+            hist_percentile(h, 0.5) * scale,
+            hist_percentile(h, 0.99) * scale,
+            hist_percentile(h, 0.999) * scale,
+            h->max * scale);
+}
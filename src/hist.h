@@ -0,0 +1,48 @@
+#pragma once
+
+/**
+ * hist.h
+ *
+ * Implements a fixed-size log-linear histogram for recording latencies.
+ *
+ * Values are bucketed by their highest set bit, with each power of two split
+ * into 16 linear sub-buckets. This keeps the relative error of any reported
+ * value under 1/16 across the entire 64-bit range without allocating.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Number of linear sub-buckets per power of two, as a power of two */
+#define HIST_SUB_BITS 4
+
+#define HIST_BUCKETS ((2 << HIST_SUB_BITS) + (63 - HIST_SUB_BITS) * (1 << HIST_SUB_BITS))
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint32_t bucket[HIST_BUCKETS];
+} hist_t;
+
+/* Reset all recorded values */
+void hist_zero(hist_t *h);
+
+/* Add every value recorded in src to dst */
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/* Record a single value */
+void hist_record(hist_t *h, uint64_t value);
+
+/**
+ * Return the value at the given percentile in the range [0, 1]. The returned
+ * value is the upper bound of the bucket the percentile falls in, clamped to
+ * the recorded maximum.
+ */
+uint64_t hist_percentile(hist_t *h, double p);
+
+/**
+ * Print a one-line summary of the histogram. Values are multiplied by scale
+ * before being printed, which allows converting to microseconds.
+ */
+void hist_print(hist_t *h, const char *name, double scale, FILE *fd);
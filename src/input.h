@@ -0,0 +1,99 @@
+#pragma once
+
+/**
+ * input.h
+ *
+ * Implements a single-producer/single-consumer queue of timestamped key
+ * events. A frontend input thread pushes events as they are received, and
+ * the simulation thread drains them in order at the start of each frame.
+ */
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mptet.h"
+#include "ts.h"
+
+/* Number of events which can be queued. Must be a power of two. */
+#define MPQUEUE_SIZE 256
+
+typedef struct {
+    /* Time the event was received */
+    uint64_t time;
+
+    /* Key index, see K_Left etc. */
+    int key;
+
+    /* Was the key pressed or released? */
+    bool down;
+} mpevent;
+
+typedef struct {
+    mpevent event[MPQUEUE_SIZE];
+
+    /* Next slot to be written, only modified by the producer */
+    alignas(64) atomic_uint head;
+
+    /* Next slot to be read, only modified by the consumer */
+    alignas(64) atomic_uint tail;
+} mpqueue;
+
+static inline void mpqueue_init(mpqueue *q)
+{
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+/**
+ * Push an event onto the queue. Returns false and drops the event if the
+ * queue is full.
+ */
+static inline bool mpqueue_push(mpqueue *q, uint64_t time, int key, bool down)
+{
+    const unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    const unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head - tail == MPQUEUE_SIZE)
+        return false;
+
+    mpevent *e = &q->event[head & (MPQUEUE_SIZE - 1)];
+    e->time = time;
+    e->key = key;
+    e->down = down;
+
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Pop the oldest event from the queue. Returns false if the queue is empty.
+ */
+static inline bool mpqueue_pop(mpqueue *q, mpevent *e)
+{
+    const unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    const unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (head == tail)
+        return false;
+
+    *e = q->event[tail & (MPQUEUE_SIZE - 1)];
+
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Apply all queued events to the game state in the order they arrived, and
+ * update the frame count of each held key.
+ */
+static inline void mpqueue_drain(mpqueue *q, mpstate *ms)
+{
+    mpevent e;
+
+    while (mpqueue_pop(q, &e))
+        mptet_keyevent(ms, e.key, e.down, e.time);
+
+    mptet_keyframe(ms, ts_get_current_time());
+}
@@ -0,0 +1,92 @@
+/**
+ * layout.c
+ *
+ * Implements placement of everything drawn on screen.
+ */
+
+#include "layout.h"
+
+static mprect mprect_make(int x, int y, int w, int h)
+{
+    const mprect r = { x, y, w, h };
+    return r;
+}
+
+static mprect mprect_offset(mprect r, int x, int y)
+{
+    r.x += x;
+    r.y += y;
+    return r;
+}
+
+/**
+ * Offsets are scaled with the block side. The hold and preview blocks are a
+ * fraction of this side, so their positions are computed in tenths of a
+ * pixel and truncated. Each piece is truncated to a whole pixel before its
+ * cells, so that every piece has identical cell offsets and can be drawn
+ * from a sprite.
+ */
+void mplayout_compute(mplayout *l, int width, int height)
+{
+    int side = M_BLOCK_SIDE * height / L_BASE_HEIGHT;
+
+    if (side > M_BLOCK_SIDE * width / L_BASE_WIDTH)
+        side = M_BLOCK_SIDE * width / L_BASE_WIDTH;
+    if (side < L_MIN_SIDE)
+        side = L_MIN_SIDE;
+
+    #define S(v) ((v) * side / M_BLOCK_SIDE)
+
+    l->width = width;
+    l->height = height;
+    l->side = side;
+
+    /* Field */
+    const int fx = S(M_X_OFFSET);
+    const int fy = S(M_Y_OFFSET);
+
+    l->field = mprect_make(fx, fy, 10 * side, 22 * side);
+    l->border[0] = mprect_make(fx - 1, fy - 1, 10 * side + 2, 22 * side + 2);
+    l->border[1] = mprect_make(fx - 2, fy - 2, 10 * side + 4, 22 * side + 4);
+
+    for (int i = 0; i < 220; ++i) {
+        l->cell[i] = mprect_make(fx + side * (9 - i % 10) + 1,
+                fy + side * (21 - i / 10) + 1, side - 2, side - 2);
+    }
+
+    /* Hold piece, centered left of the field */
+    const int hs = side * H_BLOCK_SCALE;
+    const int hx = (fx * 10 / 2 - 2 * hs) / 10;
+    const int hy = fy + S(H_Y_OFFSET);
+
+    l->hold = mprect_make(hx, hy, 4 * hs / 10, 4 * hs / 10);
+
+    for (int k = 0; k < 16; ++k) {
+        l->hold_sprite[k] = mprect_make(k % 4 * hs / 10, k / 4 * hs / 10,
+                hs / 10 - 2, hs / 10 - 2);
+        l->hold_cell[k] = mprect_offset(l->hold_sprite[k], hx, hy);
+    }
+
+    /* Preview pieces, right of the field */
+    const int ps = side * P_BLOCK_SCALE;
+    const int px = fx + 10 * side + S(P_X_OFFSET);
+    const int pstride = 10 * S(P_Y_OFFSET) + 4 * ps;
+
+    l->preview = mprect_make(px, fy, 4 * ps / 10, PREVIEW_NUMBER * pstride / 10);
+
+    for (int k = 0; k < 16; ++k) {
+        l->preview_sprite[k] = mprect_make(k % 4 * ps / 10, k / 4 * ps / 10,
+                ps / 10 - 2, ps / 10 - 2);
+    }
+
+    for (int i = 0; i < PREVIEW_NUMBER; ++i) {
+        const int py = fy + i * pstride / 10;
+
+        l->preview_piece[i] = mprect_make(px, py, 4 * ps / 10, 4 * ps / 10);
+
+        for (int k = 0; k < 16; ++k)
+            l->preview_cell[i][k] = mprect_offset(l->preview_sprite[k], px, py);
+    }
+
+    #undef S
+}
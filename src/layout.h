@@ -0,0 +1,142 @@
+#pragma once
+
+/**
+ * layout.h
+ *
+ * Implements placement of everything drawn on screen for a given surface
+ * size. Positions are computed into integer tables when a frontend starts
+ * and whenever its surface is resized, so rendering only indexes them.
+ *
+ * The layout is designed for a 1920x1080 surface and scaled uniformly to fit
+ * the available space.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Number of preview pieces shown */
+#define PREVIEW_NUMBER 3
+
+/* Block side length */
+#define M_BLOCK_SIDE 36
+
+/* Main grid x offset */
+#define M_X_OFFSET 200
+
+/* Main grid y offset */
+#define M_Y_OFFSET 100
+
+/* Preview x offset */
+#define P_X_OFFSET 40
+
+/* Preview y offset */
+#define P_Y_OFFSET 20
+
+/* Preview block scale, in tenths */
+#define P_BLOCK_SCALE 9
+
+/* Hold preview block scale, in tenths */
+#define H_BLOCK_SCALE 9
+
+/* Hold preview y offset */
+#define H_Y_OFFSET 40
+
+/* Surface height the layout is designed for */
+#define L_BASE_HEIGHT 1080
+
+/* Surface width required by the unscaled layout */
+#define L_BASE_WIDTH (M_X_OFFSET + 10 * M_BLOCK_SIDE + 2 * P_X_OFFSET + \
+        4 * M_BLOCK_SIDE * P_BLOCK_SCALE / 10)
+
+/* Smallest block side which can be drawn */
+#define L_MIN_SIDE 4
+
+/* Number of piece sprites, one per piece followed by an empty one */
+#define L_SPRITES 8
+
+typedef struct {
+    int x, y, w, h;
+} mprect;
+
+typedef struct {
+    /* Size of the surface this was computed for */
+    int width;
+    int height;
+
+    /* Side length of a field cell, including a one pixel gap on each side */
+    int side;
+
+    /* Area covered by the field cells */
+    mprect field;
+
+    /* Inner and outer field border */
+    mprect border[2];
+
+    /* Interior of each field cell, by field bit index */
+    mprect cell[220];
+
+    /* Area containing the hold piece, and the interior of each cell of its
+     * 4x4 grid */
+    mprect hold;
+    mprect hold_cell[16];
+
+    /* Area containing every preview piece, the area of each piece, and the
+     * interior of each cell of their 4x4 grids */
+    mprect preview;
+    mprect preview_piece[PREVIEW_NUMBER];
+    mprect preview_cell[PREVIEW_NUMBER][16];
+
+    /**
+     * Interior of each cell of a hold and preview piece relative to the top-left
+     * of its area, for pre-rendering piece sprites. Each piece is drawn with
+     * the same offsets.
+     */
+    mprect hold_sprite[16];
+    mprect preview_sprite[16];
+} mplayout;
+
+/* Compute the layout for a surface of the given size */
+void mplayout_compute(mplayout *l, int width, int height);
+
+/**
+ * Recompute the layout if the surface size has changed, returning whether
+ * it was.
+ */
+static inline bool mplayout_resize(mplayout *l, int width, int height)
+{
+    if (l->width == width && l->height == height)
+        return false;
+
+    mplayout_compute(l, width, height);
+    return true;
+}
+
+/**
+ * Is cell k, being y * 4 + x, of the 4x4 grid of a block filled?
+ */
+static inline bool mplayout_piece_cell(uint64_t block, int k)
+{
+    return block & (UINT64_C(1) << ((4 - k / 4) * 10 - k % 4 - 1));
+}
+
+/**
+ * Return the sprite index for a piece id, or the empty sprite for -1.
+ */
+static inline int mplayout_sprite(int id)
+{
+    return id < 0 ? L_SPRITES - 1 : id;
+}
+
+/**
+ * Return the area covered by the field cells from (x0, y0) to (x1, y1)
+ * inclusive, counting from the top-left.
+ */
+static inline mprect mplayout_cells(const mplayout *l, int x0, int y0, int x1, int y1)
+{
+    const mprect r = {
+        l->field.x + x0 * l->side, l->field.y + y0 * l->side,
+        (x1 - x0 + 1) * l->side, (y1 - y0 + 1) * l->side
+    };
+
+    return r;
+}
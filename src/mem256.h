@@ -56,6 +56,46 @@ static inline int mem256_64highbit(uint64_t x)
 }
 #endif
 
+/**
+ * Return the index of the lowest 1-bit set in a 64-bit integer. The result is
+ * undefined if no bits are set.
+ */
+#if defined(__GNUC__)
+#   define mem256_64lowbit(x) __builtin_ctzll(x)
+#else
+static inline int mem256_64lowbit(uint64_t x)
+{
+    int lowbit = 0;
+
+    while (!(x & 1)) {
+        lowbit++;
+        x >>= 1;
+    }
+
+    return lowbit;
+}
+#endif
+
+/**
+ * Return count bits starting at index, for count <= 57. Bits past the end of
+ * the memory block are read as 0.
+ */
+static inline uint64_t mem256_extract(const mem256_t *rop, int index, int count)
+{
+    const int limb = index >> 6;
+    const int offset = index & 63;
+
+    if (limb > 3)
+        return 0;
+
+    uint64_t value = rop->limb[limb] >> offset;
+
+    if (offset + count > 64 && limb < 3)
+        value |= rop->limb[limb + 1] << (64 - offset);
+
+    return value & ((UINT64_C(1) << count) - 1);
+}
+
 /**
  * Shift the entire 256 memory block left by the specified shift. Any shift
  * value > 255 is first truncated before being applied.
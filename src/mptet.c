@@ -10,13 +10,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <time.h>
 
 #include "mptet.h"
+#include "bench.h"
 #include "gfx.h"
+#include "hist.h"
 #include "mem256.h"
 #include "ts.h"
 
+#if defined(MP_THREADED)
+#   include <pthread.h>
+#   include "tbuf.h"
+#endif
+
 /**
  * Determine if the given block will collide with the field or wall.
  */
@@ -67,6 +75,139 @@ bool mptet_move(mpstate *ms, int d)
     }
 }
 
+/**
+ * Return how many columns a block can slide in direction d (1 for left, -1
+ * for right) before it meets the field or a wall.
+ *
+ * Every row of a tetrimino is contiguous, so each row can only be stopped by
+ * the nearest filled cell beside its edge, or the wall. The reach is the
+ * least over the rows of the piece, with no need to try each column.
+ */
+int mptet_reach(const mem256_t *field, const mem256_t *block, int d)
+{
+    int low = 0, high = 3;
+
+    while (low < 3 && !block->limb[low])
+        ++low;
+    while (high > 0 && !block->limb[high])
+        --high;
+
+    if (!block->limb[high])
+        return 0;
+
+    const int first = (64 * low + mem256_64lowbit(block->limb[low])) / 10;
+    const int last = (64 * high + mem256_64highbit(block->limb[high]) - 1) / 10;
+    int reach = 9;
+
+    for (int row = first; row <= last; ++row) {
+        const uint64_t p = mem256_extract(block, 10 * row, 10);
+        const uint64_t f = mem256_extract(field, 10 * row, 10);
+        int r;
+
+        if (!p)
+            continue;
+
+        if (d > 0) {
+            /* Cells above the piece's leftmost, with the wall as bit 10 */
+            const int edge = mem256_64highbit(p);
+            r = mem256_64lowbit((f >> edge) | (UINT64_C(1) << (10 - edge)));
+        }
+        else {
+            /* Cells below the piece's rightmost, with the wall as bit -1 */
+            const int edge = mem256_64lowbit(p);
+            const uint64_t below = f & ((UINT64_C(1) << edge) - 1);
+            r = edge - (mem256_64highbit((below << 1) | 1) - 1);
+        }
+
+        if (r < reach)
+            reach = r;
+    }
+
+    return reach;
+}
+
+/**
+ * Slide the piece as far as it can go in direction d in one shift, returning
+ * the columns moved.
+ */
+int mptet_slide(mpstate *ms, int d)
+{
+    const int reach = mptet_reach(&ms->field, &ms->block, d);
+
+    mem256_bshift(&ms->block, d * reach);
+    ms->bx -= d * reach;
+    return reach;
+}
+
+/* Does the block overlap the field? */
+static inline bool mptet_overlap(const mem256_t *field, const mem256_t *block)
+{
+    return (field->limb[0] & block->limb[0]) | (field->limb[1] & block->limb[1]) |
+        (field->limb[2] & block->limb[2]) | (field->limb[3] & block->limb[3]);
+}
+
+/**
+ * Fill out with each distinct place piece id can be dropped on the field,
+ * returning how many there are. Tucks and spins are not searched.
+ */
+int mptet_placements(const mem256_t *field, int id, mpplacement *out)
+{
+    int count = 0;
+
+    for (int br = 0; br < 4; ++br) {
+        mem256_t spawn;
+        mem256_zero(&spawn);
+        spawn.limb[0] = mptetd_block[id][br];
+        mem256_bshift(&spawn, 187);
+
+        if (mptet_overlap(field, &spawn))
+            continue;
+
+        const int left = mptet_reach(field, &spawn, 1);
+        const int right = mptet_reach(field, &spawn, -1);
+
+        for (int d = -right; d <= left; ++d) {
+            mem256_t block = spawn, below;
+            int by = 22;
+
+            mem256_bshift(&block, d);
+
+            /* Drop until the next row down is the floor or the field */
+            while (true) {
+                if (block.limb[0] & 0x3ff)
+                    break;
+
+                /* One row down, written out since it is done for every row */
+                below.limb[0] = block.limb[0] >> 10 | block.limb[1] << 54;
+                below.limb[1] = block.limb[1] >> 10 | block.limb[2] << 54;
+                below.limb[2] = block.limb[2] >> 10 | block.limb[3] << 54;
+                below.limb[3] = block.limb[3] >> 10;
+
+                if (mptet_overlap(field, &below))
+                    break;
+
+                block = below;
+                --by;
+            }
+
+            /* Rotations of I, S, Z and O pieces can rest in the same cells */
+            bool seen = false;
+
+            for (int i = 0; i < count && !seen; ++i)
+                seen = !memcmp(&out[i].block, &block, sizeof(block));
+
+            if (seen)
+                continue;
+
+            out[count++] = (mpplacement) {
+                .block = block, .br = br, .bx = 3 - d, .by = by
+            };
+        }
+    }
+
+    return count;
+}
+
 /**
  * Attempt to rotate a block, returning whether or not this was
  * successful.
@@ -126,6 +267,20 @@ bool mptet_rotate(mpstate *ms, int d)
     return false;
 }
 
+/**
+ * Return the next value of the state's random sequence.
+ *
+ * Each state has its own xorshift64* generator, so that states seeded alike
+ * receive the same pieces regardless of any other state.
+ */
+uint32_t mptet_random(mpstate *ms)
+{
+    ms->seed ^= ms->seed >> 12;
+    ms->seed ^= ms->seed << 25;
+    ms->seed ^= ms->seed >> 27;
+    return (ms->seed * 0x2545f4914f6cdd1dull) >> 32;
+}
+
 /**
  * Shuffle a 7 element run in a 14 element bag.
  *
@@ -139,7 +294,7 @@ void mptet_shuffle(mpstate *ms, int region)
 
     /* Perform a Fisher-Yates shuffle */
     for (int i = 0; i < 7; ++i) {
-        const int j = (rand() % (7 - i)) + i;
+        const int j = (mptet_random(ms) % (7 - i)) + i;
         const int tmp = ms->bag[region + j];
         ms->bag[region + j] = ms->bag[region + i];
         ms->bag[region + i] = tmp;
@@ -148,19 +303,57 @@ void mptet_shuffle(mpstate *ms, int region)
 
 void mpstate_init(mpstate *ms)
 {
-    srand(time(NULL));
+    /* A fixed seed reproduces the same sequence of pieces */
+    const char *seed = getenv("MPTET_SEED");
+    const uint64_t value = seed ? strtoull(seed, NULL, 10) : (uint64_t) time(NULL);
 
     ms->running = true;
     ms->lock_piece = false;
     ms->can_hold = true;
     ms->lines_cleared = 0;
     memset(ms->keystate, 0, sizeof(ms->keystate));
+    memset(ms->keytime, 0, sizeof(ms->keytime));
+    ms->keyevents = false;
     mem256_zero(&ms->field);
     mem256_zero(&ms->ghost);
 
     ms->hold = -1;
 
     ms->total_frames = 0;
+    ms->ghead = 0;
+    ms->gcount = 0;
+    ms->attack = 0;
+    ms->fall = MPRULES_ROW;
+    ms->soft = 0;
+    ms->lock_timer = 0;
+    ms->lock_hook = NULL;
+    ms->lock_ctx = NULL;
+
+    mpstate_seed(ms, value);
+
+    /* Rules may be chosen by name, for the games which do not set their own */
+    const char *rules = getenv("MPTET_RULES");
+    mpstate_rules(ms, rules && mprules_find(rules) ? mprules_find(rules) : &mprules_classic);
+}
+
+/**
+ * Play under the given rules, with their goal.
+ */
+void mpstate_rules(mpstate *ms, const mprules *rules)
+{
+    ms->rules = rules;
+    ms->goal = rules->goal;
+}
+
+/**
+ * Restart the piece sequence from the given seed.
+ */
+void mpstate_seed(mpstate *ms, uint64_t seed)
+{
+    /* The generator must never be zero */
+    ms->seed = seed ^ 0x9e3779b97f4a7c15ull;
+    if (!ms->seed)
+        ms->seed = 1;
 
     /* Initialize random bag */
     ms->bhead = 0;
@@ -183,10 +376,15 @@ void mptet_set_block(mpstate *ms, const int id)
 
     ms->bx = 3;
     ms->by = 22;
+    ms->lock_timer = 0;
 
     mem256_zero(&ms->block);
     ms->block.limb[0] = mptetd_block[ms->id][ms->br];
     mem256_bshift(&ms->block, 187);
+
+    /* The game is lost if there is no room for the new block */
+    if (mptet_collision(ms, &ms->block, ms->id, ms->br, ms->bx, ms->by))
+        ms->running = false;
 }
 
 void mptet_set_random_block(mpstate *ms)
@@ -263,7 +461,7 @@ int mptet_lineclear(mpstate *ms)
         else {
             mem256_t lmask;
             mem256_zero(&lmask);
-            mem256_fillones(&lmask, 0, y - 1);
+            mem256_fillones(&lmask, 0, y);
 
             /* Save the region beneath the line that needs to be cleared */
             mem256_t lower = ms->field;
@@ -291,86 +489,582 @@ int mptet_lineclear(mpstate *ms)
     return cleared;
 }
 
+/* Lines of garbage sent for clearing each number of lines at once */
+static const int mptet_attack_lines[5] = { 0, 0, 1, 2, 4 };
+
 /**
- * Deal with keypresses and updating of logic.
+ * Add garbage to be raised when a piece next locks without clearing lines.
+ * Returns false if too many attacks are already pending.
  */
-void mptet_update(mpstate *ms)
+bool mptet_queue_garbage(mpstate *ms, int lines, int hole)
 {
-    /* Horizontal movement */
-    if (ms->keystate[K_Left] == 1 || ms->keystate[K_Left] > DAS)
+    if (lines <= 0)
+        return true;
+
+    if (ms->gcount == GARBAGE_QUEUE)
+        return false;
+
+    mpgarbage *g = &ms->garbage[(ms->ghead + ms->gcount++) % GARBAGE_QUEUE];
+    g->lines = lines > 22 ? 22 : lines;
+    g->hole = hole;
+    return true;
+}
+
+/**
+ * Return the number of garbage lines waiting to rise.
+ */
+int mptet_garbage_pending(const mpstate *ms)
+{
+    int lines = 0;
+
+    for (int i = 0; i < ms->gcount; ++i)
+        lines += ms->garbage[(ms->ghead + i) % GARBAGE_QUEUE].lines;
+
+    return lines;
+}
+
+/**
+ * Raise the field by the given number of rows, each filled except for a hole
+ * in the given column. The game is lost if anything is pushed above the top
+ * of the field.
+ */
+void mptet_add_garbage(mpstate *ms, int lines, int hole)
+{
+    if (lines <= 0)
+        return;
+
+    if (lines > 22)
+        lines = 22;
+
+    /* The highest bit is counted from 1, or 0 for an empty field */
+    if (mem256_highbit(&ms->field) + 10 * lines > 220)
+        ms->running = false;
+
+    mem256_bshift(&ms->field, 10 * lines);
+
+    /* Anything past the top row no longer exists */
+    ms->field.limb[3] &= (1ull << 28) - 1;
+
+    mem256_t rows;
+    mem256_zero(&rows);
+    mem256_fillones(&rows, 0, 10 * lines);
+
+    /* Columns are numbered from the left, bits from the right */
+    for (int i = 0; i < lines; ++i)
+        rows.limb[(10 * i + 9 - hole) / 64] &= ~(1ull << ((10 * i + 9 - hole) % 64));
+
+    mem256_ior(&ms->field, &rows);
+}
+
+/**
+ * Clearing lines first cancels pending garbage, and anything left over is
+ * sent as an attack. Otherwise all pending garbage rises.
+ */
+static void mptet_garbage(mpstate *ms, int cleared)
+{
+    int attack = mptet_attack_lines[cleared];
+
+    if (!cleared) {
+        for (; ms->gcount; --ms->gcount, ms->ghead = (ms->ghead + 1) % GARBAGE_QUEUE) {
+            mpgarbage *g = &ms->garbage[ms->ghead];
+            mptet_add_garbage(ms, g->lines, g->hole);
+        }
+
+        return;
+    }
+
+    while (attack && ms->gcount) {
+        mpgarbage *g = &ms->garbage[ms->ghead];
+        const int cancel = attack < g->lines ? attack : g->lines;
+
+        attack -= cancel;
+        g->lines -= cancel;
+
+        if (!g->lines) {
+            ms->ghead = (ms->ghead + 1) % GARBAGE_QUEUE;
+            ms->gcount--;
+        }
+    }
+
+    ms->attack += attack;
+}
+
+/**
+ * Add the current piece to the field, check for line clears and garbage,
+ * then spawn a new block.
+ */
+void mptet_lock(mpstate *ms)
+{
+    mem256_t before;
+
+    if (ms->lock_hook)
+        before = ms->field;
+
+    mem256_ior(&ms->field, &ms->block);
+
+    const int cleared = mptet_lineclear(ms);
+    ms->lines_cleared += cleared;
+
+    if (ms->lock_hook)
+        ms->lock_hook(ms, &before, cleared, ms->lock_ctx);
+
+    mptet_garbage(ms, cleared);
+
+    mptet_set_random_block(ms);
+    ms->lock_piece = false;
+}
+
+/**
+ * Perform the action associated with the initial press of a key.
+ */
+static void mptet_keypress(mpstate *ms, int key)
+{
+    switch (key) {
+    case K_Left:
         mptet_move(ms, 1);
-    else if (ms->keystate[K_Right] == 1 || ms->keystate[K_Right] > DAS)
+        break;
+    case K_Right:
         mptet_move(ms, -1);
-
-    /* Vertical movement */
-    if (ms->keystate[K_Down] || ms->keystate[K_Down] > DAS)
+        break;
+    case K_Down:
         mptet_move(ms, -10);
-
-    /* Rotation */
-    if (ms->keystate[K_z] == 1)
+        break;
+    case K_z:
         mptet_rotate(ms, -1);
-    else if (ms->keystate[K_x] == 1)
+        break;
+    case K_x:
         mptet_rotate(ms, 1);
-
-    /* Hold piece */
-    if (ms->keystate[K_c] == 1)
+        break;
+    case K_c:
         mptet_hold(ms);
-
-    /* Hard drop */
-    if (ms->keystate[K_Space] == 1)
+        break;
+    case K_Space:
         mptet_hard_drop(ms);
-
-    /* Quit toggle */
-    if (ms->keystate[K_q])
+        break;
+    case K_q:
         ms->running = false;
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Apply a timestamped key event.
+ *
+ * Presses are acted on immediately so that the order of events within a
+ * frame is preserved, and a press released before the next frame is not
+ * lost. Repeated presses of a held key are ignored.
+ */
+void mptet_keyevent(mpstate *ms, int key, bool down, uint64_t time)
+{
+    ms->keyevents = true;
 
-    /* Do we need to lock the current piece? Then add it to field,
-     * spawn a new block and check for line clears */
-    if (ms->lock_piece) {
-        mem256_ior(&ms->field, &ms->block);
-        mptet_set_random_block(ms);
-        ms->lines_cleared += mptet_lineclear(ms);
-        ms->lock_piece = false;
+    if (!down) {
+        ms->keystate[key] = 0;
+        return;
+    }
+
+    if (ms->keystate[key])
+        return;
+
+    ms->keystate[key] = 1;
+    ms->keytime[key] = time;
+    mptet_keypress(ms, key);
+
+    /* Lock before any following event can move the dropped piece */
+    if (ms->lock_piece)
+        mptet_lock(ms);
+}
+
+/**
+ * Apply the keys held this frame, as bits indexed by K_Left etc. Each held
+ * key counts the frames it has been held, as sampled input does, so a game
+ * driven only by this is reproduced exactly from the same keys.
+ */
+void mptet_keymask(mpstate *ms, unsigned keys)
+{
+    for (int k = 0; k <= K_q; ++k)
+        ms->keystate[k] = keys & (1u << k) ? ms->keystate[k] + 1 : 0;
+}
+
+/**
+ * Derive the frame count of each held key from the time it was pressed.
+ */
+void mptet_keyframe(mpstate *ms, uint64_t now)
+{
+    for (int i = 0; i < 10; ++i) {
+        if (ms->keystate[i])
+            ms->keystate[i] = 1 + (now - ms->keytime[i]) / (TS_IN_A_SECOND / FPS);
+    }
+}
+
+/**
+ * Has the key been pressed this frame? Presses which are delivered as events
+ * have already been handled when they arrived.
+ */
+static inline bool mptet_pressed(mpstate *ms, int key)
+{
+    return !ms->keyevents && ms->keystate[key] == 1;
+}
+
+/**
+ * Move the piece one column each frame from when a direction is pressed until
+ * it has been held for das frames, then every arr frames, or to the wall at
+ * once if arr is 0.
+ */
+static MP_ALWAYS_INLINE
+void mptet_shift(mpstate *ms, int d, int held, const mprules *r)
+{
+    if (held <= r->das || r->arr == 1)
+        mptet_move(ms, d);
+    else if (r->arr == 0)
+        mptet_slide(ms, d);
+    else if ((held - r->das - 1) % r->arr == 0)
+        mptet_move(ms, d);
+}
+
+/**
+ * Set the ghost to where the piece would land, returning that row.
+ */
+static MP_ALWAYS_INLINE
+int mptet_ghost(mpstate *ms, const mprules *r)
+{
+    /* A piece under 20G is always on the floor, so it is its own ghost */
+    if (r->gravity >= MPRULES_20G) {
+        while (mptet_move(ms, -10));
+        ms->ghost = ms->block;
+        return ms->by;
     }
 
-    /* Recalc ghost every frame for now */
     mem256_t tmp = ms->block;
     const int bx = ms->bx;
     const int by = ms->by;
 
     while (mptet_move(ms, -10));
 
+    const int ghost = ms->by;
     ms->ghost = ms->block;
     ms->block = tmp;
     ms->bx = bx;
     ms->by = by;
+    return ghost;
+}
 
-    /* Perform some gravity. Ensure we don't down drop multiple times
-     * per frame even if pressing. */
-    if ((ms->total_frames & 63) == 0) {
-        mptet_move(ms, -10);
+/**
+ * Deal with keypresses and updating of logic under the given rules.
+ *
+ * This is inlined into an update function for each built-in ruleset, where
+ * the rules are constants, so every test of them below is decided at
+ * compile time. Rules built at run time use mptet_update_generic instead.
+ */
+static MP_ALWAYS_INLINE
+void mptet_update_rules(mpstate *ms, const mprules *r)
+{
+    /* Horizontal movement */
+    if (mptet_pressed(ms, K_Left) || ms->keystate[K_Left] > r->das)
+        mptet_shift(ms, 1, ms->keystate[K_Left], r);
+    else if (mptet_pressed(ms, K_Right) || ms->keystate[K_Right] > r->das)
+        mptet_shift(ms, -1, ms->keystate[K_Right], r);
+
+    /* Vertical movement, which makes no difference under 20G */
+    if (r->gravity < MPRULES_20G) {
+        if (mptet_pressed(ms, K_Down) || ms->keystate[K_Down] > 1) {
+            if (r->soft_drop == MPRULES_SONIC) {
+                while (mptet_move(ms, -10));
+            }
+            else {
+                ms->soft += r->gravity * r->soft_drop;
+
+                for (; ms->soft >= MPRULES_ROW; ms->soft -= MPRULES_ROW)
+                    mptet_move(ms, -10);
+            }
+        }
+        else {
+            ms->soft = 0;
+        }
+    }
+
+    /* Rotation */
+    if (mptet_pressed(ms, K_z))
+        mptet_rotate(ms, -1);
+    else if (mptet_pressed(ms, K_x))
+        mptet_rotate(ms, 1);
+
+    /* Hold piece */
+    if (mptet_pressed(ms, K_c))
+        mptet_hold(ms);
+
+    /* Hard drop */
+    if (mptet_pressed(ms, K_Space))
+        mptet_hard_drop(ms);
+
+    /* Quit toggle */
+    if (ms->keystate[K_q])
+        ms->running = false;
+
+    /* Do we need to lock the current piece? */
+    if (ms->lock_piece)
+        mptet_lock(ms);
+
+    /* Gravity owed from earlier frames is applied before this frame's, so
+     * that a new game falls a row on its first frame */
+    if (r->gravity < MPRULES_20G) {
+        for (; ms->fall >= MPRULES_ROW; ms->fall -= MPRULES_ROW)
+            mptet_move(ms, -10);
+
+        ms->fall += r->gravity;
+    }
+
+    /* Recalc ghost every frame, which also drops the piece under 20G */
+    const int ghost = mptet_ghost(ms, r);
+
+    /* Lock a piece which has rested on the floor for long enough */
+    if (r->lock_delay) {
+        if (ms->by != ghost)
+            ms->lock_timer = 0;
+        else if (++ms->lock_timer >= r->lock_delay) {
+            mptet_lock(ms);
+            mptet_ghost(ms, r);
+        }
     }
 
     /* Check the end condition */
-    if (ms->lines_cleared >= 40)
+    if (ms->goal && ms->lines_cleared >= ms->goal)
         ms->running = false;
 }
 
+void mptet_update_generic(mpstate *ms)
+{
+    mptet_update_rules(ms, ms->rules);
+}
+
+/* Define a built-in ruleset along with its update function */
+#define MPRULES_DEFINE(id, ...) \
+    static void mptet_update_##id(mpstate *ms); \
+    const mprules mprules_##id = { __VA_ARGS__, mptet_update_##id }; \
+    static void mptet_update_##id(mpstate *ms) \
+    { \
+        mptet_update_rules(ms, &mprules_##id); \
+    }
+
+/* One row every 64 frames, and pieces only lock when hard dropped */
+MPRULES_DEFINE(classic, "classic", MPRULES_ROW / 64, 8, 1, 64, 0, 40)
+
+/* One row a second at 60 frames a second, with a half second lock delay */
+MPRULES_DEFINE(guideline, "guideline", MPRULES_ROW / 60, 10, 2, 20, 30, 40)
+
+/* Instant auto-repeat and soft drop, as favoured for sprints */
+MPRULES_DEFINE(instant, "instant", MPRULES_ROW / 60, 7, 0, MPRULES_SONIC, 30, 40)
+
+/* Pieces fall to the floor as soon as they appear */
+MPRULES_DEFINE(20g, "20g", MPRULES_20G, 10, 1, 1, 30, 0)
+
+const mprules *const mprules_all[] = {
+    &mprules_classic, &mprules_guideline, &mprules_instant, &mprules_20g, NULL
+};
+
+const mprules *mprules_find(const char *name)
+{
+    for (int i = 0; mprules_all[i]; ++i) {
+        if (!strcmp(mprules_all[i]->name, name))
+            return mprules_all[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Deal with keypresses and updating of logic.
+ */
+void mptet_update(mpstate *ms)
+{
+    ms->rules->update(ms);
+}
+
+/**
+ * Copy the parts of a state which are required to render it.
+ */
+void mptet_snapshot(mpstate *restrict dst, const mpstate *restrict src)
+{
+    dst->bx = src->bx;
+    dst->by = src->by;
+    dst->id = src->id;
+    dst->br = src->br;
+    dst->block = src->block;
+    dst->ghost = src->ghost;
+    dst->field = src->field;
+    dst->hold = src->hold;
+    memcpy(dst->bag, src->bag, sizeof(dst->bag));
+    dst->bhead = src->bhead;
+    dst->running = src->running;
+    dst->total_frames = src->total_frames;
+    dst->lines_cleared = src->lines_cleared;
+}
+
 #if !defined(MP_NO_GFX)
+
+/* Phases of a single frame which are timed separately */
+enum {
+    P_Input, P_Logic, P_Render, P_Sleep, P_Frame, P_Count
+};
+
+static const char *phase_names[P_Count] = {
+    "input", "logic", "render", "sleep", "frame"
+};
+
+static hist_t phase_hist[P_Count];
+
+/* Set from a signal handler to request a dump of the phase timings */
+static volatile sig_atomic_t phase_dump_requested;
+
+static void phase_dump_handler(int sig)
+{
+    (void) sig;
+    phase_dump_requested = 1;
+}
+
+#if defined(MP_THREADED)
+/* Snapshots passed from the simulation thread to the render thread */
+static mptbuf snapshots;
+#endif
+
+static void phase_dump(FILE *fd)
+{
+    fprintf(fd, "frame phase timings (us):\n");
+    for (int i = 0; i < P_Count; ++i)
+        hist_print(&phase_hist[i], phase_names[i], 1000000.0 / TS_IN_A_SECOND, fd);
+}
+
 void mptet_tick(mpstate *ms, mpgfx *mx)
 {
+    const uint64_t t0 = ts_get_current_time();
+
     /* Update keyboard */
     mpgfx_update(ms, mx);
+    const uint64_t t1 = ts_get_current_time();
 
     /* Update game state by one tick */
     mptet_update(ms);
+    const uint64_t t2 = ts_get_current_time();
 
+#if defined(MP_THREADED)
+    /* Rendering happens on the main thread from the published snapshot */
+    mptet_snapshot(mptbuf_back(&snapshots), ms);
+    mptbuf_publish(&snapshots);
+#else
     /* Render the current frame */
     mpgfx_render(ms, mx);
+    hist_record(&phase_hist[P_Render], ts_get_current_time() - t2);
+#endif
+
+    hist_record(&phase_hist[P_Input], t1 - t0);
+    hist_record(&phase_hist[P_Logic], t2 - t1);
 
     ms->total_frames++;
 }
 
+/**
+ * Run the game at a fixed rate until it is no longer running.
+ */
+static void mptet_run(mpstate *ms, mpgfx *mx, ts_pacer *pacer)
+{
+    while (ms->running) {
+        const uint64_t start = ts_get_current_time();
+
+        mptet_tick(ms, mx);
+
+        const uint64_t sleep = ts_get_current_time();
+#if !defined(MP_GFX_UNPACED)
+        ts_pacer_wait(pacer);
+#else
+        (void) pacer;
+#endif
+        const uint64_t end = ts_get_current_time();
+
+        hist_record(&phase_hist[P_Sleep], end - sleep);
+        hist_record(&phase_hist[P_Frame], end - start);
+
+        if (phase_dump_requested) {
+            phase_dump_requested = 0;
+            phase_dump(stderr);
+        }
+    }
+}
+
+/**
+ * Render the scripted game at each field density as fast as possible, and
+ * report how long each frame took to render. Input is taken only from the
+ * script.
+ */
+static void mptet_bench(mpstate *ms, mpgfx *mx, int frames)
+{
+    mpbench mb;
+    hist_t render[B_Count];
+
+    for (int d = 0; d < B_Count; ++d) {
+        hist_zero(&render[d]);
+        mpbench_start(&mb, ms, d);
+
+        for (int i = 0; i < frames; ++i) {
+            mpbench_input(&mb, ms);
+            mptet_update(ms);
+            mpbench_restore(&mb, ms);
+
+            const uint64_t start = ts_get_current_time();
+            mpgfx_render(ms, mx);
+            hist_record(&render[d], ts_get_current_time() - start);
+
+            ms->total_frames++;
+        }
+    }
+
+    printf("render timings by field density (us):\n");
+    for (int d = 0; d < B_Count; ++d)
+        hist_print(&render[d], mpbench_names[d], 1000000.0 / TS_IN_A_SECOND, stdout);
+}
+
+#if defined(MP_THREADED)
+typedef struct {
+    mpstate *ms;
+    mpgfx *mx;
+    ts_pacer *pacer;
+} mpsim;
+
+static void *mptet_simulate(void *arg)
+{
+    mpsim *sim = arg;
+    mptet_run(sim->ms, sim->mx, sim->pacer);
+    return NULL;
+}
+
+/**
+ * Render published snapshots until the simulation thread stops the game.
+ *
+ * Only fresh snapshots are rendered. Backends which block in present will
+ * pace this loop to the display rate, otherwise we poll for the next one.
+ */
+static void mptet_present(mpgfx *mx)
+{
+    while (true) {
+        if (!mptbuf_consume(&snapshots)) {
+            mpgfx_poll(mx);
+            ts_sleep(TS_IN_A_SECOND / 1000);
+            continue;
+        }
+
+        mpstate *view = mptbuf_front(&snapshots);
+
+        const uint64_t start = ts_get_current_time();
+        mpgfx_render(view, mx);
+        hist_record(&phase_hist[P_Render], ts_get_current_time() - start);
+
+        if (!view->running)
+            break;
+    }
+}
+#endif
+
 int main(int argc, char **argv)
 {
     mpstate ms;
@@ -379,30 +1073,58 @@ int main(int argc, char **argv)
     mpstate_init(&ms);
     mpgfx_init(&mx, &argc, &argv);
 
+    /* Benchmark rendering for the given number of frames per density */
+    const char *bench = getenv("MPTET_BENCH");
+
+    if (bench) {
+        mptet_bench(&ms, &mx, atoi(bench) > 0 ? atoi(bench) : 600);
+        mpstate_free(&ms);
+        mpgfx_free(&mx);
+        return 0;
+    }
+
     mptet_set_random_block(&ms);
     mpgfx_render(&ms, &mx);
 
     ms.start_time = ts_get_current_time();
 
-    /* This loop is quite naive, and assumes that we can always perform a game
-     * tick and update the field within 16ms. This should be no trouble for the
-     * most part but we should take into account cases where this may not
-     * always be the case.
-     */
-    while (ms.running) {
-        const uint64_t start = ts_get_current_time();
+    /* Frames which overrun their deadline are not caught up, the pacer
+     * resynchronizes and continues from the current time instead. */
+    ts_pacer pacer;
+    ts_pacer_init(&pacer, TS_IN_A_SECOND / FPS, TS_SPIN_MARGIN);
+
+    for (int i = 0; i < P_Count; ++i)
+        hist_zero(&phase_hist[i]);
 
-        mptet_tick(&ms, &mx);
+    /* Timings can be dumped on demand with SIGUSR1 while running */
+    signal(SIGUSR1, phase_dump_handler);
 
-        ts_sleep(start + TS_IN_A_SECOND / FPS - ts_get_current_time());
+#if defined(MP_THREADED)
+    mptbuf_init(&snapshots);
+
+    mpsim sim = { &ms, &mx, &pacer };
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, mptet_simulate, &sim) != 0) {
+        fprintf(stderr, "Failed to create simulation thread\n");
+        exit(-1);
     }
 
+    mptet_present(&mx);
+    pthread_join(thread, NULL);
+#else
+    mptet_run(&ms, &mx, &pacer);
+#endif
+
     printf("%" PRIu64 "\n", ms.total_frames);
 
     /* Calculating time from frames provides a much more accurate timing */
     printf("%lfs\n", (double) (ts_get_current_time() - ms.start_time) / TS_IN_A_SECOND);
     printf("%d\n", ms.lines_cleared);
 
+    ts_pacer_report(&pacer, stderr);
+    phase_dump(stderr);
+
     mpstate_free(&ms);
     mpgfx_free(&mx);
 }
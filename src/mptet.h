@@ -1,20 +1,117 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "mem256.h"
 
+/* Data tables are not used by every file which includes this header */
+#if defined(__GNUC__)
+#   define MP_UNUSED __attribute__((unused))
+#else
+#   define MP_UNUSED
+#endif
+
+/* Functions which must be inlined for their callers to be specialised */
+#if defined(__GNUC__)
+#   define MP_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#   define MP_ALWAYS_INLINE inline
+#endif
+
 /* Game configuration */
 #define FPS 60
-#define DAS 8
+
+/* Number of separate garbage attacks which can be pending at once */
+#define GARBAGE_QUEUE 16
 
 enum {
     K_Left, K_Right, K_Down, K_z, K_x, K_c, K_Space, K_q
 };
 
+typedef struct mpstate mpstate;
+
 /**
- * Store an entire gamestate.
+ * Called as each piece locks, once lines are cleared but before garbage rises
+ * or the next piece spawns. The state still describes the piece placed, and
+ * before holds the field as it was before placing it.
+ */
+typedef void (*mplock_fn)(const mpstate *ms, const mem256_t *before, int cleared,
+        void *ctx);
+
+/* Most places a piece can be dropped, four rotations in ten columns */
+#define MPTET_PLACEMENTS 40
+
+/**
+ * A place a piece can rest after rotating at its spawn point, sliding and
+ * dropping, as found by mptet_placements. The block is its cells in the field
+ * and br, bx and by are as in mpstate.
+ */
+typedef struct {
+    mem256_t block;
+    int8_t br;
+    int8_t bx;
+    int8_t by;
+} mpplacement;
+
+/* Gravity is measured in subcells, fractions of a row */
+#define MPRULES_ROW 65536
+
+/* Gravity at or above this drops pieces to the floor on every frame */
+#define MPRULES_20G (20 * MPRULES_ROW)
+
+/* Soft drop factor which drops pieces to the floor at once */
+#define MPRULES_SONIC 0
+
+/**
+ * Rules of a game. Each built-in ruleset has its own update function, in
+ * which the rules are constants, so that checks which cannot apply to it are
+ * removed by the compiler (see mptet_update_rules).
  */
 typedef struct {
+    const char *name;
+
+    /* Subcells fallen on each frame, up to MPRULES_20G */
+    uint32_t gravity;
+
+    /* Frames a direction must be held before it repeats, and the frames
+     * between each repeat. An arr of 0 moves to the wall at once */
+    int das;
+    int arr;
+
+    /* Gravity while soft dropping is this multiple of normal gravity, or
+     * MPRULES_SONIC to drop to the floor */
+    int soft_drop;
+
+    /* Frames a piece rests on the floor before locking, or 0 if pieces only
+     * lock when hard dropped */
+    int lock_delay;
+
+    /* Lines to clear in a single player game, or 0 to play until topping
+     * out */
+    int goal;
+
+    void (*update)(mpstate *ms);
+} mprules;
+
+/* The original rules, which every recorded replay was played under */
+extern const mprules mprules_classic;
+
+/* Built-in rulesets, ending with NULL */
+extern const mprules *const mprules_all[];
+
+/* Find a built-in ruleset by name, or return NULL */
+const mprules *mprules_find(const char *name);
+
+/* A run of garbage rows, each with a hole in the same column */
+typedef struct {
+    uint8_t lines;
+    uint8_t hole;
+} mpgarbage;
+
+/**
+ * Store an entire gamestate.
+ */
+struct mpstate {
 
     /* Current block top-left x position of bounding square */
     int bx;
@@ -50,6 +147,12 @@ typedef struct {
      * */
     int keystate[10];
 
+    /* Time at which each held key was pressed, when using key events */
+    uint64_t keytime[10];
+
+    /* Are keys delivered as timestamped events rather than sampled? */
+    bool keyevents;
+
     /* Id of current hold piece */
     int hold;
 
@@ -62,6 +165,30 @@ typedef struct {
     /* Current bag index */
     int bhead;
 
+    /* Randomizer state, the bag is shuffled from this */
+    uint64_t seed;
+
+    /* Garbage received from opponents, which rises when a piece locks
+     * without clearing any lines */
+    mpgarbage garbage[GARBAGE_QUEUE];
+    int ghead;
+    int gcount;
+
+    /* Lines of garbage sent by clears, to be collected and passed on to an
+     * opponent */
+    int attack;
+
+    /* Rules of the game, and the lines to clear before the game ends, which
+     * start as the rules' goal */
+    const mprules *rules;
+    int goal;
+
+    /* Subcells of gravity and soft drop owed to the current piece, and
+     * frames it has rested on the floor */
+    uint32_t fall;
+    uint32_t soft;
+    int lock_timer;
+
     /* Is the game running? */
     bool running;
 
@@ -77,22 +204,64 @@ typedef struct {
     /* Time that this state was initialized */
     uint64_t start_time;
 
-} mpstate;
+    /* Observer of each placement, or NULL */
+    mplock_fn lock_hook;
+    void *lock_ctx;
+
+};
 
 
 void mpstate_init(mpstate *ms);
 
 void mpstate_free(mpstate *ms);
 
+void mpstate_seed(mpstate *ms, uint64_t seed);
+
+void mpstate_rules(mpstate *ms, const mprules *rules);
+
+uint32_t mptet_random(mpstate *ms);
+
 bool mptet_collision(mpstate *ms, mem256_t *block,
         const int id, const int br, const int x, const int y);
 
 bool mptet_move(mpstate *ms, int d);
 
+int mptet_reach(const mem256_t *field, const mem256_t *block, int d);
+
+int mptet_slide(mpstate *ms, int d);
+
+int mptet_placements(const mem256_t *field, int id, mpplacement *out);
+
+void mptet_set_random_block(mpstate *ms);
+
+void mptet_hold(mpstate *ms);
+
+void mptet_hard_drop(mpstate *ms);
+
 bool mptet_rotate(mpstate *ms, int d);
 
 int mptet_lineclear(mpstate *ms);
 
+void mptet_lock(mpstate *ms);
+
+bool mptet_queue_garbage(mpstate *ms, int lines, int hole);
+
+int mptet_garbage_pending(const mpstate *ms);
+
+void mptet_add_garbage(mpstate *ms, int lines, int hole);
+
+void mptet_keyevent(mpstate *ms, int key, bool down, uint64_t time);
+
+void mptet_keymask(mpstate *ms, unsigned keys);
+
+void mptet_keyframe(mpstate *ms, uint64_t now);
+
+void mptet_update(mpstate *ms);
+
+void mptet_update_generic(mpstate *ms);
+
+void mptet_snapshot(mpstate *restrict dst, const mpstate *restrict src);
+
 /**
  * Initial block values for all rotations. Each block is always considered to
  * be contained in a 4x4 bounding square. Since the field itself is 10 bits
@@ -104,7 +273,7 @@ int mptet_lineclear(mpstate *ms);
  * 19: 11........
  * 9:  ..........
  */
-static uint64_t mptetd_block[7][4] = {
+static MP_UNUSED uint64_t mptetd_block[7][4] = {
     /* I-block */
     {0x3c000000, 0x2008020080, 0x3c000000, 0x2008020080},
     /* T-block */
@@ -134,7 +303,7 @@ static uint64_t mptetd_block[7][4] = {
  * V-Offset - The number of empty rows above the piece.
  * H-Offset - The number of empty columns to the left of the piece.
  */
-static uint64_t mptetd_meta[7][4] = {
+static MP_UNUSED uint64_t mptetd_meta[7][4] = {
     /* I-block */
     {0x2410, 0x4302, 0x2410, 0x4302},
     /* T-block */
@@ -155,7 +324,7 @@ static uint64_t mptetd_meta[7][4] = {
  * Wallkick data. We only store right rotations. Left rotations are calculated
  * as the negative of these rotations.
  */
-static uint64_t mptetd_wallk[2][4] = {
+static MP_UNUSED uint64_t mptetd_wallk[2][4] = {
     { /* Non I-Blocks */
       0xa9a0190900, /* 0 -> R */
       0x2120910100, /* R -> 2 */
@@ -0,0 +1,258 @@
+/**
+ * netsim.c
+ *
+ * Implements a tool which plays two rollback sessions against each other
+ * over a simulated network, as described in rollback.h, and measures what
+ * rollback costs.
+ *
+ * Each player holds random keys for a few frames at a time, which makes
+ * predictions wrong far more often than real players would. Once both
+ * sessions have played, the keys each player actually held are played again
+ * without rollback to check that both sessions reached the same games.
+ *
+ * Options:
+ *
+ *   --frames=N     frames for each session to play, 36000 by default
+ *   --latency=N    frames each packet takes to arrive, 4 by default
+ *   --jitter=N     frames packets may be further delayed by, 2 by default
+ *   --loss=N       percentage of packets lost, 5 by default
+ *   --delay=N      frames each player's keys are delayed by, 0 by default
+ *   --seed=N       seed of the games and the network
+ *
+ * Timings are reported for taking and restoring a snapshot of both games, a
+ * checksum, simulating a frame, a rollback of MPROLLBACK_WINDOW frames and
+ * each tick of a session.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hist.h"
+#include "replay.h"
+#include "rollback.h"
+
+static uint64_t netsim_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Keys held by a player, changed every few frames */
+typedef struct {
+    mpstate rng;
+    uint8_t keys;
+    int left;
+} netsim_player;
+
+static uint8_t netsim_keys(netsim_player *p)
+{
+    if (--p->left <= 0) {
+        const uint32_t r = mptet_random(&p->rng);
+
+        /* Mostly moves, with a hard drop every few changes */
+        p->keys = r % 6 == 0 ? 1 << K_Space : (r >> 8) & 0x3f;
+        p->left = 1 + (r >> 16) % 12;
+    }
+
+    return p->keys;
+}
+
+/**
+ * Time the parts of a rollback on games part way through, so the fields are
+ * not empty.
+ */
+static void netsim_bench(const mpstate games[2], uint64_t seed)
+{
+    static mpstate state[2], snapshot[2];
+    const int runs = 100000;
+    const uint8_t keys[2] = { 1 << K_Left, 1 << K_Right };
+    hist_t save, restore, checksum, frame, rollback;
+    uint64_t sink = 0;
+
+    hist_zero(&save);
+    hist_zero(&restore);
+    hist_zero(&checksum);
+    hist_zero(&frame);
+    hist_zero(&rollback);
+
+    mprollback_save(state, games);
+
+    for (int i = 0; i < runs; ++i) {
+        uint64_t t = netsim_now();
+        mprollback_save(snapshot, state);
+        hist_record(&save, netsim_now() - t);
+
+        t = netsim_now();
+        sink += mprollback_checksum(state);
+        hist_record(&checksum, netsim_now() - t);
+
+        t = netsim_now();
+        mprollback_simulate(state, keys, seed);
+        hist_record(&frame, netsim_now() - t);
+
+        t = netsim_now();
+        mprollback_save(state, snapshot);
+        hist_record(&restore, netsim_now() - t);
+    }
+
+    /* A rollback at the limit: restore, then simulate every predicted frame
+     * again, taking a snapshot before each */
+    for (int i = 0; i < runs / 10; ++i) {
+        static mpstate ring[MPROLLBACK_WINDOW][2];
+        const uint64_t t = netsim_now();
+
+        mprollback_save(state, snapshot);
+
+        for (int f = 0; f < MPROLLBACK_WINDOW; ++f) {
+            mprollback_save(ring[f], state);
+            mprollback_simulate(state, keys, seed);
+        }
+
+        hist_record(&rollback, netsim_now() - t);
+    }
+
+    printf("snapshot of %zu bytes:\n", sizeof(state));
+    hist_print(&save, "save", 1e-3, stdout);
+    hist_print(&restore, "restore", 1e-3, stdout);
+    hist_print(&checksum, "checksum", 1e-3, stdout);
+    hist_print(&frame, "frame", 1e-3, stdout);
+    hist_print(&rollback, "rollback", 1e-3, stdout);
+
+    if (sink == 42)
+        printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 36000;
+    int latency = 4;
+    int jitter = 2;
+    int loss = 5;
+    int delay = 0;
+    uint64_t seed = time(NULL);
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--frames=", 9)) {
+            frames = atoi(argv[i] + 9);
+        }
+        else if (!strncmp(argv[i], "--latency=", 10)) {
+            latency = atoi(argv[i] + 10);
+        }
+        else if (!strncmp(argv[i], "--jitter=", 9)) {
+            jitter = atoi(argv[i] + 9);
+        }
+        else if (!strncmp(argv[i], "--loss=", 7)) {
+            loss = atoi(argv[i] + 7);
+        }
+        else if (!strncmp(argv[i], "--delay=", 8)) {
+            delay = atoi(argv[i] + 8);
+        }
+        else if (!strncmp(argv[i], "--seed=", 7)) {
+            seed = strtoull(argv[i] + 7, NULL, 10);
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (frames < 1 || latency < 0 || jitter < 0 || loss < 0 || loss >= 100) {
+        fprintf(stderr, "Need at least one frame, and some packets to arrive\n");
+        return 2;
+    }
+
+    static mprollback session[2];
+    static mploopback lb;
+    netsim_player player[2];
+    uint8_t *held[2];
+    hist_t tick;
+
+    mploopback_init(&lb, latency, jitter, loss, seed);
+    hist_zero(&tick);
+
+    for (int i = 0; i < 2; ++i) {
+        mprollback_init(&session[i], i, seed, delay, mploopback_transport(&lb, i));
+        mpstate_init(&player[i].rng);
+        mpstate_seed(&player[i].rng, seed + i + 1);
+        player[i].keys = 0;
+        player[i].left = 0;
+
+        held[i] = calloc(frames + MPROLLBACK_DELAY, 1);
+        if (!held[i]) {
+            fprintf(stderr, "Failed to allocate keys\n");
+            return 1;
+        }
+    }
+
+    /* Keep ticking once a session has played every frame until the other
+     * has too, and both have confirmed each other's keys */
+    while (session[0].frame < (uint32_t) frames || session[1].frame < (uint32_t) frames ||
+            session[0].remote_next < session[1].local_next ||
+            session[1].remote_next < session[0].local_next) {
+        for (int i = 0; i < 2; ++i) {
+            mprollback *s = &session[i];
+
+            if (s->frame >= (uint32_t) frames) {
+                mprollback_poll(s);
+                continue;
+            }
+
+            const uint8_t keys = netsim_keys(&player[i]);
+            const uint32_t at = s->local_next;
+            const uint64_t t = netsim_now();
+
+            if (mprollback_advance(s, keys))
+                held[i][at] = keys;
+
+            hist_record(&tick, netsim_now() - t);
+        }
+
+        mploopback_tick(&lb);
+    }
+
+    /* Both sessions hold predictions until confirmed, so compare the games
+     * each would have once every key is known */
+    static mpstate reference[2];
+    int status = 0;
+
+    for (int seat = 0; seat < 2; ++seat)
+        mpreplay_start(&reference[seat], seed, 0);
+
+    for (int f = 0; f < frames; ++f) {
+        const uint8_t keys[2] = { held[0][f], held[1][f] };
+        mprollback_simulate(reference, keys, seed);
+    }
+
+    const uint64_t expected = mprollback_checksum(reference);
+
+    for (int i = 0; i < 2; ++i) {
+        mprollback *s = &session[i];
+
+        /* Simulate any last predictions again with the keys which arrived */
+        mprollback_poll(s);
+
+        printf("session %d: %" PRIu64 " rollbacks, %" PRIu64 " frames resimulated, "
+                "deepest %d, %" PRIu64 " stalls, %s\n", i, s->rollbacks, s->resimulated,
+                s->deepest, s->stalls,
+                s->desync != MPROLLBACK_SYNCED ? "desync" :
+                mprollback_checksum(s->state) != expected ? "differs from reference" :
+                "in sync");
+
+        if (s->desync != MPROLLBACK_SYNCED || mprollback_checksum(s->state) != expected)
+            status = 1;
+    }
+
+    printf("%" PRIu64 " packets sent, %" PRIu64 " lost\n", lb.sent, lb.dropped);
+    hist_print(&tick, "tick", 1e-3, stdout);
+    netsim_bench(reference, seed);
+
+    free(held[0]);
+    free(held[1]);
+    return status;
+}
@@ -0,0 +1,663 @@
+/**
+ * pc.c
+ *
+ * Implements a perfect clear solver over boards of up to four rows.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pc.h"
+
+/* Most places a piece fits in four rows, over all rotations */
+#define MPPC_PLACES 160
+
+/* Most tiles with the same lowest cell, and of the same piece */
+#define MPPC_TILES 256
+#define MPPC_PIECE_TILES 512
+
+/* The bottom row, that bit in every row, and the even columns of every row */
+#define MPPC_ROW 0x3ffull
+#define MPPC_COLUMN 0x0040100401ull
+#define MPPC_EVEN 0x5555555555ull
+
+typedef struct {
+    uint64_t mask;
+    int8_t br;
+    int8_t bx;
+    int8_t by;
+} mppc_place;
+
+/**
+ * A piece in the rows of the board it ends up filling. A piece can span rows
+ * which cleared before it was placed, so its rows need not be adjacent.
+ */
+typedef struct {
+    uint64_t mask;
+
+    /* Rows between the piece's rows, as a bit for each, which must have
+     * cleared before it is placed */
+    uint8_t gaps;
+    int8_t id;
+} mppc_tile;
+
+/* Each distinct place each piece fits in adjacent rows, lowest first */
+static mppc_place places[7][MPPC_PLACES];
+static int nplaces[7];
+
+/* Tiles by their lowest cell, and by piece */
+static mppc_tile tiles[40][MPPC_TILES];
+static int ntiles[40];
+static mppc_tile pieces[7][MPPC_PIECE_TILES];
+static int npieces[7];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/* A piece which could be placed next */
+typedef struct {
+    int id;
+    int next;
+    int hold;
+    bool held;
+} mppc_option;
+
+/* A move from the start, which workers take in turn */
+typedef struct {
+    const mppc_tile *tile;
+    mppc_option option;
+} mppc_first;
+
+/* A single solve, shared by every worker */
+typedef struct {
+    uint64_t board;
+    int height;
+    const int8_t *queue;
+    int n;
+    int hold;
+
+    mppc_first first[3 * MPPC_PIECE_TILES];
+    int nfirst;
+    atomic_int taken;
+
+    atomic_bool found;
+    mppc_solution *out;
+} mppc_job;
+
+/* A board and pieces left, and whether the board can be tiled with them */
+typedef struct {
+    uint64_t board;
+    uint32_t counts;
+
+    /* Generation of the solve, shifted left by one, and the result */
+    uint32_t stamp;
+} mppc_tiling;
+
+/* A board, the next piece and the held one, from which the search failed */
+typedef struct {
+    uint64_t key;
+    uint32_t generation;
+} mppc_failed;
+
+struct mppc_worker {
+    mppc_solver *pc;
+    mppc_job *job;
+    pthread_t thread;
+
+    /* Both kept for the solve whose generation they have */
+    mppc_failed *memo;
+    mppc_tiling *tilings;
+
+    /* Tiles placed so far, where each was placed and if hold was pressed */
+    const mppc_tile *tile[MPPC_QUEUE];
+    uint64_t placed[MPPC_QUEUE];
+    bool held[MPPC_QUEUE];
+    int count;
+
+    uint64_t nodes;
+};
+
+static int mppc_compare(const void *a, const void *b)
+{
+    const uint64_t x = ((const mppc_place *) a)->mask;
+    const uint64_t y = ((const mppc_place *) b)->mask;
+    return (x > y) - (x < y);
+}
+
+/* Add a tile, unless the same piece already fills the same cells */
+static void mppc_add_tile(uint64_t mask, uint8_t gaps, int id)
+{
+    const int low = mem256_64lowbit(mask);
+
+    for (int t = 0; t < ntiles[low]; ++t) {
+        if (tiles[low][t].mask == mask && tiles[low][t].id == id)
+            return;
+    }
+
+    if (ntiles[low] < MPPC_TILES && npieces[id] < MPPC_PIECE_TILES) {
+        tiles[low][ntiles[low]++] = (mppc_tile) { .mask = mask, .gaps = gaps, .id = id };
+        pieces[id][npieces[id]++] = tiles[low][ntiles[low] - 1];
+    }
+}
+
+/**
+ * Find every place each piece fits within four rows, from the positions in
+ * which mptet_collision finds it clear of the walls and floor, and then each
+ * way its rows can be spread apart by rows which clear before it.
+ */
+static void mppc_build(void)
+{
+    for (int id = 0; id < 7; ++id) {
+        nplaces[id] = 0;
+
+        for (int br = 0; br < 4; ++br) {
+            const uint64_t meta = mptetd_meta[id][br];
+
+            for (int by = -3; by < 8; ++by) {
+                for (int bx = -3; bx < 10; ++bx) {
+                    if (bx + mptetd_get(meta, 2) > 10 || bx + mptetd_get(meta, 0) < 0 ||
+                            by + mptetd_get(meta, 3) < 0)
+                        continue;
+
+                    /* As mptet_rotate places a block */
+                    const int shift = 10 * (by - 3) - bx;
+                    const uint64_t t = mptetd_block[id][br];
+
+                    if (shift <= -64 || shift >= 64)
+                        continue;
+                    const uint64_t mask = shift < 0 ? t >> -shift : t << shift;
+
+                    if (mem256_64popcnt(mask) != 4 || mask >> 40)
+                        continue;
+
+                    bool seen = false;
+
+                    for (int i = 0; i < nplaces[id] && !seen; ++i)
+                        seen = places[id][i].mask == mask;
+
+                    if (!seen) {
+                        places[id][nplaces[id]++] = (mppc_place) {
+                            .mask = mask, .br = br, .bx = bx, .by = by
+                        };
+                    }
+                }
+            }
+        }
+
+        qsort(places[id], nplaces[id], sizeof(mppc_place), mppc_compare);
+
+        /* Spread each place on the floor over every choice of its rows */
+        for (int i = 0; i < nplaces[id]; ++i) {
+            const uint64_t mask = places[id][i].mask;
+            const int rows = (mem256_64highbit(mask) - 1) / 10 + 1;
+
+            if (!(mask & MPPC_ROW))
+                continue;
+
+            for (int chosen = 1; chosen < 16; ++chosen) {
+                uint64_t spread = 0;
+                uint8_t gaps = 0;
+                int row = 0;
+
+                if (mem256_64popcnt(chosen) != rows)
+                    continue;
+
+                for (int r = 0; r < 4; ++r) {
+                    if (chosen >> r & 1)
+                        spread |= (mask >> (10 * row++) & MPPC_ROW) << (10 * r);
+                    else if (row && row < rows)
+                        gaps |= 1 << r;
+                }
+
+                mppc_add_tile(spread, gaps, id);
+            }
+        }
+    }
+}
+
+/* A bit for each full row of a board */
+static inline unsigned mppc_full(uint64_t board, int height)
+{
+    unsigned full = 0;
+
+    for (int row = 0; row < height; ++row) {
+        if ((board >> (10 * row) & MPPC_ROW) == MPPC_ROW)
+            full |= 1 << row;
+    }
+
+    return full;
+}
+
+/* Remove the given rows, so the rows above them fall */
+static inline uint64_t mppc_compress(uint64_t value, unsigned rows)
+{
+    for (int row = 3; row >= 0; --row) {
+        if (rows >> row & 1) {
+            const uint64_t below = value & ((1ull << (10 * row)) - 1);
+            value = below | (value >> (10 * (row + 1))) << (10 * row);
+        }
+    }
+
+    return value;
+}
+
+/**
+ * Can the empty cells on each side of every full column still be filled?
+ * Pieces cannot cross a full column, and clearing rows never opens it.
+ */
+static inline bool mppc_walls(uint64_t board, uint64_t region)
+{
+    const uint64_t empty = ~board & region;
+    uint64_t full = MPPC_ROW;
+
+    for (int row = 0; region >> (10 * row); ++row)
+        full &= board >> (10 * row);
+
+    full &= MPPC_ROW;
+
+    while (full) {
+        const int column = mem256_64lowbit(full);
+        const uint64_t side = ((1ull << column) - 1) * MPPC_COLUMN & region;
+
+        if (mem256_64popcnt(empty & side) % 4)
+            return false;
+
+        full &= full - 1;
+    }
+
+    return true;
+}
+
+/**
+ * Can the pieces left balance the empty cells of even and odd columns?
+ *
+ * Colouring columns alternately, O, S and Z pieces always fill two cells of
+ * each colour. L and J pieces always fill three of one and one of the other,
+ * T pieces do when upright and I pieces fill four of one when upright. Rows
+ * clear whole, so clearing never changes the balance of the empty cells.
+ */
+static inline bool mppc_parity(uint64_t board, uint64_t region, const int count[7], int spare)
+{
+    const uint64_t empty = ~board & region;
+    const int balance = mem256_64popcnt(empty & MPPC_EVEN) -
+        mem256_64popcnt(empty & ~MPPC_EVEN);
+    const int lj = count[2] + count[3];
+
+    if (abs(balance) > 4 * count[0] + 2 * count[1] + 2 * lj)
+        return false;
+
+    /* Without T pieces, the number of L and J pieces used fixes the balance
+     * modulo four, unless one of them may be left unused */
+    if (!count[1] && !(spare && lj))
+        return (balance / 2 - lj) % 2 == 0;
+
+    return true;
+}
+
+/**
+ * Where a tile is in the board as it is, with full rows cleared, or 0 if it
+ * cannot be placed yet: it must rest on the floor or the board, and have
+ * nothing above it so it can be dropped there.
+ */
+static inline uint64_t mppc_placeable(uint64_t board, int height, const mppc_tile *t)
+{
+    const unsigned full = mppc_full(board, height);
+
+    if (t->gaps & ~full)
+        return 0;
+
+    const uint64_t cells = mppc_compress(board, full);
+    const uint64_t mask = mppc_compress(t->mask, full);
+
+    if (!(mask & MPPC_ROW) && !((mask >> 10) & cells))
+        return 0;
+
+    if ((mask << 10 | mask << 20 | mask << 30) & cells)
+        return 0;
+
+    return mask;
+}
+
+/* The place of a piece in adjacent rows, to find its rotation and position */
+static const mppc_place *mppc_place_of(int id, uint64_t mask)
+{
+    for (int i = 0; i < nplaces[id]; ++i) {
+        if (places[id][i].mask == mask)
+            return &places[id][i];
+    }
+
+    return NULL;
+}
+
+/* Pack the pieces left, which never exceed the queue, four bits each */
+static inline uint32_t mppc_pack(const int count[7])
+{
+    uint32_t packed = 0;
+
+    for (int id = 0; id < 7; ++id)
+        packed |= (uint32_t) count[id] << (4 * id);
+
+    return packed;
+}
+
+/**
+ * Can the empty cells of the board be tiled with the pieces left, ignoring
+ * the order they come in? Covers the lowest empty cell with each tile which
+ * fits, and remembers the result for each board and pieces left.
+ */
+static bool mppc_tileable(struct mppc_worker *w, uint64_t board, int count[7], int spare)
+{
+    const uint64_t region = (1ull << (10 * w->job->height)) - 1;
+
+    if (board == region)
+        return true;
+
+    if (!mppc_walls(board, region) || !mppc_parity(board, region, count, spare))
+        return false;
+
+    const uint32_t counts = mppc_pack(count);
+    mppc_tiling *e = &w->tilings[(board * 0x9e3779b97f4a7c15ull ^ counts) >> 32 &
+        (MPPC_TILINGS - 1)];
+
+    if (e->stamp >> 1 == w->pc->generation && e->board == board && e->counts == counts)
+        return e->stamp & 1;
+
+    const int cell = mem256_64lowbit(~board & region);
+    bool tileable = false;
+
+    for (int i = 0; i < ntiles[cell] && !tileable; ++i) {
+        const mppc_tile *t = &tiles[cell][i];
+
+        if (t->mask & (board | ~region) || !count[t->id])
+            continue;
+
+        count[t->id]--;
+        tileable = mppc_tileable(w, board | t->mask, count, spare);
+        count[t->id]++;
+    }
+
+    *e = (mppc_tiling) {
+        .board = board, .counts = counts, .stamp = w->pc->generation << 1 | tileable
+    };
+
+    return tileable;
+}
+
+/* Pieces which could be placed next, with where each leaves the queue */
+static int mppc_options(const mppc_job *job, int next, int hold, mppc_option options[3])
+{
+    const int8_t *q = job->queue;
+    int n = 0;
+
+    if (next < job->n)
+        options[n++] = (mppc_option) { q[next], next + 1, hold, false };
+
+    /* Swapping with an identical held piece changes nothing */
+    if (next < job->n && hold >= 0 && hold != q[next])
+        options[n++] = (mppc_option) { hold, next + 1, q[next], true };
+
+    if (next + 1 < job->n && hold < 0)
+        options[n++] = (mppc_option) { q[next + 1], next + 2, q[next], true };
+
+    return n;
+}
+
+/**
+ * Place the pieces of the queue in order, each as any tile of it which can
+ * be placed, until the board is full. Boards are kept as the cells each tile
+ * fills rather than with full rows cleared, so that the same board reached
+ * in different orders is the same state.
+ */
+static bool mppc_dfs(struct mppc_worker *w, uint64_t board, int next, int hold, int depth)
+{
+    const mppc_job *job = w->job;
+    const uint64_t region = (1ull << (10 * job->height)) - 1;
+
+    if (board == region) {
+        w->count = depth;
+        return true;
+    }
+
+    if (atomic_load_explicit(&w->job->found, memory_order_relaxed))
+        return false;
+
+    w->nodes++;
+
+    const uint64_t key = board | (uint64_t) next << 40 | (uint64_t) (hold + 1) << 44;
+    mppc_failed *e = &w->memo[key * 0x9e3779b97f4a7c15ull >> 32 & (MPPC_MEMO - 1)];
+
+    if (e->generation == w->pc->generation && e->key == key)
+        return false;
+
+    int count[7] = { 0 };
+    int spare = -mem256_64popcnt(~board & region) / 4;
+
+    for (int i = next; i < job->n; ++i)
+        count[job->queue[i]]++;
+
+    if (hold >= 0)
+        count[hold]++;
+
+    for (int id = 0; id < 7; ++id)
+        spare += count[id];
+
+    if (spare >= 0 && mppc_tileable(w, board, count, spare)) {
+        mppc_option options[3];
+        const int noptions = mppc_options(job, next, hold, options);
+
+        for (int o = 0; o < noptions; ++o) {
+            const int id = options[o].id;
+
+            for (int i = 0; i < npieces[id]; ++i) {
+                const mppc_tile *t = &pieces[id][i];
+                uint64_t placed;
+
+                if (t->mask & (board | ~region) ||
+                        !(placed = mppc_placeable(board, job->height, t)))
+                    continue;
+
+                w->tile[depth] = t;
+                w->placed[depth] = placed;
+                w->held[depth] = options[o].held;
+
+                if (mppc_dfs(w, board | t->mask, options[o].next, options[o].hold, depth + 1))
+                    return true;
+            }
+        }
+    }
+
+    *e = (mppc_failed) { .key = key, .generation = w->pc->generation };
+    return false;
+}
+
+/* Search after each first move in turn until any worker finds a solution */
+static void *mppc_work(void *arg)
+{
+    struct mppc_worker *w = arg;
+    mppc_job *job = w->job;
+    int i;
+
+    while ((i = atomic_fetch_add(&job->taken, 1)) < job->nfirst) {
+        const mppc_first *f = &job->first[i];
+
+        w->tile[0] = f->tile;
+        w->placed[0] = mppc_placeable(job->board, job->height, f->tile);
+        w->held[0] = f->option.held;
+
+        if (!mppc_dfs(w, job->board | f->tile->mask, f->option.next, f->option.hold, 1))
+            continue;
+
+        /* Only the first solution found is kept */
+        if (!atomic_exchange(&job->found, true)) {
+            job->out->count = w->count;
+
+            for (int m = 0; m < w->count; ++m) {
+                const mppc_tile *t = w->tile[m];
+                const mppc_place *p = mppc_place_of(t->id, w->placed[m]);
+
+                job->out->moves[m] = (mppc_move) {
+                    .mask = w->placed[m], .id = t->id, .br = p->br, .bx = p->bx,
+                    .by = p->by, .hold = w->held[m]
+                };
+            }
+        }
+
+        break;
+    }
+
+    return NULL;
+}
+
+void mppc_init(mppc_solver *pc, int threads)
+{
+    pthread_once(&tables_once, mppc_build);
+
+    pc->threads = threads < 1 ? 1 : threads;
+    pc->generation = 0;
+    pc->workers = calloc(pc->threads, sizeof(struct mppc_worker));
+
+    if (!pc->workers) {
+        fprintf(stderr, "Failed to allocate solver\n");
+        exit(-1);
+    }
+
+    for (int i = 0; i < pc->threads; ++i) {
+        pc->workers[i].pc = pc;
+        pc->workers[i].memo = calloc(MPPC_MEMO, sizeof(mppc_failed));
+        pc->workers[i].tilings = calloc(MPPC_TILINGS, sizeof(mppc_tiling));
+
+        if (!pc->workers[i].memo || !pc->workers[i].tilings) {
+            fprintf(stderr, "Failed to allocate solver memo\n");
+            exit(-1);
+        }
+    }
+}
+
+void mppc_free(mppc_solver *pc)
+{
+    for (int i = 0; i < pc->threads; ++i) {
+        free(pc->workers[i].memo);
+        free(pc->workers[i].tilings);
+    }
+
+    free(pc->workers);
+    pc->workers = NULL;
+}
+
+bool mppc_solve(mppc_solver *pc, uint64_t board, int height, const int8_t *queue, int n,
+        int hold, mppc_solution *out)
+{
+    static mppc_job zero;
+    mppc_job job = zero;
+
+    out->count = 0;
+    out->height = height;
+    out->nodes = 0;
+
+    if (height < 0 || height > MPPC_HEIGHT || board >> (10 * height) ||
+            (10 * height - mem256_64popcnt(board)) % 4)
+        return false;
+
+    if (!height)
+        return true;
+
+    job.board = board;
+    job.height = height;
+    job.queue = queue;
+    job.n = n < MPPC_QUEUE ? n : MPPC_QUEUE;
+    job.hold = hold;
+    job.out = out;
+
+    /* The first moves are shared between threads */
+    const uint64_t region = (1ull << (10 * height)) - 1;
+    mppc_option options[3];
+    const int noptions = mppc_options(&job, 0, hold, options);
+
+    for (int o = 0; o < noptions; ++o) {
+        const int id = options[o].id;
+
+        for (int i = 0; i < npieces[id]; ++i) {
+            const mppc_tile *t = &pieces[id][i];
+
+            if (!(t->mask & (board | ~region)) && mppc_placeable(board, height, t))
+                job.first[job.nfirst++] = (mppc_first) { t, options[o] };
+        }
+    }
+
+    atomic_init(&job.taken, 0);
+    atomic_init(&job.found, false);
+
+    /* Memos of earlier solves no longer match. The stamp of a tiling keeps
+     * the generation in 31 bits. */
+    if (++pc->generation == 1u << 31) {
+        for (int i = 0; i < pc->threads; ++i) {
+            memset(pc->workers[i].memo, 0, MPPC_MEMO * sizeof(mppc_failed));
+            memset(pc->workers[i].tilings, 0, MPPC_TILINGS * sizeof(mppc_tiling));
+        }
+
+        pc->generation = 1;
+    }
+
+    for (int i = 0; i < pc->threads; ++i) {
+        pc->workers[i].job = &job;
+        pc->workers[i].nodes = 0;
+    }
+
+    int started = 1;
+
+    for (; started < pc->threads && started < job.nfirst; ++started) {
+        if (pthread_create(&pc->workers[started].thread, NULL, mppc_work,
+                    &pc->workers[started]) != 0)
+            break;
+    }
+
+    mppc_work(&pc->workers[0]);
+
+    for (int i = 1; i < started; ++i)
+        pthread_join(pc->workers[i].thread, NULL);
+
+    for (int i = 0; i < pc->threads; ++i)
+        out->nodes += pc->workers[i].nodes;
+
+    return atomic_load(&job.found);
+}
+
+bool mppc_solve_state(mppc_solver *pc, const mpstate *ms, int height, mppc_solution *out)
+{
+    int8_t queue[MPPC_QUEUE];
+    int n = 0;
+
+    /* The bag holds the rest of its current run and all of the next */
+    const int known = 14 - ms->bhead % 7;
+
+    queue[n++] = ms->id;
+
+    for (int i = 0; i < known && n < MPPC_QUEUE; ++i)
+        queue[n++] = ms->bag[(ms->bhead + i) % 14];
+
+    const uint64_t board = ms->field.limb[0] & ((1ull << 40) - 1);
+
+    if (ms->field.limb[0] >> 40 || ms->field.limb[1] || ms->field.limb[2] ||
+            ms->field.limb[3]) {
+        out->count = 0;
+        out->height = 0;
+        out->nodes = 0;
+        return false;
+    }
+
+    if (height)
+        return mppc_solve(pc, board, height, queue, n, ms->hold, out);
+
+    /* The lowest height with room for the stack, then higher */
+    while (board >> (10 * height))
+        ++height;
+
+    for (; height <= MPPC_HEIGHT; ++height) {
+        if (height && mppc_solve(pc, board, height, queue, n, ms->hold, out))
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+/**
+ * pc.h
+ *
+ * Implements a perfect clear solver, which finds whether the bottom rows of
+ * a field can be cleared entirely with the pieces in the queue, and how.
+ *
+ * The bottom four rows of the field are the low 40 bits of its first limb,
+ * so a board fits in a uint64_t and placing, testing and clearing a piece
+ * are single operations on it.
+ *
+ * The search is depth first over the queue in order: each step places the
+ * next piece, or the held one, as any tile from a table of every place each
+ * piece fits in the four rows. A tile may span rows which clear before it is
+ * placed, so its rows need not be adjacent. Boards keep their full rows, as
+ * the cells every tile placed so far fills, so the same board reached in a
+ * different order is the same state. States (board, next piece, held piece)
+ * the search failed from are remembered by each thread for the whole solve.
+ *
+ * Pieces are placed by dropping them straight down from above, as
+ * mptet_placements does, so the solver never relies on tucks or spins. A
+ * tile can only be placed once the rows between its cells are full, and is
+ * tested against the board with those rows cleared, so each move is where
+ * the piece rests in the field the player sees.
+ *
+ * Each state is pruned when a completely filled column leaves a region on
+ * either side which is not a multiple of four cells, as no piece can cross
+ * it, when the pieces left cannot balance the empty cells of alternate
+ * columns, and when the pieces left cannot tile the empty cells in any
+ * order. That last check covers the lowest empty cell with each tile which
+ * fits, and remembers its result for each board and pieces left.
+ *
+ * The first moves are split between threads, and the first solution found by
+ * any of them is returned, so which solution is found can vary between runs
+ * with more than one thread.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mptet.h"
+
+/* Rows a perfect clear is searched in */
+#define MPPC_HEIGHT 4
+
+/* Most pieces searched: ten fill four empty rows, and one more may be held */
+#define MPPC_QUEUE 11
+
+/* States remembered as failing by each thread, and boards remembered as
+ * tileable or not with the pieces left. Both must be powers of two. */
+#define MPPC_MEMO (1 << 18)
+#define MPPC_TILINGS (1 << 16)
+
+/* A piece of a solution */
+typedef struct {
+    /* Cells the piece fills, in the board as it was before placing it */
+    uint64_t mask;
+
+    /* Piece, and where it rests as in mpstate */
+    int8_t id;
+    int8_t br;
+    int8_t bx;
+    int8_t by;
+
+    /* Is the piece hold pressed before placing it? */
+    bool hold;
+} mppc_move;
+
+typedef struct {
+    mppc_move moves[MPPC_QUEUE];
+    int count;
+
+    /* Rows cleared */
+    int height;
+
+    /* States visited by the search */
+    uint64_t nodes;
+} mppc_solution;
+
+struct mppc_worker;
+
+/* A solver, which can be reused to solve many boards */
+typedef struct {
+    int threads;
+    struct mppc_worker *workers;
+
+    /* Distinguishes memos of different solves, so they need not be cleared */
+    uint32_t generation;
+} mppc_solver;
+
+void mppc_init(mppc_solver *pc, int threads);
+
+void mppc_free(mppc_solver *pc);
+
+/**
+ * Find a perfect clear of a board of the given height, placing the pieces
+ * in queue in order, except that hold may be used, starting with hold
+ * holding a piece or -1. Returns false if there is none.
+ */
+bool mppc_solve(mppc_solver *pc, uint64_t board, int height, const int8_t *queue, int n,
+        int hold, mppc_solution *out);
+
+/**
+ * Find a perfect clear of the given height for a game, from its current
+ * piece, which must not have been held yet, its hold and the pieces known in
+ * its bag. A height of 0 tries each height from the lowest which holds the
+ * stack. The field must be empty above the board. This is what a bot would
+ * use, pressing hold when a move says so and moving the piece to br, bx and
+ * by before hard dropping it. Returns false if there is none.
+ */
+bool mppc_solve_state(mppc_solver *pc, const mpstate *ms, int height, mppc_solution *out);
@@ -0,0 +1,196 @@
+/**
+ * pcsolve.c
+ *
+ * Implements a tool which runs the perfect clear solver described in pc.h,
+ * either measuring how fast it solves the openings of random games or
+ * printing them as drills to practise.
+ *
+ * Options:
+ *
+ *   --count=N      openings to solve, 1000 by default
+ *   --height=N     rows to clear, 4 by default, or 0 for the lowest possible
+ *   --threads=N    threads splitting each search, the number of cores by
+ *                  default
+ *   --seed=N       seed of the first game
+ *   --train        print each opening and its solution instead
+ *
+ * Each opening is the empty field of a game with the current piece and the
+ * rest of the bag known, after a random number of pieces have been dealt so
+ * that every position in the bag is covered.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "pc.h"
+
+/* Letter of each piece, in the order of mptetd_block */
+static const char letters[] = "ITLJSZO";
+
+static uint64_t pc_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Steps of a drill printed side by side */
+#define PC_COLUMNS 5
+
+/**
+ * Print the board after each piece of a solution, before full rows clear,
+ * with the piece just placed in capitals.
+ */
+static void pc_print(const mpstate *ms, const mppc_solution *sol)
+{
+    char grid[MPPC_QUEUE][MPPC_HEIGHT][11];
+    char rows[MPPC_HEIGHT][11];
+    const int height = sol->height;
+    int h = height;
+
+    /* The queue as mppc_solve_state takes it */
+    printf("queue %c", letters[ms->id]);
+    for (int i = 0; i < MPPC_QUEUE - 1 && i < 14 - ms->bhead % 7; ++i)
+        printf("%c", letters[ms->bag[(ms->bhead + i) % 14]]);
+    printf(", hold %c\n", ms->hold < 0 ? '-' : letters[ms->hold]);
+
+    memset(rows, '.', sizeof(rows));
+
+    for (int m = 0; m < sol->count; ++m) {
+        const mppc_move *mv = &sol->moves[m];
+
+        for (int y = 0; y < MPPC_HEIGHT; ++y) {
+            for (int x = 0; x < 10; ++x) {
+                if (rows[y][x] != '.')
+                    rows[y][x] |= 0x20;
+                if (mv->mask >> (10 * y + 9 - x) & 1)
+                    rows[y][x] = letters[mv->id];
+            }
+        }
+
+        memcpy(grid[m], rows, sizeof(rows));
+
+        /* Hidden rows above the board stay blank */
+        for (int y = h; y < MPPC_HEIGHT; ++y)
+            memset(grid[m][y], ' ', 10);
+
+        /* Clear full rows, as the solver did */
+        for (int y = 0; y < h;) {
+            if (!memchr(rows[y], '.', 10)) {
+                memmove(rows[y], rows[y + 1], (MPPC_HEIGHT - 1 - y) * sizeof(rows[0]));
+                memset(rows[MPPC_HEIGHT - 1], '.', 10);
+                --h;
+            }
+            else {
+                ++y;
+            }
+        }
+    }
+
+    for (int start = 0; start < sol->count; start += PC_COLUMNS) {
+        for (int y = height - 1; y >= 0; --y) {
+            for (int m = start; m < sol->count && m < start + PC_COLUMNS; ++m)
+                printf("%.10s   ", grid[m][y]);
+            printf("\n");
+        }
+
+        for (int m = start; m < sol->count && m < start + PC_COLUMNS; ++m)
+            printf("%2d %c%-7s  ", m + 1, letters[sol->moves[m].id],
+                    sol->moves[m].hold ? " (hold)" : "");
+        printf("\n\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int count = 1000;
+    int height = 4;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seed = time(NULL);
+    bool train = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--count=", 8)) {
+            count = atoi(argv[i] + 8);
+        }
+        else if (!strncmp(argv[i], "--height=", 9)) {
+            height = atoi(argv[i] + 9);
+        }
+        else if (!strncmp(argv[i], "--threads=", 10)) {
+            threads = atoi(argv[i] + 10);
+        }
+        else if (!strncmp(argv[i], "--seed=", 7)) {
+            seed = strtoull(argv[i] + 7, NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--train")) {
+            train = true;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (height < 0 || height > MPPC_HEIGHT) {
+        fprintf(stderr, "Height must be at most %d\n", MPPC_HEIGHT);
+        return 2;
+    }
+
+    mppc_solver pc;
+    mpstate ms, rng;
+    mppc_solution sol;
+    hist_t solve;
+    uint64_t nodes = 0;
+    int solved = 0;
+
+    mppc_init(&pc, threads);
+    mpstate_init(&rng);
+    mpstate_seed(&rng, seed);
+    hist_zero(&solve);
+
+    const uint64_t start = pc_now();
+
+    for (int i = 0; i < count; ++i) {
+        mpstate_init(&ms);
+        mpstate_seed(&ms, seed + i);
+        mptet_set_random_block(&ms);
+
+        for (int deal = mptet_random(&rng) % 7; deal > 0; --deal)
+            mptet_set_random_block(&ms);
+
+        const uint64_t t = pc_now();
+        const bool found = mppc_solve_state(&pc, &ms, height, &sol);
+
+        hist_record(&solve, pc_now() - t);
+        nodes += sol.nodes;
+        solved += found;
+
+        if (train) {
+            printf("drill %d: ", i + 1);
+
+            if (found)
+                pc_print(&ms, &sol);
+            else
+                printf("no perfect clear\n\n");
+        }
+    }
+
+    const double elapsed = (pc_now() - start) * 1e-9;
+
+    fprintf(train ? stderr : stdout,
+            "%d of %d openings cleared on %d threads in %.2f s (%.0f solves/s, %.1fM nodes/s)\n",
+            solved, count, pc.threads, elapsed, count / elapsed, nodes / elapsed * 1e-6);
+
+    if (!train)
+        hist_print(&solve, "solve", 1e-3, stdout);
+
+    mppc_free(&pc);
+    return 0;
+}
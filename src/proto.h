@@ -0,0 +1,155 @@
+#pragma once
+
+/**
+ * proto.h
+ *
+ * Implements the messages exchanged between the versus server and its
+ * clients over a stream socket.
+ *
+ * Every message starts with a one byte type and has a fixed size for that
+ * type. Multi-byte values are little-endian.
+ *
+ * A client connects and sends MSG_JOIN with the number of players it wants
+ * in a match. Once enough clients are waiting, each is sent MSG_START with
+ * its seat and the match seed, and then sends MSG_INPUT whenever the keys
+ * it holds change. Every player is sent a MSG_FRAME for each seat whenever
+ * that seat's game changes, and finally MSG_END with the winner before the
+ * server closes the connection.
+ *
+ * A spectator instead sends MSG_WATCH with the id of a match, or 0 for the
+ * most recent. It is sent MSG_KEYFRAME holding the whole match, then a
+ * MSG_DELTA for every tick in which anything changed, and finally MSG_END.
+ * These messages vary in size and are described in spectate.h.
+ *
+ * The byte following MSG_INPUT holds a bit for each key held, indexed by
+ * K_Left etc., so setting the K_q bit forfeits. Closing the connection also
+ * forfeits.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mem256.h"
+#include "mptet.h"
+
+/* Default TCP port the server listens on */
+#define MP_PORT 7341
+
+/* Most players in a single match */
+#define MP_MAX_PLAYERS 8
+
+/* Seat or piece value sent for none */
+#define MP_NONE 0xff
+
+enum {
+    MSG_JOIN = 1, MSG_INPUT, MSG_START, MSG_FRAME, MSG_END,
+    MSG_WATCH, MSG_KEYFRAME, MSG_DELTA, MSG_Count
+};
+
+/* Size of each type of message, including the type */
+enum {
+    MSG_JOIN_SIZE = 2,
+    MSG_INPUT_SIZE = 2,
+    MSG_START_SIZE = 8,
+    MSG_FRAME_SIZE = 48,
+    MSG_END_SIZE = 2,
+    MSG_WATCH_SIZE = 5
+};
+
+/* Messages which vary in size start with their type and a 2 byte size */
+#define MSG_HEADER_SIZE 3
+
+static const uint8_t mpmsg_size[MSG_Count] MP_UNUSED = {
+    [MSG_JOIN] = MSG_JOIN_SIZE,
+    [MSG_INPUT] = MSG_INPUT_SIZE,
+    [MSG_START] = MSG_START_SIZE,
+    [MSG_FRAME] = MSG_FRAME_SIZE,
+    [MSG_END] = MSG_END_SIZE,
+    [MSG_WATCH] = MSG_WATCH_SIZE
+};
+
+/**
+ * Return the size of a message of the given type, or 0 if it is invalid or
+ * varies in size.
+ */
+static inline size_t mpmsg_length(uint8_t type)
+{
+    return type < MSG_Count ? mpmsg_size[type] : 0;
+}
+
+static inline bool mpmsg_variable(uint8_t type)
+{
+    return type == MSG_KEYFRAME || type == MSG_DELTA;
+}
+
+static inline void mpmsg_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t mpmsg_get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/**
+ * Return the size of a partially received message of any type, given the
+ * first have bytes of it, or 0 if it is invalid. This may be less than the
+ * actual size until the whole header of a message which varies in size has
+ * been received.
+ */
+static inline size_t mpmsg_need(const uint8_t *m, size_t have)
+{
+    if (!mpmsg_variable(m[0]))
+        return mpmsg_length(m[0]);
+
+    if (have < MSG_HEADER_SIZE)
+        return MSG_HEADER_SIZE;
+
+    const size_t size = m[1] | m[2] << 8;
+    return size < MSG_HEADER_SIZE ? 0 : size;
+}
+
+/**
+ * Encode the state of one seat, which is the part of MSG_FRAME following
+ * the type and seat:
+ *
+ *   0   frame number, 4 bytes
+ *   4   field, 28 bytes holding bits 0 to 223
+ *   32  piece id, rotation, x and y
+ *   36  hold piece id or MP_NONE
+ *   37  next 3 pieces
+ *   40  pending garbage lines
+ *   41  1 if still playing
+ *   42  padding
+ */
+static inline void mpmsg_frame(uint8_t *m, int seat, const mpstate *ms)
+{
+    memset(m, 0, MSG_FRAME_SIZE);
+    m[0] = MSG_FRAME;
+    m[1] = seat;
+
+    uint8_t *p = m + 2;
+    mpmsg_put32(p, ms->total_frames);
+
+    for (int i = 0; i < 28; ++i)
+        p[4 + i] = ms->field.limb[i / 8] >> (i % 8 * 8);
+
+    p[32] = ms->id;
+    p[33] = ms->br;
+    p[34] = ms->bx;
+    p[35] = ms->by;
+    p[36] = ms->hold == -1 ? MP_NONE : ms->hold;
+
+    for (int i = 0; i < 3; ++i)
+        p[37 + i] = ms->bag[(ms->bhead + i) % 14];
+
+    const int pending = mptet_garbage_pending(ms);
+    p[40] = pending > 0xff ? 0xff : pending;
+    p[41] = ms->running;
+}
@@ -0,0 +1,67 @@
+/**
+ * raster.c
+ *
+ * Implements conversion of the field into pixels.
+ */
+
+#include <string.h>
+
+#include "raster.h"
+
+void mpraster_classify(mpraster *r, const mpstate *ms)
+{
+    for (int i = 0; i < 22; ++i) {
+        const uint16_t field = mpraster_row(&ms->field, i);
+        const uint16_t block = mpraster_row(&ms->block, i) & ~field;
+        const uint16_t ghost = mpraster_row(&ms->ghost, i) & ~(field | block);
+
+        /* Rows are stored top to bottom */
+        const int y = 21 - i;
+        r->row[R_Field][y] = field;
+        r->row[R_Block][y] = block;
+        r->row[R_Ghost][y] = ghost;
+        r->row[R_Empty][y] = ~(field | block | ghost) & 0x3ff;
+    }
+}
+
+/**
+ * Each row of cells is expanded into pixels once for the scanline containing
+ * the top edge of its cells and once for an interior scanline. The remaining
+ * scanlines of the row are copies of these.
+ */
+void mpraster_draw(const mpraster *r, uint32_t *pixels, int pitch, int side,
+        const mpraster_palette *pal, int y0, int y1)
+{
+    const int inner = side - 2;
+    const size_t width = 10 * side;
+
+    if (side < 4)
+        return;
+
+    for (int y = y0; y <= y1; ++y) {
+        uint32_t *top = pixels + (ptrdiff_t) y * side * pitch;
+        uint32_t *edge = top + pitch;
+        uint32_t *mid = edge + pitch;
+
+        mpraster_span(top, width, pal->background);
+
+        for (int x = 0; x < 10; ++x) {
+            const int c = mpraster_class(r, y, x);
+            uint32_t *e = edge + x * side;
+            uint32_t *m = mid + x * side;
+
+            e[0] = e[side - 1] = pal->background;
+            mpraster_span(e + 1, inner, pal->edge[c]);
+
+            m[0] = m[side - 1] = pal->background;
+            m[1] = m[inner] = pal->edge[c];
+            mpraster_span(m + 2, inner - 2, pal->fill[c]);
+        }
+
+        for (int j = 3; j < side - 2; ++j)
+            memcpy(top + j * pitch, mid, width * sizeof(uint32_t));
+
+        memcpy(top + (side - 2) * pitch, edge, width * sizeof(uint32_t));
+        mpraster_span(top + (side - 1) * pitch, width, pal->background);
+    }
+}
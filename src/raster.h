@@ -0,0 +1,124 @@
+#pragma once
+
+/**
+ * raster.h
+ *
+ * Implements conversion of the field into pixels for software frontends.
+ *
+ * This is done in three steps. The 22 rows of 10 cells are first extracted
+ * from the packed bitboards, each cell is then classified with bitwise
+ * operations on whole rows, and finally each row of cells is expanded into
+ * pixel spans.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#   include <immintrin.h>
+#endif
+
+#include "mem256.h"
+#include "mptet.h"
+
+/* Classes which a cell can be drawn as, in order of precedence */
+enum {
+    R_Field, R_Block, R_Ghost, R_Empty, R_Classes
+};
+
+typedef struct {
+    /**
+     * For each class, a mask of the cells in each row. Rows are ordered top
+     * to bottom as drawn, and bit 9 - x of a row is the cell in column x, as
+     * in the field.
+     */
+    uint16_t row[R_Classes][22];
+} mpraster;
+
+typedef struct {
+    /* Gaps between cells */
+    uint32_t background;
+
+    /* One pixel outline of each class of cell */
+    uint32_t edge[R_Classes];
+
+    /* Interior of each class of cell */
+    uint32_t fill[R_Classes];
+} mpraster_palette;
+
+/**
+ * Return row r of a bitboard, counting from the bottom.
+ */
+static inline uint16_t mpraster_row(const mem256_t *m, int r)
+{
+    const int bit = 10 * r;
+    const int l = bit >> 6;
+    const int off = bit & 63;
+
+    uint64_t v = m->limb[l] >> off;
+
+    /* The row straddles two limbs */
+    if (off > 54)
+        v |= m->limb[l + 1] << (64 - off);
+
+    return v & 0x3ff;
+}
+
+/**
+ * Return the class of the cell at column x of row y, counting from the
+ * top-left.
+ */
+static inline int mpraster_class(const mpraster *r, int y, int x)
+{
+    const uint16_t bit = 1 << (9 - x);
+
+    for (int c = 0; c < R_Empty; ++c) {
+        if (r->row[c][y] & bit)
+            return c;
+    }
+
+    return R_Empty;
+}
+
+/**
+ * Return the class of the cell at the given field bit index.
+ */
+static inline int mpraster_cell(const mpraster *r, int i)
+{
+    return mpraster_class(r, 21 - i / 10, 9 - i % 10);
+}
+
+/**
+ * Fill a run of n pixels with a single value.
+ */
+static inline void mpraster_span(uint32_t *p, int n, uint32_t color)
+{
+#if defined(__AVX2__)
+    const __m256i v8 = _mm256_set1_epi32(color);
+
+    for (; n >= 8; n -= 8, p += 8)
+        _mm256_storeu_si256((__m256i *) p, v8);
+#endif
+
+#if defined(__SSE2__)
+    const __m128i v4 = _mm_set1_epi32(color);
+
+    for (; n >= 4; n -= 4, p += 4)
+        _mm_storeu_si128((__m128i *) p, v4);
+#endif
+
+    while (n-- > 0)
+        *p++ = color;
+}
+
+/* Classify every cell of the state */
+void mpraster_classify(mpraster *r, const mpstate *ms);
+
+/**
+ * Draw rows y0 to y1 inclusive of the field. Pixels points to the top-left
+ * corner of the field, and each cell is a square of the given side length
+ * in pixels, including a one pixel gap on each side. The side length must be
+ * at least 4.
+ */
+void mpraster_draw(const mpraster *r, uint32_t *pixels, int pitch, int side,
+        const mpraster_palette *pal, int y0, int y1);
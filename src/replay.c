@@ -0,0 +1,126 @@
+/**
+ * replay.c
+ *
+ * Implements recording and re-simulation of single player games.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+
+void mpreplay_init(mpreplay *r)
+{
+    r->data = NULL;
+    r->size = 0;
+    r->capacity = 0;
+    r->frames = 0;
+}
+
+void mpreplay_free(mpreplay *r)
+{
+    free(r->data);
+    mpreplay_init(r);
+}
+
+void mpreplay_clear(mpreplay *r)
+{
+    r->size = 0;
+    r->frames = 0;
+}
+
+void mpreplay_frame(mpreplay *r, uint8_t keys)
+{
+    r->frames++;
+
+    /* Extend the last run if the keys are unchanged */
+    if (r->size && r->data[r->size - 2] == keys && r->data[r->size - 1] < MPREPLAY_RUN) {
+        r->data[r->size - 1]++;
+        return;
+    }
+
+    if (r->size + 2 > r->capacity) {
+        r->capacity = r->capacity ? 2 * r->capacity : 256;
+        r->data = realloc(r->data, r->capacity);
+
+        if (!r->data) {
+            fprintf(stderr, "Failed to allocate replay\n");
+            exit(-1);
+        }
+    }
+
+    r->data[r->size++] = keys;
+    r->data[r->size++] = 1;
+}
+
+void mpreplay_start(mpstate *ms, uint64_t seed, int goal)
+{
+    mpstate_init(ms);
+    mpstate_seed(ms, seed);
+    mpstate_rules(ms, &mprules_classic);
+    ms->goal = goal;
+    mptet_set_random_block(ms);
+}
+
+bool mpreplay_step(mpstate *ms, uint8_t keys)
+{
+    mptet_keymask(ms, keys);
+    mptet_update(ms);
+    ms->total_frames++;
+    return ms->running;
+}
+
+void mpreplay_result(const mpstate *ms, mpresult *res)
+{
+    res->frames = ms->total_frames;
+    res->lines = ms->lines_cleared;
+    res->hash = mpreplay_hash(&ms->field);
+    res->finished = ms->goal && ms->lines_cleared >= ms->goal;
+}
+
+bool mpreplay_play(mpstate *ms, const uint8_t *data, size_t size)
+{
+    if (size % 2)
+        return false;
+
+    for (size_t i = 0; i < size && ms->running; i += 2) {
+        if (!data[i + 1])
+            return false;
+
+        for (int n = 0; n < data[i + 1] && mpreplay_step(ms, data[i]); ++n)
+            ;
+    }
+
+    return true;
+}
+
+bool mpreplay_run(mpstate *ms, uint64_t seed, int goal, const uint8_t *data,
+        size_t size, mpresult *res)
+{
+    mpreplay_start(ms, seed, goal);
+
+    if (!mpreplay_play(ms, data, size))
+        return false;
+
+    mpreplay_result(ms, res);
+    return true;
+}
+
+/**
+ * Each limb is mixed with the splitmix64 finalizer, so that games differing
+ * only by rows which cancel under XOR still hash differently.
+ */
+uint64_t mpreplay_hash(const mem256_t *field)
+{
+    uint64_t h = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        uint64_t z = field->limb[i] + h + 0x9e3779b97f4a7c15ull * (i + 1);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        h = z ^ (z >> 31);
+    }
+
+    return h;
+}
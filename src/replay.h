@@ -0,0 +1,82 @@
+#pragma once
+
+/**
+ * replay.h
+ *
+ * Implements recording and re-simulation of single player games.
+ *
+ * A replay is the seed and goal of a game and the keys held on each frame,
+ * which reproduce the game exactly through mptet_update. The keys are stored
+ * as runs of two bytes, the keys held and the number of frames they were held
+ * for, so a game costs two bytes for each change of input.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mptet.h"
+
+/* Longest run of a single byte of keys */
+#define MPREPLAY_RUN 255
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+
+    /* Frames recorded */
+    uint32_t frames;
+} mpreplay;
+
+/* Outcome of a game, which is stored in the archive index */
+typedef struct {
+    uint32_t frames;
+    uint32_t lines;
+    uint64_t hash;
+
+    /* Did the game reach its goal, rather than topping out or running out
+     * of input? */
+    bool finished;
+} mpresult;
+
+void mpreplay_init(mpreplay *r);
+
+void mpreplay_free(mpreplay *r);
+
+/* Discard everything recorded */
+void mpreplay_clear(mpreplay *r);
+
+/* Record the keys held for one frame, as bits indexed by K_Left etc. */
+void mpreplay_frame(mpreplay *r, uint8_t keys);
+
+/**
+ * Start a game from a seed, in the same way for recording and replaying.
+ * Replays are always played under the classic rules.
+ */
+void mpreplay_start(mpstate *ms, uint64_t seed, int goal);
+
+/**
+ * Run one frame with the given keys. Returns false once the game has ended.
+ */
+bool mpreplay_step(mpstate *ms, uint8_t keys);
+
+/* Summarise a game which has been played until it ended */
+void mpreplay_result(const mpstate *ms, mpresult *res);
+
+/**
+ * Play recorded keys on a state already started with mpreplay_start, until
+ * the keys run out or the game ends. Returns false if the replay is
+ * malformed.
+ */
+bool mpreplay_play(mpstate *ms, const uint8_t *data, size_t size);
+
+/**
+ * Play a recorded game from the start, returning false if the replay is
+ * malformed.
+ */
+bool mpreplay_run(mpstate *ms, uint64_t seed, int goal, const uint8_t *data,
+        size_t size, mpresult *res);
+
+/* Hash the final field, to detect games which no longer replay the same */
+uint64_t mpreplay_hash(const mem256_t *field);
@@ -0,0 +1,418 @@
+/**
+ * rollback.c
+ *
+ * Implements rollback netcode for a two player versus game.
+ */
+
+#include <string.h>
+
+#include "proto.h"
+#include "replay.h"
+#include "rollback.h"
+
+/* Mix a value into a hash with the splitmix64 finalizer */
+static inline uint64_t mprollback_mix(uint64_t h, uint64_t v)
+{
+    uint64_t z = h + v + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void mprollback_save(mpstate dst[2], const mpstate src[2])
+{
+    memcpy(dst, src, 2 * sizeof(mpstate));
+}
+
+/**
+ * The hole of garbage sent by a seat on a frame. Unlike the server, which
+ * draws holes from the match's generator, this gives the same hole however
+ * many times the frame is simulated.
+ */
+static int mprollback_hole(uint64_t seed, int64_t frame, int seat)
+{
+    return mprollback_mix(seed, 2 * frame + seat) % 10;
+}
+
+void mprollback_simulate(mpstate state[2], const uint8_t keys[2], uint64_t seed)
+{
+    for (int seat = 0; seat < 2; ++seat) {
+        mpstate *ms = &state[seat];
+        mpstate *target = &state[seat ^ 1];
+
+        if (!ms->running)
+            continue;
+
+        mptet_keymask(ms, keys[seat]);
+        mptet_update(ms);
+        ms->total_frames++;
+
+        if (ms->attack) {
+            if (target->running) {
+                mptet_queue_garbage(target, ms->attack,
+                        mprollback_hole(seed, ms->total_frames, seat));
+            }
+
+            ms->attack = 0;
+        }
+    }
+}
+
+uint64_t mprollback_checksum(const mpstate state[2])
+{
+    uint64_t h = 0;
+
+    for (int seat = 0; seat < 2; ++seat) {
+        const mpstate *ms = &state[seat];
+
+        h = mprollback_mix(h, mpreplay_hash(&ms->field));
+        h = mprollback_mix(h, mpreplay_hash(&ms->block));
+        h = mprollback_mix(h, (uint64_t) ms->id << 48 | (uint64_t) ms->br << 32 |
+                (uint32_t) ms->bx << 16 | (uint16_t) ms->by);
+        h = mprollback_mix(h, (uint64_t) (ms->hold + 1) << 32 | ms->bhead << 8 |
+                ms->can_hold << 2 | ms->lock_piece << 1 | ms->running);
+        h = mprollback_mix(h, ms->seed);
+
+        for (int i = 0; i < 14; ++i)
+            h = mprollback_mix(h, ms->bag[i]);
+
+        for (int k = 0; k <= K_q; ++k)
+            h = mprollback_mix(h, ms->keystate[k]);
+
+        for (int i = 0; i < ms->gcount; ++i) {
+            const mpgarbage *g = &ms->garbage[(ms->ghead + i) % GARBAGE_QUEUE];
+            h = mprollback_mix(h, g->lines << 8 | g->hole);
+        }
+
+        h = mprollback_mix(h, (uint64_t) ms->fall << 32 | ms->soft);
+        h = mprollback_mix(h, (uint64_t) ms->lock_timer << 32 | ms->lines_cleared);
+        h = mprollback_mix(h, ms->total_frames);
+    }
+
+    return h;
+}
+
+void mprollback_init(mprollback *s, int local, uint64_t seed, int delay,
+        mptransport transport)
+{
+    for (int seat = 0; seat < 2; ++seat)
+        mpreplay_start(&s->state[seat], seed, 0);
+
+    memset(s->input, 0, sizeof(s->input));
+    memset(s->checks, 0, sizeof(s->checks));
+
+    s->frame = 0;
+    s->local = local;
+    s->delay = delay < 0 ? 0 : delay > MPROLLBACK_DELAY ? MPROLLBACK_DELAY : delay;
+    s->seed = seed;
+
+    /* The first frames of a delayed player have no keys held */
+    s->local_next = s->delay;
+    s->remote_next = 0;
+    s->acked = 0;
+    s->rollback = UINT32_MAX;
+    s->desync = MPROLLBACK_SYNCED;
+    s->transport = transport;
+
+    s->rollbacks = 0;
+    s->resimulated = 0;
+    s->deepest = 0;
+    s->stalls = 0;
+}
+
+static mpcheckpoint *mprollback_checkpoint(mprollback *s, uint32_t frame)
+{
+    return &s->checks[frame / MPROLLBACK_CHECK % MPROLLBACK_CHECKS];
+}
+
+/**
+ * Snapshot the games, predict the opponent's keys if they have not arrived
+ * and run the current frame.
+ */
+static void mprollback_step(mprollback *s)
+{
+    const uint32_t f = s->frame;
+    const int remote = s->local ^ 1;
+
+    mprollback_save(s->snapshot[f % MPROLLBACK_SNAPSHOTS], s->state);
+
+    if (f % MPROLLBACK_CHECK == 0) {
+        mpcheckpoint *c = mprollback_checkpoint(s, f);
+
+        if (c->frame != f)
+            *c = (mpcheckpoint) { .frame = f };
+
+        c->local = mprollback_checksum(s->state);
+        c->has_local = true;
+    }
+
+    /* The opponent is assumed to keep holding their last confirmed keys */
+    if (f >= s->remote_next) {
+        s->input[remote][f % MPROLLBACK_INPUTS] = s->remote_next ?
+            s->input[remote][(s->remote_next - 1) % MPROLLBACK_INPUTS] : 0;
+    }
+
+    const uint8_t keys[2] = {
+        s->input[0][f % MPROLLBACK_INPUTS],
+        s->input[1][f % MPROLLBACK_INPUTS]
+    };
+
+    mprollback_simulate(s->state, keys, s->seed);
+    s->frame++;
+}
+
+static void mprollback_resimulate(mprollback *s)
+{
+    if (s->rollback >= s->frame) {
+        s->rollback = UINT32_MAX;
+        return;
+    }
+
+    const uint32_t present = s->frame;
+    const int depth = present - s->rollback;
+
+    mprollback_save(s->state, s->snapshot[s->rollback % MPROLLBACK_SNAPSHOTS]);
+    s->frame = s->rollback;
+    s->rollback = UINT32_MAX;
+
+    while (s->frame < present)
+        mprollback_step(s);
+
+    s->rollbacks++;
+    s->resimulated += depth;
+
+    if (depth > s->deepest)
+        s->deepest = depth;
+}
+
+static void mprollback_receive(mprollback *s, const uint8_t *p, size_t size)
+{
+    const int remote = s->local ^ 1;
+
+    if (size < MPROLLBACK_HEADER)
+        return;
+
+    const uint32_t ack = mpmsg_get32(p);
+    const uint32_t start = mpmsg_get32(p + 4);
+    const uint32_t count = p[8];
+    const uint32_t check = mpmsg_get32(p + 9);
+    const uint64_t sum = mpmsg_get32(p + 13) | (uint64_t) mpmsg_get32(p + 17) << 32;
+
+    if (size < MPROLLBACK_HEADER + count || count > MPROLLBACK_INPUTS)
+        return;
+
+    if (ack > s->acked && ack <= s->local_next)
+        s->acked = ack;
+
+    /* Keys are sent from the first frame not acknowledged, so they always
+     * follow on from those already confirmed unless the packet is stale */
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint32_t f = start + i;
+        const uint8_t keys = p[MPROLLBACK_HEADER + i];
+
+        if (f != s->remote_next)
+            continue;
+
+        /* Too far ahead to keep without overwriting keys still needed */
+        if (f >= s->frame + MPROLLBACK_INPUTS - MPROLLBACK_SNAPSHOTS)
+            break;
+
+        uint8_t *slot = &s->input[remote][f % MPROLLBACK_INPUTS];
+
+        if (f < s->frame && *slot != keys && f < s->rollback)
+            s->rollback = f;
+
+        *slot = keys;
+        s->remote_next++;
+    }
+
+    if (check != UINT32_MAX) {
+        mpcheckpoint *c = mprollback_checkpoint(s, check);
+
+        if (c->frame != check) {
+            if (check < c->frame)
+                return;
+            *c = (mpcheckpoint) { .frame = check };
+        }
+
+        c->remote = sum;
+        c->has_remote = true;
+    }
+}
+
+/**
+ * Take every packet waiting, simulate again from the first wrong prediction,
+ * and compare the checkpoints which are now confirmed.
+ */
+static void mprollback_receive_all(mprollback *s)
+{
+    uint8_t p[MPROLLBACK_PACKET];
+    size_t size;
+
+    while ((size = s->transport.recv(s->transport.ctx, p, sizeof(p))))
+        mprollback_receive(s, p, size);
+
+    mprollback_resimulate(s);
+
+    /* Compare checkpoints whose keys are now all confirmed */
+    for (int i = 0; i < MPROLLBACK_CHECKS; ++i) {
+        mpcheckpoint *c = &s->checks[i];
+
+        if (!c->has_local || !c->has_remote || c->checked ||
+                c->frame > s->remote_next || c->frame >= s->frame)
+            continue;
+
+        c->checked = true;
+
+        if (c->local != c->remote && c->frame < s->desync)
+            s->desync = c->frame;
+    }
+}
+
+/**
+ * Send every key the opponent has not acknowledged, and the checksum of the
+ * last checkpoint before any prediction.
+ */
+static void mprollback_send(mprollback *s)
+{
+    uint8_t p[MPROLLBACK_PACKET];
+    uint32_t start = s->acked;
+
+    if (s->local_next - start > MPROLLBACK_INPUTS)
+        start = s->local_next - MPROLLBACK_INPUTS;
+
+    const uint32_t count = s->local_next - start;
+    const uint32_t confirmed = s->remote_next < s->frame ? s->remote_next : s->frame;
+    uint32_t check = UINT32_MAX;
+    uint64_t sum = 0;
+
+    if (confirmed) {
+        const uint32_t f = (confirmed - 1) / MPROLLBACK_CHECK * MPROLLBACK_CHECK;
+        const mpcheckpoint *c = mprollback_checkpoint(s, f);
+
+        if (c->frame == f && c->has_local) {
+            check = f;
+            sum = c->local;
+        }
+    }
+
+    mpmsg_put32(p, s->remote_next);
+    mpmsg_put32(p + 4, start);
+    p[8] = count;
+    mpmsg_put32(p + 9, check);
+    mpmsg_put32(p + 13, sum);
+    mpmsg_put32(p + 17, sum >> 32);
+
+    for (uint32_t i = 0; i < count; ++i)
+        p[MPROLLBACK_HEADER + i] = s->input[s->local][(start + i) % MPROLLBACK_INPUTS];
+
+    s->transport.send(s->transport.ctx, p, MPROLLBACK_HEADER + count);
+}
+
+void mprollback_poll(mprollback *s)
+{
+    mprollback_receive_all(s);
+    mprollback_send(s);
+}
+
+bool mprollback_advance(mprollback *s, uint8_t keys)
+{
+    mprollback_receive_all(s);
+
+    if (s->frame >= s->remote_next + MPROLLBACK_WINDOW) {
+        s->stalls++;
+        mprollback_send(s);
+        return false;
+    }
+
+    s->input[s->local][s->local_next % MPROLLBACK_INPUTS] = keys;
+    s->local_next++;
+
+    mprollback_step(s);
+    mprollback_send(s);
+    return true;
+}
+
+/* xorshift64*, which is all a simulated network needs */
+static uint32_t mploopback_random(mploopback *lb)
+{
+    lb->rng ^= lb->rng >> 12;
+    lb->rng ^= lb->rng << 25;
+    lb->rng ^= lb->rng >> 27;
+    return (lb->rng * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static void mploopback_send(void *ctx, const uint8_t *data, size_t size)
+{
+    mploopback_end *e = ctx;
+    mploopback *lb = e->lb;
+    const int to = e->end ^ 1;
+
+    lb->sent++;
+
+    if ((int) (mploopback_random(lb) % 100) < lb->loss || lb->count[to] == MPLOOPBACK_PACKETS ||
+            size > MPROLLBACK_PACKET) {
+        lb->dropped++;
+        return;
+    }
+
+    mploopback_packet *p = &lb->queue[to][lb->count[to]++];
+
+    p->deliver = lb->now + lb->latency +
+        (lb->jitter ? mploopback_random(lb) % (lb->jitter + 1) : 0);
+    p->size = size;
+    memcpy(p->data, data, size);
+}
+
+/* Deliver the packet which arrived first, so jitter can reorder packets */
+static size_t mploopback_recv(void *ctx, uint8_t *data, size_t size)
+{
+    mploopback_end *e = ctx;
+    mploopback *lb = e->lb;
+    mploopback_packet *queue = lb->queue[e->end];
+    int first = -1;
+
+    for (int i = 0; i < lb->count[e->end]; ++i) {
+        if (queue[i].deliver <= lb->now &&
+                (first == -1 || queue[i].deliver < queue[first].deliver))
+            first = i;
+    }
+
+    if (first == -1 || queue[first].size > size)
+        return 0;
+
+    const size_t n = queue[first].size;
+    memcpy(data, queue[first].data, n);
+    queue[first] = queue[--lb->count[e->end]];
+    return n;
+}
+
+void mploopback_init(mploopback *lb, int latency, int jitter, int loss, uint64_t seed)
+{
+    for (int end = 0; end < 2; ++end) {
+        lb->ends[end] = (mploopback_end) { .lb = lb, .end = end };
+        lb->count[end] = 0;
+    }
+
+    lb->now = 0;
+    lb->latency = latency;
+    lb->jitter = jitter;
+    lb->loss = loss;
+    lb->rng = seed | 1;
+    lb->sent = 0;
+    lb->dropped = 0;
+}
+
+mptransport mploopback_transport(mploopback *lb, int end)
+{
+    return (mptransport) {
+        .send = mploopback_send,
+        .recv = mploopback_recv,
+        .ctx = &lb->ends[end]
+    };
+}
+
+void mploopback_tick(mploopback *lb)
+{
+    lb->now++;
+}
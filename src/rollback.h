@@ -0,0 +1,203 @@
+#pragma once
+
+/**
+ * rollback.h
+ *
+ * Implements rollback netcode for a two player versus game, in which each
+ * peer runs both games itself rather than waiting for a server.
+ *
+ * A session advances a frame on every tick using its own keys at once and
+ * predicting its opponent's, which are assumed to be the last keys received
+ * from them. When the opponent's actual keys for a frame arrive and differ
+ * from the prediction, the session restores the snapshot taken at the start
+ * of that frame and simulates again up to the present. A snapshot of both
+ * games is kept for each recent frame, and since mpstate owns no memory,
+ * taking and restoring one is a plain copy.
+ *
+ * Every packet carries all the keys the opponent has not yet acknowledged,
+ * so lost packets are covered by the next one to arrive. Packets also carry
+ * a checksum of the games at the last checkpoint for which the keys of both
+ * players are confirmed, and a session which finds its own checksum of that
+ * frame differs reports a desync.
+ *
+ * A session only predicts up to MPROLLBACK_WINDOW frames ahead of the keys
+ * confirmed from its opponent. Beyond that it stalls, not advancing until
+ * more keys arrive.
+ *
+ * Both games are played under the classic rules, whatever MPTET_RULES says,
+ * so that both peers simulate the same game. Garbage holes are derived from
+ * the seed and frame rather than drawn from a shared generator, so that they
+ * are the same however often a frame is simulated.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mptet.h"
+
+/* Snapshots kept, which bounds how far a session can roll back. Must be a
+ * power of two. */
+#define MPROLLBACK_SNAPSHOTS 16
+
+/* Most frames predicted beyond the opponent's confirmed keys */
+#define MPROLLBACK_WINDOW 12
+
+/* Keys kept for each player. Must be a power of two. */
+#define MPROLLBACK_INPUTS 64
+
+/* Most frames a player's keys may be delayed by */
+#define MPROLLBACK_DELAY 8
+
+/* Frames between checksums, and the checkpoints remembered for comparing */
+#define MPROLLBACK_CHECK 8
+#define MPROLLBACK_CHECKS 8
+
+/* Largest packet: a header followed by the keys of each frame */
+#define MPROLLBACK_HEADER 21
+#define MPROLLBACK_PACKET (MPROLLBACK_HEADER + MPROLLBACK_INPUTS)
+
+/* Frame reported while no desync has been found */
+#define MPROLLBACK_SYNCED UINT32_MAX
+
+/**
+ * Carries packets to the opponent. Packets may be lost, duplicated or
+ * reordered. recv returns the size of the next packet received, or 0 if none
+ * is waiting.
+ */
+typedef struct {
+    void (*send)(void *ctx, const uint8_t *data, size_t size);
+    size_t (*recv)(void *ctx, uint8_t *data, size_t size);
+    void *ctx;
+} mptransport;
+
+/* Checksums of the games at the start of a checkpoint frame */
+typedef struct {
+    uint32_t frame;
+    bool has_local;
+    bool has_remote;
+    bool checked;
+    uint64_t local;
+    uint64_t remote;
+} mpcheckpoint;
+
+typedef struct {
+    /* Both games as of the start of frame */
+    mpstate state[2];
+    uint32_t frame;
+
+    /* Both games at the start of each recent frame, by frame % SNAPSHOTS */
+    mpstate snapshot[MPROLLBACK_SNAPSHOTS][2];
+
+    /* Keys of each player by frame % INPUTS. The opponent's keys from
+     * remote_next onwards are predictions. */
+    uint8_t input[2][MPROLLBACK_INPUTS];
+
+    /* This peer's seat, and the frames its keys are delayed by */
+    int local;
+    int delay;
+
+    /* Seed of both games, which also chooses garbage holes */
+    uint64_t seed;
+
+    /* Frames of keys known for this player, confirmed from the opponent,
+     * and of this player's keys the opponent has confirmed */
+    uint32_t local_next;
+    uint32_t remote_next;
+    uint32_t acked;
+
+    /* Earliest frame simulated with a wrong prediction, or UINT32_MAX */
+    uint32_t rollback;
+
+    mpcheckpoint checks[MPROLLBACK_CHECKS];
+
+    /* First checkpoint at which the games differed from the opponent's, or
+     * MPROLLBACK_SYNCED */
+    uint32_t desync;
+
+    mptransport transport;
+
+    /* Rollbacks made, frames simulated again, the most in one rollback and
+     * ticks spent stalled */
+    uint64_t rollbacks;
+    uint64_t resimulated;
+    int deepest;
+    uint64_t stalls;
+} mprollback;
+
+/**
+ * Start a session in the given seat, 0 or 1, with the same seed as the
+ * opponent. The local player's keys take effect delay frames after they are
+ * given, which makes rollbacks rarer at the cost of responsiveness.
+ */
+void mprollback_init(mprollback *s, int local, uint64_t seed, int delay,
+        mptransport transport);
+
+/**
+ * Take the local player's keys for this tick, receive any packets, roll back
+ * if they contradict a prediction, and advance a frame. Returns false if the
+ * session stalled waiting for the opponent, in which case the keys were not
+ * used.
+ */
+bool mprollback_advance(mprollback *s, uint8_t keys);
+
+/**
+ * Take the keys of the opponent, rolling back if needed, and send this
+ * player's keys again, without advancing. Used while the game is paused.
+ */
+void mprollback_poll(mprollback *s);
+
+/* Copy both games to snapshot, and restore them from it */
+void mprollback_save(mpstate dst[2], const mpstate src[2]);
+
+/* Run a single frame of both games with each player's keys */
+void mprollback_simulate(mpstate state[2], const uint8_t keys[2], uint64_t seed);
+
+/* Checksum of both games, covering everything which affects later frames */
+uint64_t mprollback_checksum(const mpstate state[2]);
+
+/* Most packets in flight in each direction of a loopback */
+#define MPLOOPBACK_PACKETS 64
+
+typedef struct {
+    uint64_t deliver;
+    size_t size;
+    uint8_t data[MPROLLBACK_PACKET];
+} mploopback_packet;
+
+typedef struct mploopback mploopback;
+
+/* Each end of a loopback, whose transport sends to the other end */
+typedef struct {
+    mploopback *lb;
+    int end;
+} mploopback_end;
+
+/**
+ * Connects two sessions in one process, delivering each packet after the
+ * latency plus up to jitter ticks, or dropping loss percent of them.
+ */
+struct mploopback {
+    mploopback_end ends[2];
+
+    /* Packets in flight towards each end */
+    mploopback_packet queue[2][MPLOOPBACK_PACKETS];
+    int count[2];
+
+    uint64_t now;
+    int latency;
+    int jitter;
+    int loss;
+    uint64_t rng;
+
+    uint64_t sent;
+    uint64_t dropped;
+};
+
+void mploopback_init(mploopback *lb, int latency, int jitter, int loss, uint64_t seed);
+
+/* Transport of the given end, 0 or 1 */
+mptransport mploopback_transport(mploopback *lb, int end);
+
+/* Advance the loopback's clock by one tick */
+void mploopback_tick(mploopback *lb);
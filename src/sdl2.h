@@ -1,10 +1,42 @@
 #include <SDL.h>
 
+#include "damage.h"
+#include "layout.h"
+#include "raster.h"
+
+#if defined(MP_THREADED)
+#   include "input.h"
+#endif
+
 typedef struct {
     SDL_Window *window;
     SDL_Renderer *renderer;
+
+    /* Placement of everything in the window, for its current size */
+    mplayout layout;
+
+    /* Field border, empty cells, and the hold and preview pieces, which only
+     * change on resize or when the pieces change */
+    SDL_Texture *background;
+
+    /* Hold piece sprites in the first row and preview sprites in the second,
+     * indexed by mplayout_sprite */
+    SDL_Texture *sprites;
+
+    /* Changes since the last presented frame */
+    mpdamage damage;
+#if defined(MP_THREADED)
+    /* Key events captured as they are pumped on the render thread */
+    mpqueue input;
+#endif
 } mpgfx;
 
+#if defined(MP_THREADED)
+static int mpgfx_watch(void *data, SDL_Event *e);
+#endif
+
+static void mpgfx_init_background(mpgfx *mx);
+
 void mpgfx_init(mpgfx *mx, int *argc, char ***argv)
 {
     (void) argc;
@@ -26,11 +58,33 @@ void mpgfx_init(mpgfx *mx, int *argc, char ***argv)
     mx->renderer = SDL_CreateRenderer(mx->window, -1,
             SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
+    /* Fall back to any renderer, such as the software renderer used by the
+     * dummy and offscreen video drivers */
+    if (!mx->renderer)
+        mx->renderer = SDL_CreateRenderer(mx->window, -1, 0);
+
     if (!mx->renderer) {
+        fprintf(stderr, "SDL_CreateRenderer Error: %s\n", SDL_GetError());
         SDL_DestroyWindow(mx->window);
         SDL_Quit();
         exit(-1);
     }
+
+    /* The window size is used if the renderer cannot report its own */
+    int w, h;
+    SDL_GetWindowSize(mx->window, &w, &h);
+    SDL_GetRendererOutputSize(mx->renderer, &w, &h);
+    mplayout_compute(&mx->layout, w, h);
+
+    mx->background = NULL;
+    mx->sprites = NULL;
+    mpgfx_init_background(mx);
+    mpdamage_init(&mx->damage, 1);
+
+#if defined(MP_THREADED)
+    mpqueue_init(&mx->input);
+    SDL_AddEventWatch(mpgfx_watch, mx);
+#endif
 }
 
 static int keycodes[] = {
@@ -38,6 +92,43 @@ static int keycodes[] = {
     SDL_SCANCODE_X, SDL_SCANCODE_C, SDL_SCANCODE_SPACE, SDL_SCANCODE_Q
 };
 
+#if defined(MP_THREADED)
+/**
+ * SDL requires events to be pumped from the thread which created the window,
+ * so rather than a dedicated input thread we timestamp key events from a
+ * watch as the render thread pumps them.
+ */
+static int mpgfx_watch(void *data, SDL_Event *e)
+{
+    mpgfx *mx = data;
+
+    if ((e->type != SDL_KEYDOWN && e->type != SDL_KEYUP) || e->key.repeat)
+        return 0;
+
+    const uint64_t now = ts_get_current_time();
+
+    for (size_t i = 0; i < sizeof(keycodes) / sizeof(keycodes[0]); ++i) {
+        if (e->key.keysym.scancode == keycodes[i]) {
+            mpqueue_push(&mx->input, now, i, e->type == SDL_KEYDOWN);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void mpgfx_update(mpstate *ms, mpgfx *mx)
+{
+    mpqueue_drain(&mx->input, ms);
+}
+
+/* Pump events while the render thread is otherwise idle */
+void mpgfx_poll(mpgfx *mx)
+{
+    (void) mx;
+    SDL_PumpEvents();
+}
+#else
 void mpgfx_update(mpstate *ms, mpgfx *mx)
 {
     (void) mx;
@@ -52,131 +143,254 @@ void mpgfx_update(mpstate *ms, mpgfx *mx)
             ms->keystate[i] = 0;
     }
 }
+#endif
 
 void mpgfx_free(mpgfx *mx)
 {
+#if defined(MP_THREADED)
+    SDL_DelEventWatch(mpgfx_watch, mx);
+#endif
+
+    if (mx->background)
+        SDL_DestroyTexture(mx->background);
+    if (mx->sprites)
+        SDL_DestroyTexture(mx->sprites);
     SDL_DestroyRenderer(mx->renderer);
     SDL_DestroyWindow(mx->window);
     SDL_Quit();
 }
 
-/* Number of preview pieces shown */
-#define PREVIEW_NUMBER 3
+#define AddRect(list, n, _x, _y, _w, _h)                        \
+    do {                                                        \
+        list[n].x = (_x); list[n].y = (_y);                     \
+        list[n].w = (_w); list[n].h = (_h);                     \
+        n++;                                                    \
+    } while (0)
 
-/* Block side length */
-#define M_BLOCK_SIDE 36
+/**
+ * Draw the parts of a frame which never change.
+ */
+static void mpgfx_draw_background(mpgfx *mx)
+{
+    const mplayout *l = &mx->layout;
+    SDL_Rect r[220 + 2];
+    int n = 0;
 
-/* Main grid x offset */
-#define M_X_OFFSET 200
+    // Clear Screen
+    SDL_SetRenderDrawColor(mx->renderer, 0, 0, 0, 0xff);
+    SDL_RenderClear(mx->renderer);
 
-/* Main grid y offset */
-#define M_Y_OFFSET 100
+    // Draw bounding field
+    for (int i = 0; i < 2; ++i)
+        AddRect(r, n, l->border[i].x, l->border[i].y, l->border[i].w, l->border[i].h);
 
-/* Preview x offset */
-#define P_X_OFFSET 40
+    SDL_SetRenderDrawColor(mx->renderer, 0x80, 0x80, 0x80, 0xff);
+    SDL_RenderDrawRects(mx->renderer, r, n);
 
-/* Preview y offset */
-#define P_Y_OFFSET 20
+    // Draw empty cells
+    n = 0;
+    for (int i = 219; i >= 0; --i)
+        AddRect(r, n, l->cell[i].x, l->cell[i].y, l->cell[i].w, l->cell[i].h);
 
-/* Preview block scale */
-#define P_BLOCK_SCALE 0.9f
+    SDL_SetRenderDrawColor(mx->renderer, 0, 0, 0, 0xff);
+    SDL_RenderDrawRects(mx->renderer, r, n);
+}
 
-/* Hold preview block scale */
-#define H_BLOCK_SCALE 0.9f
+/**
+ * Gather the filled cells of a 4x4 piece.
+ */
+static void mpgfx_piece(SDL_Rect *fill, int *nfill, uint64_t block, const mprect *cell,
+        int x, int y)
+{
+    for (int k = 0; k < 16; ++k) {
+        if (mplayout_piece_cell(block, k))
+            AddRect(fill, (*nfill), x + cell[k].x, y + cell[k].y, cell[k].w, cell[k].h);
+    }
+}
 
-/* Hold preview x offset - assert(M_X_OFFSET > (M_BLOCK_SIDE * H_BLOCK_SCALE * 4))*/
-#define H_X_OFFSET (M_X_OFFSET / 2 -  (M_BLOCK_SIDE * H_BLOCK_SCALE) * 2)
+/**
+ * Create a texture which can be rendered to, and make it the render target.
+ */
+static SDL_Texture *mpgfx_target(mpgfx *mx, int w, int h)
+{
+    SDL_Texture *t = SDL_CreateTexture(mx->renderer, SDL_PIXELFORMAT_RGBA8888,
+            SDL_TEXTUREACCESS_TARGET, w, h);
 
-/* Hold preview y offset */
-#define H_Y_OFFSET 40
+    if (t && SDL_SetRenderTarget(mx->renderer, t) != 0) {
+        SDL_DestroyTexture(t);
+        return NULL;
+    }
 
-#define DrawRect(rnd, r, _fun, _x, _y, _w, _h)          \
-    do {                                                \
-        r.x = (_x); r.y = (_y); r.w = (_w); r.h = (_h); \
-        SDL_Render##_fun##Rect(rnd, &r);               \
-    } while (0)
+    return t;
+}
 
-void mpgfx_render(mpstate *ms, mpgfx *mx)
+/**
+ * Pre-render the static parts of each frame to a texture, along with a
+ * sprite of every piece at the hold and preview scales. If the renderer
+ * cannot render to textures these are instead redrawn every frame.
+ */
+static void mpgfx_init_background(mpgfx *mx)
 {
-    SDL_Rect r;
+    const mplayout *l = &mx->layout;
+
+    if (mx->background)
+        SDL_DestroyTexture(mx->background);
+    if (mx->sprites)
+        SDL_DestroyTexture(mx->sprites);
+
+    mx->background = NULL;
+    mx->sprites = NULL;
+
+    if (!SDL_RenderTargetSupported(mx->renderer))
+        return;
+
+    const mprect *area[2] = { &l->hold, &l->preview_piece[0] };
+    const mprect *cell[2] = { l->hold_sprite, l->preview_sprite };
+    SDL_Rect fill[2 * (L_SPRITES - 1) * 4];
+    int nfill = 0;
+
+    mx->sprites = mpgfx_target(mx, L_SPRITES * (area[0]->w > area[1]->w ? area[0]->w : area[1]->w),
+            area[0]->h + area[1]->h);
+
+    if (!mx->sprites)
+        return;
+
+    /* The last sprite is left empty */
+    for (int id = 0; id < L_SPRITES - 1; ++id) {
+        mpgfx_piece(fill, &nfill, mptetd_block[id][0], cell[0], id * area[0]->w, 0);
+        mpgfx_piece(fill, &nfill, mptetd_block[id][0], cell[1], id * area[1]->w, area[0]->h);
+    }
 
-    // Clear Screen
     SDL_SetRenderDrawColor(mx->renderer, 0, 0, 0, 0xff);
     SDL_RenderClear(mx->renderer);
+    SDL_SetRenderDrawColor(mx->renderer, 0x80, 0x80, 0xff, 0xff);
+    SDL_RenderFillRects(mx->renderer, fill, nfill);
 
-    // Draw bounding field
-    SDL_SetRenderDrawColor(mx->renderer, 0x80, 0x80, 0x80, 0xff);
+    mx->background = mpgfx_target(mx, l->width, l->height);
 
-    DrawRect(mx->renderer, r, Draw,
-            M_X_OFFSET - 1, M_Y_OFFSET - 1,
-            10 * M_BLOCK_SIDE + 2, 22 * M_BLOCK_SIDE + 2);
+    if (!mx->background) {
+        SDL_DestroyTexture(mx->sprites);
+        mx->sprites = NULL;
+        SDL_SetRenderTarget(mx->renderer, NULL);
+        return;
+    }
 
-    DrawRect(mx->renderer, r, Draw,
-            M_X_OFFSET - 2, M_Y_OFFSET - 2,
-            10 * M_BLOCK_SIDE + 4, 22 * M_BLOCK_SIDE + 4);
+    mpgfx_draw_background(mx);
+    SDL_SetRenderTarget(mx->renderer, NULL);
+}
 
-    // Draw blocks
-    for (int i = 219; i >= 0; --i) {
-        bool fill = false;
-        if (mem256_get(&ms->field, i) || mem256_get(&ms->block, i)) {
-            SDL_SetRenderDrawColor(mx->renderer, 0x80, 0x80, 0xff, 0xff);
-            fill = true;
-        }
-        else if (mem256_get(&ms->ghost, i)) {
-            SDL_SetRenderDrawColor(mx->renderer, 0x80, 0x80, 0xff / 2, 0);
-        }
-        else {
-            SDL_SetRenderDrawColor(mx->renderer, 0, 0, 0, 0xff);
-        }
+/**
+ * Copy the hold and preview sprites into the static layer where they have
+ * changed. The sprites cover the whole area of each piece.
+ */
+static void mpgfx_update_pieces(mpstate *ms, mpgfx *mx, const mpdamage_list *dl)
+{
+    const mplayout *l = &mx->layout;
 
-        if (fill) {
-            DrawRect(mx->renderer, r, Fill,
-                     M_X_OFFSET + M_BLOCK_SIDE * (9 - i % 10) + 1,
-                     M_Y_OFFSET + M_BLOCK_SIDE * (21 - (i / 10)) + 1,
-                     M_BLOCK_SIDE - 2,
-                     M_BLOCK_SIDE - 2);
-        }
-        else {
-            DrawRect(mx->renderer, r, Draw,
-                     M_X_OFFSET + M_BLOCK_SIDE * (9 - i % 10) + 1,
-                     M_Y_OFFSET + M_BLOCK_SIDE * (21 - (i / 10)) + 1,
-                     M_BLOCK_SIDE - 2,
-                     M_BLOCK_SIDE - 2);
-        }
+    if (!dl->full && !dl->hold && !dl->preview)
+        return;
+
+    SDL_SetRenderTarget(mx->renderer, mx->background);
+
+    if (dl->full || dl->hold) {
+        const SDL_Rect src = { mplayout_sprite(ms->hold) * l->hold.w, 0, l->hold.w, l->hold.h };
+        const SDL_Rect dst = { l->hold.x, l->hold.y, l->hold.w, l->hold.h };
+
+        SDL_RenderCopy(mx->renderer, mx->sprites, &src, &dst);
     }
 
-    SDL_SetRenderDrawColor(mx->renderer, 0x80, 0x80, 0xff, 0xff);
-    uint64_t block = mptetd_block[ms->hold][0];
-
-    if (ms->hold != -1) {
-        for (int x = 0; x < 4; ++x) {
-            for (int y = 0; y < 4; ++y) {
-                if (block & ((1 << ((4 - y) * 10 - x - 1))))
-                    DrawRect(mx->renderer, r, Fill,
-                             H_X_OFFSET + x * M_BLOCK_SIDE * H_BLOCK_SCALE,
-                             M_Y_OFFSET + H_Y_OFFSET + y * M_BLOCK_SIDE * H_BLOCK_SCALE,
-                             H_BLOCK_SCALE * M_BLOCK_SIDE - 2,
-                             H_BLOCK_SCALE * M_BLOCK_SIDE - 2);
-            }
+    if (dl->full || dl->preview) {
+        for (int i = 0; i < PREVIEW_NUMBER; ++i) {
+            const mprect *p = &l->preview_piece[i];
+            const SDL_Rect src = {
+                mplayout_sprite(ms->bag[(ms->bhead + i) % 14]) * p->w, l->hold.h, p->w, p->h
+            };
+            const SDL_Rect dst = { p->x, p->y, p->w, p->h };
+
+            SDL_RenderCopy(mx->renderer, mx->sprites, &src, &dst);
         }
     }
 
-    // Draw preview pieces
-    for (int i = 0; i < PREVIEW_NUMBER; ++i) {
-        uint64_t block = mptetd_block[ms->bag[ms->bhead + i] % 14][0];
-
-        for (int x = 0; x < 4; ++x) {
-            for (int y = 0; y < 4; ++y) {
-                if (block & ((1 << ((4 - y) * 10 - x - 1))))
-                    DrawRect(mx->renderer, r, Fill,
-                             M_X_OFFSET + 10 * M_BLOCK_SIDE + P_X_OFFSET + x * M_BLOCK_SIDE * P_BLOCK_SCALE,
-                             M_Y_OFFSET + i * (P_Y_OFFSET + 4 * M_BLOCK_SIDE * P_BLOCK_SCALE) +
-                                    y * M_BLOCK_SIDE * P_BLOCK_SCALE,
-                             P_BLOCK_SCALE * M_BLOCK_SIDE - 2,
-                             P_BLOCK_SCALE * M_BLOCK_SIDE - 2);
-            }
+    SDL_SetRenderTarget(mx->renderer, NULL);
+}
+
+/**
+ * Recompute the layout and static layer if the output size has changed.
+ */
+static bool mpgfx_resized(mpgfx *mx)
+{
+    int w, h;
+
+    if (SDL_GetRendererOutputSize(mx->renderer, &w, &h) != 0 ||
+            !mplayout_resize(&mx->layout, w, h))
+        return false;
+
+    mpgfx_init_background(mx);
+    mpdamage_reset(&mx->damage);
+    return true;
+}
+
+/**
+ * Filled cells and ghost outlines are gathered and submitted with a single
+ * call per color over the cached static layer. The hold and preview pieces
+ * are only drawn into the static layer when they change.
+ */
+void mpgfx_render(mpstate *ms, mpgfx *mx)
+{
+    SDL_Rect fill[220 + 4 * (PREVIEW_NUMBER + 1)];
+    SDL_Rect ghost[4];
+    int nfill = 0;
+    int nghost = 0;
+
+    const mplayout *l = &mx->layout;
+
+#if defined(MP_THREADED)
+    SDL_PumpEvents();
+#endif
+
+    mpgfx_resized(mx);
+
+    /* The contents of the back buffer are undefined after presenting, so
+     * we can only skip frames in which nothing has changed. */
+    mpdamage_list dl;
+    if (!mpdamage_compute(&mx->damage, ms, &dl))
+        return;
+
+    if (mx->background) {
+        mpgfx_update_pieces(ms, mx, &dl);
+        SDL_RenderCopy(mx->renderer, mx->background, NULL, NULL);
+    }
+    else {
+        mpgfx_draw_background(mx);
+
+        if (ms->hold != -1)
+            mpgfx_piece(fill, &nfill, mptetd_block[ms->hold][0], l->hold_cell, 0, 0);
+
+        for (int i = 0; i < PREVIEW_NUMBER; ++i) {
+            mpgfx_piece(fill, &nfill, mptetd_block[ms->bag[(ms->bhead + i) % 14]][0],
+                    l->preview_cell[i], 0, 0);
         }
     }
 
+    // Gather blocks
+    mpraster r;
+    mpraster_classify(&r, ms);
+
+    for (int i = 219; i >= 0; --i) {
+        const int c = mpraster_cell(&r, i);
+        const SDL_Rect cell = { l->cell[i].x, l->cell[i].y, l->cell[i].w, l->cell[i].h };
+
+        if (c == R_Field || c == R_Block)
+            fill[nfill++] = cell;
+        else if (c == R_Ghost && nghost < 4)
+            ghost[nghost++] = cell;
+    }
+
+    SDL_SetRenderDrawColor(mx->renderer, 0x80, 0x80, 0xff / 2, 0);
+    SDL_RenderDrawRects(mx->renderer, ghost, nghost);
+
+    SDL_SetRenderDrawColor(mx->renderer, 0x80, 0x80, 0xff, 0xff);
+    SDL_RenderFillRects(mx->renderer, fill, nfill);
+
     SDL_RenderPresent(mx->renderer);
 }
@@ -0,0 +1,1437 @@
+/**
+ * server.c
+ *
+ * Implements a server which hosts many versus matches in one process.
+ *
+ * The main thread accepts connections and keeps each client in a lobby until
+ * enough clients have asked for a match of the same size. The match is then
+ * handed to one of the worker threads, usually one per core, which owns it
+ * and its connections until it ends. Each worker runs a single-threaded
+ * epoll loop, and ticks all of its matches at the game rate from a timer
+ * wheel.
+ *
+ * Lines cleared by a player are sent as garbage to a random opponent, and the
+ * last player still standing wins. The protocol is described in proto.h.
+ *
+ * Any number of spectators may watch a match. They are handed to the worker
+ * owning it, and each tick is encoded once as a delta and written to all of
+ * them from the same buffer (see spectate.h).
+ *
+ * Options:
+ *
+ *   --port=N      listen for TCP connections on port N, 0 to disable
+ *   --unix=PATH   also listen on a Unix socket at PATH
+ *   --workers=N   number of worker threads, the number of cores by default
+ *   --export=PATH write every placement in every match to a dataset at PATH
+ *                 (see dataset.h), with each worker writing its own records
+ *
+ * Timings for each worker are printed on exit, or on SIGUSR1.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dataset.h"
+#include "hist.h"
+#include "mptet.h"
+#include "proto.h"
+#include "spectate.h"
+#include "wheel.h"
+
+/* Length of a timer wheel tick */
+#define SV_TICK_NS 1000000ull
+
+/* Length of a game frame */
+#define SV_FRAME_NS (1000000000ull / FPS)
+
+/* Most frames a match runs at once to catch up after falling behind */
+#define SV_CATCHUP 4
+
+/* Output which can be queued for a client before it is disconnected */
+#define SV_OUTBUF 8192
+
+/* Spectator messages which can be queued before a spectator is resent a
+ * keyframe in place of those it has fallen behind on */
+#define SV_VIEWER_QUEUE 64
+
+/* Events handled per epoll_wait */
+#define SV_EVENTS 256
+
+enum {
+    SV_Listener, SV_Client, SV_Viewer, SV_Closed
+};
+
+/* Start of everything registered with epoll, to tell them apart */
+typedef struct {
+    int fd;
+    int kind;
+} svsock;
+
+struct svmatch;
+
+typedef struct svconn {
+    svsock sock;
+
+    /* Match size requested while in the lobby */
+    int players;
+
+    /* Match id requested by a spectator while in the lobby */
+    uint32_t watch;
+
+    /* Next spectator in a worker's inbox */
+    struct svconn *next;
+
+    /* Match and seat once playing */
+    struct svmatch *match;
+    int seat;
+
+    /* Partially received message */
+    uint8_t in[8];
+    size_t inlen;
+
+    /* Queued output, from outpos to outlen */
+    uint8_t out[SV_OUTBUF];
+    size_t outpos;
+    size_t outlen;
+
+    /* Is EPOLLOUT currently requested? */
+    bool writing;
+
+    /* Close once the queued output has been written */
+    bool closing;
+
+    /* Keys currently held, and keys pressed at any time since the last frame,
+     * as bits indexed by K_Left etc. */
+    uint8_t held;
+    uint8_t tapped;
+} svconn;
+
+/**
+ * A spectator, which is sent each tick of a match as a message shared with
+ * every other spectator of it.
+ */
+typedef struct svviewer {
+    svsock sock;
+
+    /* Match being watched, and neighbours in its list of spectators */
+    struct svmatch *match;
+    struct svviewer *next;
+    struct svviewer *prev;
+
+    /* Queued messages, of which offset bytes of the first have been sent */
+    mpshared *queue[SV_VIEWER_QUEUE];
+    int qhead;
+    int qcount;
+    size_t offset;
+
+    bool writing;
+    bool closing;
+
+    /* Messages were dropped, so a keyframe must be sent next */
+    bool resync;
+} svviewer;
+
+struct svworker;
+
+typedef struct svmatch {
+    struct svworker *worker;
+    uint32_t id;
+    int players;
+
+    /* Connection for each seat, or NULL once it has closed */
+    svconn *conn[MP_MAX_PLAYERS];
+    int conns;
+
+    mpstate state[MP_MAX_PLAYERS];
+
+    /* Last frame sent for each seat, so only changes are sent */
+    uint8_t sent[MP_MAX_PLAYERS][MSG_FRAME_SIZE];
+
+    /* Match as last sent to spectators */
+    mpspec view;
+
+    /* Keyframe of the view for spectators joining this tick, or NULL */
+    mpshared *keyframe;
+
+    svviewer *viewers;
+
+    /* Chooses garbage holes and targets */
+    mpstate rng;
+
+    /* Time the match started, and frames run since */
+    uint64_t start;
+    uint64_t frames;
+
+    mptimer timer;
+    bool over;
+
+    /* Next match in a worker's inbox, then neighbours in its match list */
+    struct svmatch *next;
+    struct svmatch *prev;
+} svmatch;
+
+typedef struct svworker {
+    pthread_t thread;
+    int epfd;
+
+    /* Signalled when matches or spectators are added to the inbox */
+    int wakefd;
+    pthread_mutex_t lock;
+    svmatch *inbox;
+    svconn *watchers;
+
+    /* Every match owned by this worker, so spectators can find them */
+    svmatch *live;
+
+    /* Spectators closed during the current batch of events */
+    svviewer *closed;
+
+    mpwheel wheel;
+
+    /* Producer of this worker's placements, or NULL if not exporting */
+    mpdataset_stream *dataset;
+
+    /* Time to run each due match tick, and how late each started */
+    hist_t tick;
+    hist_t late;
+
+    /* Time to send each spectator message to all spectators of a match */
+    hist_t fanout;
+
+    /* Matches and spectators currently connected, and totals */
+    int active;
+    int viewers;
+    uint64_t matches;
+    uint64_t frames;
+    uint64_t spectated;
+} svworker;
+
+static atomic_bool running = true;
+static volatile sig_atomic_t stats_requested;
+
+static uint64_t sv_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Wheel tick in which a time falls, rounding up so timers never fire early */
+static uint64_t sv_tick(uint64_t ns)
+{
+    return (ns + SV_TICK_NS - 1) / SV_TICK_NS;
+}
+
+static void sv_stop(int sig)
+{
+    (void) sig;
+    atomic_store(&running, false);
+}
+
+static void sv_stats(int sig)
+{
+    (void) sig;
+    stats_requested = 1;
+}
+
+static svconn *conn_new(int fd)
+{
+    svconn *c = calloc(1, sizeof(*c));
+
+    if (!c) {
+        fprintf(stderr, "Failed to allocate connection\n");
+        exit(-1);
+    }
+
+    c->sock.fd = fd;
+    c->sock.kind = SV_Client;
+    c->seat = -1;
+    return c;
+}
+
+static void match_detach(svmatch *m, svconn *c);
+
+/**
+ * Close a connection, forfeiting its seat if it is in a match.
+ */
+static void conn_close(svconn *c)
+{
+    close(c->sock.fd);
+
+    if (c->match)
+        match_detach(c->match, c);
+
+    free(c);
+}
+
+/**
+ * Write as much queued output as the socket accepts. Returns false if the
+ * connection was closed.
+ */
+static bool conn_flush(svworker *w, svconn *c)
+{
+    while (c->outpos < c->outlen) {
+        const ssize_t n = write(c->sock.fd, c->out + c->outpos, c->outlen - c->outpos);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && errno == EAGAIN)
+            break;
+
+        if (n <= 0) {
+            conn_close(c);
+            return false;
+        }
+
+        c->outpos += n;
+    }
+
+    if (c->outpos == c->outlen) {
+        c->outpos = c->outlen = 0;
+
+        if (c->closing) {
+            conn_close(c);
+            return false;
+        }
+    }
+
+    /* Wait for the socket to become writable only while output is queued */
+    const bool writing = c->outlen != 0;
+
+    if (writing != c->writing) {
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0),
+            .data.ptr = c
+        };
+
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->sock.fd, &ev);
+        c->writing = writing;
+    }
+
+    return true;
+}
+
+/**
+ * Queue a message. A client which has fallen too far behind is dropped when
+ * its output is next flushed.
+ */
+static void conn_send(svconn *c, const uint8_t *msg, size_t n)
+{
+    if (c->outlen + n > SV_OUTBUF && c->outpos) {
+        memmove(c->out, c->out + c->outpos, c->outlen - c->outpos);
+        c->outlen -= c->outpos;
+        c->outpos = 0;
+    }
+
+    if (c->outlen + n > SV_OUTBUF) {
+        c->closing = true;
+        c->outpos = c->outlen = 0;
+        return;
+    }
+
+    memcpy(c->out + c->outlen, msg, n);
+    c->outlen += n;
+}
+
+/**
+ * Read available input, calling fn for each complete message. Returns false
+ * if the connection has been closed by the peer or sent something invalid.
+ */
+static bool conn_read(svconn *c, void (*fn)(svconn *c, const uint8_t *msg))
+{
+    uint8_t buf[512];
+
+    while (true) {
+        const ssize_t n = read(c->sock.fd, buf, sizeof(buf));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && errno == EAGAIN)
+            return true;
+
+        if (n <= 0)
+            return false;
+
+        for (ssize_t i = 0; i < n; ++i) {
+            c->in[c->inlen++] = buf[i];
+
+            /* Clients only send the short messages */
+            const size_t length = mpmsg_length(c->in[0]);
+
+            if (!length || length > sizeof(c->in))
+                return false;
+
+            if (c->inlen == length) {
+                fn(c, c->in);
+                c->inlen = 0;
+            }
+        }
+    }
+}
+
+static void viewer_close(svworker *w, svviewer *v)
+{
+    svmatch *m = v->match;
+
+    if (m) {
+        if (v->prev)
+            v->prev->next = v->next;
+        else
+            m->viewers = v->next;
+
+        if (v->next)
+            v->next->prev = v->prev;
+    }
+
+    for (int i = 0; i < v->qcount; ++i)
+        mpshared_unref(v->queue[(v->qhead + i) % SV_VIEWER_QUEUE]);
+
+    /* A player leaving can close every spectator of a match, some of which
+     * may have events later in the same batch, so freeing is deferred */
+    close(v->sock.fd);
+    v->sock.kind = SV_Closed;
+    v->match = NULL;
+    v->qcount = 0;
+    v->next = w->closed;
+    w->closed = v;
+    w->viewers--;
+}
+
+/**
+ * Write as many queued messages as the socket accepts with a single writev.
+ * Returns false if the spectator was closed.
+ */
+static bool viewer_flush(svworker *w, svviewer *v)
+{
+    struct iovec iov[SV_VIEWER_QUEUE];
+
+    while (v->qcount) {
+        for (int i = 0; i < v->qcount; ++i) {
+            const mpshared *b = v->queue[(v->qhead + i) % SV_VIEWER_QUEUE];
+            iov[i].iov_base = (void *) b->data;
+            iov[i].iov_len = b->size;
+        }
+
+        iov[0].iov_base = (uint8_t *) iov[0].iov_base + v->offset;
+        iov[0].iov_len -= v->offset;
+
+        ssize_t n = writev(v->sock.fd, iov, v->qcount);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && errno == EAGAIN)
+            break;
+
+        if (n <= 0) {
+            viewer_close(w, v);
+            return false;
+        }
+
+        /* Release every message which was completely written */
+        n += v->offset;
+
+        while (v->qcount && (size_t) n >= v->queue[v->qhead]->size) {
+            n -= v->queue[v->qhead]->size;
+            mpshared_unref(v->queue[v->qhead]);
+            v->qhead = (v->qhead + 1) % SV_VIEWER_QUEUE;
+            v->qcount--;
+        }
+
+        v->offset = n;
+    }
+
+    if (!v->qcount && v->closing) {
+        viewer_close(w, v);
+        return false;
+    }
+
+    const bool writing = v->qcount != 0;
+
+    if (writing != v->writing) {
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0),
+            .data.ptr = v
+        };
+
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, v->sock.fd, &ev);
+        v->writing = writing;
+    }
+
+    return true;
+}
+
+static mpshared *match_keyframe(svmatch *m);
+
+/**
+ * Queue a message for a spectator. One which has fallen too far behind
+ * drops everything it has not started writing, and is sent a keyframe in
+ * place of the next message.
+ */
+static void viewer_push(svviewer *v, mpshared *b)
+{
+    if (v->closing)
+        return;
+
+    if (v->qcount == SV_VIEWER_QUEUE) {
+        const int keep = v->offset ? 1 : 0;
+
+        for (int i = keep; i < v->qcount; ++i)
+            mpshared_unref(v->queue[(v->qhead + i) % SV_VIEWER_QUEUE]);
+
+        v->qcount = keep;
+        v->resync = true;
+    }
+
+    /* The keyframe includes the changes of the message it replaces */
+    if (v->resync && b->data[0] == MSG_DELTA) {
+        b = match_keyframe(v->match);
+        v->resync = false;
+    }
+
+    v->queue[(v->qhead + v->qcount++) % SV_VIEWER_QUEUE] = mpshared_ref(b);
+}
+
+/**
+ * Choose a random opponent of a seat which is still playing, or -1.
+ */
+static int match_target(svmatch *m, int seat)
+{
+    int alive[MP_MAX_PLAYERS];
+    int n = 0;
+
+    for (int i = 0; i < m->players; ++i) {
+        if (i != seat && m->state[i].running)
+            alive[n++] = i;
+    }
+
+    return n ? alive[mptet_random(&m->rng) % n] : -1;
+}
+
+/**
+ * Return a keyframe of the match as last sent to spectators, which is
+ * shared by every spectator needing one before the next tick.
+ */
+static mpshared *match_keyframe(svmatch *m)
+{
+    if (!m->keyframe) {
+        uint8_t msg[MPSPEC_MAX_SIZE];
+        m->keyframe = mpshared_new(msg, mpspec_encode(msg, NULL, &m->view));
+    }
+
+    return m->keyframe;
+}
+
+/**
+ * Send a message to every spectator of the match. It is written to each from
+ * the same buffer, so the cost per spectator is only the system call.
+ */
+static void match_spectate(svmatch *m, const uint8_t *msg, size_t size)
+{
+    svworker *w = m->worker;
+    const uint64_t start = sv_now();
+    mpshared *b = mpshared_new(msg, size);
+
+    for (svviewer *v = m->viewers, *next; v; v = next) {
+        next = v->next;
+        viewer_push(v, b);
+        viewer_flush(w, v);
+    }
+
+    mpshared_unref(b);
+    w->spectated++;
+    hist_record(&w->fanout, sv_now() - start);
+}
+
+/**
+ * Send every seat which has changed since it was last sent to all players,
+ * and everything which changed this tick to all spectators.
+ */
+static void match_broadcast(svmatch *m)
+{
+    uint8_t msg[MSG_FRAME_SIZE];
+    mpspec view = m->view;
+
+    view.frame = m->frames;
+
+    for (int seat = 0; seat < m->players; ++seat) {
+        mpmsg_frame(msg, seat, &m->state[seat]);
+        memcpy(view.seat[seat], msg + 6, MPSPEC_SEAT_SIZE);
+
+        /* The frame number alone changing is not worth sending */
+        if (!memcmp(msg + 6, m->sent[seat] + 6, MSG_FRAME_SIZE - 6))
+            continue;
+
+        memcpy(m->sent[seat], msg, MSG_FRAME_SIZE);
+
+        for (int i = 0; i < m->players; ++i) {
+            if (m->conn[i])
+                conn_send(m->conn[i], msg, MSG_FRAME_SIZE);
+        }
+    }
+
+    if (m->keyframe) {
+        mpshared_unref(m->keyframe);
+        m->keyframe = NULL;
+    }
+
+    /* Only the view is kept up to date while nobody is watching */
+    if (m->viewers) {
+        uint8_t delta[MPSPEC_MAX_SIZE];
+        const size_t size = mpspec_encode(delta, &m->view, &view);
+
+        m->view = view;
+
+        if (size > 8)
+            match_spectate(m, delta, size);
+    }
+    else {
+        m->view = view;
+    }
+}
+
+/**
+ * Run a single frame of every game in the match which is still playing.
+ */
+static void match_frame(svmatch *m)
+{
+    for (int seat = 0; seat < m->players; ++seat) {
+        mpstate *ms = &m->state[seat];
+        svconn *c = m->conn[seat];
+
+        if (!ms->running)
+            continue;
+
+        /* A key pressed and released within a frame is still seen */
+        const uint8_t keys = c->held | c->tapped;
+        c->tapped = 0;
+
+        mptet_keymask(ms, keys);
+        mptet_update(ms);
+        ms->total_frames++;
+
+        if (ms->attack) {
+            const int target = match_target(m, seat);
+
+            if (target != -1) {
+                mptet_queue_garbage(&m->state[target], ms->attack,
+                        mptet_random(&m->rng) % 10);
+            }
+
+            ms->attack = 0;
+        }
+    }
+
+    m->frames++;
+    m->worker->frames++;
+}
+
+/**
+ * Send the winner to every spectator, which are closed once it is written.
+ * The match no longer needs to outlive them.
+ */
+static void match_end_viewers(svmatch *m, int winner)
+{
+    const uint8_t msg[MSG_END_SIZE] = { MSG_END, winner };
+
+    if (!m->viewers)
+        return;
+
+    mpshared *b = mpshared_new(msg, sizeof(msg));
+    svviewer *v = m->viewers;
+
+    m->viewers = NULL;
+
+    for (svviewer *next; v; v = next) {
+        next = v->next;
+        v->match = NULL;
+        v->next = v->prev = NULL;
+
+        viewer_push(v, b);
+        v->closing = true;
+        viewer_flush(m->worker, v);
+    }
+
+    mpshared_unref(b);
+}
+
+static void match_free(svmatch *m)
+{
+    svworker *w = m->worker;
+
+    match_end_viewers(m, MP_NONE);
+    mpwheel_del(&w->wheel, &m->timer);
+
+    if (m->prev)
+        m->prev->next = m->next;
+    else
+        w->live = m->next;
+
+    if (m->next)
+        m->next->prev = m->prev;
+
+    if (m->keyframe)
+        mpshared_unref(m->keyframe);
+
+    w->active--;
+    free(m);
+}
+
+/**
+ * End the match once at most one player is left, sending the winner to
+ * every player. Returns true if the match has ended.
+ */
+static bool match_end(svmatch *m)
+{
+    int alive = 0;
+    int winner = MP_NONE;
+
+    for (int i = 0; i < m->players; ++i) {
+        if (m->state[i].running) {
+            alive++;
+            winner = i;
+        }
+    }
+
+    if (alive > 1)
+        return false;
+
+    const uint8_t msg[MSG_END_SIZE] = { MSG_END, alive ? winner : MP_NONE };
+    svconn *conn[MP_MAX_PLAYERS];
+
+    m->over = true;
+    mpwheel_del(&m->worker->wheel, &m->timer);
+    match_end_viewers(m, msg[1]);
+    memcpy(conn, m->conn, sizeof(conn));
+
+    for (int i = 0; i < m->players; ++i) {
+        if (conn[i]) {
+            conn_send(conn[i], msg, sizeof(msg));
+            conn[i]->closing = true;
+        }
+    }
+
+    /* The match is freed once its last connection closes */
+    const int players = m->players;
+    svworker *w = m->worker;
+
+    for (int i = 0; i < players; ++i) {
+        if (conn[i])
+            conn_flush(w, conn[i]);
+    }
+
+    return true;
+}
+
+/**
+ * Remove a closed connection from its match. The player forfeits if they
+ * were still playing.
+ */
+static void match_detach(svmatch *m, svconn *c)
+{
+    m->conn[c->seat] = NULL;
+    m->state[c->seat].running = false;
+    m->conns--;
+
+    if (!m->conns) {
+        match_free(m);
+        return;
+    }
+
+    /* The remaining players are told at the next tick if this ended it */
+}
+
+/**
+ * Run every frame which is due, then schedule the next. A match which has
+ * fallen far behind skips ahead rather than running many frames at once.
+ */
+static void match_tick(void *data)
+{
+    svmatch *m = data;
+    svworker *w = m->worker;
+    const uint64_t now = sv_now();
+
+    uint64_t due = (now - m->start) / SV_FRAME_NS + 1;
+
+    if (due - m->frames > SV_CATCHUP) {
+        m->start += (due - m->frames - SV_CATCHUP) * SV_FRAME_NS;
+        due = m->frames + SV_CATCHUP;
+    }
+
+    hist_record(&w->late, now - (m->start + m->frames * SV_FRAME_NS));
+
+    while (m->frames < due)
+        match_frame(m);
+
+    match_broadcast(m);
+    hist_record(&w->tick, sv_now() - now);
+
+    if (match_end(m))
+        return;
+
+    svconn *conn[MP_MAX_PLAYERS];
+    const int players = m->players;
+    memcpy(conn, m->conn, sizeof(conn));
+
+    mpwheel_add(&w->wheel, &m->timer, sv_tick(m->start + m->frames * SV_FRAME_NS));
+
+    /* Flushing may close connections and free the match, so is done last */
+    for (int i = 0; i < players; ++i) {
+        if (conn[i])
+            conn_flush(w, conn[i]);
+    }
+}
+
+/**
+ * Take ownership of a match formed in the lobby and start it.
+ */
+static void match_start(svworker *w, svmatch *m)
+{
+    uint8_t msg[MSG_START_SIZE];
+    const uint32_t seed = mptet_random(&m->rng);
+
+    m->worker = w;
+    m->start = sv_now();
+    m->frames = 0;
+    m->over = false;
+    m->conns = m->players;
+    m->keyframe = NULL;
+    m->viewers = NULL;
+    mpspec_zero(&m->view, m->players);
+    mptimer_init(&m->timer, match_tick, m);
+
+    m->prev = NULL;
+    m->next = w->live;
+    if (w->live)
+        w->live->prev = m;
+    w->live = m;
+
+    w->active++;
+    w->matches++;
+
+    for (int i = 0; i < m->players; ++i) {
+        mpstate *ms = &m->state[i];
+
+        /* Every player receives the same pieces */
+        mpstate_init(ms);
+        mpstate_seed(ms, seed);
+        ms->goal = 0;
+        mptet_set_random_block(ms);
+
+        if (w->dataset)
+            mpdataset_attach(ms, w->dataset);
+
+        memset(m->sent[i], 0, MSG_FRAME_SIZE);
+        mpspec_set(&m->view, i, ms);
+
+        svconn *c = m->conn[i];
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->sock.fd, &ev);
+
+        msg[0] = MSG_START;
+        msg[1] = i;
+        msg[2] = m->players;
+        msg[3] = 0;
+        mpmsg_put32(msg + 4, seed);
+        conn_send(c, msg, sizeof(msg));
+    }
+
+    mpwheel_add(&w->wheel, &m->timer, sv_tick(m->start));
+}
+
+/**
+ * Turn a connection from the lobby into a spectator of one of this worker's
+ * matches, starting with a keyframe. One asking for a match which has
+ * already ended is sent MSG_END with no winner.
+ */
+static void worker_watch(svworker *w, svconn *c)
+{
+    svmatch *m = w->live;
+
+    while (m && (m->id != c->watch || m->over))
+        m = m->next;
+
+    svviewer *v = calloc(1, sizeof(*v));
+
+    if (!v) {
+        fprintf(stderr, "Failed to allocate spectator\n");
+        exit(-1);
+    }
+
+    v->sock.fd = c->sock.fd;
+    v->sock.kind = SV_Viewer;
+    free(c);
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = v };
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, v->sock.fd, &ev);
+    w->viewers++;
+
+    if (!m) {
+        const uint8_t msg[MSG_END_SIZE] = { MSG_END, MP_NONE };
+        mpshared *b = mpshared_new(msg, sizeof(msg));
+
+        viewer_push(v, b);
+        mpshared_unref(b);
+        v->closing = true;
+        viewer_flush(w, v);
+        return;
+    }
+
+    v->match = m;
+    v->next = m->viewers;
+    if (m->viewers)
+        m->viewers->prev = v;
+    m->viewers = v;
+
+    viewer_push(v, match_keyframe(m));
+    viewer_flush(w, v);
+}
+
+static void worker_message(svconn *c, const uint8_t *msg)
+{
+    if (msg[0] != MSG_INPUT)
+        return;
+
+    c->held = msg[1];
+    c->tapped |= msg[1];
+}
+
+/**
+ * Spectators have nothing to say, so anything they send is discarded until
+ * they close the connection.
+ */
+static void worker_viewer_event(svworker *w, svviewer *v, uint32_t events)
+{
+    uint8_t buf[256];
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        viewer_close(w, v);
+        return;
+    }
+
+    if (events & EPOLLIN) {
+        ssize_t n;
+
+        while ((n = read(v->sock.fd, buf, sizeof(buf))) > 0)
+            ;
+
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            viewer_close(w, v);
+            return;
+        }
+    }
+
+    if (events & EPOLLOUT)
+        viewer_flush(w, v);
+}
+
+static void worker_event(svworker *w, svconn *c, uint32_t events)
+{
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(c);
+        return;
+    }
+
+    if (events & EPOLLIN && !conn_read(c, worker_message)) {
+        conn_close(c);
+        return;
+    }
+
+    if (events & EPOLLOUT)
+        conn_flush(w, c);
+}
+
+static void worker_stats(svworker *w, int id, FILE *fd)
+{
+    fprintf(fd, "worker %d: %d active, %" PRIu64 " matches, %" PRIu64 " frames, "
+            "%d spectators, %" PRIu64 " spectated (us):\n",
+            id, w->active, w->matches, w->frames, w->viewers, w->spectated);
+    hist_print(&w->tick, "tick", 1e-3, fd);
+    hist_print(&w->late, "late", 1e-3, fd);
+    hist_print(&w->fanout, "fanout", 1e-3, fd);
+}
+
+static void *worker_run(void *arg)
+{
+    svworker *w = arg;
+    struct epoll_event events[SV_EVENTS];
+
+    while (atomic_load(&running)) {
+        const uint64_t now = sv_now();
+        const uint64_t next = mpwheel_next(&w->wheel);
+
+        int timeout = 100;
+        if (next != UINT64_MAX) {
+            const uint64_t at = next * SV_TICK_NS;
+            timeout = at <= now ? 0 : (at - now + 999999) / 1000000;
+        }
+
+        const int n = epoll_wait(w->epfd, events, SV_EVENTS, timeout);
+
+        for (int i = 0; i < n; ++i) {
+            svsock *sock = events[i].data.ptr;
+
+            if (sock && sock->kind == SV_Closed)
+                continue;
+
+            if (sock && sock->kind == SV_Viewer) {
+                worker_viewer_event(w, (svviewer *) sock, events[i].events);
+                continue;
+            }
+
+            if (sock) {
+                worker_event(w, (svconn *) sock, events[i].events);
+                continue;
+            }
+
+            /* New matches and spectators from the lobby */
+            uint64_t count;
+            if (read(w->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                perror("read");
+
+            pthread_mutex_lock(&w->lock);
+            svmatch *m = w->inbox;
+            svconn *c = w->watchers;
+            w->inbox = NULL;
+            w->watchers = NULL;
+            pthread_mutex_unlock(&w->lock);
+
+            while (m) {
+                svmatch *next = m->next;
+                match_start(w, m);
+                m = next;
+            }
+
+            while (c) {
+                svconn *next = c->next;
+                worker_watch(w, c);
+                c = next;
+            }
+        }
+
+        mpwheel_advance(&w->wheel, sv_now() / SV_TICK_NS);
+
+        while (w->closed) {
+            svviewer *v = w->closed;
+            w->closed = v->next;
+            free(v);
+        }
+    }
+
+    return NULL;
+}
+
+static void worker_init(svworker *w, mpdataset *d)
+{
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (w->epfd < 0 || w->wakefd < 0) {
+        perror("epoll");
+        exit(-1);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev);
+
+    pthread_mutex_init(&w->lock, NULL);
+    w->inbox = NULL;
+    w->watchers = NULL;
+    w->live = NULL;
+    w->closed = NULL;
+    mpwheel_init(&w->wheel, sv_now() / SV_TICK_NS);
+    hist_zero(&w->tick);
+    hist_zero(&w->late);
+    hist_zero(&w->fanout);
+    w->active = 0;
+    w->viewers = 0;
+    w->matches = 0;
+    w->frames = 0;
+    w->spectated = 0;
+    w->dataset = NULL;
+
+    if (d) {
+        w->dataset = malloc(sizeof(mpdataset_stream));
+
+        if (!w->dataset) {
+            fprintf(stderr, "Failed to allocate dataset stream\n");
+            exit(-1);
+        }
+
+        mpdataset_stream_init(w->dataset, d, NULL, NULL);
+    }
+
+    if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+        fprintf(stderr, "Failed to create worker thread\n");
+        exit(-1);
+    }
+}
+
+/* Clients waiting in the lobby for each size of match */
+typedef struct {
+    int epfd;
+    svconn *waiting[MP_MAX_PLAYERS + 1][MP_MAX_PLAYERS];
+    int count[MP_MAX_PLAYERS + 1];
+
+    /* Matches formed and spectators which have asked to watch, which are not
+     * yet handed to a worker */
+    svmatch *formed;
+    svconn *watching;
+
+    /* Id of the last match handed to a worker, which also chooses the
+     * worker, so that spectators can be sent to the right one */
+    uint32_t ids;
+
+    svworker *workers;
+    int nworkers;
+
+    /* Seeds matches */
+    mpstate rng;
+} svlobby;
+
+static svlobby lobby;
+
+static void lobby_remove(svconn *c)
+{
+    if (!c->players)
+        return;
+
+    svconn **queue = lobby.waiting[c->players];
+    int *n = &lobby.count[c->players];
+
+    for (int i = 0; i < *n; ++i) {
+        if (queue[i] == c) {
+            queue[i] = queue[--*n];
+            break;
+        }
+    }
+
+    c->players = 0;
+}
+
+/**
+ * Form a match from a full queue.
+ */
+static void lobby_match(int players)
+{
+    svmatch *m = calloc(1, sizeof(*m));
+
+    if (!m) {
+        fprintf(stderr, "Failed to allocate match\n");
+        exit(-1);
+    }
+
+    m->players = players;
+    mpstate_seed(&m->rng, ((uint64_t) mptet_random(&lobby.rng) << 32) | sv_now());
+
+    for (int i = 0; i < players; ++i) {
+        svconn *c = lobby.waiting[players][i];
+
+        epoll_ctl(lobby.epfd, EPOLL_CTL_DEL, c->sock.fd, NULL);
+        c->players = 0;
+        c->match = m;
+        c->seat = i;
+        m->conn[i] = c;
+    }
+
+    lobby.count[players] = 0;
+
+    m->next = lobby.formed;
+    lobby.formed = m;
+}
+
+static void lobby_wake(svworker *w)
+{
+    const uint64_t one = 1;
+    if (write(w->wakefd, &one, sizeof(one)) < 0)
+        perror("write");
+}
+
+/**
+ * Hand each match formed and spectator joined while handling the last batch
+ * of events to a worker. This waits until the batch is done, since it may
+ * still hold events for their connections which only the worker may now
+ * handle. Matches go to each worker in turn.
+ */
+static void lobby_dispatch(void)
+{
+    while (lobby.formed) {
+        svmatch *m = lobby.formed;
+        lobby.formed = m->next;
+
+        m->id = ++lobby.ids;
+        svworker *w = &lobby.workers[m->id % lobby.nworkers];
+
+        pthread_mutex_lock(&w->lock);
+        m->next = w->inbox;
+        w->inbox = m;
+        pthread_mutex_unlock(&w->lock);
+
+        lobby_wake(w);
+    }
+
+    while (lobby.watching) {
+        svconn *c = lobby.watching;
+        lobby.watching = c->next;
+
+        svworker *w = &lobby.workers[c->watch % lobby.nworkers];
+
+        pthread_mutex_lock(&w->lock);
+        c->next = w->watchers;
+        w->watchers = c;
+        pthread_mutex_unlock(&w->lock);
+
+        lobby_wake(w);
+    }
+}
+
+/**
+ * Send a spectator to the worker owning the match it asked for, or the most
+ * recent match for id 0. One asking for a match which does not exist yet is
+ * disconnected.
+ */
+static void lobby_watch(svconn *c, uint32_t id)
+{
+    if (!id)
+        id = lobby.ids;
+
+    if (!id || id > lobby.ids) {
+        c->closing = true;
+        return;
+    }
+
+    epoll_ctl(lobby.epfd, EPOLL_CTL_DEL, c->sock.fd, NULL);
+    c->watch = id;
+    c->next = lobby.watching;
+    lobby.watching = c;
+}
+
+static void lobby_message(svconn *c, const uint8_t *msg)
+{
+    if (c->players || c->match || c->watch)
+        return;
+
+    if (msg[0] == MSG_WATCH) {
+        lobby_watch(c, mpmsg_get32(msg + 1));
+        return;
+    }
+
+    if (msg[0] != MSG_JOIN)
+        return;
+
+    const int players = msg[1];
+
+    if (players < 2 || players > MP_MAX_PLAYERS)
+        return;
+
+    c->players = players;
+    lobby.waiting[players][lobby.count[players]++] = c;
+
+    if (lobby.count[players] == players)
+        lobby_match(players);
+}
+
+static void lobby_accept(svconn *l)
+{
+    while (true) {
+        const int fd = accept4(l->sock.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                perror("accept");
+            return;
+        }
+
+        /* Messages are small and latency sensitive */
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        svconn *c = conn_new(fd);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+        epoll_ctl(lobby.epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void lobby_listen(int fd, const struct sockaddr *addr, socklen_t len, const char *name)
+{
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, addr, len) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", name, strerror(errno));
+        exit(-1);
+    }
+
+    svconn *l = conn_new(fd);
+    l->sock.kind = SV_Listener;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = l };
+    epoll_ctl(lobby.epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int main(int argc, char **argv)
+{
+    int port = MP_PORT;
+    const char *path = NULL;
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *export = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--port=", 7)) {
+            port = atoi(argv[i] + 7);
+        }
+        else if (!strncmp(argv[i], "--unix=", 7)) {
+            path = argv[i] + 7;
+        }
+        else if (!strncmp(argv[i], "--workers=", 10)) {
+            nworkers = atoi(argv[i] + 10);
+        }
+        else if (!strncmp(argv[i], "--export=", 9)) {
+            export = argv[i] + 9;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+
+    if (nworkers < 1)
+        nworkers = 1;
+
+    /* Every spectator needs a descriptor, so allow as many as possible */
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, sv_stop);
+    signal(SIGTERM, sv_stop);
+    signal(SIGUSR1, sv_stats);
+
+    lobby.epfd = epoll_create1(EPOLL_CLOEXEC);
+    mpstate_init(&lobby.rng);
+
+    if (port) {
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = htonl(INADDR_ANY)
+        };
+
+        lobby_listen(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+                (struct sockaddr *) &addr, sizeof(addr), "tcp");
+    }
+
+    if (path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        unlink(path);
+
+        lobby_listen(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+                (struct sockaddr *) &addr, sizeof(addr), path);
+    }
+
+    mpdataset dataset;
+
+    if (export && !mpdataset_create(&dataset, export, false))
+        exit(-1);
+
+    lobby.nworkers = nworkers;
+    lobby.workers = calloc(nworkers, sizeof(svworker));
+
+    for (int i = 0; i < nworkers; ++i)
+        worker_init(&lobby.workers[i], export ? &dataset : NULL);
+
+    struct epoll_event events[SV_EVENTS];
+
+    while (atomic_load(&running)) {
+        const int n = epoll_wait(lobby.epfd, events, SV_EVENTS, 100);
+
+        for (int i = 0; i < n; ++i) {
+            svconn *c = events[i].data.ptr;
+
+            if (c->sock.kind == SV_Listener) {
+                lobby_accept(c);
+                continue;
+            }
+
+            /* Joined a match or started watching earlier in this batch */
+            if (c->match || c->watch)
+                continue;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP) ||
+                    !conn_read(c, lobby_message) || c->closing) {
+                /* Handed to a worker while reading, which will see the same
+                 * error itself */
+                if (c->match || c->watch)
+                    continue;
+
+                lobby_remove(c);
+                epoll_ctl(lobby.epfd, EPOLL_CTL_DEL, c->sock.fd, NULL);
+                close(c->sock.fd);
+                free(c);
+            }
+        }
+
+        lobby_dispatch();
+
+        if (stats_requested) {
+            stats_requested = 0;
+
+            /* Read without locking, so values may be slightly inconsistent */
+            for (int i = 0; i < nworkers; ++i)
+                worker_stats(&lobby.workers[i], i, stderr);
+        }
+    }
+
+    for (int i = 0; i < nworkers; ++i) {
+        const uint64_t one = 1;
+        if (write(lobby.workers[i].wakefd, &one, sizeof(one)) < 0)
+            perror("write");
+        pthread_join(lobby.workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < nworkers; ++i)
+        worker_stats(&lobby.workers[i], i, stderr);
+
+    if (export) {
+        for (int i = 0; i < nworkers; ++i)
+            mpdataset_stream_free(lobby.workers[i].dataset);
+
+        const uint64_t records = atomic_load(&dataset.count);
+
+        if (!mpdataset_finish(&dataset))
+            fprintf(stderr, "Failed to write dataset %s\n", export);
+        else
+            fprintf(stderr, "%" PRIu64 " placements written to %s\n", records, export);
+    }
+
+    if (path)
+        unlink(path);
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+/**
+ * spectate.c
+ *
+ * Implements delta encoding of the spectator stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spectate.h"
+
+/* Size of each part, in the order their flags are numbered */
+static const uint8_t mpspec_part_size[] = {
+    MPSPEC_FIELD_SIZE, MPSPEC_BLOCK_SIZE, MPSPEC_HOLD_SIZE,
+    MPSPEC_NEXT_SIZE, MPSPEC_GARBAGE_SIZE, MPSPEC_RUNNING_SIZE
+};
+
+#define MPSPEC_PARTS (sizeof(mpspec_part_size) / sizeof(mpspec_part_size[0]))
+
+void mpspec_zero(mpspec *sp, int players)
+{
+    sp->frame = 0;
+    sp->players = players;
+    memset(sp->seat, 0, sizeof(sp->seat));
+}
+
+void mpspec_set(mpspec *sp, int seat, const mpstate *ms)
+{
+    uint8_t msg[MSG_FRAME_SIZE];
+
+    mpmsg_frame(msg, seat, ms);
+    memcpy(sp->seat[seat], msg + 6, MPSPEC_SEAT_SIZE);
+}
+
+/**
+ * Encode one seat, returning the bytes written or 0 if nothing changed. A
+ * keyframe compares against zeroes but still sends every part, so that a
+ * part equal to zero is distinguished from one that is unchanged.
+ */
+static size_t mpspec_encode_seat(uint8_t *m, int seat, const uint8_t *prev,
+        const uint8_t *cur, bool keyframe)
+{
+    static const uint8_t zero[MPSPEC_SEAT_SIZE];
+    uint8_t *p = m + 2;
+    int flags = 0;
+
+    if (!prev)
+        prev = zero;
+
+    /* The field is sent as the changed bytes of its XOR, as a lock changes
+     * only a few rows and most frames change none */
+    uint32_t mask = 0;
+    for (int i = 0; i < MPSPEC_FIELD_SIZE; ++i) {
+        if (cur[i] != prev[i])
+            mask |= 1u << i;
+    }
+
+    if (mask || keyframe) {
+        flags |= MPSPEC_FIELD;
+        mpmsg_put32(p, mask);
+        p += 4;
+
+        for (int i = 0; i < MPSPEC_FIELD_SIZE; ++i) {
+            if (mask & (1u << i))
+                *p++ = cur[i] ^ prev[i];
+        }
+    }
+
+    /* Remaining parts are small enough to send whole */
+    int offset = MPSPEC_FIELD_SIZE;
+
+    for (size_t k = 1; k < MPSPEC_PARTS; ++k) {
+        const int size = mpspec_part_size[k];
+
+        if (keyframe || memcmp(cur + offset, prev + offset, size)) {
+            flags |= 1 << k;
+            memcpy(p, cur + offset, size);
+            p += size;
+        }
+
+        offset += size;
+    }
+
+    if (!flags)
+        return 0;
+
+    m[0] = seat;
+    m[1] = flags;
+    return p - m;
+}
+
+size_t mpspec_encode(uint8_t *m, const mpspec *prev, const mpspec *cur)
+{
+    size_t size = 8;
+
+    m[0] = prev ? MSG_DELTA : MSG_KEYFRAME;
+    mpmsg_put32(m + 3, cur->frame);
+    m[7] = cur->players;
+
+    for (int seat = 0; seat < cur->players; ++seat) {
+        size += mpspec_encode_seat(m + size, seat, prev ? prev->seat[seat] : NULL,
+                cur->seat[seat], !prev);
+    }
+
+    m[1] = size;
+    m[2] = size >> 8;
+    return size;
+}
+
+bool mpspec_apply(mpspec *sp, const uint8_t *m, size_t size)
+{
+    if (size < 8 || size != (size_t) (m[1] | m[2] << 8) || m[7] > MP_MAX_PLAYERS)
+        return false;
+
+    if (m[0] == MSG_KEYFRAME)
+        mpspec_zero(sp, m[7]);
+    else if (m[0] != MSG_DELTA || m[7] != sp->players)
+        return false;
+
+    sp->frame = mpmsg_get32(m + 3);
+
+    const uint8_t *p = m + 8;
+    const uint8_t *end = m + size;
+
+    while (p < end) {
+        if (end - p < 2 || p[0] >= sp->players)
+            return false;
+
+        uint8_t *seat = sp->seat[p[0]];
+        const int flags = p[1];
+        p += 2;
+
+        if (flags & MPSPEC_FIELD) {
+            if (end - p < 4)
+                return false;
+
+            const uint32_t mask = mpmsg_get32(p);
+            p += 4;
+
+            for (int i = 0; i < MPSPEC_FIELD_SIZE; ++i) {
+                if (!(mask & (1u << i)))
+                    continue;
+
+                if (p == end)
+                    return false;
+
+                seat[i] ^= *p++;
+            }
+        }
+
+        int offset = MPSPEC_FIELD_SIZE;
+
+        for (size_t k = 1; k < MPSPEC_PARTS; ++k) {
+            const int part = mpspec_part_size[k];
+
+            if (flags & (1 << k)) {
+                if (end - p < part)
+                    return false;
+
+                memcpy(seat + offset, p, part);
+                p += part;
+            }
+
+            offset += part;
+        }
+    }
+
+    return true;
+}
+
+mpshared *mpshared_new(const uint8_t *data, size_t size)
+{
+    mpshared *b = malloc(sizeof(*b) + size);
+
+    if (!b) {
+        fprintf(stderr, "Failed to allocate shared buffer\n");
+        exit(-1);
+    }
+
+    b->refs = 1;
+    b->size = size;
+    memcpy(b->data, data, size);
+    return b;
+}
+
+void mpshared_unref(mpshared *b)
+{
+    if (--b->refs == 0)
+        free(b);
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+/**
+ * spectate.h
+ *
+ * Implements the stream sent to spectators of a versus match.
+ *
+ * Rather than every seat being sent each time it changes, each tick of a
+ * match is encoded once as a delta against the previous tick, and the same
+ * bytes are then written to every spectator. A spectator joining late is
+ * first sent a keyframe, which is a delta against an empty match.
+ *
+ * Both MSG_KEYFRAME and MSG_DELTA are laid out as:
+ *
+ *   0   type
+ *   1   size of the whole message, 2 bytes
+ *   3   match frame number, 4 bytes
+ *   7   number of players
+ *   8   an entry for each seat which changed
+ *
+ * Each entry is a seat, a byte of MPSPEC_* flags for the parts which
+ * changed, and then each of those parts in order:
+ *
+ *   field      4 byte mask of which of the 28 field bytes changed, followed
+ *              by the XOR of each of those bytes with its previous value
+ *   block      piece id, rotation, x and y
+ *   hold       hold piece id or MP_NONE
+ *   next       next 3 pieces
+ *   garbage    pending garbage lines
+ *   running    1 if still playing
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mptet.h"
+#include "proto.h"
+
+/* Bytes of each part of a seat, which follow the field in this order */
+enum {
+    MPSPEC_FIELD_SIZE = 28,
+    MPSPEC_BLOCK_SIZE = 4,
+    MPSPEC_HOLD_SIZE = 1,
+    MPSPEC_NEXT_SIZE = 3,
+    MPSPEC_GARBAGE_SIZE = 1,
+    MPSPEC_RUNNING_SIZE = 1,
+    MPSPEC_SEAT_SIZE = 38
+};
+
+enum {
+    MPSPEC_FIELD = 1 << 0,
+    MPSPEC_BLOCK = 1 << 1,
+    MPSPEC_HOLD = 1 << 2,
+    MPSPEC_NEXT = 1 << 3,
+    MPSPEC_GARBAGE = 1 << 4,
+    MPSPEC_RUNNING = 1 << 5,
+    MPSPEC_ALL = (1 << 6) - 1
+};
+
+/* Largest possible message, a keyframe in which every byte is set */
+#define MPSPEC_MAX_SIZE (8 + MP_MAX_PLAYERS * (2 + 4 + MPSPEC_SEAT_SIZE))
+
+/**
+ * A match as seen by spectators. Each seat is held as the part of MSG_FRAME
+ * following the frame number.
+ */
+typedef struct {
+    uint32_t frame;
+    int players;
+    uint8_t seat[MP_MAX_PLAYERS][MPSPEC_SEAT_SIZE];
+} mpspec;
+
+/* Reset to an empty match */
+void mpspec_zero(mpspec *sp, int players);
+
+/* Store the state of one seat */
+void mpspec_set(mpspec *sp, int seat, const mpstate *ms);
+
+/**
+ * Encode the changes from prev to cur, or all of cur as a keyframe if prev
+ * is NULL. Returns the size of the message, which is only a header if
+ * nothing changed.
+ */
+size_t mpspec_encode(uint8_t *m, const mpspec *prev, const mpspec *cur);
+
+/**
+ * Apply a received MSG_KEYFRAME or MSG_DELTA. Returns false if the message
+ * is malformed, or is a delta for a different number of players.
+ */
+bool mpspec_apply(mpspec *sp, const uint8_t *m, size_t size);
+
+/**
+ * A message shared between every spectator it is queued for, which is freed
+ * once the last of them releases it.
+ */
+typedef struct {
+    int refs;
+    uint32_t size;
+    uint8_t data[];
+} mpshared;
+
+/* Copy a message into a new buffer holding a single reference */
+mpshared *mpshared_new(const uint8_t *data, size_t size);
+
+static inline mpshared *mpshared_ref(mpshared *b)
+{
+    b->refs++;
+    return b;
+}
+
+void mpshared_unref(mpshared *b);
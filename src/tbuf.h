@@ -0,0 +1,73 @@
+#pragma once
+
+/**
+ * tbuf.h
+ *
+ * Implements a lock-free triple buffer of game state snapshots, used to pass
+ * state from the simulation thread to the render thread.
+ *
+ * The writer and reader each own one slot, and the third is exchanged
+ * atomically between them. Neither side ever waits on the other, and the
+ * reader always sees the most recently published snapshot in full.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "mptet.h"
+
+/* Set on the shared index when it holds a snapshot the reader has not seen */
+#define TBUF_FRESH 4
+
+typedef struct {
+    mpstate slot[3];
+
+    /* Index of the shared slot, along with TBUF_FRESH */
+    atomic_int middle;
+
+    /* Slot currently owned by the writer */
+    int back;
+
+    /* Slot currently owned by the reader */
+    int front;
+} mptbuf;
+
+static inline void mptbuf_init(mptbuf *tb)
+{
+    tb->front = 0;
+    atomic_init(&tb->middle, 1);
+    tb->back = 2;
+}
+
+/* Return the slot the writer should fill before publishing */
+static inline mpstate *mptbuf_back(mptbuf *tb)
+{
+    return &tb->slot[tb->back];
+}
+
+/* Make the back slot visible to the reader */
+static inline void mptbuf_publish(mptbuf *tb)
+{
+    tb->back = atomic_exchange_explicit(&tb->middle, tb->back | TBUF_FRESH,
+                    memory_order_acq_rel) & 3;
+}
+
+/**
+ * Acquire the most recently published snapshot, if any has been published
+ * since the last call. Returns false if the front slot is unchanged.
+ */
+static inline bool mptbuf_consume(mptbuf *tb)
+{
+    if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed) & TBUF_FRESH))
+        return false;
+
+    tb->front = atomic_exchange_explicit(&tb->middle, tb->front,
+                    memory_order_acq_rel) & 3;
+    return true;
+}
+
+/* Return the slot the reader should render from */
+static inline mpstate *mptbuf_front(mptbuf *tb)
+{
+    return &tb->slot[tb->front];
+}
@@ -0,0 +1,440 @@
+/**
+ * term.h
+ *
+ * Draws the game on an ANSI/VT terminal, for playing over SSH on machines
+ * without a display server.
+ *
+ * Only the cells which changed since the last frame are emitted, and each
+ * frame is sent with a single write(), so a typical frame is a few hundred
+ * bytes.
+ *
+ * Terminals do not report key releases, so every key received is treated as
+ * a separate tap. Holding a key repeats it at the terminal's repeat rate.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "damage.h"
+#include "layout.h"
+#include "raster.h"
+
+#if defined(MP_THREADED)
+#   include <poll.h>
+#   include <pthread.h>
+#   include "input.h"
+#endif
+
+/* Terminal columns per cell, cells are drawn two characters wide so they
+ * are roughly square */
+#define T_CELL_W 2
+
+/* Position of the top-left field cell, 1-based */
+#define T_FIELD_ROW 2
+#define T_FIELD_COL 14
+
+/* Position of the hold piece */
+#define T_HOLD_ROW 2
+#define T_HOLD_COL 3
+
+/* Position of the preview pieces */
+#define T_PREVIEW_ROW 2
+#define T_PREVIEW_COL (T_FIELD_COL + 10 * T_CELL_W + 3)
+
+/* Size of the output buffer, enough for a full redraw */
+#define T_OUT_SIZE 16384
+
+/* How each cell is drawn */
+enum {
+    T_Empty, T_Block, T_Ghost, T_Blank
+};
+
+typedef struct {
+    /* Terminal settings to be restored on exit */
+    struct termios saved;
+
+    /* Escape sequence parser state, kept across reads */
+    int escape;
+
+    /* Pending output for the current frame */
+    char out[T_OUT_SIZE];
+    int len;
+
+    /* Cursor position and drawing style after the pending output, or 0 when
+     * unknown */
+    int row, col;
+    int style;
+
+    /* Drawn style of each hold and preview cell */
+    uint8_t hold[16];
+    uint8_t preview[PREVIEW_NUMBER][16];
+
+    /* Changes since the last frame */
+    mpdamage damage;
+#if defined(MP_THREADED)
+    pthread_t input_thread;
+    atomic_bool input_running;
+    mpqueue input;
+#endif
+} mpgfx;
+
+/* The terminal that was modified, so it can be restored on any exit */
+static mpgfx *term_active;
+
+/* Set when the terminal is resized, as it may have been redrawn */
+static volatile sig_atomic_t term_resized;
+
+static void term_resize_handler(int sig)
+{
+    (void) sig;
+    term_resized = 1;
+}
+
+static void term_restore(void)
+{
+    static const char reset[] = "\x1b[0m\x1b[?25h";
+
+    if (!term_active)
+        return;
+
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &term_active->saved);
+
+    if (write(STDOUT_FILENO, reset, sizeof(reset) - 1) < 0) {
+        /* Nothing more can be done */
+    }
+
+    term_active = NULL;
+}
+
+#if defined(MP_THREADED)
+static void *mpgfx_input_thread(void *arg);
+#endif
+
+void mpgfx_init(mpgfx *mx, int *argc, char ***argv)
+{
+    (void) argc;
+    (void) argv;
+
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "The terminal frontend must be run on a terminal\n");
+        exit(-1);
+    }
+
+    if (tcgetattr(STDIN_FILENO, &mx->saved) != 0) {
+        perror("tcgetattr");
+        exit(-1);
+    }
+
+    /* Read keys unbuffered and without echo, and return immediately from
+     * reads when no input is available. Signals are also disabled, so ctrl-c
+     * is read as a key. */
+    struct termios raw = mx->saved;
+    cfmakeraw(&raw);
+    raw.c_oflag |= OPOST;
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0) {
+        perror("tcsetattr");
+        exit(-1);
+    }
+
+    term_active = mx;
+    atexit(term_restore);
+    signal(SIGWINCH, term_resize_handler);
+
+    mx->escape = 0;
+    mx->len = 0;
+    mpdamage_init(&mx->damage, 1);
+
+#if defined(MP_THREADED)
+    mpqueue_init(&mx->input);
+    atomic_init(&mx->input_running, true);
+
+    if (pthread_create(&mx->input_thread, NULL, mpgfx_input_thread, mx) != 0) {
+        fprintf(stderr, "Failed to create input thread\n");
+        exit(-1);
+    }
+#endif
+}
+
+/**
+ * Decode the next byte of input, returning the key it completes or -1.
+ * Arrow keys are sent as ESC [ x, or ESC O x in application mode.
+ */
+static int term_key(mpgfx *mx, unsigned char c)
+{
+    if (mx->escape == 1) {
+        mx->escape = (c == '[' || c == 'O') ? 2 : 0;
+        return -1;
+    }
+
+    if (mx->escape == 2) {
+        mx->escape = 0;
+
+        switch (c) {
+        case 'D':
+            return K_Left;
+        case 'C':
+            return K_Right;
+        case 'B':
+            return K_Down;
+        default:
+            return -1;
+        }
+    }
+
+    switch (c) {
+    case 0x1b:
+        mx->escape = 1;
+        return -1;
+    case 'z': case 'Z':
+        return K_z;
+    case 'x': case 'X':
+        return K_x;
+    case 'c': case 'C':
+        return K_c;
+    case ' ':
+        return K_Space;
+    case 'q': case 'Q': case 0x03:
+        return K_q;
+    default:
+        return -1;
+    }
+}
+
+#if defined(MP_THREADED)
+static void *mpgfx_input_thread(void *arg)
+{
+    mpgfx *mx = arg;
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    unsigned char buf[64];
+
+    while (atomic_load(&mx->input_running)) {
+        const ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        const uint64_t now = ts_get_current_time();
+
+        for (ssize_t i = 0; i < n; ++i) {
+            const int index = term_key(mx, buf[i]);
+
+            if (index != -1) {
+                mpqueue_push(&mx->input, now, index, true);
+                mpqueue_push(&mx->input, now, index, false);
+            }
+        }
+
+        /* Wake periodically to check if we should stop */
+        if (n <= 0)
+            poll(&pfd, 1, 50);
+    }
+
+    return NULL;
+}
+
+void mpgfx_update(mpstate *ms, mpgfx *mx)
+{
+    mpqueue_drain(&mx->input, ms);
+}
+
+void mpgfx_poll(mpgfx *mx)
+{
+    (void) mx;
+}
+#else
+void mpgfx_update(mpstate *ms, mpgfx *mx)
+{
+    unsigned char buf[64];
+    bool seen[10] = { false };
+    ssize_t n;
+
+    while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; ++i) {
+            const int index = term_key(mx, buf[i]);
+
+            if (index != -1)
+                seen[index] = true;
+        }
+    }
+
+    /* Each key received is pressed for a single frame */
+    for (int i = 0; i < 10; ++i)
+        ms->keystate[i] = seen[i];
+}
+#endif
+
+void mpgfx_free(mpgfx *mx)
+{
+#if defined(MP_THREADED)
+    atomic_store(&mx->input_running, false);
+    pthread_join(mx->input_thread, NULL);
+#endif
+
+    (void) mx;
+    term_restore();
+}
+
+static void term_puts(mpgfx *mx, const char *s, int n)
+{
+    memcpy(mx->out + mx->len, s, n);
+    mx->len += n;
+}
+
+/**
+ * Move the cursor, unless it is already in place.
+ */
+static void term_move(mpgfx *mx, int row, int col)
+{
+    if (mx->row == row && mx->col == col)
+        return;
+
+    mx->len += sprintf(mx->out + mx->len, "\x1b[%d;%dH", row, col);
+    mx->row = row;
+    mx->col = col;
+}
+
+/**
+ * Draw a cell in the given style at the cursor.
+ */
+static void term_cell(mpgfx *mx, int style)
+{
+    static const char *sgr[] = {
+        [T_Empty] = "\x1b[0;90m", [T_Block] = "\x1b[0;44m",
+        [T_Ghost] = "\x1b[0;34m", [T_Blank] = "\x1b[0m"
+    };
+
+    static const char *glyph[] = {
+        [T_Empty] = " .", [T_Block] = "  ", [T_Ghost] = "[]", [T_Blank] = "  "
+    };
+
+    if (mx->style != style) {
+        term_puts(mx, sgr[style], strlen(sgr[style]));
+        mx->style = style;
+    }
+
+    term_puts(mx, glyph[style], T_CELL_W);
+    mx->col += T_CELL_W;
+}
+
+static int term_field_style(const mpraster *r, int i)
+{
+    static const int styles[R_Classes] = {
+        [R_Field] = T_Block, [R_Block] = T_Block,
+        [R_Ghost] = T_Ghost, [R_Empty] = T_Empty
+    };
+
+    return styles[mpraster_cell(r, i)];
+}
+
+/**
+ * Draw the cells of a 4x4 piece preview which differ from those drawn.
+ */
+static void term_piece(mpgfx *mx, uint8_t *drawn, int id, int row, int col, bool full)
+{
+    const uint64_t block = id == -1 ? 0 : mptetd_block[id][0];
+
+    for (int y = 0; y < 4; ++y) {
+        for (int x = 0; x < 4; ++x) {
+            const int style = block & (1 << ((4 - y) * 10 - x - 1)) ? T_Block : T_Blank;
+
+            if (full || drawn[y * 4 + x] != style) {
+                term_move(mx, row + y, col + x * T_CELL_W);
+                term_cell(mx, style);
+                drawn[y * 4 + x] = style;
+            }
+        }
+    }
+}
+
+/**
+ * Draw the field border and labels, which never change.
+ */
+static void term_frame(mpgfx *mx)
+{
+    term_puts(mx, "\x1b[0m\x1b[?25l\x1b[2J", 14);
+    mx->style = T_Blank;
+
+    for (int y = 0; y < 22; ++y) {
+        mx->len += sprintf(mx->out + mx->len, "\x1b[%d;%dH|\x1b[%d;%dH|",
+                T_FIELD_ROW + y, T_FIELD_COL - 1,
+                T_FIELD_ROW + y, T_FIELD_COL + 10 * T_CELL_W);
+    }
+
+    mx->len += sprintf(mx->out + mx->len, "\x1b[%d;%dH+", T_FIELD_ROW + 22, T_FIELD_COL - 1);
+    for (int x = 0; x < 10 * T_CELL_W; ++x)
+        term_puts(mx, "-", 1);
+    term_puts(mx, "+", 1);
+
+    mx->row = mx->col = 0;
+}
+
+/**
+ * Emit the changed cells and send the frame in a single write.
+ */
+void mpgfx_render(mpstate *ms, mpgfx *mx)
+{
+    mpdamage_list dl;
+
+    if (term_resized) {
+        term_resized = 0;
+        mpdamage_reset(&mx->damage);
+    }
+
+    if (!mpdamage_compute(&mx->damage, ms, &dl))
+        return;
+
+    mx->len = 0;
+
+    mpraster r;
+    mpraster_classify(&r, ms);
+
+    if (dl.full) {
+        term_frame(mx);
+
+        for (int i = 219; i >= 0; --i) {
+            term_move(mx, T_FIELD_ROW + 21 - i / 10, T_FIELD_COL + (9 - i % 10) * T_CELL_W);
+            term_cell(mx, term_field_style(&r, i));
+        }
+    }
+    else {
+        /* Cells are listed from the bottom-right, so walk them backwards to
+         * draw left to right and avoid moving the cursor between neighbours */
+        for (int j = dl.count - 1; j >= 0; --j) {
+            const int i = dl.cell[j];
+
+            term_move(mx, T_FIELD_ROW + 21 - i / 10, T_FIELD_COL + (9 - i % 10) * T_CELL_W);
+            term_cell(mx, term_field_style(&r, i));
+        }
+    }
+
+    if (dl.full || dl.hold)
+        term_piece(mx, mx->hold, ms->hold, T_HOLD_ROW, T_HOLD_COL, dl.full);
+
+    if (dl.full || dl.preview) {
+        for (int i = 0; i < PREVIEW_NUMBER; ++i) {
+            term_piece(mx, mx->preview[i], ms->bag[(ms->bhead + i) % 14],
+                    T_PREVIEW_ROW + 4 * i, T_PREVIEW_COL, dl.full);
+        }
+    }
+
+    /* Leave the cursor below the board, where any other output will go */
+    term_move(mx, T_FIELD_ROW + 23, 1);
+    term_puts(mx, "\x1b[0m", 4);
+    mx->style = T_Blank;
+
+    for (int off = 0; off < mx->len;) {
+        const ssize_t n = write(STDOUT_FILENO, mx->out + off, mx->len - off);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        off += n;
+    }
+}
@@ -1,11 +1,31 @@
 /* Test tetris functions for accuracy */
 
 #include <assert.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "archive.h"
+#include "bench.h"
+#include "damage.h"
+#include "dataset.h"
+#include "env.h"
+#include "eval.h"
+#include "fb.h"
+#include "hist.h"
+#include "layout.h"
 #include "mem256.h"
 #include "mptet.h"
+#include "pc.h"
+#include "raster.h"
+#include "replay.h"
+#include "rollback.h"
+#include "spectate.h"
+#include "wheel.h"
 
 mpstate ms;
 int errors = 0;
@@ -153,6 +173,26 @@ void test2(void)
             "          "
             "# ########"
             "######## #");
+
+    /* The leftmost cell of the row below a cleared row must be kept, and not
+     * replaced by the cell of the row above it */
+    set_layout(&ms, 0, 0,
+            "          "
+            "#         "
+            "##########"
+            " #########");
+
+    mptet_lineclear(&ms);
+
+    assert_layout(&ms,
+            "          "
+            "#         "
+            " #########");
+
+    if (mem256_get(&ms.field, 9)) {
+        fprintf(stderr, "Line clear filled the leftmost cell below it\n");
+        errors++;
+    }
 }
 
 void test3(void)
@@ -182,6 +222,1361 @@ void test3(void)
             " ##### ###");
 }
 
+void test4(void)
+{
+    static hist_t h;
+    hist_zero(&h);
+
+    for (uint64_t i = 1; i <= 100000; ++i)
+        hist_record(&h, i * 1000);
+
+    /* Reported percentiles should be within the bucket error of 1/16 */
+    const double p[] = { 0.5, 0.99, 0.999 };
+    for (size_t i = 0; i < sizeof(p) / sizeof(p[0]); ++i) {
+        const double expect = p[i] * 100000000;
+        const double found = hist_percentile(&h, p[i]);
+
+        if (found < expect || found > expect * (1 + 1.0 / 16)) {
+            fprintf(stderr, "Histogram failure p%g: %g but expected %g\n",
+                    p[i] * 100, found, expect);
+            errors++;
+        }
+    }
+
+    if (hist_percentile(&h, 1) != 100000000 || h.max != 100000000) {
+        fprintf(stderr, "Histogram failure: max %" PRIu64 "\n", h.max);
+        errors++;
+    }
+}
+
+void test5(void)
+{
+    mpstate_init(&ms);
+    set_layout(&ms, O_, 0,
+            "     x    "
+            "          "
+            "          "
+            "          "
+            "          ");
+
+    const int bx = ms.bx;
+
+    /* A press released before the next frame must still move the piece */
+    mptet_keyevent(&ms, K_Left, true, 0);
+    mptet_keyevent(&ms, K_Left, false, 1);
+    mptet_update(&ms);
+
+    if (ms.bx != bx - 1 || ms.keystate[K_Left]) {
+        fprintf(stderr, "Key event failure: x %d but expected %d\n", ms.bx, bx - 1);
+        errors++;
+    }
+
+    /* Events are applied in the order they arrived */
+    mptet_keyevent(&ms, K_Right, true, 2);
+    mptet_keyevent(&ms, K_Right, false, 3);
+    mptet_keyevent(&ms, K_Right, true, 4);
+    mptet_update(&ms);
+
+    if (ms.bx != bx + 1 || ms.keystate[K_Right] != 1) {
+        fprintf(stderr, "Key event failure: x %d but expected %d\n", ms.bx, bx + 1);
+        errors++;
+    }
+}
+
+void test6(void)
+{
+    static mpdamage md;
+    mpdamage_list dl;
+
+    mpstate_init(&ms);
+    mpdamage_init(&md, 2);
+
+    set_layout(&ms, 0, 0,
+            "          "
+            "#         ");
+
+    /* With no previous frames everything must be drawn */
+    if (!mpdamage_compute(&md, &ms, &dl) || !dl.full) {
+        fprintf(stderr, "Damage failure: first frame not full\n");
+        errors++;
+    }
+
+    mpdamage_compute(&md, &ms, &dl);
+    if (mpdamage_compute(&md, &ms, &dl)) {
+        fprintf(stderr, "Damage failure: unchanged frame reported %d cells\n", dl.count);
+        errors++;
+    }
+
+    /* The back buffer is two frames old, so a change is seen twice */
+    mem256_set(&ms.field, 10);
+    mem256_set(&ms.field, 25);
+
+    for (int frame = 0; frame < 2; ++frame) {
+        if (!mpdamage_compute(&md, &ms, &dl) || dl.count != 2 ||
+                dl.x0 != 4 || dl.x1 != 9 || dl.y0 != 19 || dl.y1 != 20) {
+            fprintf(stderr, "Damage failure: %d cells in (%d, %d) - (%d, %d)\n",
+                    dl.count, dl.x0, dl.y0, dl.x1, dl.y1);
+            errors++;
+        }
+    }
+
+    if (mpdamage_compute(&md, &ms, &dl)) {
+        fprintf(stderr, "Damage failure: change reported a third time\n");
+        errors++;
+    }
+
+    /* A persistent buffer must redraw a change which is reverted on the next
+     * frame, as a piece moved left then right */
+    mpdamage_init(&md, 1);
+    mpdamage_compute(&md, &ms, &dl);
+
+    for (int frame = 0; frame < 2; ++frame) {
+        ms.field.limb[0] ^= 1ull << 30;
+
+        if (!mpdamage_compute(&md, &ms, &dl) || dl.count != 1 || dl.cell[0] != 30) {
+            fprintf(stderr, "Damage failure: reverted change on frame %d not redrawn\n",
+                    frame);
+            errors++;
+        }
+    }
+}
+
+void test7(void)
+{
+    enum { Side = 5, Pitch = 10 * Side + 3, Height = 22 * Side };
+    static uint32_t pixels[Height * Pitch];
+
+    static const mpraster_palette palette = {
+        .background = 0,
+        .edge = { 1, 2, 3, 4 },
+        .fill = { 11, 12, 13, 14 }
+    };
+
+    mpraster r;
+
+    mpstate_init(&ms);
+    mem256_zero(&ms.field);
+    mem256_zero(&ms.block);
+    mem256_zero(&ms.ghost);
+
+    /* Row 6 straddles the first two limbs */
+    for (int i = 60; i < 70; ++i)
+        mem256_set(&ms.field, i);
+
+    mem256_set(&ms.block, 69);
+    mem256_set(&ms.block, 128);
+    mem256_set(&ms.ghost, 127);
+    mem256_set(&ms.ghost, 128);
+
+    if (mpraster_row(&ms.field, 6) != 0x3ff || mpraster_row(&ms.field, 5) ||
+            mpraster_row(&ms.field, 7)) {
+        fprintf(stderr, "Raster failure: row extraction\n");
+        errors++;
+    }
+
+    mpraster_classify(&r, &ms);
+
+    if (mpraster_class(&r, 15, 0) != R_Field || mpraster_class(&r, 15, 9) != R_Field ||
+            mpraster_class(&r, 9, 1) != R_Block || mpraster_class(&r, 9, 2) != R_Ghost ||
+            mpraster_class(&r, 0, 0) != R_Empty || mpraster_cell(&r, 127) != R_Ghost) {
+        fprintf(stderr, "Raster failure: classification\n");
+        errors++;
+    }
+
+    for (int i = 0; i < Height * Pitch; ++i)
+        pixels[i] = 0xdeadbeef;
+
+    mpraster_draw(&r, pixels, Pitch, Side, &palette, 0, 21);
+
+    #define PX(x, y) pixels[(y) * Pitch + (x)]
+
+    if (PX(0, 75) != 0 || PX(1, 76) != 1 || PX(2, 77) != 11 ||
+            PX(7, 47) != 12 || PX(11, 46) != 3 || PX(12, 47) != 13 ||
+            PX(1, 1) != 4 || PX(2, 2) != 14 || PX(49, Height - 1) != 0) {
+        fprintf(stderr, "Raster failure: incorrect pixels\n");
+        errors++;
+    }
+
+    /* Pixels beyond the field in each row must not be touched */
+    for (int y = 0; y < Height; ++y) {
+        for (int x = 10 * Side; x < Pitch; ++x) {
+            if (PX(x, y) != 0xdeadbeef) {
+                fprintf(stderr, "Raster failure: wrote outside field at (%d, %d)\n", x, y);
+                errors++;
+                return;
+            }
+        }
+    }
+
+    /* Drawing a range of rows leaves all other rows alone */
+    for (int i = 0; i < Height * Pitch; ++i)
+        pixels[i] = 0xdeadbeef;
+
+    mpraster_draw(&r, pixels, Pitch, Side, &palette, 9, 9);
+
+    if (PX(7, 47) != 12 || PX(0, 9 * Side - 1) != 0xdeadbeef ||
+            PX(0, 10 * Side) != 0xdeadbeef) {
+        fprintf(stderr, "Raster failure: drew outside of row range\n");
+        errors++;
+    }
+
+    #undef PX
+}
+
+static bool rect_inside(const mprect *r, int width, int height)
+{
+    return r->x >= 0 && r->y >= 0 && r->w > 0 && r->h > 0 &&
+           r->x + r->w <= width && r->y + r->h <= height;
+}
+
+void test8(void)
+{
+    static const int sizes[][2] = {
+        { 1920, 1080 }, { 3840, 2160 }, { 1280, 720 }, { 800, 480 }, { 1080, 1920 }
+    };
+
+    static mplayout l;
+
+    /* The base size is laid out as designed */
+    mplayout_compute(&l, 1920, 1080);
+
+    if (l.side != M_BLOCK_SIDE || l.field.x != M_X_OFFSET || l.field.y != M_Y_OFFSET ||
+            l.cell[219].x != M_X_OFFSET + 1 || l.cell[0].y != M_Y_OFFSET + 21 * M_BLOCK_SIDE + 1 ||
+            l.hold.x != 35 || l.hold.w != 129 || l.hold_cell[5].x != 67 ||
+            l.preview.x != 600 || l.preview.h != 448 || l.preview_cell[1][4].y != 281) {
+        fprintf(stderr, "Layout failure: base layout differs\n");
+        errors++;
+    }
+
+    mplayout_compute(&l, 3840, 2160);
+
+    if (l.side != 2 * M_BLOCK_SIDE || l.field.x != 2 * M_X_OFFSET) {
+        fprintf(stderr, "Layout failure: 4K layout is not doubled, side %d\n", l.side);
+        errors++;
+    }
+
+    /* Everything must be visible on any reasonable surface */
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); ++n) {
+        const int w = sizes[n][0];
+        const int h = sizes[n][1];
+
+        mplayout_compute(&l, w, h);
+
+        bool inside = rect_inside(&l.border[1], w, h) && rect_inside(&l.hold, w, h) &&
+                      rect_inside(&l.preview, w, h);
+
+        for (int k = 0; k < 16; ++k) {
+            inside &= rect_inside(&l.hold_cell[k], w, h);
+            for (int i = 0; i < PREVIEW_NUMBER; ++i)
+                inside &= rect_inside(&l.preview_cell[i][k], w, h);
+        }
+
+        if (!inside) {
+            fprintf(stderr, "Layout failure: %dx%d does not fit\n", w, h);
+            errors++;
+        }
+    }
+
+    if (mplayout_resize(&l, sizes[4][0], sizes[4][1]) || !mplayout_resize(&l, 640, 480)) {
+        fprintf(stderr, "Layout failure: resize\n");
+        errors++;
+    }
+}
+
+void test9(void)
+{
+    enum { Width = 480, Height = 270 };
+
+    static const mpfb_palette palette = {
+        .background = 0, .border = 1, .block = 2, .ghost = 3, .empty = 4
+    };
+
+    static uint32_t full[Width * Height], partial[Width * Height];
+    static mplayout l;
+
+    mpfb a = { full, Width, Height, Width };
+    mpfb b = { partial, Width, Height, Width };
+    mpfb_cache ca, cb;
+
+    mplayout_compute(&l, Width, Height);
+    mpfb_cache_init(&ca);
+    mpfb_cache_init(&cb);
+    mpstate_init(&ms);
+
+    /* Sprites drawn over a previous piece must match a fresh frame */
+    ms.hold = -1;
+    mpfb_render(&ms, &b, &l, &palette, &cb);
+
+    for (int id = -1; id < 7; ++id) {
+        ms.hold = id;
+        ms.bhead = (ms.bhead + 1) % 14;
+
+        mpfb_render(&ms, &a, &l, &palette, &ca);
+        mpfb_hold(&ms, &b, &l, &palette, &cb);
+        mpfb_preview(&ms, &b, &l, &palette, &cb);
+
+        if (memcmp(full, partial, sizeof(full))) {
+            fprintf(stderr, "Sprite failure: hold %d differs from a full frame\n", id);
+            errors++;
+            break;
+        }
+
+        int filled = 0;
+        for (int k = 0; k < 16; ++k)
+            filled += full[l.hold_cell[k].y * Width + l.hold_cell[k].x] == palette.block;
+
+        if (filled != (id == -1 ? 0 : 4)) {
+            fprintf(stderr, "Sprite failure: hold %d has %d cells\n", id, filled);
+            errors++;
+        }
+    }
+
+    /* Sprites are re-rendered when the layout changes their size */
+    mplayout_compute(&l, Width / 2, Height / 2);
+    a.width = Width / 2;
+    a.height = Height / 2;
+    mpfb_hold(&ms, &a, &l, &palette, &ca);
+
+    if (ca.hold.width != l.hold.w || ca.preview.width == l.preview_piece[0].w) {
+        fprintf(stderr, "Sprite failure: cache not resized\n");
+        errors++;
+    }
+
+    mpfb_cache_free(&ca);
+    mpfb_cache_free(&cb);
+}
+
+void test10(void)
+{
+    static const int filled[B_Count] = { 0, 11 * 9, 18 * 9 };
+
+    mpbench mb;
+
+    for (int d = 0; d < B_Count; ++d) {
+        mpstate_init(&ms);
+        mpbench_start(&mb, &ms, d);
+
+        if (mem256_popcnt(&ms.field) != filled[d]) {
+            fprintf(stderr, "Bench failure: %s field has %d cells\n",
+                    mpbench_names[d], mem256_popcnt(&ms.field));
+            errors++;
+        }
+
+        /* The script moves, holds and drops pieces without the density
+         * changing or the game ending */
+        const int bhead = ms.bhead;
+
+        for (int i = 0; i < 200; ++i) {
+            mpbench_input(&mb, &ms);
+            mptet_update(&ms);
+            mpbench_restore(&mb, &ms);
+            ms.total_frames++;
+        }
+
+        if (mem256_popcnt(&ms.field) != filled[d] || !ms.running ||
+                ms.bhead == bhead || ms.hold == -1) {
+            fprintf(stderr, "Bench failure: %s script did not run as expected\n",
+                    mpbench_names[d]);
+            errors++;
+        }
+    }
+}
+
+void test11(void)
+{
+    mpstate_init(&ms);
+    mpstate_seed(&ms, 1);
+    ms.goal = 0;
+
+    mem256_zero(&ms.field);
+    mem256_set(&ms.field, 9);
+
+    /* Rows rise beneath the field, with the hole counted from the left */
+    mptet_add_garbage(&ms, 2, 3);
+
+    for (int i = 0; i < 30; ++i) {
+        const bool expect = i < 20 ? i % 10 != 6 : i == 29;
+
+        if (mem256_get(&ms.field, i) != expect) {
+            fprintf(stderr, "Garbage failure: bit %d is %d after rising\n", i, !expect);
+            errors++;
+            break;
+        }
+    }
+
+    /* A clear cancels pending garbage before any is sent */
+    mptet_queue_garbage(&ms, 1, 0);
+    mptet_queue_garbage(&ms, 2, 0);
+    mem256_zero(&ms.field);
+    mem256_zero(&ms.block);
+
+    for (int i = 0; i < 40; ++i)
+        mem256_set(i % 10 ? &ms.field : &ms.block, i);
+
+    ms.lines_cleared = 0;
+    mptet_lock(&ms);
+
+    if (ms.lines_cleared != 4 || mptet_garbage_pending(&ms) != 0 || ms.attack != 1) {
+        fprintf(stderr, "Garbage failure: tetris left %d pending, %d attack\n",
+                mptet_garbage_pending(&ms), ms.attack);
+        errors++;
+    }
+
+    /* Garbage pushing blocks off the top ends the game */
+    mem256_zero(&ms.field);
+    mem256_set(&ms.field, 205);
+    ms.running = true;
+    mptet_add_garbage(&ms, 1, 0);
+    const bool survived = ms.running;
+    mptet_add_garbage(&ms, 1, 0);
+
+    if (!survived || ms.running) {
+        fprintf(stderr, "Garbage failure: topping out did not end the game\n");
+        errors++;
+    }
+
+    /* Seeded states receive the same pieces */
+    mpstate a, b;
+    mpstate_init(&a);
+    mpstate_init(&b);
+    mpstate_seed(&a, 42);
+    mptet_random(&b);
+    mpstate_seed(&b, 42);
+
+    if (memcmp(a.bag, b.bag, sizeof(a.bag))) {
+        fprintf(stderr, "Garbage failure: seeded bags differ\n");
+        errors++;
+    }
+
+    mpstate_free(&a);
+    mpstate_free(&b);
+}
+
+static int fired[4];
+
+static void test12_fire(void *data)
+{
+    fired[(intptr_t) data]++;
+}
+
+void test12(void)
+{
+    mpwheel w;
+    mptimer t[4];
+
+    mpwheel_init(&w, 1000);
+
+    for (int i = 0; i < 4; ++i)
+        mptimer_init(&t[i], test12_fire, (void *) (intptr_t) i);
+
+    /* The last wraps around the wheel more than once */
+    mpwheel_add(&w, &t[0], 1000);
+    mpwheel_add(&w, &t[1], 1005);
+    mpwheel_add(&w, &t[2], 1010);
+    mpwheel_add(&w, &t[3], 1000 + 3 * MPWHEEL_SLOTS + 5);
+    mpwheel_del(&w, &t[2]);
+
+    const int first = mpwheel_advance(&w, 1005);
+    const uint64_t next = mpwheel_next(&w);
+    const int second = mpwheel_advance(&w, 1000 + 3 * MPWHEEL_SLOTS + 4);
+    const int third = mpwheel_advance(&w, 1000 + 3 * MPWHEEL_SLOTS + 5);
+
+    if (first != 2 || second != 0 || third != 1 || next > 1000 + 3 * MPWHEEL_SLOTS + 5 ||
+            fired[0] != 1 || fired[1] != 1 || fired[2] != 0 || fired[3] != 1 || w.count) {
+        fprintf(stderr, "Wheel failure: fired %d %d %d %d\n",
+                fired[0], fired[1], fired[2], fired[3]);
+        errors++;
+    }
+}
+
+void test13(void)
+{
+    static mpstate seats[2];
+    mpspec prev, cur, seen;
+    uint8_t msg[MPSPEC_MAX_SIZE];
+
+    for (int i = 0; i < 2; ++i) {
+        mpstate_init(&seats[i]);
+        mpstate_seed(&seats[i], 7);
+        mptet_set_random_block(&seats[i]);
+    }
+
+    mpspec_zero(&cur, 2);
+    mpspec_set(&cur, 0, &seats[0]);
+    mpspec_set(&cur, 1, &seats[1]);
+    cur.frame = 1;
+
+    /* A keyframe reproduces the match from nothing */
+    size_t size = mpspec_encode(msg, NULL, &cur);
+    mpspec_zero(&seen, 0);
+
+    if (!mpspec_apply(&seen, msg, size) || memcmp(&seen, &cur, sizeof(cur))) {
+        fprintf(stderr, "Spectate failure: keyframe did not decode\n");
+        errors++;
+    }
+
+    /* A move and rising garbage are sent as a few bytes */
+    prev = cur;
+    mptet_move(&seats[1], 1);
+    mptet_add_garbage(&seats[0], 2, 4);
+    mpspec_set(&cur, 0, &seats[0]);
+    mpspec_set(&cur, 1, &seats[1]);
+    cur.frame = 2;
+
+    size = mpspec_encode(msg, &prev, &cur);
+
+    if (size >= 2 * MSG_FRAME_SIZE || !mpspec_apply(&seen, msg, size) ||
+            memcmp(&seen, &cur, sizeof(cur))) {
+        fprintf(stderr, "Spectate failure: delta of %zu bytes did not decode\n", size);
+        errors++;
+    }
+
+    /* Nothing changing leaves only the header, and truncation is caught */
+    const size_t empty = mpspec_encode(msg, &cur, &cur);
+    size = mpspec_encode(msg, &prev, &cur);
+    msg[1]--;
+
+    if (empty != 8 || mpspec_apply(&seen, msg, size - 1)) {
+        fprintf(stderr, "Spectate failure: bad message sizes accepted\n");
+        errors++;
+    }
+
+    mpshared *b = mpshared_new(msg, size);
+    mpshared_ref(b);
+    mpshared_unref(b);
+
+    if (b->refs != 1 || b->size != size || memcmp(b->data, msg, size)) {
+        fprintf(stderr, "Spectate failure: shared buffer\n");
+        errors++;
+    }
+
+    mpshared_unref(b);
+}
+
+static uint64_t scanned[3];
+
+static bool test14_filter(const mparchive_entry *e, void *ctx)
+{
+    (void) ctx;
+    return e->seed != 2;
+}
+
+static void test14_visit(const mparchive *a, const mparchive_entry *e, int thread,
+        mpstate *ms, void *ctx)
+{
+    mpresult res;
+    (void) ctx;
+
+    if (mparchive_verify(a, e, ms, &res))
+        scanned[thread]++;
+}
+
+void test14(void)
+{
+    static const uint8_t keys[] = {
+        1 << K_Left, 1 << K_Left, 1 << K_Space, 1 << K_Right, 1 << K_z, 1 << K_Space,
+        1 << K_c, 1 << K_Down, 1 << K_Space, 1 << K_x, 0, 1 << K_Space
+    };
+
+    char path[] = "/tmp/mptet-test-XXXXXX";
+    const int fd = mkstemp(path);
+    mparchive_writer w;
+    mparchive a;
+    mpreplay r;
+    mpresult res, again;
+
+    close(fd);
+    mpreplay_init(&r);
+
+    /* Two sessions, the second appending to the first */
+    for (int session = 0; session < 2; ++session) {
+        if (!mparchive_create(&w, path)) {
+            errors++;
+            return;
+        }
+
+        /* A second writer is refused while the first holds the archive */
+        mparchive_writer other;
+
+        if (session == 0 && mparchive_create(&other, path)) {
+            fprintf(stderr, "Archive failure: two writers opened the archive\n");
+            mparchive_finish(&other);
+            errors++;
+        }
+
+        for (int seed = 3 * session; seed < 3 * session + 3; ++seed) {
+            mpreplay_clear(&r);
+            mpreplay_start(&ms, seed, 0);
+
+            for (int f = 0; f < 2000; ++f) {
+                const uint8_t k = keys[f / 3 % sizeof(keys)];
+                mpreplay_frame(&r, k);
+
+                if (!mpreplay_step(&ms, k))
+                    break;
+            }
+
+            mpreplay_result(&ms, &res);
+            mparchive_append(&w, seed, 0, &r, &res);
+        }
+
+        mparchive_finish(&w);
+    }
+
+    if (!mparchive_open(&a, path) || a.count != 6) {
+        fprintf(stderr, "Archive failure: reopened archive is invalid\n");
+        errors++;
+        unlink(path);
+        return;
+    }
+
+    /* The second session fills the room left after the first index, rather
+     * than writing another after its payloads */
+    if (a.header->index > a.entries[3].offset) {
+        fprintf(stderr, "Archive failure: appending moved the index\n");
+        errors++;
+    }
+
+    /* The same seed and keys replay identically */
+    const mparchive_entry *e = &a.entries[4];
+
+    if (!mparchive_verify(&a, e, &ms, &res) ||
+            !mpreplay_run(&ms, e->seed, e->goal, mparchive_payload(&a, e), e->size, &again) ||
+            res.hash != again.hash || res.frames != e->frames || e->seed != 4) {
+        fprintf(stderr, "Archive failure: replay did not reproduce its game\n");
+        errors++;
+    }
+
+    /* Every entry the filter passes is visited once */
+    mparchive_scan(&a, 3, test14_filter, test14_visit, NULL);
+
+    if (scanned[0] + scanned[1] + scanned[2] != 5) {
+        fprintf(stderr, "Archive failure: scan verified %" PRIu64 " games\n",
+                scanned[0] + scanned[1] + scanned[2]);
+        errors++;
+    }
+
+    mparchive_close(&a);
+    mpreplay_free(&r);
+    unlink(path);
+}
+
+/* Placements scored so far, and the piece and field hash of each */
+#define TEST15_MAX (3 * MPDATASET_BUFFER)
+static uint32_t placed;
+static uint8_t placed_id[TEST15_MAX];
+static uint64_t placed_hash[TEST15_MAX];
+
+static float test15_score(const mpstate *ms, const mem256_t *before, int cleared, void *ctx)
+{
+    mem256_t visible = *before;
+    (void) cleared;
+    (void) ctx;
+
+    /* A piece locked partly above the field is cut off in the dataset */
+    visible.limb[3] &= (1ull << 28) - 1;
+
+    placed_id[placed] = ms->id;
+    placed_hash[placed] = mpreplay_hash(&visible);
+    return placed++;
+}
+
+void test15(void)
+{
+    static const uint8_t keys[] = {
+        1 << K_Left, 1 << K_Space, 0, 1 << K_Right, 1 << K_Space, 1 << K_z, 0, 1 << K_Space
+    };
+
+    char path[] = "/tmp/mptet-test-XXXXXX";
+    const int fd = mkstemp(path);
+    mpdataset d;
+    mpdataset_stream streams[2];
+    mpdataset_view v;
+    uint64_t lines = 0;
+
+    close(fd);
+
+    if (!mpdataset_create(&d, path, true)) {
+        errors++;
+        return;
+    }
+
+    mpdataset_stream_init(&streams[0], &d, test15_score, NULL);
+    mpdataset_stream_init(&streams[1], &d, test15_score, NULL);
+
+    /* Two producers, each filling both of their buffers more than once */
+    for (int game = 0; placed < 2 * MPDATASET_BUFFER + 100; ++game) {
+        mpreplay_start(&ms, game, 0);
+        mpdataset_attach(&ms, &streams[game % 2]);
+
+        for (int f = 0; f < 2000 && placed < TEST15_MAX - 1; ++f) {
+            if (!mpreplay_step(&ms, keys[(f + game) % sizeof(keys)]))
+                break;
+        }
+
+        lines += ms.lines_cleared;
+    }
+
+    ms.lock_hook = NULL;
+    mpdataset_stream_free(&streams[0]);
+    mpdataset_stream_free(&streams[1]);
+
+    if (!mpdataset_finish(&d) || !mpdataset_open(&v, path) || v.count != placed ||
+            !(v.header->flags & MPDATASET_SCORED)) {
+        fprintf(stderr, "Dataset failure: %u placements were not all written\n", placed);
+        errors++;
+        unlink(path);
+        return;
+    }
+
+    /* Every placement appears exactly once, whichever stream wrote it */
+    static bool seen[TEST15_MAX];
+    uint64_t found = 0;
+
+    memset(seen, 0, sizeof(seen));
+
+    for (uint64_t i = 0; i < v.count; ++i) {
+        const mpdataset_record *r = &v.records[i];
+        const uint32_t n = r->score;
+        mem256_t field;
+
+        mem256_zero(&field);
+
+        for (int y = 0; y < 22; ++y) {
+            for (int x = 0; x < 10; ++x) {
+                if (mpdataset_cell(r, x, y))
+                    mem256_set(&field, 10 * (21 - y) + 9 - x);
+            }
+        }
+
+        if (n >= placed || seen[n] || r->id != placed_id[n] ||
+                mpreplay_hash(&field) != placed_hash[n]) {
+            fprintf(stderr, "Dataset failure: record %" PRIu64 " does not match placement %u\n",
+                    i, n);
+            errors++;
+            break;
+        }
+
+        seen[n] = true;
+        found += r->lines;
+    }
+
+    if (found != lines) {
+        fprintf(stderr, "Dataset failure: %" PRIu64 " lines recorded, %" PRIu64 " cleared\n",
+                found, lines);
+        errors++;
+    }
+
+    mpdataset_close(&v);
+    unlink(path);
+}
+
+void test16(void)
+{
+    char path[] = "/tmp/mptet-test-XXXXXX";
+    const int fd = mkstemp(path);
+    mpenv_host h;
+    mpenv_client c;
+    mpstate local;
+
+    close(fd);
+
+    if (!mpenv_create(&h, path, 2, 4, 2, 100, 1000) || !mpenv_attach(&c, path)) {
+        fprintf(stderr, "Env failure: could not create host\n");
+        errors++;
+        return;
+    }
+
+    /* Another process steps the other lane meanwhile */
+    const pid_t child = fork();
+
+    if (child == 0) {
+        mpenv_client other;
+        bool ok = mpenv_attach(&other, path) && other.index == 1;
+
+        for (int step = 0; ok && step < 500; ++step) {
+            const int action = step % MPENV_RESET;
+            const uint32_t steps = other.obs[0].steps;
+
+            memset(other.actions, action, other.envs);
+            ok = mpenv_step(&other) && (other.obs[0].done || other.obs[0].steps == steps + 1);
+        }
+
+        _exit(!ok);
+    }
+
+    /* The games of the lane's first slot match ones played here with the
+     * same seeds, which differ by the number of slots */
+    uint32_t episode = 0;
+    mpreplay_start(&local, 100, 0);
+    memset(c.actions, MPENV_HARD_DROP, c.envs);
+
+    for (int step = 0; step < 200; ++step) {
+        uint8_t field[28];
+
+        if (!mpenv_step(&c)) {
+            fprintf(stderr, "Env failure: host stopped\n");
+            errors++;
+            break;
+        }
+
+        mptet_hard_drop(&local);
+        mptet_lock(&local);
+
+        const mpenv_obs *o = &c.obs[0];
+
+        if (!local.running) {
+            if (o->done != MPENV_TOPPED_OUT || o->episode != ++episode || o->steps != 0) {
+                fprintf(stderr, "Env failure: game did not restart after topping out\n");
+                errors++;
+            }
+
+            mpreplay_start(&local, 100 + 8 * episode, 0);
+            continue;
+        }
+
+        mpdataset_pack(field, &local.field);
+
+        if (o->done || o->id != local.id || o->lines != (uint32_t) local.lines_cleared ||
+                memcmp(o->field, field, sizeof(field))) {
+            fprintf(stderr, "Env failure: step %d differs from the same game\n", step);
+            errors++;
+            break;
+        }
+    }
+
+    int status;
+
+    if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "Env failure: client in another process failed\n");
+        errors++;
+    }
+
+    c.actions[0] = MPENV_RESET;
+    mpenv_step(&c);
+
+    if (c.obs[0].steps != 0 || c.obs[0].done || c.obs[0].episode != episode + 1) {
+        fprintf(stderr, "Env failure: reset did not start a new game\n");
+        errors++;
+    }
+
+    if (mpenv_stepped(&h) != 4 * 201 + 4 * 500) {
+        fprintf(stderr, "Env failure: %" PRIu64 " steps counted\n", mpenv_stepped(&h));
+        errors++;
+    }
+
+    mpenv_detach(&c);
+    mpenv_destroy(&h);
+}
+
+void test17(void)
+{
+    static const uint8_t keys[] = {
+        1 << K_Left, 1 << K_Left, 0, 1 << K_Down, 1 << K_Right, 1 << K_z, 0, 1 << K_Space,
+        1 << K_x, 1 << K_Down, 1 << K_c, 0, 1 << K_Right, 1 << K_Space, 0, 0
+    };
+
+    /* Each specialised update plays exactly as the generic one */
+    for (int i = 0; mprules_all[i]; ++i) {
+        mprules generic = *mprules_all[i];
+        mpstate a, b;
+
+        generic.update = mptet_update_generic;
+
+        mpstate_init(&a);
+        mpstate_init(&b);
+        mpstate_seed(&a, i);
+        mpstate_seed(&b, i);
+        mpstate_rules(&a, mprules_all[i]);
+        mpstate_rules(&b, &generic);
+        mptet_set_random_block(&a);
+        mptet_set_random_block(&b);
+
+        for (int f = 0; f < 3000 && a.running; ++f) {
+            const uint8_t k = keys[f / 5 % sizeof(keys)];
+
+            mpreplay_step(&a, k);
+            mpreplay_step(&b, k);
+
+            if (a.running != b.running || a.bx != b.bx || a.by != b.by ||
+                    a.lines_cleared != b.lines_cleared ||
+                    mpreplay_hash(&a.field) != mpreplay_hash(&b.field) ||
+                    mpreplay_hash(&a.ghost) != mpreplay_hash(&b.ghost)) {
+                fprintf(stderr, "Rules failure: %s differs from generic on frame %d\n",
+                        mprules_all[i]->name, f);
+                errors++;
+                break;
+            }
+
+            /* Under 20G the piece is always on the floor */
+            if (mprules_all[i]->gravity >= MPRULES_20G && a.running &&
+                    mpreplay_hash(&a.block) != mpreplay_hash(&a.ghost)) {
+                fprintf(stderr, "Rules failure: 20g piece is above its ghost\n");
+                errors++;
+                break;
+            }
+        }
+    }
+
+    /* Auto-repeat with an arr of 0 reaches the wall on the first repeat, and
+     * sonic soft drop reaches the floor at once */
+    const mprules *instant = mprules_find("instant");
+
+    mpreplay_start(&ms, 1, 0);
+    mpstate_rules(&ms, instant);
+
+    for (int f = 0; f <= instant->das; ++f)
+        mpreplay_step(&ms, 1 << K_Left);
+
+    const bool wall = !mptet_move(&ms, 1);
+    mpreplay_step(&ms, 1 << K_Down);
+
+    if (!wall || mpreplay_hash(&ms.block) != mpreplay_hash(&ms.ghost)) {
+        fprintf(stderr, "Rules failure: instant did not reach the wall and floor\n");
+        errors++;
+    }
+
+    /* Without input a piece falls, rests for the lock delay, then locks */
+    const mprules *guideline = mprules_find("guideline");
+    int f;
+
+    mpreplay_start(&ms, 2, 0);
+    mpstate_rules(&ms, guideline);
+
+    const int bhead = ms.bhead;
+
+    for (f = 0; f < 5000 && ms.bhead == bhead; ++f)
+        mpreplay_step(&ms, 0);
+
+    /* The piece falls about 21 rows at one a second before it rests */
+    if (ms.bhead == bhead || f < 19 * FPS || f > 23 * FPS + guideline->lock_delay) {
+        fprintf(stderr, "Rules failure: guideline piece locked after %d frames\n", f);
+        errors++;
+    }
+
+    /* The classic rules never lock a resting piece */
+    mpreplay_start(&ms, 2, 0);
+
+    for (f = 0; f < 3000; ++f)
+        mpreplay_step(&ms, 0);
+
+    if (ms.bhead != bhead) {
+        fprintf(stderr, "Rules failure: classic piece locked without a hard drop\n");
+        errors++;
+    }
+}
+
+/* Put piece id at its spawn point in rotation br */
+static void test18_spawn(mpstate *s, int id, int br)
+{
+    s->id = id;
+    s->br = br;
+    s->bx = 3;
+    s->by = 22;
+    mem256_zero(&s->block);
+    s->block.limb[0] = mptetd_block[id][br];
+    mem256_bshift(&s->block, 187);
+}
+
+void test18(void)
+{
+    mpstate rng;
+
+    mpstate_init(&rng);
+    mpstate_seed(&rng, 18);
+
+    for (int t = 0; t < 2000; ++t) {
+        mpstate s = ms;
+        mpplacement places[MPTET_PLACEMENTS];
+        uint64_t found[MPTET_PLACEMENTS];
+        int moves[2], nfound = 0;
+
+        /* Random fields, sparse or dense, to a random height */
+        const int height = mptet_random(&rng) % 20;
+        const uint32_t density = 1 + mptet_random(&rng) % 4;
+
+        mem256_zero(&s.field);
+        for (int i = 0; i < 10 * height; ++i) {
+            if (mptet_random(&rng) % 5 < density)
+                mem256_set(&s.field, i);
+        }
+
+        test18_spawn(&s, t % 7, 0);
+
+        if (mptet_collision(&s, &s.block, s.id, 0, s.bx, s.by))
+            continue;
+
+        /* Wander a little so the piece starts anywhere */
+        for (int i = mptet_random(&rng) % 8; i > 0; --i) {
+            switch (mptet_random(&rng) % 4) {
+            case 0: mptet_rotate(&s, 1); break;
+            case 1: mptet_move(&s, 1); break;
+            case 2: mptet_move(&s, -1); break;
+            case 3: mptet_move(&s, -10); break;
+            }
+        }
+
+        /* Reach is how far single moves get in each direction */
+        for (int d = 0; d < 2; ++d) {
+            mpstate m = s;
+            moves[d] = 0;
+
+            while (mptet_move(&m, d ? -1 : 1))
+                moves[d]++;
+        }
+
+        if (mptet_reach(&s.field, &s.block, 1) != moves[0] ||
+                mptet_reach(&s.field, &s.block, -1) != moves[1]) {
+            fprintf(stderr, "Reach failure: piece %d reaches %d,%d and not %d,%d\n", s.id,
+                    mptet_reach(&s.field, &s.block, 1), mptet_reach(&s.field, &s.block, -1),
+                    moves[0], moves[1]);
+            errors++;
+            break;
+        }
+
+        mpstate m = s;
+        mptet_slide(&m, 1);
+
+        if (m.bx != s.bx - moves[0] || mptet_move(&m, 1)) {
+            fprintf(stderr, "Reach failure: slide did not stop at the obstacle\n");
+            errors++;
+            break;
+        }
+
+        /* Placements are every rotation at spawn moved one column at a time
+         * and dropped, without duplicates */
+        for (int br = 0; br < 4; ++br) {
+            mpstate b = s;
+            test18_spawn(&b, s.id, br);
+
+            if (mptet_collision(&b, &b.block, b.id, br, b.bx, b.by))
+                continue;
+
+            while (mptet_move(&b, -1));
+
+            do {
+                mpstate d = b;
+                mptet_hard_drop(&d);
+
+                const uint64_t h = mpreplay_hash(&d.block);
+                bool seen = false;
+
+                for (int i = 0; i < nfound; ++i)
+                    seen |= found[i] == h;
+
+                if (!seen)
+                    found[nfound++] = h;
+            } while (mptet_move(&b, 1));
+        }
+
+        const int n = mptet_placements(&s.field, s.id, places);
+        int matched = 0;
+
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < nfound; ++j)
+                matched += mpreplay_hash(&places[i].block) == found[j];
+        }
+
+        if (n != nfound || matched != n) {
+            fprintf(stderr, "Placement failure: piece %d has %d placements, expected %d\n",
+                    s.id, n, nfound);
+            errors++;
+            break;
+        }
+    }
+}
+
+static mprollback test19_sessions[2];
+static mploopback test19_lb;
+
+/* Tick both sessions until each has played to frame, with keys from rng */
+static void test19_play(mpstate *rng, uint8_t held[2][1200], uint32_t frames)
+{
+    mprollback *s = test19_sessions;
+
+    while (s[0].frame < frames || s[1].frame < frames ||
+            s[0].remote_next < s[1].local_next || s[1].remote_next < s[0].local_next) {
+        for (int i = 0; i < 2; ++i) {
+            const uint32_t at = s[i].local_next;
+            const uint8_t keys = mptet_random(rng) % 4 ? held[i][at ? at - 1 : 0] :
+                mptet_random(rng) & 0x7f;
+
+            if (s[i].frame >= frames)
+                mprollback_poll(&s[i]);
+            else if (mprollback_advance(&s[i], keys))
+                held[i][at] = keys;
+        }
+
+        mploopback_tick(&test19_lb);
+    }
+
+    mprollback_poll(&s[0]);
+    mprollback_poll(&s[1]);
+}
+
+void test19(void)
+{
+    static uint8_t held[2][1200];
+    static mpstate reference[2];
+    mprollback *s = test19_sessions;
+    mpstate rng;
+
+    mpstate_init(&rng);
+    mpstate_seed(&rng, 19);
+    mploopback_init(&test19_lb, 3, 2, 10, 19);
+
+    for (int i = 0; i < 2; ++i)
+        mprollback_init(&s[i], i, 19, i, mploopback_transport(&test19_lb, i));
+
+    /* Once every key has arrived, both sessions have the games which the
+     * keys actually held produce */
+    test19_play(&rng, held, 1000);
+
+    for (int seat = 0; seat < 2; ++seat)
+        mpreplay_start(&reference[seat], 19, 0);
+
+    for (int f = 0; f < 1000; ++f) {
+        const uint8_t keys[2] = { held[0][f], held[1][f] };
+        mprollback_simulate(reference, keys, 19);
+    }
+
+    const uint64_t sum = mprollback_checksum(reference);
+
+    for (int i = 0; i < 2; ++i) {
+        if (mprollback_checksum(s[i].state) != sum || s[i].desync != MPROLLBACK_SYNCED) {
+            fprintf(stderr, "Rollback failure: session %d is not in sync\n", i);
+            errors++;
+        }
+    }
+
+    if (!s[0].rollbacks || !s[1].rollbacks || s[0].deepest > MPROLLBACK_WINDOW) {
+        fprintf(stderr, "Rollback failure: %" PRIu64 " and %" PRIu64 " rollbacks\n",
+                s[0].rollbacks, s[1].rollbacks);
+        errors++;
+    }
+
+    /* A game changed outside the simulation is found by the next checkpoint */
+    mem256_set(&s[1].state[0].field, 0);
+    test19_play(&rng, held, 1100);
+
+    if (s[0].desync == MPROLLBACK_SYNCED || s[1].desync == MPROLLBACK_SYNCED ||
+            s[1].desync > 1000 + 2 * MPROLLBACK_CHECK) {
+        fprintf(stderr, "Rollback failure: desync found at %u and %u\n",
+                s[0].desync, s[1].desync);
+        errors++;
+    }
+}
+
+/* Play a solution in the game it was found for, which must clear the field */
+static bool test20_play(mpstate s, const mppc_solution *sol)
+{
+    for (int m = 0; m < sol->count; ++m) {
+        const mppc_move *mv = &sol->moves[m];
+        mpplacement places[MPTET_PLACEMENTS];
+        int p, n;
+
+        if (mv->hold)
+            mptet_hold(&s);
+
+        if (s.id != mv->id)
+            return false;
+
+        /* The move must be where its rotation and position put the piece,
+         * and somewhere a hard drop reaches */
+        const int shift = 10 * (mv->by - 3) - mv->bx;
+        const uint64_t t = mptetd_block[mv->id][mv->br];
+
+        if ((shift < 0 ? t >> -shift : t << shift) != mv->mask)
+            return false;
+
+        n = mptet_placements(&s.field, s.id, places);
+
+        for (p = 0; p < n; ++p) {
+            if (places[p].block.limb[0] == mv->mask && !places[p].block.limb[1])
+                break;
+        }
+
+        if (p == n)
+            return false;
+
+        s.block = places[p].block;
+        mptet_lock(&s);
+    }
+
+    return mem256_popcnt(&s.field) == 0;
+}
+
+void test20(void)
+{
+    mppc_solver pc;
+    mppc_solution sol;
+    int solved = 0;
+
+    mppc_init(&pc, 2);
+
+    /* Openings of games, whose solutions must play out as a perfect clear */
+    for (int i = 0; i < 8; ++i) {
+        mpstate s;
+
+        mpstate_init(&s);
+        mpstate_seed(&s, 20 + i);
+        mptet_set_random_block(&s);
+
+        for (int deal = i % 7; deal > 0; --deal)
+            mptet_set_random_block(&s);
+
+        if (!mppc_solve_state(&pc, &s, 4, &sol))
+            continue;
+
+        solved++;
+
+        if (sol.height != 4 || sol.count != 10 || !test20_play(s, &sol)) {
+            fprintf(stderr, "PC failure: solution %d does not clear the field\n", i);
+            errors++;
+        }
+    }
+
+    if (solved < 6) {
+        fprintf(stderr, "PC failure: %d of 8 openings cleared\n", solved);
+        errors++;
+    }
+
+    /* Five O pieces clear two rows, five S pieces never do */
+    const int8_t o[5] = { O_, O_, O_, O_, O_ };
+    const int8_t sz[5] = { S_, S_, S_, S_, S_ };
+
+    if (!mppc_solve(&pc, 0, 2, o, 5, -1, &sol) || sol.count != 5 ||
+            mppc_solve(&pc, 0, 2, sz, 5, -1, &sol)) {
+        fprintf(stderr, "PC failure: two row clears\n");
+        errors++;
+    }
+
+    /* A full column leaves 19 empty cells on its left and 13 on its right.
+     * The 32 cells take eight pieces, and the queue has enough of each for
+     * its colours to balance, so only the column rules the board out. */
+    const int8_t mixed[10] = { I_, T_, L_, J_, T_, I_, O_, T_, S_, Z_ };
+
+    if (mppc_solve(&pc, 0x0040100401ull << 4 | 1 << 9 | 0x7, 4, mixed, 10, -1, &sol)) {
+        fprintf(stderr, "PC failure: solved a board split by a full column\n");
+        errors++;
+    }
+
+    mppc_free(&pc);
+}
+
+/* Features of a field measured cell by cell, after clearing full rows */
+static void test21_reference(mem256_t field, uint16_t features[E_Count])
+{
+    mpstate s = ms;
+    int heights[10] = { 0 };
+
+    memset(features, 0, E_Count * sizeof(uint16_t));
+    s.field = field;
+
+    /* A single clear stops at four rows, which a placement never exceeds */
+    for (int cleared; (cleared = mptet_lineclear(&s)); )
+        features[E_Lines] += cleared;
+
+    for (int x = 0; x < 10; ++x) {
+        for (int y = 0; y < MPEVAL_ROWS; ++y) {
+            if (mem256_get(&s.field, 10 * y + 9 - x))
+                heights[x] = y + 1;
+        }
+
+        features[E_Height] += heights[x];
+
+        for (int y = 0; y < heights[x]; ++y)
+            features[E_Holes] += !mem256_get(&s.field, 10 * y + 9 - x);
+    }
+
+    for (int x = 0; x < 9; ++x)
+        features[E_Bumpiness] += abs(heights[x] - heights[x + 1]);
+
+    for (int y = 0; y < MPEVAL_ROWS; ++y) {
+        for (int x = -1; x < 10; ++x) {
+            const bool a = x < 0 || mem256_get(&s.field, 10 * y + 9 - x);
+            const bool b = x + 1 > 9 || mem256_get(&s.field, 10 * y + 8 - x);
+            features[E_Transitions] += a != b;
+        }
+    }
+
+    /* Wells are the cells above each column with both neighbours filled */
+    for (int x = 0; x < 10; ++x) {
+        for (int y = heights[x]; y < MPEVAL_ROWS; ++y) {
+            const bool l = x == 0 || mem256_get(&s.field, 10 * y + 10 - x);
+            const bool r = x == 9 || mem256_get(&s.field, 10 * y + 8 - x);
+            features[E_Wells] += l && r;
+        }
+    }
+}
+
+void test21(void)
+{
+    mem256_t fields[37];
+    uint16_t features[37][E_Count];
+    float scores[37];
+    mpstate rng;
+
+    mpstate_init(&rng);
+    mpstate_seed(&rng, 21);
+
+    /* Random stacks with some full rows, in a batch which is not a multiple
+     * of the lanes */
+    for (int t = 0; t < 20; ++t) {
+        for (int i = 0; i < 37; ++i) {
+            const int height = mptet_random(&rng) % 23;
+
+            mem256_zero(&fields[i]);
+
+            for (int y = 0; y < height; ++y) {
+                const uint32_t r = mptet_random(&rng);
+
+                for (int x = 0; x < 10; ++x) {
+                    if (r % 4 == 0 || (r >> (2 + x)) & 1)
+                        mem256_set(&fields[i], 10 * y + x);
+                }
+            }
+        }
+
+        mpeval_features(fields, 37, features);
+        mpeval_score(fields, 37, mpeval_default, scores);
+
+        for (int i = 0; i < 37; ++i) {
+            uint16_t expected[E_Count];
+            float score = 0;
+
+            test21_reference(fields[i], expected);
+
+            for (int f = 0; f < E_Count; ++f)
+                score += expected[f] * mpeval_default[f];
+
+            if (memcmp(features[i], expected, sizeof(expected)) ||
+                    fabsf(scores[i] - score) > 1e-3f) {
+                fprintf(stderr, "Eval failure: field %d scored %f, expected %f\n", i,
+                        scores[i], score);
+                errors++;
+                return;
+            }
+        }
+    }
+
+    /* A well beside four full rows is best filled by an I piece */
+    mpplacement best;
+
+    mem256_zero(&fields[0]);
+
+    for (int y = 0; y < 4; ++y) {
+        for (int x = 1; x < 10; ++x)
+            mem256_set(&fields[0], 10 * y + x);
+    }
+
+    if (mpeval_best(&fields[0], I_, mpeval_default, &best) == 0 ||
+            best.block.limb[0] != (1 | 1 << 10 | 1 << 20 | 1ull << 30)) {
+        fprintf(stderr, "Eval failure: I piece not placed in the well\n");
+        errors++;
+    }
+}
+
 int main(void)
 {
     mpstate_init(&ms);
@@ -189,6 +1584,24 @@ int main(void)
     test1();
     test2();
     test3();
+    test4();
+    test5();
+    test6();
+    test7();
+    test8();
+    test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test19();
+    test20();
+    test21();
 
     mpstate_free(&ms);
 
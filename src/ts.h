@@ -1,3 +1,5 @@
+#pragma once
+
 /**
  * Define cross-platform timekeeping functions.
  *
@@ -22,6 +24,20 @@
 #define TS_SCALE_FACTOR
 */
 
+/**
+ * Specifies how long before a deadline ts_pacer_wait stops sleeping and starts
+ * spinning. Sleeping functions regularly overshoot by more than this on a
+ * loaded system, so the final stretch is spent polling the clock instead. A
+ * margin of 0 disables spinning entirely.
+ */
+#if !defined(TS_SPIN_MARGIN)
+#   define TS_SPIN_MARGIN (TS_IN_A_SECOND / 1000)
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #if defined(MP_GFX_SDL2)
@@ -40,6 +56,23 @@
 #   endif
 #endif
 
+/* Absolute sleeps avoid accumulating drift from the time spent computing the
+ * remaining interval. clock_nanosleep does not accept CLOCK_MONOTONIC_RAW. */
+#if defined(TS_HAVE_CLOCK_GETTIME) && defined(_POSIX_CLOCK_SELECTION) && \
+        _POSIX_CLOCK_SELECTION > 0 && !defined(HAVE_CLOCK_MONOTONIC_RAW) && \
+        !defined(TS_NO_ABSTIME)
+#   define TS_HAVE_CLOCK_NANOSLEEP
+#endif
+
+/* Hint to the cpu that we are in a spin-wait loop */
+#if defined(__i386__) || defined(__x86_64__)
+#   define ts_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || (defined(__arm__) && defined(__ARM_ARCH) && __ARM_ARCH >= 7)
+#   define ts_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#   define ts_cpu_relax() ((void) 0)
+#endif
+
 /* TODO: Fix this unlikely combination. Related to the scale factor < 1 */
 #if !defined(TS_HAVE_CLOCK_GETTIME) && defined(TS_HAVE_NANOSLEEP)
 #error "Invalid time function combination"
@@ -99,3 +132,105 @@ void ts_sleep(uint64_t no_of_ts)
     usleep(no_of_ts);
 #endif
 }
+
+/**
+ * Sleep until the specified absolute time. This returns immediately if the
+ * deadline has already passed.
+ */
+void ts_sleep_until(uint64_t deadline)
+{
+#if defined(TS_HAVE_CLOCK_NANOSLEEP)
+    struct timespec ts = { deadline / TS_IN_A_SECOND, deadline % TS_IN_A_SECOND };
+    while (clock_nanosleep(TS_CLOCK, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#else
+    const uint64_t now = ts_get_current_time();
+    if (now < deadline)
+        ts_sleep(deadline - now);
+#endif
+}
+
+/**
+ * A frame pacer which sleeps until shortly before each deadline and then
+ * spins for the remainder.
+ *
+ * Deadlines are advanced by a fixed period from the previous deadline rather
+ * than the current time, so time spent in a frame does not cause drift.
+ */
+typedef struct {
+    /* Timeshares between each deadline */
+    uint64_t period;
+
+    /* Timeshares before a deadline at which we stop sleeping and spin */
+    uint64_t margin;
+
+    /* Next deadline to wait for */
+    uint64_t deadline;
+
+    /* Number of deadlines waited on */
+    uint64_t frames;
+
+    /* Number of deadlines which had already passed when waited on */
+    uint64_t missed;
+
+    /* Sum and maximum of the wakeup error on deadlines we waited for */
+    uint64_t jitter_total;
+    uint64_t jitter_max;
+} ts_pacer;
+
+void ts_pacer_init(ts_pacer *tp, uint64_t period, uint64_t margin)
+{
+    tp->period = period;
+    tp->margin = margin;
+    tp->deadline = ts_get_current_time() + period;
+    tp->frames = 0;
+    tp->missed = 0;
+    tp->jitter_total = 0;
+    tp->jitter_max = 0;
+}
+
+/**
+ * Wait until the next deadline and schedule the one following it.
+ */
+void ts_pacer_wait(ts_pacer *tp)
+{
+    const uint64_t deadline = tp->deadline;
+    uint64_t now = ts_get_current_time();
+
+    tp->frames++;
+
+    if (now < deadline) {
+        if (deadline - now > tp->margin)
+            ts_sleep_until(deadline - tp->margin);
+
+        while ((now = ts_get_current_time()) < deadline)
+            ts_cpu_relax();
+
+        const uint64_t jitter = now - deadline;
+        tp->jitter_total += jitter;
+        if (jitter > tp->jitter_max)
+            tp->jitter_max = jitter;
+    }
+    else {
+        tp->missed++;
+    }
+
+    /* If we fell more than a period behind then resynchronize instead of
+     * running a burst of frames to catch up. */
+    tp->deadline += tp->period;
+    if (tp->deadline < now)
+        tp->deadline = now + tp->period;
+}
+
+/**
+ * Print a summary of the achieved pacing accuracy.
+ */
+void ts_pacer_report(ts_pacer *tp, FILE *fd)
+{
+    const uint64_t waited = tp->frames - tp->missed;
+
+    fprintf(fd, "pacing: %" PRIu64 " frames, %" PRIu64 " missed, "
+                "jitter mean %.1fus max %.1fus\n",
+            tp->frames, tp->missed,
+            waited ? (double) tp->jitter_total / waited * 1000000 / TS_IN_A_SECOND : 0,
+            (double) tp->jitter_max * 1000000 / TS_IN_A_SECOND);
+}
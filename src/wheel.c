@@ -0,0 +1,124 @@
+/**
+ * wheel.c
+ *
+ * Implements a hashed timer wheel.
+ */
+
+#include <stddef.h>
+
+#include "wheel.h"
+
+#define SLOT(tick) ((tick) & (MPWHEEL_SLOTS - 1))
+
+static void mptimer_link(mptimer *head, mptimer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void mptimer_unlink(mptimer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void mpwheel_init(mpwheel *w, uint64_t now)
+{
+    for (int i = 0; i < MPWHEEL_SLOTS; ++i)
+        w->slot[i].next = w->slot[i].prev = &w->slot[i];
+
+    w->now = now;
+    w->count = 0;
+}
+
+void mptimer_init(mptimer *t, void (*fn)(void *data), void *data)
+{
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->data = data;
+}
+
+void mpwheel_add(mpwheel *w, mptimer *t, uint64_t expires)
+{
+    /* The current slot has already been visited */
+    if (expires <= w->now)
+        expires = w->now + 1;
+
+    t->expires = expires;
+    mptimer_link(&w->slot[SLOT(expires)], t);
+    w->count++;
+}
+
+void mpwheel_del(mpwheel *w, mptimer *t)
+{
+    if (!mptimer_pending(t))
+        return;
+
+    mptimer_unlink(t);
+    w->count--;
+}
+
+/**
+ * Expired timers are first moved to a separate list, so that any timers
+ * they schedule are not visited again in the same pass. Each is unlinked
+ * before it is called, so callbacks may cancel those which remain.
+ */
+int mpwheel_advance(mpwheel *w, uint64_t now)
+{
+    int fired = 0;
+
+    if (now <= w->now)
+        return 0;
+
+    /* Every slot needs visiting at most once */
+    const uint64_t end = now - w->now > MPWHEEL_SLOTS ? w->now + MPWHEEL_SLOTS : now;
+
+    mptimer expired;
+    expired.next = expired.prev = &expired;
+
+    for (uint64_t tick = w->now + 1; tick <= end; ++tick) {
+        mptimer *head = &w->slot[SLOT(tick)];
+
+        for (mptimer *t = head->next, *next; t != head; t = next) {
+            next = t->next;
+
+            if (t->expires <= now) {
+                mptimer_unlink(t);
+                mptimer_link(&expired, t);
+            }
+        }
+    }
+
+    w->now = now;
+
+    while (expired.next != &expired) {
+        mptimer *t = expired.next;
+
+        mptimer_unlink(t);
+        w->count--;
+        fired++;
+
+        t->fn(t->data);
+    }
+
+    return fired;
+}
+
+uint64_t mpwheel_next(mpwheel *w)
+{
+    if (!w->count)
+        return UINT64_MAX;
+
+    for (uint64_t tick = w->now + 1; tick <= w->now + MPWHEEL_SLOTS; ++tick) {
+        const mptimer *head = &w->slot[SLOT(tick)];
+
+        if (head->next != head)
+            return tick;
+    }
+
+    return UINT64_MAX;
+}
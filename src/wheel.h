@@ -0,0 +1,75 @@
+#pragma once
+
+/**
+ * wheel.h
+ *
+ * Implements a hashed timer wheel. Each timer is kept in the slot for its
+ * expiry time modulo the number of slots, so adding or removing a timer is
+ * O(1) and advancing the wheel only visits the slots which have passed.
+ * Timers further away than one revolution stay in their slot until their
+ * time comes around.
+ *
+ * Times are in ticks of whatever length the user chooses.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Number of slots. Must be a power of two. */
+#define MPWHEEL_SLOTS 256
+
+typedef struct mptimer {
+    /* Neighbours in the slot list, or NULL when not pending */
+    struct mptimer *next;
+    struct mptimer *prev;
+
+    /* Tick at which the timer fires */
+    uint64_t expires;
+
+    /* Called when the timer fires. It may add or remove any timer, including
+     * itself. */
+    void (*fn)(void *data);
+    void *data;
+} mptimer;
+
+typedef struct {
+    /* List head of each slot */
+    mptimer slot[MPWHEEL_SLOTS];
+
+    /* Every timer expiring at or before this tick has fired */
+    uint64_t now;
+
+    /* Number of pending timers */
+    int count;
+} mpwheel;
+
+void mpwheel_init(mpwheel *w, uint64_t now);
+
+void mptimer_init(mptimer *t, void (*fn)(void *data), void *data);
+
+static inline bool mptimer_pending(const mptimer *t)
+{
+    return t->next != NULL;
+}
+
+/**
+ * Schedule a timer, which must not be pending. Timers which have already
+ * expired fire on the next advance.
+ */
+void mpwheel_add(mpwheel *w, mptimer *t, uint64_t expires);
+
+/* Cancel a timer if it is pending */
+void mpwheel_del(mpwheel *w, mptimer *t);
+
+/**
+ * Fire every timer expiring at or before the given tick, returning how many
+ * fired.
+ */
+int mpwheel_advance(mpwheel *w, uint64_t now);
+
+/**
+ * Return a tick at or before which the next timer expires, or UINT64_MAX if
+ * no timers are pending. This may be earlier than the actual expiry of a
+ * timer more than one revolution away.
+ */
+uint64_t mpwheel_next(mpwheel *w);
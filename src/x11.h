@@ -1,18 +1,254 @@
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/keysym.h>
 
+#if defined(MP_X11_SHM)
+#   include <sys/ipc.h>
+#   include <sys/shm.h>
+#   include <X11/extensions/XShm.h>
+#endif
+
+#include "damage.h"
+#include "layout.h"
+#include "raster.h"
+
+#if defined(MP_X11_SHM)
+#   include "fb.h"
+#endif
+
+#if defined(MP_THREADED)
+#   include <poll.h>
+#   include <pthread.h>
+#   include "input.h"
+#endif
+
 typedef struct mpgfx__ {
     Display *display;
     Window window;
     GC gc;
     int id;
+    int width;
+    int height;
+
+    /* Placement of everything in the window, for its current size */
+    mplayout layout;
+
+    /* Changes since the last presented frame */
+    mpdamage damage;
+
+#if defined(MP_X11_SHM)
+    /* Client-side framebuffer, shared with the server when possible */
+    XImage *image;
+    XShmSegmentInfo shminfo;
+    bool shm;
+
+    /* Hold and preview piece sprites */
+    mpfb_cache sprites;
+#else
+    /* Off-screen buffer which each frame is drawn to before being copied */
+    Pixmap buffer;
+
+    /* Hold piece sprites in the first row and preview sprites in the second,
+     * indexed by mplayout_sprite */
+    Pixmap sprites;
+#endif
+#if defined(MP_THREADED)
+    /* Key events are read on a separate connection by the input thread */
+    Display *input_display;
+    pthread_t input_thread;
+    atomic_bool input_running;
+    mpqueue input;
+#endif
 } mpgfx;
 
+#if defined(MP_THREADED)
+static void *mpgfx_input_thread(void *arg);
+#endif
+
+#if defined(MP_X11_SHM)
+/* Set if an error occurs while attaching the shared memory segment */
+static bool x11_shm_failed;
+
+static int x11_shm_error(Display *display, XErrorEvent *e)
+{
+    (void) display;
+    (void) e;
+    x11_shm_failed = true;
+    return 0;
+}
+
+/**
+ * Create the framebuffer image. A shared memory segment is used if the
+ * extension is available and the server can attach to it, which will not be
+ * the case for remote displays.
+ */
+static void mpgfx_init_image(mpgfx *mx)
+{
+    Visual *visual = DefaultVisual(mx->display, mx->id);
+    const int depth = DefaultDepth(mx->display, mx->id);
+
+    if (visual->class != TrueColor || (depth != 24 && depth != 32)) {
+        fprintf(stderr, "A 24 or 32-bit TrueColor visual is required\n");
+        exit(-1);
+    }
+
+    mx->shm = false;
+
+    if (XShmQueryExtension(mx->display)) {
+        mx->image = XShmCreateImage(mx->display, visual, depth, ZPixmap, NULL,
+                &mx->shminfo, mx->width, mx->height);
+    }
+    else {
+        mx->image = NULL;
+    }
+
+    if (mx->image) {
+        mx->shminfo.shmid = shmget(IPC_PRIVATE,
+                mx->image->bytes_per_line * mx->image->height, IPC_CREAT | 0600);
+        mx->shminfo.shmaddr = mx->shminfo.shmid != -1
+                ? shmat(mx->shminfo.shmid, NULL, 0) : (char *) -1;
+
+        if (mx->shminfo.shmaddr != (char *) -1) {
+            mx->image->data = mx->shminfo.shmaddr;
+            mx->shminfo.readOnly = False;
+
+            XSync(mx->display, False);
+            x11_shm_failed = false;
+            int (*handler)(Display *, XErrorEvent *) = XSetErrorHandler(x11_shm_error);
+            XShmAttach(mx->display, &mx->shminfo);
+            XSync(mx->display, False);
+            XSetErrorHandler(handler);
+
+            mx->shm = !x11_shm_failed;
+
+            if (!mx->shm)
+                shmdt(mx->shminfo.shmaddr);
+        }
+
+        /* The segment is released once both sides have detached */
+        if (mx->shminfo.shmid != -1)
+            shmctl(mx->shminfo.shmid, IPC_RMID, NULL);
+
+        if (!mx->shm) {
+            mx->image->data = NULL;
+            XDestroyImage(mx->image);
+        }
+    }
+
+    if (!mx->shm) {
+        char *data = malloc(mx->width * mx->height * 4);
+
+        mx->image = XCreateImage(mx->display, visual, depth, ZPixmap, 0,
+                data, mx->width, mx->height, 32, 0);
+
+        if (!data || !mx->image) {
+            fprintf(stderr, "Failed to create framebuffer\n");
+            exit(-1);
+        }
+    }
+
+    if (mx->image->bits_per_pixel != 32) {
+        fprintf(stderr, "A 32-bit framebuffer is required\n");
+        exit(-1);
+    }
+}
+
+static void mpgfx_free_image(mpgfx *mx)
+{
+    if (mx->shm) {
+        XShmDetach(mx->display, &mx->shminfo);
+        mx->image->data = NULL;
+        XDestroyImage(mx->image);
+        shmdt(mx->shminfo.shmaddr);
+    }
+    else {
+        XDestroyImage(mx->image);
+    }
+}
+
+/**
+ * Convert an 8-bit color channel to its position in a visual's pixel.
+ */
+static uint32_t x11_channel(unsigned long mask, int value)
+{
+    int shift = 0;
+    while (mask && !((mask >> shift) & 1))
+        shift++;
+
+    /* Channels wider than 8 bits, as in deep visuals, take the value in
+     * their top bits */
+    const int bits = mem256_64popcnt(mask);
+    const uint32_t scaled = bits > 8 ? (uint32_t) value << (bits - 8) :
+        (uint32_t) value >> (8 - bits);
+
+    return (scaled << shift) & mask;
+}
+
+static uint32_t x11_rgb(mpgfx *mx, int r, int g, int b)
+{
+    Visual *visual = DefaultVisual(mx->display, mx->id);
+
+    return x11_channel(visual->red_mask, r) |
+           x11_channel(visual->green_mask, g) |
+           x11_channel(visual->blue_mask, b);
+}
+#else
+/**
+ * Render a sprite of every piece at the hold and preview scales into a
+ * pixmap, so each piece is drawn with a single copy.
+ */
+static void mpgfx_init_sprites(mpgfx *mx)
+{
+    const mplayout *l = &mx->layout;
+    const mprect *area[2] = { &l->hold, &l->preview_piece[0] };
+    const mprect *cell[2] = { l->hold_sprite, l->preview_sprite };
+
+    XRectangle fill[2 * (L_SPRITES - 1) * 4];
+    int nfill = 0;
+
+    const int width = L_SPRITES * (area[0]->w > area[1]->w ? area[0]->w : area[1]->w);
+    mx->sprites = XCreatePixmap(mx->display, mx->window, width,
+            area[0]->h + area[1]->h, DefaultDepth(mx->display, mx->id));
+
+    XSetForeground(mx->display, mx->gc, BlackPixel(mx->display, 0));
+    XFillRectangle(mx->display, mx->sprites, mx->gc, 0, 0, width, area[0]->h + area[1]->h);
+
+    for (int s = 0; s < 2; ++s) {
+        const int y = s ? area[0]->h : 0;
+
+        /* The last sprite is left empty */
+        for (int id = 0; id < L_SPRITES - 1; ++id) {
+            for (int k = 0; k < 16; ++k) {
+                if (!mplayout_piece_cell(mptetd_block[id][0], k))
+                    continue;
+
+                fill[nfill].x = id * area[s]->w + cell[s][k].x;
+                fill[nfill].y = y + cell[s][k].y;
+                fill[nfill].width = cell[s][k].w;
+                fill[nfill].height = cell[s][k].h;
+                nfill++;
+            }
+        }
+    }
+
+    XSetForeground(mx->display, mx->gc, WhitePixel(mx->display, 0));
+    XFillRectangles(mx->display, mx->sprites, mx->gc, fill, nfill);
+}
+#endif
+
 void mpgfx_init(mpgfx *mx, int *argc, char ***argv)
 {
     (void) argc;
     (void) argv;
 
+#if defined(MP_THREADED)
+    /* The display is shared by the simulation and render threads */
+    if (!XInitThreads()) {
+        fprintf(stderr, "Xlib does not support threads\n");
+        exit(-1);
+    }
+#endif
+
     mx->display = XOpenDisplay(NULL);
 
     if (!mx->display) {
@@ -22,12 +258,50 @@ void mpgfx_init(mpgfx *mx, int *argc, char ***argv)
 
     mx->id = DefaultScreen(mx->display);
     mx->gc = DefaultGC(mx->display, mx->id);
+    mx->width = DisplayWidth(mx->display, mx->id);
+    mx->height = DisplayHeight(mx->display, mx->id);
+    mplayout_compute(&mx->layout, mx->width, mx->height);
     mx->window = XCreateSimpleWindow(mx->display,
-            RootWindow(mx->display, mx->id), 0, 0, 1920, 1080, 0,
+            RootWindow(mx->display, mx->id), 0, 0, mx->width, mx->height, 0,
             BlackPixel(mx->display, mx->id), WhitePixel(mx->display, mx->id));
+#if defined(MP_X11_SHM)
+    mpgfx_init_image(mx);
+    mpfb_cache_init(&mx->sprites);
+#else
+    mx->buffer = XCreatePixmap(mx->display, mx->window, mx->width, mx->height,
+            DefaultDepth(mx->display, mx->id));
+    mpgfx_init_sprites(mx);
+#endif
+
+#if defined(MP_THREADED)
+    mx->input_display = XOpenDisplay(NULL);
+
+    if (!mx->input_display) {
+        fprintf(stderr, "Cannot open display\n");
+        exit(-1);
+    }
+
+    /* The window must exist on the server before the other connection
+     * refers to it, as requests on separate connections are not ordered */
+    XSync(mx->display, False);
+
+    XSelectInput(mx->input_display, mx->window, KeyPressMask | KeyReleaseMask);
+    XFlush(mx->input_display);
+    XSelectInput(mx->display, mx->window, ExposureMask | StructureNotifyMask);
+
+    mpqueue_init(&mx->input);
+    atomic_init(&mx->input_running, true);
 
-    XSelectInput(mx->display, mx->window, KeyPressMask | KeyReleaseMask);
+    if (pthread_create(&mx->input_thread, NULL, mpgfx_input_thread, mx) != 0) {
+        fprintf(stderr, "Failed to create input thread\n");
+        exit(-1);
+    }
+#else
+    XSelectInput(mx->display, mx->window,
+            KeyPressMask | KeyReleaseMask | ExposureMask | StructureNotifyMask);
+#endif
     XMapWindow(mx->display, mx->window);
+    mpdamage_init(&mx->damage, 1);
 }
 
 static int xk_index(XEvent *e)
@@ -54,6 +328,61 @@ static int xk_index(XEvent *e)
     }
 }
 
+#if defined(MP_THREADED)
+/**
+ * Is this key release immediately followed by a press of the same key? This
+ * is how auto-repeat is reported and should not be seen as a release.
+ */
+static bool xk_autorepeat(Display *display, XEvent *e)
+{
+    XEvent next;
+
+    if (e->type != KeyRelease || !XEventsQueued(display, QueuedAfterReading))
+        return false;
+
+    XPeekEvent(display, &next);
+    return next.type == KeyPress && next.xkey.time == e->xkey.time &&
+           next.xkey.keycode == e->xkey.keycode;
+}
+
+static void *mpgfx_input_thread(void *arg)
+{
+    mpgfx *mx = arg;
+    struct pollfd pfd = { ConnectionNumber(mx->input_display), POLLIN, 0 };
+    XEvent e;
+
+    while (atomic_load(&mx->input_running)) {
+        while (XPending(mx->input_display)) {
+            XNextEvent(mx->input_display, &e);
+            const uint64_t now = ts_get_current_time();
+
+            if (xk_autorepeat(mx->input_display, &e)) {
+                XNextEvent(mx->input_display, &e);
+                continue;
+            }
+
+            const int index = xk_index(&e);
+            if (index != -1)
+                mpqueue_push(&mx->input, now, index, e.type == KeyPress);
+        }
+
+        /* Wake periodically to check if we should stop */
+        poll(&pfd, 1, 50);
+    }
+
+    return NULL;
+}
+
+void mpgfx_update(mpstate *ms, mpgfx *mx)
+{
+    mpqueue_drain(&mx->input, ms);
+}
+
+void mpgfx_poll(mpgfx *mx)
+{
+    (void) mx;
+}
+#else
 void mpgfx_update(mpstate *ms, mpgfx *mx)
 {
     XEvent e;
@@ -93,122 +422,278 @@ void mpgfx_update(mpstate *ms, mpgfx *mx)
             ms->keystate[i]++;
     }
 }
+#endif
 
 void mpgfx_free(mpgfx *mx)
 {
+#if defined(MP_THREADED)
+    atomic_store(&mx->input_running, false);
+    pthread_join(mx->input_thread, NULL);
+    XCloseDisplay(mx->input_display);
+#endif
+
+#if defined(MP_X11_SHM)
+    mpgfx_free_image(mx);
+    mpfb_cache_free(&mx->sprites);
+#else
+    XFreePixmap(mx->display, mx->sprites);
+    XFreePixmap(mx->display, mx->buffer);
+#endif
     XDestroyWindow(mx->display, mx->window);
     XCloseDisplay(mx->display);
 }
 
-/* Number of preview pieces shown */
-#define PREVIEW_NUMBER 3
+/**
+ * Has the window been exposed, losing its contents? Pending expose events
+ * are consumed.
+ */
+static bool mpgfx_exposed(mpgfx *mx)
+{
+    XEvent e;
+    bool exposed = false;
 
-/* Block side length */
-#define M_BLOCK_SIDE 36
+    while (XCheckTypedWindowEvent(mx->display, mx->window, Expose, &e))
+        exposed = true;
 
-/* Main grid x offset */
-#define M_X_OFFSET 200
+    return exposed;
+}
 
-/* Main grid y offset */
-#define M_Y_OFFSET 100
+/**
+ * Has the window been resized? The back buffer and layout are recreated for
+ * the new size, and everything must be redrawn.
+ */
+static bool mpgfx_resized(mpgfx *mx)
+{
+    XEvent e;
+    int width = mx->width;
+    int height = mx->height;
 
-/* Preview x offset */
-#define P_X_OFFSET 40
+    while (XCheckTypedWindowEvent(mx->display, mx->window, ConfigureNotify, &e)) {
+        width = e.xconfigure.width;
+        height = e.xconfigure.height;
+    }
 
-/* Preview y offset */
-#define P_Y_OFFSET 20
+    if (width == mx->width && height == mx->height)
+        return false;
+
+    mx->width = width;
+    mx->height = height;
+    mplayout_resize(&mx->layout, width, height);
+
+#if defined(MP_X11_SHM)
+    mpgfx_free_image(mx);
+    mpgfx_init_image(mx);
+#else
+    XFreePixmap(mx->display, mx->buffer);
+    XFreePixmap(mx->display, mx->sprites);
+    mx->buffer = XCreatePixmap(mx->display, mx->window, mx->width, mx->height,
+            DefaultDepth(mx->display, mx->id));
+    mpgfx_init_sprites(mx);
+#endif
+
+    mpdamage_reset(&mx->damage);
+    return true;
+}
 
-/* Preview block scale */
-#define P_BLOCK_SCALE 0.9f
+#if defined(MP_X11_SHM)
+/**
+ * The frame is drawn entirely on the client and presented as one image, so
+ * its cost does not depend on how well the server rasterizes rectangles.
+ * Only the damaged regions of the image are redrawn and uploaded.
+ */
+static void mpgfx_put(mpgfx *mx, int x, int y, int w, int h)
+{
+    if (mx->shm) {
+        XShmPutImage(mx->display, mx->window, mx->gc, mx->image,
+                x, y, x, y, w, h, False);
+    }
+    else {
+        XPutImage(mx->display, mx->window, mx->gc, mx->image,
+                x, y, x, y, w, h);
+    }
+}
 
-/* Hold preview block scale */
-#define H_BLOCK_SCALE 0.9f
+void mpgfx_render(mpstate *ms, mpgfx *mx)
+{
+    const mpfb_palette palette = {
+        .background = x11_rgb(mx, 0, 0, 0),
+        .border = x11_rgb(mx, 0x80, 0x80, 0x80),
+        .block = x11_rgb(mx, 0x80, 0x80, 0xff),
+        .ghost = x11_rgb(mx, 0x80, 0x80, 0xff / 2),
+        .empty = x11_rgb(mx, 0, 0, 0)
+    };
+
+    mpdamage_list dl;
+    const mplayout *l = &mx->layout;
+    mpgfx_resized(mx);
+    const bool exposed = mpgfx_exposed(mx);
+
+    if (!mpdamage_compute(&mx->damage, ms, &dl) && !exposed)
+        return;
+
+    mpfb fb = {
+        (uint32_t *) mx->image->data, mx->width, mx->height,
+        mx->image->bytes_per_line / 4
+    };
+
+    if (dl.full) {
+        mpfb_render(ms, &fb, l, &palette, &mx->sprites);
+    }
+    else {
+        if (dl.count)
+            mpfb_rows(ms, &fb, l, &palette, dl.y0, dl.y1);
 
-/* Hold preview x offset - assert(M_X_OFFSET > (M_BLOCK_SIDE * H_BLOCK_SCALE * 4))*/
-#define H_X_OFFSET (M_X_OFFSET / 2 -  (M_BLOCK_SIDE * H_BLOCK_SCALE) * 2)
+        if (dl.hold)
+            mpfb_hold(ms, &fb, l, &palette, &mx->sprites);
 
-/* Hold preview y offset */
-#define H_Y_OFFSET 40
+        if (dl.preview)
+            mpfb_preview(ms, &fb, l, &palette, &mx->sprites);
+    }
 
-void mpgfx_render(mpstate *ms, mpgfx *mx)
+    if (dl.full || exposed) {
+        mpgfx_put(mx, 0, 0, mx->width, mx->height);
+    }
+    else {
+        if (dl.count) {
+            const mprect r = mplayout_cells(l, dl.x0, dl.y0, dl.x1, dl.y1);
+            mpgfx_put(mx, r.x, r.y, r.w, r.h);
+        }
+
+        if (dl.hold)
+            mpgfx_put(mx, l->hold.x, l->hold.y, l->hold.w, l->hold.h);
+
+        if (dl.preview)
+            mpgfx_put(mx, l->preview.x, l->preview.y, l->preview.w, l->preview.h);
+    }
+
+    /* The server must be finished with a shared image before we redraw it */
+    if (mx->shm)
+        XSync(mx->display, False);
+    else
+        XFlush(mx->display);
+}
+#else
+#define AddRect(list, n, _x, _y, _w, _h)                                \
+    do {                                                                \
+        list[n].x = (_x); list[n].y = (_y);                             \
+        list[n].width = (_w); list[n].height = (_h);                    \
+        n++;                                                            \
+    } while (0)
+
+/**
+ * Everything is drawn to the back buffer in as few requests as possible, one
+ * per color and primitive, and then presented by copying the damaged regions.
+ *
+ * Empty cells are outlined in the background color, so they are covered by
+ * the clear and do not need to be drawn. The hold and preview pieces are
+ * copied from pre-rendered sprites.
+ */
+static void mpgfx_draw(mpstate *ms, mpgfx *mx, mpdamage_list *dl)
 {
-    /* Clear screen */
-    XSetForeground(mx->display, mx->gc, BlackPixel(mx->display, 0));
-    XFillRectangle(mx->display, mx->window, mx->gc, 0, 0, 1920, 1080);
+    XRectangle fill[220];
+    XRectangle outline[220 + 2];
+    XRectangle clear[220];
+    int nfill = 0;
+    int noutline = 0;
+    int nclear = 0;
 
-    XSetForeground(mx->display, mx->gc, WhitePixel(mx->display, 0));
+    const mplayout *l = &mx->layout;
 
-    XDrawRectangle(mx->display, mx->window, mx->gc,
-                    M_X_OFFSET - 1,
-                    M_Y_OFFSET - 1,
-                    10 * M_BLOCK_SIDE + 2,
-                    22 * M_BLOCK_SIDE + 2);
-
-    XDrawRectangle(mx->display, mx->window, mx->gc,
-                    M_X_OFFSET - 2,
-                    M_Y_OFFSET - 2,
-                    10 * M_BLOCK_SIDE + 4,
-                    22 * M_BLOCK_SIDE + 4);
-
-    // Draw blocks
-    for (int i = 219; i >= 0; --i) {
-        bool fill = false;
-
-        if (mem256_get(&ms->field, i) || mem256_get(&ms->block, i)) {
-            XSetForeground(mx->display, mx->gc, WhitePixel(mx->display, 0));
-            fill = true;
-        }
-        else if (mem256_get(&ms->ghost, i))
-            XSetForeground(mx->display, mx->gc, WhitePixel(mx->display, 0));
-        else
-            XSetForeground(mx->display, mx->gc, BlackPixel(mx->display, 0));
-
-        if (fill) {
-            XFillRectangle(mx->display, mx->window, mx->gc,
-                        M_X_OFFSET + M_BLOCK_SIDE * (9 - i % 10) + 1,
-                        M_Y_OFFSET + M_BLOCK_SIDE * (21 - (i / 10)) + 1,
-                        M_BLOCK_SIDE - 2,
-                        M_BLOCK_SIDE - 2);
-        }
-        else {
-            XDrawRectangle(mx->display, mx->window, mx->gc,
-                        M_X_OFFSET + M_BLOCK_SIDE * (9 - i % 10) + 1,
-                        M_Y_OFFSET + M_BLOCK_SIDE * (21 - (i / 10)) + 1,
-                        M_BLOCK_SIDE - 2,
-                        M_BLOCK_SIDE - 2);
+    if (dl->full) {
+        AddRect(clear, nclear, 0, 0, mx->width, mx->height);
+
+        for (int i = 0; i < 2; ++i) {
+            AddRect(outline, noutline, l->border[i].x, l->border[i].y,
+                    l->border[i].w, l->border[i].h);
         }
     }
 
+    // Gather blocks
+    mpraster r;
+    mpraster_classify(&r, ms);
+
+    const int ncells = dl->full ? 220 : dl->count;
+
+    for (int k = 0; k < ncells; ++k) {
+        const int i = dl->full ? 219 - k : dl->cell[k];
+        const mprect *cell = &l->cell[i];
+
+        if (!dl->full)
+            AddRect(clear, nclear, cell->x, cell->y, cell->w + 1, cell->h + 1);
+
+        const int c = mpraster_cell(&r, i);
+
+        if (c == R_Field || c == R_Block)
+            AddRect(fill, nfill, cell->x, cell->y, cell->w, cell->h);
+        else if (c == R_Ghost)
+            AddRect(outline, noutline, cell->x, cell->y, cell->w, cell->h);
+    }
+
+    XSetForeground(mx->display, mx->gc, BlackPixel(mx->display, 0));
+    XFillRectangles(mx->display, mx->buffer, mx->gc, clear, nclear);
+
     XSetForeground(mx->display, mx->gc, WhitePixel(mx->display, 0));
-    uint64_t block = mptetd_block[ms->hold][0];
-
-    if (ms->hold != -1) {
-        for (int x = 0; x < 4; ++x) {
-            for (int y = 0; y < 4; ++y) {
-                if (block & ((1 << ((4 - y) * 10 - x - 1))))
-                    XFillRectangle(mx->display, mx->window, mx->gc,
-                                H_X_OFFSET + x * M_BLOCK_SIDE * H_BLOCK_SCALE,
-                                M_Y_OFFSET + H_Y_OFFSET + y * M_BLOCK_SIDE * H_BLOCK_SCALE,
-                                H_BLOCK_SCALE * M_BLOCK_SIDE - 2,
-                                H_BLOCK_SCALE * M_BLOCK_SIDE - 2);
-            }
+    if (noutline)
+        XDrawRectangles(mx->display, mx->buffer, mx->gc, outline, noutline);
+    if (nfill)
+        XFillRectangles(mx->display, mx->buffer, mx->gc, fill, nfill);
+
+    // Copy hold and preview sprites, which cover their whole area
+    if (dl->full || dl->hold) {
+        XCopyArea(mx->display, mx->sprites, mx->buffer, mx->gc,
+                mplayout_sprite(ms->hold) * l->hold.w, 0, l->hold.w, l->hold.h,
+                l->hold.x, l->hold.y);
+    }
+
+    if (dl->full || dl->preview) {
+        for (int i = 0; i < PREVIEW_NUMBER; ++i) {
+            const mprect *p = &l->preview_piece[i];
+
+            XCopyArea(mx->display, mx->sprites, mx->buffer, mx->gc,
+                    mplayout_sprite(ms->bag[(ms->bhead + i) % 14]) * p->w, l->hold.h,
+                    p->w, p->h, p->x, p->y);
         }
     }
+}
+
+/**
+ * Copy an area of the back buffer to the window.
+ */
+static void mpgfx_copy(mpgfx *mx, const mprect *r)
+{
+    XCopyArea(mx->display, mx->buffer, mx->window, mx->gc,
+            r->x, r->y, r->w, r->h, r->x, r->y);
+}
 
-    // Draw preview pieces
-    for (int i = 0; i < PREVIEW_NUMBER; ++i) {
-        uint64_t block = mptetd_block[ms->bag[ms->bhead + i] % 14][0];
+void mpgfx_render(mpstate *ms, mpgfx *mx)
+{
+    mpdamage_list dl;
+    mpgfx_resized(mx);
+    const bool exposed = mpgfx_exposed(mx);
 
-        for (int x = 0; x < 4; ++x) {
-            for (int y = 0; y < 4; ++y) {
-                if (block & ((1 << ((4 - y) * 10 - x - 1))))
-                    XFillRectangle(mx->display, mx->window, mx->gc,
-                                M_X_OFFSET + 10 * M_BLOCK_SIDE + P_X_OFFSET + x * M_BLOCK_SIDE * P_BLOCK_SCALE,
-                                M_Y_OFFSET + i * (P_Y_OFFSET + 4 * M_BLOCK_SIDE * P_BLOCK_SCALE)
-                                + y * M_BLOCK_SIDE * P_BLOCK_SCALE,
-                                P_BLOCK_SCALE * M_BLOCK_SIDE - 2,
-                                P_BLOCK_SCALE * M_BLOCK_SIDE - 2);
-            }
+    if (mpdamage_compute(&mx->damage, ms, &dl))
+        mpgfx_draw(ms, mx, &dl);
+
+    if (dl.full || exposed) {
+        XCopyArea(mx->display, mx->buffer, mx->window, mx->gc,
+                0, 0, mx->width, mx->height, 0, 0);
+    }
+    else {
+        if (dl.count) {
+            const mprect r = mplayout_cells(&mx->layout, dl.x0, dl.y0, dl.x1, dl.y1);
+            mpgfx_copy(mx, &r);
         }
+
+        if (dl.hold)
+            mpgfx_copy(mx, &mx->layout.hold);
+
+        if (dl.preview)
+            mpgfx_copy(mx, &mx->layout.preview);
     }
+
+#if defined(MP_THREADED)
+    /* The simulation thread no longer flushes our requests when polling */
+    XFlush(mx->display);
+#endif
 }
+#endif /* defined(MP_X11_SHM) */